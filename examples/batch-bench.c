@@ -0,0 +1,147 @@
+/**
+ * A benchmark comparing batched socket operations against individual
+ * bt_send and bt_recv calls.
+ *
+ * It doesn't need any Bluetooth hardware: the sockets are local socket pairs,
+ * which is enough to show the cost of entering the kernel. Each round sends
+ * a short message over every pair and reads it back at the other end. The
+ * number of system calls and the time taken are printed for each method.
+ *
+ * Build libpicobt with -DPICOBT_IO_URING=ON to compare against io_uring;
+ * otherwise the batch falls back to synchronous calls and the numbers should
+ * be about the same.
+ *
+ */
+
+#include <picobt/bt.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PAIRS 64
+#define ROUNDS 2000
+#define MESSAGE_SIZE 64
+
+static bt_socket_t senders[PAIRS];
+static bt_socket_t receivers[PAIRS];
+static char out[PAIRS][MESSAGE_SIZE];
+static char in[PAIRS][MESSAGE_SIZE];
+
+static void report(char const *name, unsigned long calls, int64_t elapsed) {
+	unsigned long messages = (unsigned long) PAIRS * ROUNDS;
+
+	printf("%-10s %10lu syscalls %8.2f per message %10.1f ms %8.0f ns per message\n",
+		name, calls, (double) calls / messages, elapsed / 1000.0,
+		(elapsed * 1000.0) / messages);
+}
+
+static int run_direct(void) {
+	unsigned long calls = 0;
+	int64_t start;
+	size_t len;
+	int round;
+	int i;
+
+	start = bt_time_now_us();
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < PAIRS; i++) {
+			len = MESSAGE_SIZE;
+			if (bt_send(&senders[i], out[i], &len) != BT_SUCCESS)
+				return -1;
+			calls++;
+		}
+		for (i = 0; i < PAIRS; i++) {
+			len = MESSAGE_SIZE;
+			if (bt_recv(&receivers[i], in[i], &len) != BT_SUCCESS)
+				return -1;
+			calls++;
+		}
+	}
+	report("direct", calls, bt_time_now_us() - start);
+
+	return 0;
+}
+
+static int run_batch(char const *name, int flags) {
+	bt_batch_op_t results[PAIRS];
+	bt_batch_stats_t stats;
+	bt_batch_t batch;
+	unsigned count;
+	int64_t start;
+	int round;
+	int i;
+
+	if (bt_batch_init(&batch, PAIRS, flags) != BT_SUCCESS)
+		return -1;
+
+	start = bt_time_now_us();
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < PAIRS; i++) {
+			bt_batch_add_send(&batch, &senders[i], out[i], MESSAGE_SIZE, NULL);
+		}
+		bt_batch_submit(&batch);
+		bt_batch_reap(&batch, results, PAIRS, PAIRS, &count);
+
+		for (i = 0; i < PAIRS; i++) {
+			bt_batch_add_recv(&batch, &receivers[i], in[i], MESSAGE_SIZE, NULL);
+		}
+		bt_batch_submit(&batch);
+		bt_batch_reap(&batch, results, PAIRS, PAIRS, &count);
+		if (count != PAIRS || results[0].result != BT_SUCCESS) {
+			bt_batch_free(&batch);
+			return -1;
+		}
+	}
+
+	bt_batch_get_stats(&batch, &stats);
+	report(name, stats.kernel_calls, bt_time_now_us() - start);
+	if (flags == 0 && !bt_batch_uses_io_uring(&batch)) {
+		printf("(io_uring not available, so the batch ran synchronously)\n");
+	}
+	bt_batch_free(&batch);
+
+	return 0;
+}
+
+int main() {
+	int fds[2];
+	int ret = -1;
+	int i;
+
+	for (i = 0; i < PAIRS; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+			printf("Error creating socket pair\n");
+			return ret;
+		}
+		senders[i].s = fds[0];
+		receivers[i].s = fds[1];
+		memset(out[i], 'a' + (i % 26), MESSAGE_SIZE);
+	}
+
+	printf("%d socket pairs, %d rounds of %d byte messages\n", PAIRS, ROUNDS, MESSAGE_SIZE);
+
+	if (run_direct() != 0) {
+		printf("Error in direct run\n");
+		goto cleanup;
+	}
+
+	if (run_batch("batch-sync", BT_BATCH_SYNC) != 0) {
+		printf("Error in synchronous batch run\n");
+		goto cleanup;
+	}
+
+	if (run_batch("batch", 0) != 0) {
+		printf("Error in batch run\n");
+		goto cleanup;
+	}
+
+	ret = 0;
+cleanup:
+	for (i = 0; i < PAIRS; i++) {
+		bt_disconnect(&senders[i]);
+		bt_disconnect(&receivers[i]);
+	}
+
+	return ret;
+}
@@ -0,0 +1,184 @@
+/**
+ * A benchmark comparing the round-trip latency of RFCOMM with that of an
+ * L2CAP SEQPACKET channel between two machines.
+ *
+ * Run it with "server" on one machine, which listens on RFCOMM channel
+ * CHANNEL and L2CAP PSM PSM and echoes whatever it receives. Then run it
+ * with the server's address on another machine. The client sends ROUNDS
+ * messages of MESSAGE_SIZE bytes over each transport in turn, waits for
+ * each one to come back, and prints the round-trip times.
+ *
+ * RFCOMM is a stream, so the client has to read until the whole message is
+ * back. The L2CAP channel keeps message boundaries, so each message comes
+ * back from a single bt_recv_message.
+ *
+ */
+
+#include <picobt/bt.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CHANNEL 15
+#define PSM 0x1001
+#define ROUNDS 500
+#define MESSAGE_SIZE 64
+
+static void report(char const *name, int64_t total, int64_t best, int64_t worst) {
+	printf("%-8s %8.1f us mean %8ld us min %8ld us max\n", name,
+		(double) total / ROUNDS, (long) best, (long) worst);
+}
+
+static int serve_rfcomm(bt_socket_t *listener) {
+	unsigned char buffer[MESSAGE_SIZE];
+	bt_socket_t client;
+	size_t len;
+
+	if (bt_accept_deadline(listener, &client, BT_DEADLINE_NEVER) != BT_SUCCESS)
+		return -1;
+	printf("RFCOMM client connected\n");
+
+	len = sizeof(buffer);
+	while (bt_recv(&client, buffer, &len) == BT_SUCCESS) {
+		if (bt_write(&client, buffer, len) != BT_SUCCESS)
+			break;
+		len = sizeof(buffer);
+	}
+	bt_disconnect(&client);
+
+	return 0;
+}
+
+static int serve_l2cap(bt_socket_t *listener) {
+	unsigned char buffer[MESSAGE_SIZE];
+	bt_socket_t client;
+	size_t len;
+
+	if (bt_accept_deadline(listener, &client, BT_DEADLINE_NEVER) != BT_SUCCESS)
+		return -1;
+	printf("L2CAP client connected\n");
+
+	len = sizeof(buffer);
+	while (bt_recv_message(&client, buffer, &len) == BT_SUCCESS) {
+		if (bt_send_message(&client, buffer, len) != BT_SUCCESS)
+			break;
+		len = sizeof(buffer);
+	}
+	bt_disconnect(&client);
+
+	return 0;
+}
+
+static int run_server(void) {
+	bt_socket_t rfcomm;
+	bt_socket_t l2cap;
+	int ret = -1;
+
+	rfcomm.s = -1;
+	l2cap.s = -1;
+
+	if (bt_bind_to_channel(&rfcomm, CHANNEL) != BT_SUCCESS || bt_listen(&rfcomm) != BT_SUCCESS) {
+		printf("Error listening on channel %d\n", CHANNEL);
+		goto cleanup;
+	}
+	if (bt_bind_l2cap(&l2cap, PSM) != BT_SUCCESS || bt_listen(&l2cap) != BT_SUCCESS) {
+		printf("Error listening on PSM 0x%04x\n", PSM);
+		goto cleanup;
+	}
+
+	printf("Waiting for the client...\n");
+	if (serve_rfcomm(&rfcomm) == 0 && serve_l2cap(&l2cap) == 0)
+		ret = 0;
+
+cleanup:
+	bt_disconnect(&rfcomm);
+	bt_disconnect(&l2cap);
+
+	return ret;
+}
+
+static int run_client(char const *address) {
+	unsigned char out[MESSAGE_SIZE];
+	unsigned char in[MESSAGE_SIZE];
+	bt_addr_t remote;
+	bt_socket_t sock;
+	int64_t total, best, worst, start, elapsed;
+	size_t len;
+	int round;
+
+	bt_str_to_addr(address, &remote);
+	memset(out, 'p', sizeof(out));
+
+	if (bt_connect_to_port(&remote, CHANNEL, &sock) != BT_SUCCESS) {
+		printf("Error connecting to channel %d\n", CHANNEL);
+		return -1;
+	}
+	total = 0;
+	best = INT64_MAX;
+	worst = 0;
+	for (round = 0; round < ROUNDS; round++) {
+		start = bt_time_now_us();
+		len = sizeof(in);
+		if (bt_write(&sock, out, sizeof(out)) != BT_SUCCESS || bt_read(&sock, in, &len) != BT_SUCCESS) {
+			printf("Error exchanging messages over RFCOMM\n");
+			bt_disconnect(&sock);
+			return -1;
+		}
+		elapsed = bt_time_now_us() - start;
+		total += elapsed;
+		best = (elapsed < best) ? elapsed : best;
+		worst = (elapsed > worst) ? elapsed : worst;
+	}
+	bt_disconnect(&sock);
+	report("rfcomm", total, best, worst);
+
+	if (bt_connect_l2cap(&remote, PSM, &sock) != BT_SUCCESS) {
+		printf("Error connecting to PSM 0x%04x\n", PSM);
+		return -1;
+	}
+	total = 0;
+	best = INT64_MAX;
+	worst = 0;
+	for (round = 0; round < ROUNDS; round++) {
+		start = bt_time_now_us();
+		len = sizeof(in);
+		if (bt_send_message(&sock, out, sizeof(out)) != BT_SUCCESS || bt_recv_message(&sock, in, &len) != BT_SUCCESS) {
+			printf("Error exchanging messages over L2CAP\n");
+			bt_disconnect(&sock);
+			return -1;
+		}
+		elapsed = bt_time_now_us() - start;
+		total += elapsed;
+		best = (elapsed < best) ? elapsed : best;
+		worst = (elapsed > worst) ? elapsed : worst;
+	}
+	bt_disconnect(&sock);
+	report("l2cap", total, best, worst);
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int ret;
+
+	if (argc != 2) {
+		printf("Usage: %s server | <server address>\n", argv[0]);
+		return -1;
+	}
+
+	if (bt_init() != BT_SUCCESS) {
+		printf("Error initialising Bluetooth\n");
+		return -1;
+	}
+
+	if (strcmp(argv[1], "server") == 0) {
+		ret = run_server();
+	}
+	else {
+		printf("%d round trips of %d byte messages\n", ROUNDS, MESSAGE_SIZE);
+		ret = run_client(argv[1]);
+	}
+
+	bt_exit();
+
+	return ret;
+}
@@ -0,0 +1,193 @@
+/**
+ * A benchmark comparing the work-stealing scheduler with a pool of threads
+ * sharing a single queue, for a skewed mix of connection handlers.
+ *
+ * It doesn't need any Bluetooth hardware: each mock connection is a task
+ * that burns processor time. Most are quick pings, but one in LONG_EVERY
+ * is a long exchange that runs as a chain of continuations, as a handler
+ * waiting on several round trips would. The time taken to serve every
+ * connection is printed for each method, along with how much work the
+ * scheduler's workers stole from each other.
+ *
+ */
+
+#include <picobt/bt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CONNECTIONS 50000
+#define WORKERS 4
+#define LONG_EVERY 20
+#define PING_US 5
+#define STEP_US 100
+#define STEPS 8
+
+/// A mock connection and how far its handler has got.
+typedef struct {
+	/// The number of steps left to run.
+	int steps;
+	/// How long each step takes.
+	int step_us;
+} connection_t;
+
+static connection_t connections[CONNECTIONS];
+
+static void burn(int us) {
+	int64_t end = bt_time_now_us() + us;
+	while (bt_time_now_us() < end);
+}
+
+static void reset(void) {
+	int i;
+
+	for (i = 0; i < CONNECTIONS; i++) {
+		connections[i].steps = (i % LONG_EVERY == 0) ? STEPS : 1;
+		connections[i].step_us = (i % LONG_EVERY == 0) ? STEP_US : PING_US;
+	}
+}
+
+/* SHARED QUEUE */
+
+/// A pool of threads taking tasks from one locked queue.
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t idle;
+	connection_t **queue;
+	size_t head;
+	size_t count;
+	size_t outstanding;
+	int stopping;
+} pool;
+
+static void pool_push(connection_t *connection) {
+	pthread_mutex_lock(&pool.lock);
+	pool.queue[(pool.head + pool.count) % CONNECTIONS] = connection;
+	pool.count++;
+	pool.outstanding++;
+	pthread_cond_signal(&pool.ready);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void *pool_worker(void *arg) {
+	connection_t *connection;
+
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (pool.count == 0 && !pool.stopping) {
+			pthread_cond_wait(&pool.ready, &pool.lock);
+		}
+		if (pool.count == 0)
+			break;
+		connection = pool.queue[pool.head];
+		pool.head = (pool.head + 1) % CONNECTIONS;
+		pool.count--;
+		pthread_mutex_unlock(&pool.lock);
+
+		// each step of a long exchange goes back on the queue
+		burn(connection->step_us);
+		if (--connection->steps > 0) {
+			pool_push(connection);
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.outstanding == 0) {
+			pthread_cond_broadcast(&pool.idle);
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+static int64_t run_pool(void) {
+	pthread_t threads[WORKERS];
+	int64_t start;
+	int i;
+
+	reset();
+	pool.queue = malloc(CONNECTIONS * sizeof(connection_t *));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.ready, NULL);
+	pthread_cond_init(&pool.idle, NULL);
+	for (i = 0; i < WORKERS; i++) {
+		pthread_create(&threads[i], NULL, pool_worker, NULL);
+	}
+
+	start = bt_time_now_us();
+	for (i = 0; i < CONNECTIONS; i++) {
+		pool_push(&connections[i]);
+	}
+	pthread_mutex_lock(&pool.lock);
+	while (pool.outstanding > 0) {
+		pthread_cond_wait(&pool.idle, &pool.lock);
+	}
+	pool.stopping = 1;
+	pthread_cond_broadcast(&pool.ready);
+	pthread_mutex_unlock(&pool.lock);
+	start = bt_time_now_us() - start;
+
+	for (i = 0; i < WORKERS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(pool.queue);
+
+	return start;
+}
+
+/* WORK STEALING */
+
+static void sched_task(bt_sched_t *sched, void *data) {
+	connection_t *connection = data;
+
+	burn(connection->step_us);
+	if (--connection->steps > 0) {
+		// the continuation stays on this worker unless another steals it
+		bt_sched_submit(sched, sched_task, connection);
+	}
+}
+
+static int64_t run_sched(bt_sched_stats_t *stats) {
+	bt_sched_t sched;
+	int64_t start;
+	int i;
+
+	reset();
+	if (bt_sched_init(&sched, WORKERS) != BT_SUCCESS)
+		return -1;
+
+	start = bt_time_now_us();
+	for (i = 0; i < CONNECTIONS; i++) {
+		bt_sched_submit(&sched, sched_task, &connections[i]);
+	}
+	bt_sched_wait_idle(&sched);
+	start = bt_time_now_us() - start;
+
+	bt_sched_get_stats(&sched, stats);
+	bt_sched_free(&sched);
+
+	return start;
+}
+
+int main() {
+	bt_sched_stats_t stats;
+	int64_t elapsed;
+
+	printf("%d connections on %d workers, 1 in %d running %d steps of %d us, the rest %d us\n",
+		CONNECTIONS, WORKERS, LONG_EVERY, STEPS, STEP_US, PING_US);
+
+	elapsed = run_pool();
+	printf("%-14s %8.1f ms %10.0f connections/s\n", "shared queue", elapsed / 1000.0,
+		CONNECTIONS / (elapsed / 1000000.0));
+
+	elapsed = run_sched(&stats);
+	if (elapsed < 0) {
+		printf("Error creating scheduler\n");
+		return -1;
+	}
+	printf("%-14s %8.1f ms %10.0f connections/s  %lu tasks, %lu stolen\n", "work stealing",
+		elapsed / 1000.0, CONNECTIONS / (elapsed / 1000000.0), stats.executed, stats.stolen);
+
+	return 0;
+}
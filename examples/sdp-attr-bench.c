@@ -0,0 +1,307 @@
+/**
+ * A benchmark comparing service queries that fetch every SDP attribute with
+ * queries that fetch only the attributes they use.
+ *
+ * It doesn't need any Bluetooth hardware: the remote SDP server is mocked by
+ * this program, which provides its own sdp_connect, sdp_service_search_attr_req
+ * and sdp_close in place of BlueZ's. The mock device has a set of service
+ * records like a phone's. It answers each request by encoding the requested
+ * attributes and splitting the result into responses that fit the default SDP
+ * MTU, counting the bytes and round trips that would have crossed the air.
+ *
+ * Each query is made through bt_services_begin_ex, listing every service with
+ * all attributes, with the default selection, and finding one service's
+ * channel the way bt_connect_to_service does.
+ *
+ */
+
+#include <picobt/bt.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/sdp.h>
+#include <bluetooth/sdp_lib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 1000
+/// The default L2CAP MTU for SDP.
+#define SDP_MTU 672
+/// PDU header, attribute byte count and the longest continuation state.
+#define SDP_RSP_OVERHEAD (5 + 2 + 17)
+#define PICO_SERVICE "ed995e5a-c7e7-4442-a6ee-7bb76df43b0d"
+
+/// A service offered by the mock device.
+typedef struct {
+	/// The 16-bit service class, or 0 for the Pico service.
+	uint16_t service_class;
+	/// The RFCOMM channel, or 0 for services that only use L2CAP.
+	uint8_t channel;
+	/// The service name.
+	char const *name;
+	/// The service description.
+	char const *description;
+} mock_service_t;
+
+static mock_service_t const services[] = {
+	{ 0x1112, 2, "Headset Gateway", "Headset audio gateway" },
+	{ 0x111f, 3, "Handsfree Gateway", "Hands-free audio gateway" },
+	{ 0x1105, 12, "OBEX Object Push", "Push files and contacts to this phone" },
+	{ 0x112f, 19, "OBEX Phonebook Access Server", "Phonebook access for car kits" },
+	{ 0x1132, 26, "SMS/MMS", "Message access server" },
+	{ 0x1101, 5, "Serial Port", "Serial port emulation" },
+	{ 0x110a, 0, "Audio Source", "Advanced audio distribution source" },
+	{ 0x110c, 0, "AV Remote Control Target", "Remote control of media playback" },
+	{ 0x1116, 0, "Network Access Point", "Personal area network access point" },
+	{ 0x1200, 0, "PnP Information", "Device identification" },
+	{ 0, 10, "Pico", "Pico authentication service" }
+};
+
+#define SERVICES (sizeof(services) / sizeof(services[0]))
+
+static sdp_record_t *records[SERVICES];
+static unsigned long bytes_sent;
+static unsigned long bytes_received;
+static unsigned long round_trips;
+
+static void add_list(sdp_record_t *record, uint16_t uuid16, uuid_t const *uuid128, int (*set)(sdp_record_t *, sdp_list_t *)) {
+	uuid_t uuid;
+	sdp_list_t *list;
+
+	if (uuid128 != NULL)
+		uuid = *uuid128;
+	else
+		sdp_uuid16_create(&uuid, uuid16);
+	list = sdp_list_append(NULL, &uuid);
+	set(record, list);
+	sdp_list_free(list, 0);
+}
+
+static sdp_record_t *create_record(mock_service_t const *service, uint32_t handle) {
+	sdp_record_t *record;
+	uuid_t pico;
+	bt_uuid_t pico_uuid;
+	uuid_t l2cap_uuid, rfcomm_uuid;
+	sdp_list_t *l2cap_list, *rfcomm_list, *proto_list, *access_list;
+	sdp_profile_desc_t profile;
+	sdp_list_t *profiles;
+	sdp_data_t *channel;
+	uint16_t features = 0x003f;
+	char url[128];
+
+	record = sdp_record_alloc();
+	record->handle = handle;
+	sdp_attr_add(record, SDP_ATTR_RECORD_HANDLE, sdp_data_alloc(SDP_UINT32, &handle));
+
+	if (service->service_class == 0) {
+		bt_str_to_uuid(PICO_SERVICE, &pico_uuid);
+		bt_uuid_to_uuid(&pico_uuid, &pico);
+		add_list(record, 0, &pico, sdp_set_service_classes);
+	} else {
+		add_list(record, service->service_class, NULL, sdp_set_service_classes);
+	}
+	add_list(record, PUBLIC_BROWSE_GROUP, NULL, sdp_set_browse_groups);
+
+	// L2CAP, then RFCOMM for the services that have a channel
+	sdp_uuid16_create(&l2cap_uuid, L2CAP_UUID);
+	l2cap_list = sdp_list_append(NULL, &l2cap_uuid);
+	proto_list = sdp_list_append(NULL, l2cap_list);
+	rfcomm_list = NULL;
+	channel = NULL;
+	if (service->channel > 0) {
+		sdp_uuid16_create(&rfcomm_uuid, RFCOMM_UUID);
+		channel = sdp_data_alloc(SDP_UINT8, &service->channel);
+		rfcomm_list = sdp_list_append(NULL, &rfcomm_uuid);
+		sdp_list_append(rfcomm_list, channel);
+		sdp_list_append(proto_list, rfcomm_list);
+	}
+	access_list = sdp_list_append(NULL, proto_list);
+	sdp_set_access_protos(record, access_list);
+	sdp_list_free(access_list, 0);
+	sdp_list_free(proto_list, 0);
+	sdp_list_free(rfcomm_list, 0);
+	sdp_list_free(l2cap_list, 0);
+	sdp_data_free(channel);
+
+	// the attributes nobody here uses, but which phones send anyway
+	sdp_add_lang_attr(record);
+	sdp_uuid16_create(&profile.uuid, service->service_class ? service->service_class : 0x1101);
+	profile.version = 0x0102;
+	profiles = sdp_list_append(NULL, &profile);
+	sdp_set_profile_descs(record, profiles);
+	sdp_list_free(profiles, 0);
+	sdp_attr_add(record, SDP_ATTR_SUPPORTED_FEATURES, sdp_data_alloc(SDP_UINT16, &features));
+	snprintf(url, sizeof(url), "http://www.example.com/support/bluetooth/profiles/%04x.html", handle);
+	sdp_attr_add(record, SDP_ATTR_DOC_URL, sdp_data_alloc(SDP_URL_STR8, url));
+	snprintf(url, sizeof(url), "http://www.example.com/support/bluetooth/icons/%04x.png", handle);
+	sdp_attr_add(record, SDP_ATTR_ICON_URL, sdp_data_alloc(SDP_URL_STR8, url));
+
+	sdp_set_info_attr(record, service->name, "Example Phones Ltd", service->description);
+
+	return record;
+}
+
+static bool record_has_uuid(sdp_record_t const *record, uuid_t const *uuid) {
+	sdp_list_t *lists[2] = { NULL, NULL };
+	sdp_list_t *item;
+	bool found = false;
+	int i;
+
+	sdp_get_service_classes(record, &lists[0]);
+	sdp_get_browse_groups(record, &lists[1]);
+	for (i = 0; i < 2; i++) {
+		for (item = lists[i]; item != NULL && !found; item = item->next) {
+			found = (sdp_uuid_cmp(item->data, uuid) == 0);
+		}
+		sdp_list_free(lists[i], free);
+	}
+
+	return found;
+}
+
+static bool attribute_wanted(uint16_t id, sdp_attrreq_type_t reqtype, sdp_list_t const *attrid_list) {
+	uint32_t range;
+
+	for (; attrid_list != NULL; attrid_list = attrid_list->next) {
+		if (reqtype == SDP_ATTR_REQ_RANGE) {
+			range = *(uint32_t*) attrid_list->data;
+			if (id >= (range >> 16) && id <= (range & 0xffff))
+				return true;
+		} else if (id == *(uint16_t*) attrid_list->data) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static unsigned long sequence_size(unsigned long contents) {
+	if (contents < 0x100)
+		return contents + 2;
+	if (contents < 0x10000)
+		return contents + 3;
+	return contents + 5;
+}
+
+sdp_session_t *sdp_connect(const bdaddr_t *src, const bdaddr_t *dst, uint32_t flags) {
+	return calloc(1, sizeof(sdp_session_t));
+}
+
+int sdp_close(sdp_session_t *session) {
+	free(session);
+	return 0;
+}
+
+int sdp_service_search_attr_req(sdp_session_t *session, const sdp_list_t *search, sdp_attrreq_type_t reqtype, const sdp_list_t *attrid_list, sdp_list_t **rsp_list) {
+	sdp_list_t const *item;
+	sdp_list_t *attribute;
+	sdp_record_t *record;
+	sdp_data_t *data;
+	sdp_buf_t pdu;
+	unsigned long request;
+	unsigned long response;
+	unsigned long chunk;
+	unsigned long trips;
+	unsigned long i;
+	int scanned;
+
+	*rsp_list = NULL;
+	response = 0;
+	for (i = 0; i < SERVICES; i++) {
+		if (!record_has_uuid(records[i], search->data))
+			continue;
+
+		// the client gets its own copy of the record, with just the attributes asked for
+		sdp_gen_record_pdu(records[i], &pdu);
+		record = sdp_extract_pdu(pdu.data, pdu.data_size, &scanned);
+		free(pdu.data);
+		for (attribute = record->attrlist; attribute != NULL; ) {
+			data = attribute->data;
+			attribute = attribute->next;
+			if (!attribute_wanted(data->attrId, reqtype, attrid_list))
+				sdp_attr_remove(record, data->attrId);
+		}
+		sdp_gen_record_pdu(record, &pdu);
+		response += pdu.data_size;
+		free(pdu.data);
+
+		*rsp_list = sdp_list_append(*rsp_list, record);
+	}
+	response = sequence_size(response);
+
+	// the request repeats its search pattern and attribute list each time
+	request = 0;
+	for (item = search; item != NULL; item = item->next) {
+		request += (((uuid_t*) item->data)->type == SDP_UUID16) ? 3 : 17;
+	}
+	request = sequence_size(request) + 2;
+	request += sequence_size((reqtype == SDP_ATTR_REQ_RANGE ? 5 : 3) * sdp_list_len(attrid_list));
+
+	trips = 0;
+	while (response > 0 || trips == 0) {
+		chunk = (response > SDP_MTU - SDP_RSP_OVERHEAD) ? SDP_MTU - SDP_RSP_OVERHEAD : response;
+		response -= chunk;
+		bytes_sent += 5 + request + (trips == 0 ? 1 : 17);
+		bytes_received += 5 + 2 + chunk + (response > 0 ? 17 : 1);
+		trips++;
+	}
+	round_trips += trips;
+
+	return 0;
+}
+
+static int run(char const *name, bt_addr_t const *device, bt_uuid_t const *service_class, unsigned attributes) {
+	bt_inquiry_t inquiry;
+	bt_service_t service;
+	unsigned long found = 0;
+	int round;
+
+	bytes_sent = 0;
+	bytes_received = 0;
+	round_trips = 0;
+
+	for (round = 0; round < ROUNDS; round++) {
+		if (bt_services_begin_ex(&inquiry, device, service_class, 0, attributes) != BT_SUCCESS)
+			return -1;
+		while (bt_services_next(&inquiry, &service) == BT_SUCCESS) {
+			found++;
+		}
+		bt_services_end(&inquiry);
+	}
+
+	printf("%-12s %3lu services %8.1f bytes sent %8.1f bytes received %5.2f round trips per query\n",
+		name, found / ROUNDS, (double) bytes_sent / ROUNDS,
+		(double) bytes_received / ROUNDS, (double) round_trips / ROUNDS);
+
+	return 0;
+}
+
+int main() {
+	bt_addr_t device;
+	bt_uuid_t pico;
+	int ret = -1;
+	unsigned long i;
+
+	for (i = 0; i < SERVICES; i++) {
+		records[i] = create_record(&services[i], 0x10000 + i);
+	}
+	bt_str_to_addr("00:11:22:33:44:55", &device);
+	bt_str_to_uuid(PICO_SERVICE, &pico);
+
+	printf("%lu services on the device, %d queries each\n", (unsigned long) SERVICES, ROUNDS);
+
+	if (run("browse-all", &device, NULL, BT_SERVICE_ATTR_ALL) != 0
+			|| run("browse", &device, NULL, BT_SERVICE_ATTR_DEFAULT) != 0
+			|| run("channel-all", &device, &pico, BT_SERVICE_ATTR_ALL) != 0
+			|| run("channel", &device, &pico, BT_SERVICE_ATTR_PROTOCOLS) != 0) {
+		printf("Error querying services\n");
+		goto cleanup;
+	}
+
+	ret = 0;
+cleanup:
+	for (i = 0; i < SERVICES; i++) {
+		sdp_record_free(records[i]);
+	}
+
+	return ret;
+}
@@ -0,0 +1,417 @@
+/**
+ * A benchmark measuring how fast SDP records are parsed by
+ * bt_sdp_parse_record, compared with BlueZ's sdp_extract_pdu. It also times
+ * finding just the RFCOMM channel with an SDP cursor, which reads no more of
+ * each record than it needs.
+ *
+ * It doesn't need any Bluetooth hardware. The corpus is a set of records
+ * in the form a phone sends them. Any files named on the command line are
+ * added to it; each should hold one raw record, as captured from a device.
+ * Every record is parsed ROUNDS times by each parser, and the throughput is
+ * printed.
+ *
+ */
+
+#include <picobt/bt.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/sdp.h>
+#include <bluetooth/sdp_lib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ROUNDS 100000
+#define MAX_RECORDS 256
+#define MAX_RECORD_SIZE 65536
+#define MAX_ELEMENTS 4096
+
+/// A record to parse.
+typedef struct {
+	/// The packed record.
+	uint8_t const *data;
+	/// The number of bytes in the record.
+	size_t length;
+} corpus_record_t;
+
+// Serial port
+static uint8_t const serial_port[] = {
+	0x35, 0x85, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x00, 0x09, 0x00,
+	0x01, 0x35, 0x03, 0x19, 0x11, 0x01, 0x09, 0x00, 0x04, 0x35, 0x0c, 0x35,
+	0x03, 0x19, 0x01, 0x00, 0x35, 0x05, 0x19, 0x00, 0x03, 0x08, 0x05, 0x09,
+	0x00, 0x05, 0x35, 0x03, 0x19, 0x10, 0x02, 0x09, 0x00, 0x06, 0x35, 0x09,
+	0x09, 0x65, 0x6e, 0x09, 0x00, 0x6a, 0x09, 0x01, 0x00, 0x09, 0x00, 0x09,
+	0x35, 0x08, 0x35, 0x06, 0x19, 0x11, 0x01, 0x09, 0x01, 0x02, 0x09, 0x01,
+	0x00, 0x25, 0x0b, 0x53, 0x65, 0x72, 0x69, 0x61, 0x6c, 0x20, 0x50, 0x6f,
+	0x72, 0x74, 0x09, 0x01, 0x01, 0x25, 0x15, 0x53, 0x65, 0x72, 0x69, 0x61,
+	0x6c, 0x20, 0x70, 0x6f, 0x72, 0x74, 0x20, 0x65, 0x6d, 0x75, 0x6c, 0x61,
+	0x74, 0x69, 0x6f, 0x6e, 0x09, 0x01, 0x02, 0x25, 0x12, 0x45, 0x78, 0x61,
+	0x6d, 0x70, 0x6c, 0x65, 0x20, 0x50, 0x68, 0x6f, 0x6e, 0x65, 0x73, 0x20,
+	0x4c, 0x74, 0x64
+};
+
+// Headset gateway
+static uint8_t const headset_gateway[] = {
+	0x35, 0x89, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x01, 0x09, 0x00,
+	0x01, 0x35, 0x03, 0x19, 0x11, 0x12, 0x09, 0x00, 0x04, 0x35, 0x0c, 0x35,
+	0x03, 0x19, 0x01, 0x00, 0x35, 0x05, 0x19, 0x00, 0x03, 0x08, 0x02, 0x09,
+	0x00, 0x05, 0x35, 0x03, 0x19, 0x10, 0x02, 0x09, 0x00, 0x06, 0x35, 0x09,
+	0x09, 0x65, 0x6e, 0x09, 0x00, 0x6a, 0x09, 0x01, 0x00, 0x09, 0x00, 0x09,
+	0x35, 0x08, 0x35, 0x06, 0x19, 0x11, 0x08, 0x09, 0x01, 0x02, 0x09, 0x01,
+	0x00, 0x25, 0x0f, 0x48, 0x65, 0x61, 0x64, 0x73, 0x65, 0x74, 0x20, 0x47,
+	0x61, 0x74, 0x65, 0x77, 0x61, 0x79, 0x09, 0x01, 0x01, 0x25, 0x15, 0x48,
+	0x65, 0x61, 0x64, 0x73, 0x65, 0x74, 0x20, 0x61, 0x75, 0x64, 0x69, 0x6f,
+	0x20, 0x67, 0x61, 0x74, 0x65, 0x77, 0x61, 0x79, 0x09, 0x01, 0x02, 0x25,
+	0x12, 0x45, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x20, 0x50, 0x68, 0x6f,
+	0x6e, 0x65, 0x73, 0x20, 0x4c, 0x74, 0x64
+};
+
+// Hands-free gateway
+static uint8_t const hands_free_gateway[] = {
+	0x35, 0x7c, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x02, 0x09, 0x00,
+	0x01, 0x35, 0x03, 0x19, 0x11, 0x1f, 0x09, 0x00, 0x04, 0x35, 0x0c, 0x35,
+	0x03, 0x19, 0x01, 0x00, 0x35, 0x05, 0x19, 0x00, 0x03, 0x08, 0x03, 0x09,
+	0x00, 0x05, 0x35, 0x03, 0x19, 0x10, 0x02, 0x09, 0x00, 0x06, 0x35, 0x09,
+	0x09, 0x65, 0x6e, 0x09, 0x00, 0x6a, 0x09, 0x01, 0x00, 0x09, 0x00, 0x09,
+	0x35, 0x08, 0x35, 0x06, 0x19, 0x11, 0x1e, 0x09, 0x01, 0x07, 0x09, 0x03,
+	0x01, 0x08, 0x01, 0x09, 0x03, 0x11, 0x09, 0x0b, 0x7f, 0x09, 0x01, 0x00,
+	0x25, 0x11, 0x48, 0x61, 0x6e, 0x64, 0x73, 0x66, 0x72, 0x65, 0x65, 0x20,
+	0x47, 0x61, 0x74, 0x65, 0x77, 0x61, 0x79, 0x09, 0x01, 0x02, 0x25, 0x12,
+	0x45, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x20, 0x50, 0x68, 0x6f, 0x6e,
+	0x65, 0x73, 0x20, 0x4c, 0x74, 0x64
+};
+
+// Object push
+static uint8_t const object_push[] = {
+	0x35, 0xb3, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x03, 0x09, 0x00,
+	0x01, 0x35, 0x03, 0x19, 0x11, 0x05, 0x09, 0x00, 0x04, 0x35, 0x0c, 0x35,
+	0x03, 0x19, 0x01, 0x00, 0x35, 0x05, 0x19, 0x00, 0x03, 0x08, 0x0c, 0x09,
+	0x00, 0x05, 0x35, 0x03, 0x19, 0x10, 0x02, 0x09, 0x00, 0x06, 0x35, 0x09,
+	0x09, 0x65, 0x6e, 0x09, 0x00, 0x6a, 0x09, 0x01, 0x00, 0x09, 0x00, 0x09,
+	0x35, 0x08, 0x35, 0x06, 0x19, 0x11, 0x05, 0x09, 0x01, 0x02, 0x09, 0x02,
+	0x00, 0x09, 0x10, 0x23, 0x09, 0x03, 0x03, 0x35, 0x0e, 0x08, 0x01, 0x08,
+	0x02, 0x08, 0x03, 0x08, 0x04, 0x08, 0x05, 0x08, 0x06, 0x08, 0xff, 0x09,
+	0x01, 0x00, 0x25, 0x10, 0x4f, 0x42, 0x45, 0x58, 0x20, 0x4f, 0x62, 0x6a,
+	0x65, 0x63, 0x74, 0x20, 0x50, 0x75, 0x73, 0x68, 0x09, 0x01, 0x01, 0x25,
+	0x25, 0x50, 0x75, 0x73, 0x68, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x73, 0x20,
+	0x61, 0x6e, 0x64, 0x20, 0x63, 0x6f, 0x6e, 0x74, 0x61, 0x63, 0x74, 0x73,
+	0x20, 0x74, 0x6f, 0x20, 0x74, 0x68, 0x69, 0x73, 0x20, 0x70, 0x68, 0x6f,
+	0x6e, 0x65, 0x09, 0x01, 0x02, 0x25, 0x12, 0x45, 0x78, 0x61, 0x6d, 0x70,
+	0x6c, 0x65, 0x20, 0x50, 0x68, 0x6f, 0x6e, 0x65, 0x73, 0x20, 0x4c, 0x74,
+	0x64
+};
+
+// Phonebook access
+static uint8_t const phonebook_access[] = {
+	0x35, 0x8f, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x04, 0x09, 0x00,
+	0x01, 0x35, 0x03, 0x19, 0x11, 0x2f, 0x09, 0x00, 0x04, 0x35, 0x0c, 0x35,
+	0x03, 0x19, 0x01, 0x00, 0x35, 0x05, 0x19, 0x00, 0x03, 0x08, 0x13, 0x09,
+	0x00, 0x05, 0x35, 0x03, 0x19, 0x10, 0x02, 0x09, 0x00, 0x06, 0x35, 0x09,
+	0x09, 0x65, 0x6e, 0x09, 0x00, 0x6a, 0x09, 0x01, 0x00, 0x09, 0x00, 0x09,
+	0x35, 0x08, 0x35, 0x06, 0x19, 0x11, 0x30, 0x09, 0x01, 0x02, 0x09, 0x02,
+	0x00, 0x09, 0x10, 0x25, 0x09, 0x03, 0x14, 0x08, 0x03, 0x09, 0x03, 0x17,
+	0x0a, 0x00, 0x00, 0x03, 0xff, 0x09, 0x01, 0x00, 0x25, 0x1c, 0x4f, 0x42,
+	0x45, 0x58, 0x20, 0x50, 0x68, 0x6f, 0x6e, 0x65, 0x62, 0x6f, 0x6f, 0x6b,
+	0x20, 0x41, 0x63, 0x63, 0x65, 0x73, 0x73, 0x20, 0x53, 0x65, 0x72, 0x76,
+	0x65, 0x72, 0x09, 0x01, 0x02, 0x25, 0x12, 0x45, 0x78, 0x61, 0x6d, 0x70,
+	0x6c, 0x65, 0x20, 0x50, 0x68, 0x6f, 0x6e, 0x65, 0x73, 0x20, 0x4c, 0x74,
+	0x64
+};
+
+// Message access
+static uint8_t const message_access[] = {
+	0x35, 0x8b, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x05, 0x09, 0x00,
+	0x01, 0x35, 0x03, 0x19, 0x11, 0x32, 0x09, 0x00, 0x04, 0x35, 0x0c, 0x35,
+	0x03, 0x19, 0x01, 0x00, 0x35, 0x05, 0x19, 0x00, 0x03, 0x08, 0x1a, 0x09,
+	0x00, 0x05, 0x35, 0x03, 0x19, 0x10, 0x02, 0x09, 0x00, 0x06, 0x35, 0x09,
+	0x09, 0x65, 0x6e, 0x09, 0x00, 0x6a, 0x09, 0x01, 0x00, 0x09, 0x00, 0x09,
+	0x35, 0x08, 0x35, 0x06, 0x19, 0x11, 0x34, 0x09, 0x01, 0x02, 0x09, 0x03,
+	0x15, 0x08, 0x00, 0x09, 0x03, 0x16, 0x08, 0x0e, 0x09, 0x01, 0x00, 0x25,
+	0x07, 0x53, 0x4d, 0x53, 0x2f, 0x4d, 0x4d, 0x53, 0x09, 0x01, 0x01, 0x25,
+	0x15, 0x4d, 0x65, 0x73, 0x73, 0x61, 0x67, 0x65, 0x20, 0x61, 0x63, 0x63,
+	0x65, 0x73, 0x73, 0x20, 0x73, 0x65, 0x72, 0x76, 0x65, 0x72, 0x09, 0x01,
+	0x02, 0x25, 0x12, 0x45, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x20, 0x50,
+	0x68, 0x6f, 0x6e, 0x65, 0x73, 0x20, 0x4c, 0x74, 0x64
+};
+
+// A2DP source
+static uint8_t const a2dp_source[] = {
+	0x35, 0x6e, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x06, 0x09, 0x00,
+	0x01, 0x35, 0x03, 0x19, 0x11, 0x0a, 0x09, 0x00, 0x04, 0x35, 0x08, 0x35,
+	0x06, 0x19, 0x01, 0x00, 0x09, 0x00, 0x19, 0x09, 0x00, 0x05, 0x35, 0x03,
+	0x19, 0x10, 0x02, 0x09, 0x00, 0x06, 0x35, 0x09, 0x09, 0x65, 0x6e, 0x09,
+	0x00, 0x6a, 0x09, 0x01, 0x00, 0x09, 0x00, 0x09, 0x35, 0x08, 0x35, 0x06,
+	0x19, 0x11, 0x0d, 0x09, 0x01, 0x03, 0x09, 0x03, 0x11, 0x09, 0x00, 0x01,
+	0x09, 0x01, 0x00, 0x25, 0x0c, 0x41, 0x75, 0x64, 0x69, 0x6f, 0x20, 0x53,
+	0x6f, 0x75, 0x72, 0x63, 0x65, 0x09, 0x01, 0x02, 0x25, 0x12, 0x45, 0x78,
+	0x61, 0x6d, 0x70, 0x6c, 0x65, 0x20, 0x50, 0x68, 0x6f, 0x6e, 0x65, 0x73,
+	0x20, 0x4c, 0x74, 0x64
+};
+
+// AVRCP target
+static uint8_t const avrcp_target[] = {
+	0x35, 0x7a, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x07, 0x09, 0x00,
+	0x01, 0x35, 0x03, 0x19, 0x11, 0x0c, 0x09, 0x00, 0x04, 0x35, 0x08, 0x35,
+	0x06, 0x19, 0x01, 0x00, 0x09, 0x00, 0x17, 0x09, 0x00, 0x05, 0x35, 0x03,
+	0x19, 0x10, 0x02, 0x09, 0x00, 0x06, 0x35, 0x09, 0x09, 0x65, 0x6e, 0x09,
+	0x00, 0x6a, 0x09, 0x01, 0x00, 0x09, 0x00, 0x09, 0x35, 0x08, 0x35, 0x06,
+	0x19, 0x11, 0x0e, 0x09, 0x01, 0x06, 0x09, 0x03, 0x11, 0x09, 0x00, 0x02,
+	0x09, 0x01, 0x00, 0x25, 0x18, 0x41, 0x56, 0x20, 0x52, 0x65, 0x6d, 0x6f,
+	0x74, 0x65, 0x20, 0x43, 0x6f, 0x6e, 0x74, 0x72, 0x6f, 0x6c, 0x20, 0x54,
+	0x61, 0x72, 0x67, 0x65, 0x74, 0x09, 0x01, 0x02, 0x25, 0x12, 0x45, 0x78,
+	0x61, 0x6d, 0x70, 0x6c, 0x65, 0x20, 0x50, 0x68, 0x6f, 0x6e, 0x65, 0x73,
+	0x20, 0x4c, 0x74, 0x64
+};
+
+// PAN NAP
+static uint8_t const pan_nap[] = {
+	0x35, 0xab, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x08, 0x09, 0x00,
+	0x01, 0x35, 0x03, 0x19, 0x11, 0x16, 0x09, 0x00, 0x04, 0x35, 0x08, 0x35,
+	0x06, 0x19, 0x01, 0x00, 0x09, 0x00, 0x0f, 0x09, 0x00, 0x05, 0x35, 0x03,
+	0x19, 0x10, 0x02, 0x09, 0x00, 0x06, 0x35, 0x09, 0x09, 0x65, 0x6e, 0x09,
+	0x00, 0x6a, 0x09, 0x01, 0x00, 0x09, 0x00, 0x09, 0x35, 0x08, 0x35, 0x06,
+	0x19, 0x11, 0x16, 0x09, 0x01, 0x02, 0x09, 0x03, 0x0a, 0x09, 0x00, 0x00,
+	0x09, 0x03, 0x0b, 0x09, 0x00, 0x03, 0x09, 0x03, 0x0c, 0x0a, 0x00, 0x0f,
+	0x42, 0x40, 0x09, 0x01, 0x00, 0x25, 0x14, 0x4e, 0x65, 0x74, 0x77, 0x6f,
+	0x72, 0x6b, 0x20, 0x41, 0x63, 0x63, 0x65, 0x73, 0x73, 0x20, 0x50, 0x6f,
+	0x69, 0x6e, 0x74, 0x09, 0x01, 0x01, 0x25, 0x22, 0x50, 0x65, 0x72, 0x73,
+	0x6f, 0x6e, 0x61, 0x6c, 0x20, 0x61, 0x72, 0x65, 0x61, 0x20, 0x6e, 0x65,
+	0x74, 0x77, 0x6f, 0x72, 0x6b, 0x20, 0x61, 0x63, 0x63, 0x65, 0x73, 0x73,
+	0x20, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x09, 0x01, 0x02, 0x25, 0x12, 0x45,
+	0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x20, 0x50, 0x68, 0x6f, 0x6e, 0x65,
+	0x73, 0x20, 0x4c, 0x74, 0x64
+};
+
+// PnP information
+static uint8_t const pnp_information[] = {
+	0x35, 0xbc, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x09, 0x09, 0x00,
+	0x01, 0x35, 0x03, 0x19, 0x12, 0x00, 0x09, 0x00, 0x04, 0x35, 0x08, 0x35,
+	0x06, 0x19, 0x01, 0x00, 0x09, 0x00, 0x01, 0x09, 0x00, 0x05, 0x35, 0x03,
+	0x19, 0x10, 0x02, 0x09, 0x00, 0x06, 0x35, 0x09, 0x09, 0x65, 0x6e, 0x09,
+	0x00, 0x6a, 0x09, 0x01, 0x00, 0x09, 0x00, 0x09, 0x35, 0x08, 0x35, 0x06,
+	0x19, 0x12, 0x00, 0x09, 0x01, 0x02, 0x09, 0x02, 0x00, 0x09, 0x01, 0x03,
+	0x09, 0x02, 0x01, 0x09, 0x00, 0x1d, 0x09, 0x02, 0x02, 0x09, 0x12, 0x00,
+	0x09, 0x02, 0x03, 0x09, 0x14, 0x36, 0x09, 0x02, 0x04, 0x28, 0x01, 0x09,
+	0x02, 0x05, 0x09, 0x00, 0x02, 0x09, 0x00, 0x0a, 0x45, 0x29, 0x68, 0x74,
+	0x74, 0x70, 0x3a, 0x2f, 0x2f, 0x77, 0x77, 0x77, 0x2e, 0x65, 0x78, 0x61,
+	0x6d, 0x70, 0x6c, 0x65, 0x2e, 0x63, 0x6f, 0x6d, 0x2f, 0x73, 0x75, 0x70,
+	0x70, 0x6f, 0x72, 0x74, 0x2f, 0x62, 0x6c, 0x75, 0x65, 0x74, 0x6f, 0x6f,
+	0x74, 0x68, 0x2f, 0x09, 0x01, 0x00, 0x25, 0x0f, 0x50, 0x6e, 0x50, 0x20,
+	0x49, 0x6e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x09,
+	0x01, 0x02, 0x25, 0x12, 0x45, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x20,
+	0x50, 0x68, 0x6f, 0x6e, 0x65, 0x73, 0x20, 0x4c, 0x74, 0x64
+};
+
+// Pico
+static uint8_t const pico[] = {
+	0x35, 0x92, 0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x0a, 0x09, 0x00,
+	0x01, 0x35, 0x11, 0x1c, 0xed, 0x99, 0x5e, 0x5a, 0xc7, 0xe7, 0x44, 0x42,
+	0xa6, 0xee, 0x7b, 0xb7, 0x6d, 0xf4, 0x3b, 0x0d, 0x09, 0x00, 0x04, 0x35,
+	0x0c, 0x35, 0x03, 0x19, 0x01, 0x00, 0x35, 0x05, 0x19, 0x00, 0x03, 0x08,
+	0x0a, 0x09, 0x00, 0x05, 0x35, 0x03, 0x19, 0x10, 0x02, 0x09, 0x00, 0x06,
+	0x35, 0x09, 0x09, 0x65, 0x6e, 0x09, 0x00, 0x6a, 0x09, 0x01, 0x00, 0x09,
+	0x00, 0x09, 0x35, 0x08, 0x35, 0x06, 0x19, 0x11, 0x01, 0x09, 0x01, 0x02,
+	0x09, 0x01, 0x00, 0x25, 0x04, 0x50, 0x69, 0x63, 0x6f, 0x09, 0x01, 0x01,
+	0x25, 0x1b, 0x50, 0x69, 0x63, 0x6f, 0x20, 0x61, 0x75, 0x74, 0x68, 0x65,
+	0x6e, 0x74, 0x69, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x73, 0x65,
+	0x72, 0x76, 0x69, 0x63, 0x65, 0x09, 0x01, 0x02, 0x25, 0x12, 0x45, 0x78,
+	0x61, 0x6d, 0x70, 0x6c, 0x65, 0x20, 0x50, 0x68, 0x6f, 0x6e, 0x65, 0x73,
+	0x20, 0x4c, 0x74, 0x64
+};
+
+#define RECORD(x) { x, sizeof(x) }
+
+/// The built-in corpus.
+static corpus_record_t const builtin[] = {
+	RECORD(serial_port),
+	RECORD(headset_gateway),
+	RECORD(hands_free_gateway),
+	RECORD(object_push),
+	RECORD(phonebook_access),
+	RECORD(message_access),
+	RECORD(a2dp_source),
+	RECORD(avrcp_target),
+	RECORD(pan_nap),
+	RECORD(pnp_information),
+	RECORD(pico)
+};
+
+static corpus_record_t corpus[MAX_RECORDS];
+static int records = 0;
+static bt_sdp_element_t elements[MAX_ELEMENTS];
+
+static int load_record(char const *path) {
+	uint8_t *data;
+	size_t length;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (file == NULL)
+		return -1;
+	data = malloc(MAX_RECORD_SIZE);
+	length = fread(data, 1, MAX_RECORD_SIZE, file);
+	fclose(file);
+	if (length == 0 || records == MAX_RECORDS) {
+		free(data);
+		return -1;
+	}
+
+	corpus[records].data = data;
+	corpus[records].length = length;
+	records++;
+
+	return 0;
+}
+
+static void report(char const *name, unsigned long bytes, unsigned long parsed, int64_t elapsed) {
+	printf("%-10s %10.1f ms %8.1f MB/s %8.0f ns per record\n",
+		name, elapsed / 1000.0, (double) bytes / elapsed,
+		(elapsed * 1000.0) / parsed);
+}
+
+static int run_picobt(void) {
+	bt_sdp_record_t record;
+	unsigned long bytes = 0;
+	unsigned long count = 0;
+	int64_t start;
+	int round;
+	int i;
+
+	start = bt_time_now_us();
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < records; i++) {
+			if (bt_sdp_parse_record(corpus[i].data, corpus[i].length, elements, MAX_ELEMENTS, &record) != BT_SUCCESS)
+				return -1;
+			bytes += corpus[i].length;
+			count += record.count;
+		}
+	}
+	report("picobt", bytes, (unsigned long) ROUNDS * records, bt_time_now_us() - start);
+	printf("(%lu elements per round)\n", count / ROUNDS);
+
+	return 0;
+}
+
+static int find_channel(corpus_record_t const *record) {
+	bt_sdp_cursor_t cursor;
+	bt_sdp_cursor_t protocols;
+	bt_sdp_cursor_t protocol;
+	bt_sdp_element_t e;
+
+	bt_sdp_cursor_init(&cursor, record->data, record->length);
+	if (bt_sdp_find_attr(&cursor, SDP_ATTR_PROTO_DESC_LIST, &e) != BT_SUCCESS)
+		return -1;
+	if (bt_sdp_cursor_enter_seq(&cursor, &protocols) != BT_SUCCESS)
+		return -1;
+
+	// each protocol is a sequence of its UUID and parameters
+	while (bt_sdp_cursor_next(&protocols, &e) == BT_SUCCESS) {
+		if (bt_sdp_cursor_enter_seq(&protocols, &protocol) != BT_SUCCESS)
+			return -1;
+		if (bt_sdp_cursor_next(&protocol, &e) != BT_SUCCESS)
+			return -1;
+		if (e.type == BT_SDP_DATA_ELEMENT_UUID && e.sizeDesc == 1 && e.value.uuid16 == RFCOMM_UUID) {
+			if (bt_sdp_cursor_next(&protocol, &e) != BT_SUCCESS)
+				return -1;
+			return e.value.u8;
+		}
+	}
+
+	return 0;
+}
+
+static int run_cursor(void) {
+	unsigned long bytes = 0;
+	unsigned long channels = 0;
+	int64_t start;
+	int channel;
+	int round;
+	int i;
+
+	start = bt_time_now_us();
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < records; i++) {
+			channel = find_channel(&corpus[i]);
+			if (channel < 0)
+				return -1;
+			bytes += corpus[i].length;
+			channels += (channel > 0);
+		}
+	}
+	report("cursor", bytes, (unsigned long) ROUNDS * records, bt_time_now_us() - start);
+	printf("(%lu RFCOMM channels per round)\n", channels / ROUNDS);
+
+	return 0;
+}
+
+static int run_bluez(void) {
+	sdp_record_t *record;
+	unsigned long bytes = 0;
+	int64_t start;
+	int scanned;
+	int round;
+	int i;
+
+	start = bt_time_now_us();
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < records; i++) {
+			record = sdp_extract_pdu(corpus[i].data, (int) corpus[i].length, &scanned);
+			if (record == NULL)
+				return -1;
+			sdp_record_free(record);
+			bytes += corpus[i].length;
+		}
+	}
+	report("bluez", bytes, (unsigned long) ROUNDS * records, bt_time_now_us() - start);
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	bt_sdp_record_t record;
+	unsigned long size = 0;
+	int ret = -1;
+	int i;
+
+	for (i = 0; i < (int) (sizeof(builtin) / sizeof(builtin[0])); i++) {
+		corpus[records++] = builtin[i];
+	}
+	for (i = 1; i < argc; i++) {
+		if (load_record(argv[i]) != 0) {
+			printf("Error reading record from %s\n", argv[i]);
+			goto cleanup;
+		}
+	}
+
+	// make sure every record is one we can parse before timing anything
+	for (i = 0; i < records; i++) {
+		if (bt_sdp_parse_record(corpus[i].data, corpus[i].length, elements, MAX_ELEMENTS, &record) != BT_SUCCESS) {
+			printf("Error parsing record %d\n", i);
+			goto cleanup;
+		}
+		size += corpus[i].length;
+	}
+
+	printf("%d records, %lu bytes, %d rounds\n", records, size, ROUNDS);
+
+	if (run_picobt() != 0) {
+		printf("Error in picobt run\n");
+		goto cleanup;
+	}
+
+	if (run_cursor() != 0) {
+		printf("Error in cursor run\n");
+		goto cleanup;
+	}
+
+	if (run_bluez() != 0) {
+		printf("Error in BlueZ run\n");
+		goto cleanup;
+	}
+
+	ret = 0;
+cleanup:
+	for (i = (int) (sizeof(builtin) / sizeof(builtin[0])); i < records; i++) {
+		free((void *) corpus[i].data);
+	}
+
+	return ret;
+}
@@ -0,0 +1,145 @@
+/**
+ * A benchmark comparing bt_sendfile against reading a file into a buffer and
+ * sending it with bt_write.
+ *
+ * It doesn't need any Bluetooth hardware: the data is sent over a local
+ * socket pair to a child process that discards it. A temporary file is
+ * created and sent several times by each method, and the throughput and
+ * number of system calls are printed for each.
+ *
+ */
+
+#include <picobt/bt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FILE_SIZE (16 * 1024 * 1024)
+#define ROUNDS 8
+#define BUFFER_SIZE (16 * 1024)
+
+static const char *method_names[] = { "sendfile", "splice", "copy" };
+
+static void report(char const *name, uint64_t bytes, unsigned long calls, int64_t elapsed) {
+	printf("%-22s %6.1f MB/s %10lu syscalls %8.1f ms\n", name,
+		(bytes / (1024.0 * 1024.0)) / (elapsed / 1000000.0), calls, elapsed / 1000.0);
+}
+
+static int run_write(bt_socket_t *sock, int fd) {
+	char buffer[BUFFER_SIZE];
+	unsigned long calls = 0;
+	uint64_t bytes = 0;
+	int64_t start;
+	ssize_t n;
+	int round;
+
+	start = bt_time_now_us();
+	for (round = 0; round < ROUNDS; round++) {
+		if (lseek(fd, 0, SEEK_SET) != 0)
+			return -1;
+		while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+			if (bt_write(sock, buffer, n) != BT_SUCCESS)
+				return -1;
+			bytes += n;
+			calls += 2;
+		}
+	}
+	report("read and bt_write", bytes, calls, bt_time_now_us() - start);
+
+	return 0;
+}
+
+static int run_sendfile(bt_socket_t *sock, int fd) {
+	bt_sendfile_stats_t stats;
+	unsigned long calls = 0;
+	uint64_t bytes = 0;
+	int64_t start;
+	char name[32];
+	int round;
+
+	start = bt_time_now_us();
+	for (round = 0; round < ROUNDS; round++) {
+		if (bt_sendfile(sock, fd, 0, FILE_SIZE, &stats) != BT_SUCCESS)
+			return -1;
+		bytes += stats.bytes;
+		calls += stats.calls;
+	}
+	snprintf(name, sizeof(name), "bt_sendfile (%s)", method_names[stats.method]);
+	report(name, bytes, calls, bt_time_now_us() - start);
+
+	return 0;
+}
+
+int main() {
+	char path[] = "/tmp/sendfile-benchXXXXXX";
+	char block[BUFFER_SIZE];
+	bt_socket_t sender;
+	bt_socket_t receiver;
+	int fds[2];
+	int ret = -1;
+	pid_t child;
+	int fd;
+	int i;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		printf("Error creating temporary file\n");
+		return ret;
+	}
+	unlink(path);
+
+	memset(block, 'p', sizeof(block));
+	for (i = 0; i < FILE_SIZE / BUFFER_SIZE; i++) {
+		if (write(fd, block, sizeof(block)) != sizeof(block)) {
+			printf("Error writing temporary file\n");
+			close(fd);
+			return ret;
+		}
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		printf("Error creating socket pair\n");
+		close(fd);
+		return ret;
+	}
+	sender.s = fds[0];
+	receiver.s = fds[1];
+
+	child = fork();
+	if (child == 0) {
+		// discard everything until the sender closes
+		size_t len;
+		bt_disconnect(&sender);
+		do {
+			len = sizeof(block);
+		} while (bt_recv(&receiver, block, &len) == BT_SUCCESS);
+		bt_disconnect(&receiver);
+		return 0;
+	}
+	bt_disconnect(&receiver);
+
+	printf("Sending a %d MB file %d times\n", FILE_SIZE / (1024 * 1024), ROUNDS);
+
+	if (run_write(&sender, fd) != 0) {
+		printf("Error in read and write run\n");
+		goto cleanup;
+	}
+
+	if (run_sendfile(&sender, fd) != 0) {
+		printf("Error in sendfile run\n");
+		goto cleanup;
+	}
+
+	ret = 0;
+cleanup:
+	bt_disconnect(&sender);
+	close(fd);
+	if (child > 0) {
+		waitpid(child, NULL, 0);
+	}
+
+	return ret;
+}
@@ -0,0 +1,79 @@
+/**
+ * A test program that runs a long-lived echo server for a service, serving
+ * clients on a pool of worker threads.
+ * This code should be used with the client counterpart client-service.c on
+ * one or more different machines.
+ *
+ * Unlike server-service.c, the service is registered once and any number of
+ * clients can connect, one after another or at the same time. Each client's
+ * 6 byte message is read and sent back. The server's counters are printed
+ * every few seconds; press Ctrl-C to stop.
+ *
+ */
+
+#include <picobt/bt.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define SERVICE_UUID "465dbfb2-68a2-11e7-907b-a6006ad3dba0"
+#define WORKERS 8
+
+static void on_client(bt_server_t *server, bt_socket_t *client, void *data) {
+	unsigned char buffer[6];
+	size_t len = sizeof(buffer);
+
+	if (bt_read(client, buffer, &len) == BT_SUCCESS) {
+		bt_write(client, buffer, len);
+	}
+}
+
+int main() {
+	bt_server_config_t config = { 0 };
+	bt_server_stats_t stats;
+	bt_server_t server;
+	bt_uuid_t uuid;
+	bt_err_t e;
+
+	printf("Initialising Bluetooth\n");
+	e = bt_init();
+	if (e != BT_SUCCESS) {
+		printf("Error initialising Bluetooth\n");
+		return -1;
+	}
+
+	bt_str_to_uuid(SERVICE_UUID, &uuid);
+
+	config.service = &uuid;
+	config.service_name = "Test Service";
+	config.workers = WORKERS;
+	config.handler = on_client;
+
+	e = bt_server_init(&server, &config);
+	if (e != BT_SUCCESS) {
+		printf("Error creating server\n");
+		bt_exit();
+		return -1;
+	}
+
+	e = bt_server_start(&server);
+	if (e != BT_SUCCESS) {
+		printf("Error starting server\n");
+		bt_server_free(&server);
+		bt_exit();
+		return -1;
+	}
+
+	printf("Serving service uuid %s on channel %d\n", SERVICE_UUID, bt_server_get_channel(&server));
+
+	while (1) {
+		sleep(5);
+		bt_server_get_stats(&server, &stats);
+		printf("accepted %lu, handled %lu, rejected %lu, queued %u, active %u\n",
+			stats.accepted, stats.handled, stats.rejected, stats.queued, stats.active);
+	}
+
+	bt_server_free(&server);
+	bt_exit();
+
+	return 0;
+}
@@ -0,0 +1,136 @@
+/**
+ * A test program that opens an echo server on a specific port and serves
+ * many clients from a single thread using the reactor.
+ * This code can be used with the client counterpart client-port.c on one or
+ * more different machines.
+ *
+ * It will open a Bluetooth listening socket on the port defined by CHANNEL,
+ * and echo back whatever each client sends until the client disconnects.
+ *
+ */
+
+#include <picobt/bt.h>
+#include <stdio.h>
+
+#define CHANNEL 15
+#define MAX_CLIENTS 256
+
+static bt_socket_t clients[MAX_CLIENTS];
+static int connected = 0;
+
+static void on_client(bt_reactor_t *reactor, bt_socket_t *sock, int events, void *data) {
+	unsigned char buffer[256];
+	size_t len;
+	bt_err_t e;
+
+	e = BT_SUCCESS;
+	if (events & BT_REACTOR_READABLE) {
+		// the socket is non-blocking, so read until there's nothing left
+		while (e == BT_SUCCESS) {
+			len = sizeof(buffer);
+			e = bt_recv(sock, buffer, &len);
+			if (e == BT_SUCCESS) {
+				// a real server would queue anything that doesn't fit
+				bt_send(sock, buffer, &len);
+			}
+		}
+	}
+
+	if ((events & BT_REACTOR_CLOSED) || (e != BT_SUCCESS && e != BT_ERR_WOULD_BLOCK)) {
+		printf("Client on socket %d disconnected\n", sock->s);
+		bt_reactor_remove(reactor, sock);
+		bt_disconnect(sock);
+		connected--;
+	}
+}
+
+static void on_accept(bt_reactor_t *reactor, bt_socket_t *listener, bt_socket_t *client, void *data) {
+	int i;
+
+	for (i = 0; (i < MAX_CLIENTS) && (clients[i].s >= 0); i++);
+	if (i == MAX_CLIENTS) {
+		printf("Too many clients, dropping connection\n");
+		bt_disconnect(client);
+		return;
+	}
+
+	clients[i] = *client;
+	if (bt_reactor_add(reactor, &clients[i], BT_REACTOR_READABLE, on_client, NULL) != BT_SUCCESS) {
+		printf("Error registering client\n");
+		bt_disconnect(&clients[i]);
+		return;
+	}
+
+	connected++;
+	printf("Client connected on socket %d, %d connected\n", clients[i].s, connected);
+}
+
+int main() {
+	bt_err_t e;
+	bt_addr_t local_address;
+	char bt_mac_address[BT_ADDRESS_LENGTH];
+	bt_socket_t listener;
+	bt_reactor_t reactor;
+	int ret = -1;
+	int i;
+
+	listener.s = -1;
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		clients[i].s = -1;
+	}
+
+	printf("Initialising Bluetooth\n");
+	e = bt_init();
+	if (e != BT_SUCCESS) {
+		printf("Error initialising Bluetooth\n");
+		return ret;
+	}
+
+	bt_get_device_name(&local_address);
+	bt_addr_to_str(&local_address, bt_mac_address);
+	printf("Local bluetooth address: %s\n", bt_mac_address);
+
+	e = bt_reactor_init(&reactor);
+	if (e != BT_SUCCESS) {
+		printf("Error creating reactor\n");
+		bt_exit();
+		return ret;
+	}
+
+	e = bt_bind_to_channel(&listener, CHANNEL);
+	if (e != BT_SUCCESS) {
+		printf("Error binding to channel %d\n", CHANNEL);
+		goto cleanup;
+	}
+
+	e = bt_listen_with_backlog(&listener, BT_LISTEN_MAX_BACKLOG);
+	if (e != BT_SUCCESS) {
+		printf("Error setting socket to listen\n");
+		goto cleanup;
+	}
+
+	e = bt_reactor_add_listener(&reactor, &listener, on_accept, NULL);
+	if (e != BT_SUCCESS) {
+		printf("Error registering listener\n");
+		goto cleanup;
+	}
+
+	printf("Waiting for clients...\n");
+	e = bt_reactor_run(&reactor);
+	if (e != BT_SUCCESS) {
+		printf("Error running reactor\n");
+		goto cleanup;
+	}
+
+	ret = 0;
+cleanup:
+	bt_reactor_free(&reactor);
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		bt_disconnect(&clients[i]);
+	}
+	bt_disconnect(&listener);
+
+	bt_exit();
+
+	return ret;
+}
@@ -44,5 +44,15 @@
 #include "btmain.h"
 #include "btutil.h"
 #include "btsdp.h"
+#include "btbuffer.h"
+#include "btreactor.h"
+#include "btbatch.h"
+#include "btframe.h"
+#include "btserver.h"
+#include "btsched.h"
+#include "btasync.h"
+#include "btpool.h"
+#include "btlistener.h"
+#include "btsdpcache.h"
 
 #endif //__BT_H__
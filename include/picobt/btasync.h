@@ -0,0 +1,87 @@
+/**
+ * @file btasync.h
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Header for btasync.c
+ *
+ * Declares asynchronous versions of the connect, read and write calls, which
+ * report their results through completion callbacks.
+ */
+
+#ifndef __BTASYNC_H__
+#define __BTASYNC_H__
+
+#include <stdbool.h>
+#include "bttypes.h"
+#include "btreactor.h"
+
+/// Timeout value for the async calls that means the operation can wait forever.
+#define BT_ASYNC_NO_TIMEOUT (-1)
+
+struct _bt_async_t;
+struct _bt_async_socket_t;
+
+/**
+ * Callback invoked when an asynchronous operation completes.
+ *
+ * @param loop     The event loop the operation ran on.
+ * @param socket   The socket the operation was for. After a failed connect
+ *                 it has already been closed.
+ * @param result   `BT_SUCCESS`, or the error the equivalent synchronous call
+ *                 would have returned.
+ * @param numBytes The number of bytes read or written before the operation
+ *                 completed. This is zero for a connect.
+ * @param data     The user data passed when the operation was started.
+ */
+typedef void (*bt_async_callback_t)(struct _bt_async_t *loop, bt_socket_t *socket, bt_err_t result, size_t numBytes, void *data);
+
+/**
+ * An event loop that runs asynchronous connects, reads and writes and calls
+ * back as each one completes.
+ * The contents of this structure should be manipulated only through the
+ * `bt_async_*` functions.
+ */
+typedef struct _bt_async_t {
+	/// The reactor the sockets are watched with.
+	bt_reactor_t reactor;
+	/// The sockets with operations outstanding.
+	struct _bt_async_socket_t *sockets;
+	/// The number of operations outstanding.
+	size_t pending;
+	/// The number of operations completed, for counting progress.
+	unsigned long completed;
+	/// Set to make {@link bt_async_run} return.
+	bool stopping;
+} bt_async_t;
+
+bt_err_t bt_async_init(bt_async_t *loop);
+void bt_async_free(bt_async_t *loop);
+bt_err_t bt_connect_async(bt_async_t *loop, const bt_addr_t *address, unsigned char port, bt_socket_t *sock, int timeout_ms, bt_async_callback_t callback, void *data);
+bt_err_t bt_read_async(bt_async_t *loop, bt_socket_t *socket, void *buffer, size_t numBytes, int timeout_ms, bt_async_callback_t callback, void *data);
+bt_err_t bt_write_async(bt_async_t *loop, bt_socket_t *socket, const void *buffer, size_t numBytes, int timeout_ms, bt_async_callback_t callback, void *data);
+bt_err_t bt_async_cancel(bt_async_t *loop, bt_socket_t *socket);
+size_t bt_async_pending(bt_async_t const *loop);
+bt_err_t bt_async_run_once(bt_async_t *loop, int timeout_ms, int *completed);
+bt_err_t bt_async_run(bt_async_t *loop);
+void bt_async_stop(bt_async_t *loop);
+
+#endif //__BTASYNC_H__
@@ -0,0 +1,130 @@
+/**
+ * @file btbatch.h
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Header for btbatch.c
+ *
+ * Declares functions for submitting batches of socket operations and
+ * collecting their results, using io_uring where it's available.
+ */
+
+#ifndef __BTBATCH_H__
+#define __BTBATCH_H__
+
+#include <stdbool.h>
+#include "bttypes.h"
+
+/// The number of operations a batch can hold if none is specified.
+#define BT_BATCH_DEFAULT_ENTRIES 64
+
+/// Flag for bt_batch_init: run operations synchronously even if io_uring is available.
+#define BT_BATCH_SYNC 0x01
+
+/// The kinds of operation that can be batched.
+typedef enum {
+	/// Receive whatever data is available, as {@link bt_recv}.
+	BT_BATCH_RECV,
+	/// Send as much data as possible, as {@link bt_send}.
+	BT_BATCH_SEND,
+	/// Accept a connection on a listening socket.
+	BT_BATCH_ACCEPT
+} bt_batch_op_type_t;
+
+/**
+ * A batched operation. The same structure is used to return the result once
+ * the operation has completed.
+ */
+typedef struct {
+	/// The kind of operation.
+	bt_batch_op_type_t type;
+	/// The socket to operate on, or the listener for an accept.
+	bt_socket_t *socket;
+	/// The buffer to receive into or send from.
+	void *buffer;
+	/// The size of the buffer.
+	size_t size;
+	/// Where to store the new connection for an accept.
+	bt_socket_t *client;
+	/// User data to identify the operation.
+	void *data;
+	/// On completion, the number of bytes received or sent.
+	size_t numBytes;
+	/// On completion, the result, mapped the same way as for bt_recv and bt_send.
+	bt_err_t result;
+} bt_batch_op_t;
+
+/**
+ * Counters kept by a batch. Comparing kernel_calls with ops shows how many
+ * system calls batching has saved.
+ */
+typedef struct {
+	/// The number of operations completed.
+	unsigned long ops;
+	/// The number of times the kernel was entered to submit or wait.
+	unsigned long kernel_calls;
+} bt_batch_stats_t;
+
+/**
+ * A set of socket operations submitted and completed together.
+ * The contents of this structure should be manipulated only through the
+ * `bt_batch_*` functions.
+ */
+typedef struct {
+	/// The io_uring instance, or NULL when running synchronously.
+	void *ring;
+	/// Storage for the operations.
+	bt_batch_op_t *slots;
+	/// The number of slots.
+	unsigned entries;
+	/// Indices of the unused slots.
+	unsigned *free;
+	/// The number of unused slots.
+	unsigned free_count;
+	/// Indices of the slots added but not yet submitted, in order.
+	unsigned *queued;
+	/// The number of slots waiting to be submitted.
+	unsigned queued_count;
+	/// How many of the queued slots are already in the io_uring submission queue.
+	unsigned prepared;
+	/// Indices of the completed slots, as a ring.
+	unsigned *done;
+	/// Position of the oldest completed slot in the ring.
+	unsigned done_start;
+	/// The number of completed slots.
+	unsigned done_count;
+	/// The number of operations submitted but not yet complete.
+	unsigned in_flight;
+	/// Counters for monitoring the batch.
+	bt_batch_stats_t stats;
+} bt_batch_t;
+
+bt_err_t bt_batch_init(bt_batch_t *batch, unsigned entries, int flags);
+void bt_batch_free(bt_batch_t *batch);
+bool bt_batch_uses_io_uring(bt_batch_t const *batch);
+bt_err_t bt_batch_add_recv(bt_batch_t *batch, bt_socket_t *socket, void *buffer, size_t size, void *data);
+bt_err_t bt_batch_add_send(bt_batch_t *batch, bt_socket_t *socket, const void *buffer, size_t size, void *data);
+bt_err_t bt_batch_add_accept(bt_batch_t *batch, bt_socket_t *listener, bt_socket_t *client, void *data);
+bt_err_t bt_batch_submit(bt_batch_t *batch);
+bt_err_t bt_batch_reap(bt_batch_t *batch, bt_batch_op_t *results, unsigned max, unsigned wait, unsigned *count);
+void bt_batch_get_stats(bt_batch_t const *batch, bt_batch_stats_t *stats);
+
+#endif //__BTBATCH_H__
@@ -0,0 +1,249 @@
+/**
+ * @file btbuffer.h
+ * 
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Header for btbuffer.c
+ * 
+ * Declares buffered readers and writers that sit on top of a Bluetooth socket
+ * and cut down the number of system calls needed for small reads and writes.
+ */
+
+#ifndef __BTBUFFER_H__
+#define __BTBUFFER_H__
+
+#include <stdbool.h>
+#include "bttypes.h"
+
+/// The buffer size used by a buffered reader if none is specified.
+#define BT_BUFREADER_DEFAULT_CAPACITY 4096
+/// The buffer size used by a buffered writer if none is specified.
+#define BT_BUFWRITER_DEFAULT_CAPACITY 4096
+/// Latency budget value meaning buffered data is only sent when full or flushed.
+#define BT_BUFWRITER_NO_LATENCY_BUDGET (-1)
+/// The most bytes a send queue holds if no limit is specified.
+#define BT_SENDQ_DEFAULT_CAPACITY 16384
+
+/**
+ * Counters kept by a buffered reader. These can be used to see how effective
+ * the buffering is for a particular traffic pattern.
+ */
+typedef struct {
+	/// The number of read requests made by the caller.
+	unsigned long requests;
+	/// The number of `recv` calls actually made on the socket.
+	unsigned long recv_calls;
+	/// The number of requests served entirely from the buffer.
+	unsigned long buffer_hits;
+	/// The total number of bytes received from the socket.
+	unsigned long long bytes_received;
+	/// The total number of bytes handed to the caller.
+	unsigned long long bytes_delivered;
+} bt_bufreader_stats_t;
+
+/**
+ * A buffered reader wrapping a Bluetooth socket. Data is received into an
+ * internal ring buffer, filling as much of it as possible with each `recv`,
+ * and small reads are then served from the buffer.
+ * The contents of this structure should be manipulated only through the
+ * `bt_bufreader_*` functions.
+ */
+typedef struct {
+	/// The socket being read from.
+	bt_socket_t *socket;
+	/// The ring buffer.
+	uint8_t *buffer;
+	/// The size of the ring buffer in bytes.
+	size_t capacity;
+	/// Position of the first unread byte in the ring buffer.
+	size_t start;
+	/// The number of unread bytes in the ring buffer.
+	size_t count;
+	/// Counters for monitoring the reader.
+	bt_bufreader_stats_t stats;
+} bt_bufreader_t;
+
+bt_err_t bt_bufreader_init(bt_bufreader_t *reader, bt_socket_t *socket, size_t capacity);
+void bt_bufreader_free(bt_bufreader_t *reader);
+size_t bt_bufreader_available(bt_bufreader_t const *reader);
+bt_err_t bt_bufreader_read_exact(bt_bufreader_t *reader, void *buffer, size_t *numBytes);
+bt_err_t bt_bufreader_peek(bt_bufreader_t *reader, size_t numBytes, void const **data);
+bt_err_t bt_bufreader_consume(bt_bufreader_t *reader, size_t numBytes);
+bt_err_t bt_bufreader_read_until(bt_bufreader_t *reader, uint8_t delim, void *buffer, size_t *numBytes);
+void bt_bufreader_get_stats(bt_bufreader_t const *reader, bt_bufreader_stats_t *stats);
+unsigned long bt_bufreader_syscalls_saved(bt_bufreader_t const *reader);
+
+/**
+ * Counters kept by a buffered writer. These can be used to see how effective
+ * the write combining is for a particular traffic pattern.
+ */
+typedef struct {
+	/// The number of write requests made by the caller.
+	unsigned long writes;
+	/// The number of times data was sent because the threshold was reached.
+	unsigned long flushes_threshold;
+	/// The number of times data was sent because the caller asked for it.
+	unsigned long flushes_explicit;
+	/// The number of times data was sent because the latency budget ran out.
+	unsigned long flushes_latency;
+	/// The total number of bytes sent to the socket.
+	unsigned long long bytes_sent;
+} bt_bufwriter_stats_t;
+
+/**
+ * A buffered writer wrapping a Bluetooth socket. Small writes are collected
+ * in an internal buffer and sent together, so that they go out as fewer,
+ * fuller RFCOMM frames.
+ * The contents of this structure should be manipulated only through the
+ * `bt_bufwriter_*` functions.
+ */
+typedef struct {
+	/// The socket being written to.
+	bt_socket_t *socket;
+	/// The buffer.
+	uint8_t *buffer;
+	/// The size of the buffer in bytes.
+	size_t capacity;
+	/// The number of buffered bytes at which the buffer gets sent.
+	size_t threshold;
+	/// The number of bytes waiting in the buffer.
+	size_t count;
+	/// How long data may wait in the buffer in microseconds, or negative for no limit.
+	int64_t latency_us;
+	/// The time the oldest byte in the buffer was written.
+	int64_t oldest_us;
+	/// Counters for monitoring the writer.
+	bt_bufwriter_stats_t stats;
+} bt_bufwriter_t;
+
+/**
+ * A pool of equally sized buffers, so that code handling a stream of
+ * messages doesn't need to allocate memory for each one. The pool is not
+ * thread-safe.
+ * The contents of this structure should be manipulated only through the
+ * `bt_bufpool_*` functions.
+ */
+typedef struct {
+	/// The size of each buffer in bytes.
+	size_t buffer_size;
+	/// The buffers currently available.
+	void **free;
+	/// The number of buffers available.
+	size_t count;
+	/// The most buffers the pool will keep.
+	size_t capacity;
+} bt_bufpool_t;
+
+bt_err_t bt_bufwriter_init(bt_bufwriter_t *writer, bt_socket_t *socket, size_t capacity, int64_t latency_us);
+void bt_bufwriter_free(bt_bufwriter_t *writer);
+bt_err_t bt_bufwriter_set_threshold(bt_bufwriter_t *writer, size_t threshold);
+size_t bt_bufwriter_pending(bt_bufwriter_t const *writer);
+bt_err_t bt_bufwriter_write(bt_bufwriter_t *writer, void const *buffer, size_t size);
+bt_err_t bt_bufwriter_flush(bt_bufwriter_t *writer);
+bt_err_t bt_bufwriter_poll(bt_bufwriter_t *writer);
+int64_t bt_bufwriter_time_remaining_us(bt_bufwriter_t const *writer);
+void bt_bufwriter_get_stats(bt_bufwriter_t const *writer, bt_bufwriter_stats_t *stats);
+
+struct _bt_sendq_t;
+
+/**
+ * Callback invoked when a send queue crosses one of its watermarks.
+ *
+ * @param queue  The queue.
+ * @param queued The number of bytes now waiting in the queue.
+ * @param data   The user data given to {@link bt_sendq_set_callbacks}.
+ */
+typedef void (*bt_sendq_callback_t)(struct _bt_sendq_t *queue, size_t queued, void *data);
+
+/**
+ * Counters kept by a send queue.
+ */
+typedef struct {
+	/// The number of messages accepted by the queue.
+	unsigned long writes;
+	/// The number of messages turned away because the queue was full.
+	unsigned long rejected;
+	/// The number of `sendmsg` calls made on the socket.
+	unsigned long send_calls;
+	/// The number of times the socket couldn't take any more data.
+	unsigned long would_block;
+	/// The number of times the queue rose to the high watermark.
+	unsigned long high_events;
+	/// The number of times the queue fell back to the low watermark.
+	unsigned long low_events;
+	/// The total number of bytes sent to the socket.
+	unsigned long long bytes_sent;
+} bt_sendq_stats_t;
+
+/**
+ * A bounded queue of data waiting to be sent on a non-blocking socket. Writes
+ * never block: data the socket won't take straight away waits in the queue
+ * until {@link bt_sendq_drain} is called, typically when the reactor reports
+ * the socket writable. Callbacks tell the producer when the queue rises to
+ * its high watermark and when it has drained back to its low watermark, so
+ * that it can hold off or combine messages in the meantime. The queue is not
+ * thread-safe.
+ * The contents of this structure should be manipulated only through the
+ * `bt_sendq_*` functions.
+ */
+typedef struct _bt_sendq_t {
+	/// The socket being written to.
+	bt_socket_t *socket;
+	/// The ring buffer.
+	uint8_t *buffer;
+	/// The size of the ring buffer in bytes.
+	size_t capacity;
+	/// Position of the oldest queued byte in the ring buffer.
+	size_t start;
+	/// The number of queued bytes.
+	size_t count;
+	/// The number of queued bytes at which the high callback is invoked.
+	size_t high_watermark;
+	/// The number of queued bytes at which the low callback is invoked.
+	size_t low_watermark;
+	/// Whether the queue has reached the high watermark and not yet drained.
+	bool congested;
+	/// Invoked when the queue reaches the high watermark, or NULL.
+	bt_sendq_callback_t on_high;
+	/// Invoked when the queue drains to the low watermark, or NULL.
+	bt_sendq_callback_t on_low;
+	/// User data passed to the callbacks.
+	void *data;
+	/// Counters for monitoring the queue.
+	bt_sendq_stats_t stats;
+} bt_sendq_t;
+
+bt_err_t bt_bufpool_init(bt_bufpool_t *pool, size_t buffer_size, size_t capacity);
+void bt_bufpool_free(bt_bufpool_t *pool);
+void *bt_bufpool_get(bt_bufpool_t *pool);
+void bt_bufpool_put(bt_bufpool_t *pool, void *buffer);
+
+bt_err_t bt_sendq_init(bt_sendq_t *queue, bt_socket_t *socket, size_t capacity);
+void bt_sendq_free(bt_sendq_t *queue);
+bt_err_t bt_sendq_set_watermarks(bt_sendq_t *queue, size_t low, size_t high);
+void bt_sendq_set_callbacks(bt_sendq_t *queue, bt_sendq_callback_t on_high, bt_sendq_callback_t on_low, void *data);
+bt_err_t bt_sendq_write(bt_sendq_t *queue, void const *buffer, size_t size);
+bt_err_t bt_sendq_drain(bt_sendq_t *queue);
+size_t bt_sendq_pending(bt_sendq_t const *queue);
+bool bt_sendq_congested(bt_sendq_t const *queue);
+void bt_sendq_get_stats(bt_sendq_t const *queue, bt_sendq_stats_t *stats);
+
+#endif //__BTBUFFER_H__
@@ -83,6 +83,23 @@ enum _bt_err_t {
 
 	BT_ERR_TIMEOUT,
 
+	/// The socket is non-blocking and the operation would have had to wait.
+	BT_ERR_WOULD_BLOCK,
+
+	/// The operation was abandoned because its cancel token was signalled.
+	BT_ERR_CANCELLED,
+
+	// --- buffers ---
+
+	/// The data didn't fit in the buffer provided.
+	BT_ERR_BUFFER_FULL,
+	/// A message frame had a malformed length, or was larger than allowed.
+	BT_ERR_BAD_FRAME,
+
+	// --- SDP, continued ---
+
+	/// The SDP record doesn't have the attribute asked for.
+	BT_ERR_SDP_ATTR_NOT_FOUND,
 
 };
 
@@ -0,0 +1,94 @@
+/**
+ * @file btframe.h
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Header for btframe.c
+ *
+ * Declares functions for sending and receiving length-prefixed messages.
+ */
+
+#ifndef __BTFRAME_H__
+#define __BTFRAME_H__
+
+#include "bttypes.h"
+#include "btbuffer.h"
+
+/// The largest frame allowed if no format is specified.
+#define BT_FRAME_DEFAULT_MAX_SIZE (64 * 1024)
+
+/// The most bytes a length prefix can take up, in either encoding.
+#define BT_FRAME_MAX_HEADER 5
+
+/// The ways the length of a frame can be encoded.
+typedef enum {
+	/// Four bytes, most significant first.
+	BT_FRAME_LENGTH_FIXED32,
+	/// An unsigned LEB128 varint of up to five bytes.
+	BT_FRAME_LENGTH_VARINT
+} bt_frame_length_t;
+
+/**
+ * How frames are laid out on the wire. Passing NULL wherever a format is
+ * expected selects a fixed 32-bit length and `BT_FRAME_DEFAULT_MAX_SIZE`.
+ */
+typedef struct {
+	/// The encoding of the length prefix.
+	bt_frame_length_t length;
+	/// The largest frame body accepted, in bytes.
+	size_t max_size;
+} bt_frame_format_t;
+
+/**
+ * Splits a stream of bytes into frames without blocking. Data is received
+ * straight into the decoder's buffer and frames are returned as pointers
+ * into it, so nothing is copied.
+ * The contents of this structure should be manipulated only through the
+ * `bt_frame_decoder_*` functions.
+ */
+typedef struct {
+	/// The frame format expected.
+	bt_frame_format_t format;
+	/// Storage for received data.
+	uint8_t *buffer;
+	/// The size of the buffer.
+	size_t capacity;
+	/// Position of the first byte not yet returned as part of a frame.
+	size_t start;
+	/// Position after the last byte received.
+	size_t end;
+	/// The pool the buffer came from, or NULL if the caller provided it.
+	bt_bufpool_t *pool;
+} bt_frame_decoder_t;
+
+size_t bt_frame_buffer_size(bt_frame_format_t const *format);
+bt_err_t bt_frame_send(bt_socket_t *socket, bt_frame_format_t const *format, const void *payload, size_t size);
+bt_err_t bt_frame_recv(bt_socket_t *socket, bt_frame_format_t const *format, void *buffer, size_t bufferSize, size_t *frameSize);
+bt_err_t bt_frame_recv_pooled(bt_socket_t *socket, bt_frame_format_t const *format, bt_bufpool_t *pool, void **frame, size_t *frameSize);
+
+bt_err_t bt_frame_decoder_init(bt_frame_decoder_t *decoder, bt_frame_format_t const *format, void *buffer, size_t capacity);
+bt_err_t bt_frame_decoder_init_pooled(bt_frame_decoder_t *decoder, bt_frame_format_t const *format, bt_bufpool_t *pool);
+void bt_frame_decoder_free(bt_frame_decoder_t *decoder);
+bt_err_t bt_frame_decoder_next(bt_frame_decoder_t *decoder, const void **frame, size_t *frameSize);
+bt_err_t bt_frame_decoder_fill(bt_frame_decoder_t *decoder, bt_socket_t *socket);
+bt_err_t bt_frame_decoder_read(bt_frame_decoder_t *decoder, bt_socket_t *socket, const void **frame, size_t *frameSize);
+
+#endif //__BTFRAME_H__
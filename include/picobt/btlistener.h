@@ -0,0 +1,83 @@
+/**
+ * @file btlistener.h
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Header for btlistener.c
+ *
+ * Declares functions for offering several services from a single event
+ * loop.
+ */
+
+#ifndef __BTLISTENER_H__
+#define __BTLISTENER_H__
+
+#include "bttypes.h"
+#include "btreactor.h"
+
+struct _bt_listener_t;
+
+/**
+ * Callback invoked for each connection made to one of a listener's services.
+ * The client structure is only valid for the duration of the call, so copy
+ * it somewhere permanent before registering it with the reactor.
+ *
+ * @param listener The listener the service belongs to.
+ * @param client   The newly accepted connection.
+ * @param data     The user data given for the service.
+ */
+typedef void (*bt_listener_handler_t)(struct _bt_listener_t *listener, bt_socket_t *client, void *data);
+
+/**
+ * A service offered by a listener.
+ */
+typedef struct {
+	/// The UUID to register the service under.
+	bt_uuid_t uuid;
+	/// The name to register the service under.
+	char const *name;
+	/// Called for each connection to the service.
+	bt_listener_handler_t handler;
+	/// User data passed to the handler.
+	void *data;
+} bt_listener_service_t;
+
+/**
+ * A set of services, each listening on its own RFCOMM channel and registered
+ * with the local SDP server, whose listening sockets are all served by one
+ * reactor.
+ * The contents of this structure should be manipulated only through the
+ * `bt_listener_*` functions.
+ */
+typedef struct _bt_listener_t {
+	/// The reactor the listening sockets are registered with.
+	bt_reactor_t *reactor;
+	/// The number of services.
+	size_t count;
+	/// The listening sockets and registrations, private to btlistener.c.
+	void *state;
+} bt_listener_t;
+
+bt_err_t bt_listener_init(bt_listener_t *listener, bt_reactor_t *reactor, bt_listener_service_t const *services, size_t count, bt_socket_options_t const *options);
+void bt_listener_free(bt_listener_t *listener);
+uint8_t bt_listener_get_channel(bt_listener_t const *listener, size_t index);
+
+#endif //__BTLISTENER_H__
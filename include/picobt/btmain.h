@@ -30,12 +30,38 @@
 #ifndef __BTMAIN_H__
 #define __BTMAIN_H__
 
+#include <stdbool.h>
 #include "bttypes.h"
 
 /// The length of a Bluetooth address string, xx:xx:xx:xx:xx:xx, including terminating nil.
 #define BT_ADDRESS_LENGTH 18
 /// The length of a UUID string, including terminating nil.
 #define BT_UUID_LENGTH 37
+/// The maximum number of buffers passed to the OS by a single call to bt_sendv or bt_recvv.
+#define BT_IOV_MAX 64
+/// Timeout value meaning a connect should wait for as long as the operating system does.
+#define BT_CONNECT_NO_TIMEOUT (-1)
+/// The number of pending connections bt_listen allows to queue.
+#define BT_LISTEN_DEFAULT_BACKLOG 2
+/// Backlog value asking for the largest queue the operating system allows.
+#define BT_LISTEN_MAX_BACKLOG (-1)
+/// PSM value asking for an L2CAP listener to be assigned a free PSM.
+#define BT_L2CAP_PSM_DYNAMIC 0
+
+// attributes bt_services_begin_ex can ask a device for
+
+/// The service class ID list, filling in bt_service_t uuid.
+#define BT_SERVICE_ATTR_CLASSES			0x01
+/// The protocol descriptor list, filling in bt_service_t port.
+#define BT_SERVICE_ATTR_PROTOCOLS		0x02
+/// The primary language service name, filling in bt_service_t name.
+#define BT_SERVICE_ATTR_NAME			0x04
+/// The primary language service description, filling in bt_service_t description.
+#define BT_SERVICE_ATTR_DESCRIPTION		0x08
+/// Everything bt_services_next uses; what bt_services_begin asks for.
+#define BT_SERVICE_ATTR_DEFAULT			0x0f
+/// Ask for every attribute the device has, rather than a selection.
+#define BT_SERVICE_ATTR_ALL				0xffffffffu
 
 // class-of-device constants and macros
 
@@ -153,6 +179,7 @@ int bt_is_present();
 /* DEVICE DISCOVERY */
 
 bt_err_t bt_inquiry_begin(bt_inquiry_t *inquiry, int cached);
+bt_err_t bt_inquiry_begin_cancellable(bt_inquiry_t *inquiry, int cached, bt_cancel_token_t const *cancel);
 bt_err_t bt_inquiry_next(bt_inquiry_t *inquiry, bt_device_t *device);
 void bt_inquiry_end(bt_inquiry_t *inquiry);
 bt_err_t bt_get_device_name(bt_addr_t * addr);
@@ -160,28 +187,72 @@ bt_err_t bt_get_device_name(bt_addr_t * addr);
 /* SERVICE DISCOVERY */
 
 bt_err_t bt_services_begin(bt_inquiry_t *inquiry, const bt_addr_t *device, const bt_uuid_t *service_class, int cached);
+bt_err_t bt_services_begin_ex(bt_inquiry_t *inquiry, const bt_addr_t *device, const bt_uuid_t *service_class, int cached, unsigned attributes);
 bt_err_t bt_services_next(bt_inquiry_t *inquiry, bt_service_t *service);
 void bt_services_end(bt_inquiry_t *inquiry);
 bt_err_t bt_register_service(bt_uuid_t const * service, char const * service_name, bt_socket_t *sock);
+bt_err_t bt_register_service_ex(bt_uuid_t const * service, char const * service_name, bt_socket_t *sock, bt_service_registration_t *registration);
+void bt_unregister_service(bt_service_registration_t *registration);
 
 /* CONNECTIONS */
 
 bt_err_t bt_connect_to_service(const bt_addr_t *address, const bt_uuid_t *service, bt_socket_t *sock);
+bt_err_t bt_connect_to_service_ex(const bt_addr_t *address, const bt_uuid_t *service, bt_socket_t *sock, int timeout_ms);
+bt_err_t bt_connect_to_service_cancellable(const bt_addr_t *address, const bt_uuid_t *service, bt_socket_t *sock, int timeout_ms, bt_cancel_token_t const *cancel);
 bt_err_t bt_connect_to_port(const bt_addr_t *address, unsigned char port, bt_socket_t *sock);
+bt_err_t bt_connect_to_port_ex(const bt_addr_t *address, unsigned char port, bt_socket_t *sock, int timeout_ms);
+bt_err_t bt_connect_to_port_with_options(const bt_addr_t *address, unsigned char port, bt_socket_t *sock, int timeout_ms, bt_socket_options_t const *options);
+bt_err_t bt_connect_to_port_cancellable(const bt_addr_t *address, unsigned char port, bt_socket_t *sock, int timeout_ms, bt_socket_options_t const *options, bt_cancel_token_t const *cancel);
 void bt_disconnect(bt_socket_t *socket);
 bt_err_t bt_recv(bt_socket_t *socket, void *buffer, size_t *numBytes);
 bt_err_t bt_read(bt_socket_t *socket, void *buffer, size_t *numBytes);
 bt_err_t bt_send(bt_socket_t *socket, const void *buffer, size_t *numBytes);
 bt_err_t bt_write(bt_socket_t *socket, const void *buffer, size_t numBytes);
+bt_err_t bt_recvv(bt_socket_t *socket, const bt_iovec_t *iov, int iovcnt, size_t *numBytes);
+bt_err_t bt_readv(bt_socket_t *socket, const bt_iovec_t *iov, int iovcnt, size_t *numBytes);
+bt_err_t bt_sendv(bt_socket_t *socket, const bt_iovec_t *iov, int iovcnt, size_t *numBytes);
+bt_err_t bt_writev(bt_socket_t *socket, const bt_iovec_t *iov, int iovcnt);
+bt_err_t bt_read_deadline(bt_socket_t *socket, void *buffer, size_t *numBytes, bt_deadline_t deadline);
+bt_err_t bt_send_deadline(bt_socket_t *socket, const void *buffer, size_t *numBytes, bt_deadline_t deadline);
+bt_err_t bt_write_deadline(bt_socket_t *socket, const void *buffer, size_t numBytes, bt_deadline_t deadline);
+bt_err_t bt_read_cancellable(bt_socket_t *socket, void *buffer, size_t *numBytes, bt_deadline_t deadline, bt_cancel_token_t const *cancel);
+bt_err_t bt_send_cancellable(bt_socket_t *socket, const void *buffer, size_t *numBytes, bt_deadline_t deadline, bt_cancel_token_t const *cancel);
+bt_err_t bt_sendfile(bt_socket_t *socket, int fd, int64_t offset, size_t length, bt_sendfile_stats_t *stats);
 
 bt_err_t bt_bind(bt_socket_t * listener);
 bt_err_t bt_bind_to_channel(bt_socket_t * listener, uint8_t channel);
+bt_err_t bt_bind_to_channel_with_options(bt_socket_t * listener, uint8_t channel, bt_socket_options_t const * options);
 bt_err_t bt_listen(bt_socket_t * listener);
+bt_err_t bt_listen_with_backlog(bt_socket_t * listener, int backlog);
+bt_err_t bt_listen_on_free_channel(bt_socket_t * listener, bt_socket_options_t const * options, int backlog);
 bt_err_t bt_accept(bt_socket_t const * listener, bt_socket_t * sock);
 bt_err_t bt_accept_with_timeout(bt_socket_t const * listener, bt_socket_t * sock, struct timeval* timeout);
+bt_err_t bt_accept_deadline(bt_socket_t const * listener, bt_socket_t * sock, bt_deadline_t deadline);
+bt_err_t bt_accept_with_options(bt_socket_t const * listener, bt_socket_t * sock, bt_deadline_t deadline, bt_socket_options_t const * options);
+bt_err_t bt_accept_cancellable(bt_socket_t const * listener, bt_socket_t * sock, bt_deadline_t deadline, bt_socket_options_t const * options, bt_cancel_token_t const * cancel);
+bt_err_t bt_accept_many(bt_socket_t const * listener, bt_socket_t * socks, size_t max, bt_deadline_t deadline, size_t * count);
+bt_err_t bt_accept_many_cancellable(bt_socket_t const * listener, bt_socket_t * socks, size_t max, bt_deadline_t deadline, size_t * count, bt_cancel_token_t const * cancel);
 bt_err_t bt_wait_for_connection(bt_uuid_t const * service, char const * service_name, bt_socket_t * sock, struct timeval* timeout);
+bt_err_t bt_wait_for_connection_cancellable(bt_uuid_t const * service, char const * service_name, bt_socket_t * sock, bt_deadline_t deadline, bt_cancel_token_t const * cancel);
+
+/* L2CAP */
+
+bt_err_t bt_connect_l2cap(const bt_addr_t *address, uint16_t psm, bt_socket_t *sock);
+bt_err_t bt_connect_l2cap_with_options(const bt_addr_t *address, uint16_t psm, bt_socket_t *sock, int timeout_ms, bt_socket_options_t const *options);
+bt_err_t bt_connect_l2cap_cancellable(const bt_addr_t *address, uint16_t psm, bt_socket_t *sock, int timeout_ms, bt_socket_options_t const *options, bt_cancel_token_t const *cancel);
+bt_err_t bt_bind_l2cap(bt_socket_t * listener, uint16_t psm);
+bt_err_t bt_bind_l2cap_with_options(bt_socket_t * listener, uint16_t psm, bt_socket_options_t const * options);
+bt_err_t bt_register_l2cap_service(bt_uuid_t const * service, char const * service_name, bt_socket_t *sock, bt_service_registration_t *registration);
+bt_err_t bt_send_message(bt_socket_t *socket, const void *buffer, size_t numBytes);
+bt_err_t bt_recv_message(bt_socket_t *socket, void *buffer, size_t *numBytes);
+bt_err_t bt_recv_message_cancellable(bt_socket_t *socket, void *buffer, size_t *numBytes, bt_deadline_t deadline, bt_cancel_token_t const *cancel);
+bt_err_t bt_get_l2cap_mtu(bt_socket_t const *sock, uint16_t *send_mtu, uint16_t *recv_mtu);
+uint16_t bt_get_socket_psm(bt_socket_t sock);
 
 bt_err_t bt_set_timeout(bt_socket_t *sock, int duration);
+bt_err_t bt_set_nonblocking(bt_socket_t *sock, bool nonblocking);
+bt_err_t bt_socket_options_init(bt_socket_options_t *options, bt_socket_profile_t profile);
+bt_err_t bt_err_from_errno(int error);
 uint8_t bt_get_socket_channel(bt_socket_t sock);
 
 #endif //__BTMAIN_H__
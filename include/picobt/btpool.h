@@ -0,0 +1,99 @@
+/**
+ * @file btpool.h
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Header for btpool.c
+ *
+ * Declares functions for keeping connections open between uses, so that
+ * sending to the same device again doesn't need a new connection.
+ */
+
+#ifndef __BTPOOL_H__
+#define __BTPOOL_H__
+
+#include <stdbool.h>
+#include "bttypes.h"
+
+/// The most connections a pool holds if none is specified.
+#define BT_POOL_DEFAULT_SIZE 16
+/// How long, in milliseconds, an unused connection is kept if no time is specified.
+#define BT_POOL_DEFAULT_IDLE_TIMEOUT 30000
+/// Idle timeout value meaning unused connections are kept until they're evicted.
+#define BT_POOL_NO_IDLE_TIMEOUT (-1)
+
+/**
+ * How a pool should be set up. Zero values select the defaults.
+ */
+typedef struct {
+	/// The most connections to hold, in use or not, or `0` for
+	/// `BT_POOL_DEFAULT_SIZE`.
+	size_t max_size;
+	/// How long an unused connection is kept in milliseconds, `0` for
+	/// `BT_POOL_DEFAULT_IDLE_TIMEOUT` or `BT_POOL_NO_IDLE_TIMEOUT`.
+	int idle_timeout_ms;
+} bt_pool_config_t;
+
+/**
+ * Counters kept by a pool.
+ */
+typedef struct {
+	/// The number of times a held connection was reused.
+	unsigned long hits;
+	/// The number of times a new connection had to be made.
+	unsigned long misses;
+	/// The number of connections dropped because they failed, or were found
+	/// closed when they were about to be reused.
+	unsigned long evicted;
+	/// The number of connections closed after going unused for too long, or
+	/// to make room for others.
+	unsigned long expired;
+	/// The number of connections held.
+	size_t size;
+	/// The number of connections checked out.
+	size_t in_use;
+} bt_pool_stats_t;
+
+/**
+ * A set of open connections, each identified by the device it's to and the
+ * service it's for. Connections are checked out with {@link bt_pool_get}
+ * and returned with {@link bt_pool_put}. The pool can be used from several
+ * threads at once.
+ * The contents of this structure should be manipulated only through the
+ * `bt_pool_*` functions.
+ */
+typedef struct {
+	/// The configuration, with defaults filled in.
+	bt_pool_config_t config;
+	/// The connections and lock, private to btpool.c.
+	void *state;
+} bt_pool_t;
+
+bt_err_t bt_pool_init(bt_pool_t *pool, bt_pool_config_t const *config);
+void bt_pool_free(bt_pool_t *pool);
+bt_err_t bt_pool_get(bt_pool_t *pool, bt_addr_t const *address, bt_uuid_t const *service, bt_socket_t *sock);
+bt_err_t bt_pool_get_ex(bt_pool_t *pool, bt_addr_t const *address, bt_uuid_t const *service, bt_socket_t *sock, int timeout_ms);
+bt_err_t bt_pool_checkout(bt_pool_t *pool, bt_addr_t const *address, bt_uuid_t const *service, bt_socket_t *sock, int timeout_ms, bool *reused);
+void bt_pool_put(bt_pool_t *pool, bt_socket_t *sock, bt_err_t status);
+void bt_pool_expire(bt_pool_t *pool);
+void bt_pool_get_stats(bt_pool_t *pool, bt_pool_stats_t *stats);
+
+#endif //__BTPOOL_H__
@@ -0,0 +1,124 @@
+/**
+ * @file btreactor.h
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Header for btreactor.c
+ *
+ * Declares an event loop that lets a single thread serve many Bluetooth
+ * sockets at once.
+ */
+
+#ifndef __BTREACTOR_H__
+#define __BTREACTOR_H__
+
+#include <stdbool.h>
+#include "bttypes.h"
+
+/// Event flag: the socket has data to read, or a listener has a connection.
+#define BT_REACTOR_READABLE 0x01
+/// Event flag: the socket has space to write.
+#define BT_REACTOR_WRITABLE 0x02
+/// Event flag: the other end closed the connection or the socket failed.
+#define BT_REACTOR_CLOSED 0x04
+
+/// The most events collected from the OS by a single wait.
+#define BT_REACTOR_MAX_EVENTS 64
+
+struct _bt_reactor_t;
+
+/**
+ * Callback invoked when a registered socket becomes ready.
+ *
+ * @param reactor The reactor the socket is registered with.
+ * @param socket  The socket that's ready.
+ * @param events  A combination of `BT_REACTOR_*` event flags.
+ * @param data    The user data passed when the socket was registered.
+ */
+typedef void (*bt_reactor_callback_t)(struct _bt_reactor_t *reactor, bt_socket_t *socket, int events, void *data);
+
+/**
+ * Callback invoked for each connection accepted on a registered listener.
+ * The client structure is only valid for the duration of the call, so copy
+ * it somewhere permanent before registering it with the reactor.
+ *
+ * @param reactor  The reactor the listener is registered with.
+ * @param listener The listening socket.
+ * @param client   The newly accepted connection.
+ * @param data     The user data passed when the listener was registered.
+ */
+typedef void (*bt_reactor_accept_callback_t)(struct _bt_reactor_t *reactor, bt_socket_t *listener, bt_socket_t *client, void *data);
+
+/**
+ * The details of a socket registered with a reactor. These are managed by
+ * the reactor.
+ */
+typedef struct _bt_reactor_handler_t {
+	/// The next handler waiting to be freed.
+	struct _bt_reactor_handler_t *next;
+	/// The registered socket.
+	bt_socket_t *socket;
+	/// The events the caller is interested in.
+	int events;
+	/// Called when the socket is ready, for connected sockets.
+	bt_reactor_callback_t callback;
+	/// Called for each new connection, for listeners.
+	bt_reactor_accept_callback_t on_accept;
+	/// User data passed to the callback.
+	void *data;
+	/// Set once the socket has been removed from the reactor.
+	bool removed;
+} bt_reactor_handler_t;
+
+/**
+ * An event loop serving many sockets from a single thread. Sockets are
+ * registered along with callbacks, which the reactor invokes when they become
+ * readable, writable or closed.
+ * The contents of this structure should be manipulated only through the
+ * `bt_reactor_*` functions.
+ */
+typedef struct _bt_reactor_t {
+	/// The OS event queue.
+	int fd;
+	/// Handlers, indexed by socket descriptor.
+	bt_reactor_handler_t **handlers;
+	/// The number of entries allocated for handlers.
+	size_t size;
+	/// The number of registered sockets.
+	size_t count;
+	/// Handlers removed during dispatch, to be freed once it's complete.
+	bt_reactor_handler_t *removed;
+	/// Set to make {@link bt_reactor_run} return.
+	bool stopping;
+} bt_reactor_t;
+
+bt_err_t bt_reactor_init(bt_reactor_t *reactor);
+void bt_reactor_free(bt_reactor_t *reactor);
+bt_err_t bt_reactor_add(bt_reactor_t *reactor, bt_socket_t *socket, int events, bt_reactor_callback_t callback, void *data);
+bt_err_t bt_reactor_add_listener(bt_reactor_t *reactor, bt_socket_t *listener, bt_reactor_accept_callback_t callback, void *data);
+bt_err_t bt_reactor_modify(bt_reactor_t *reactor, bt_socket_t *socket, int events);
+bt_err_t bt_reactor_remove(bt_reactor_t *reactor, bt_socket_t *socket);
+size_t bt_reactor_count(bt_reactor_t const *reactor);
+bt_err_t bt_reactor_run_once(bt_reactor_t *reactor, int timeout_ms, int *dispatched);
+bt_err_t bt_reactor_run(bt_reactor_t *reactor);
+void bt_reactor_stop(bt_reactor_t *reactor);
+
+#endif //__BTREACTOR_H__
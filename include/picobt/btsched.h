@@ -0,0 +1,78 @@
+/**
+ * @file btsched.h
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Header for btsched.c
+ *
+ * Declares functions for running tasks on a pool of threads that balance
+ * their load by stealing work from each other.
+ */
+
+#ifndef __BTSCHED_H__
+#define __BTSCHED_H__
+
+#include "bttypes.h"
+
+struct _bt_sched_t;
+
+/**
+ * A task run by the scheduler.
+ *
+ * @param sched The scheduler running the task, for submitting continuations.
+ * @param data  The user data passed when the task was submitted.
+ */
+typedef void (*bt_sched_task_t)(struct _bt_sched_t *sched, void *data);
+
+/**
+ * Counters kept by a scheduler. A high stolen count shows that the load was
+ * uneven and idle workers took tasks from busy ones.
+ */
+typedef struct {
+	/// The number of tasks submitted.
+	unsigned long submitted;
+	/// The number of tasks that have finished.
+	unsigned long executed;
+	/// The number of tasks taken from another worker's queue.
+	unsigned long stolen;
+} bt_sched_stats_t;
+
+/**
+ * A pool of worker threads, each with its own queue of tasks. Workers take
+ * their newest task first, and when they run out steal the oldest task from
+ * another worker.
+ * The contents of this structure should be manipulated only through the
+ * `bt_sched_*` functions.
+ */
+typedef struct _bt_sched_t {
+	/// The number of worker threads.
+	unsigned workers;
+	/// Threads, locks and queues, private to btsched.c.
+	void *state;
+} bt_sched_t;
+
+bt_err_t bt_sched_init(bt_sched_t *sched, unsigned workers);
+void bt_sched_free(bt_sched_t *sched);
+bt_err_t bt_sched_submit(bt_sched_t *sched, bt_sched_task_t task, void *data);
+void bt_sched_wait_idle(bt_sched_t *sched);
+void bt_sched_get_stats(bt_sched_t *sched, bt_sched_stats_t *stats);
+
+#endif //__BTSCHED_H__
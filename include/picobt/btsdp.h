@@ -31,6 +31,9 @@
 
 #include "bttypes.h"
 
+/// The deepest nesting of SEQ and ALT elements bt_sdp_parse_record accepts.
+#define BT_SDP_MAX_DEPTH 16
+
 /// Enumeration of Bluetooth SDP record element types.
 enum bt_sdp_data_element_type {
 	BT_SDP_DATA_ELEMENT_NIL = 0,
@@ -45,7 +48,10 @@ enum bt_sdp_data_element_type {
 	// remaining values are reserved as of the Bluetooth Core V4.0 Spec
 };
 
-bt_err_t bt_sdp_parse_record(uint8_t *data, int length, bt_sdp_record_t *out);
-void bt_sdp_free(bt_sdp_record_t *rec);
+bt_err_t bt_sdp_parse_record(uint8_t const *data, size_t length, bt_sdp_element_t *elements, size_t capacity, bt_sdp_record_t *out);
+bt_err_t bt_sdp_cursor_init(bt_sdp_cursor_t *cursor, uint8_t const *data, size_t length);
+bt_err_t bt_sdp_cursor_next(bt_sdp_cursor_t *cursor, bt_sdp_element_t *e);
+bt_err_t bt_sdp_cursor_enter_seq(bt_sdp_cursor_t const *cursor, bt_sdp_cursor_t *inner);
+bt_err_t bt_sdp_find_attr(bt_sdp_cursor_t *record, uint16_t attr_id, bt_sdp_element_t *value);
 
 #endif //__BTSDP_H__
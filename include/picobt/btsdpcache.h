@@ -0,0 +1,81 @@
+/**
+ * @file btsdpcache.h
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Header for btsdpcache.c
+ *
+ * Declares functions for remembering which RFCOMM channel a service was
+ * found on, so that connecting to it again doesn't need an SDP query. The
+ * channels can be shared between processes through a file.
+ */
+
+#ifndef __BTSDPCACHE_H__
+#define __BTSDPCACHE_H__
+
+#include <stdbool.h>
+#include "bttypes.h"
+
+/// How long, in milliseconds, a channel is remembered if no time is specified.
+#define BT_SDP_CACHE_DEFAULT_TTL 60000
+/// TTL value meaning channels are remembered until they're invalidated.
+#define BT_SDP_CACHE_NO_EXPIRY (-1)
+/// TTL value turning the cache off.
+#define BT_SDP_CACHE_DISABLED 0
+/// The most channels remembered if no size is specified.
+#define BT_SDP_CACHE_DEFAULT_SIZE 64
+/// The number of channels a new cache file holds if no size is specified.
+#define BT_SDP_CACHE_DEFAULT_FILE_SLOTS 256
+/// The size of buffer needed for any service name kept by the cache, including the nul.
+#define BT_SDP_CACHE_NAME_LENGTH 32
+
+/**
+ * Counters kept by the channel cache.
+ */
+typedef struct {
+	/// The number of lookups answered from the cache.
+	unsigned long hits;
+	/// The number of those hits answered from the cache file.
+	unsigned long file_hits;
+	/// The number of lookups that needed an SDP query.
+	unsigned long misses;
+	/// The number of channels dropped because they'd been kept too long.
+	unsigned long expired;
+	/// The number of channels dropped because a connect to them failed.
+	unsigned long invalidated;
+	/// The number of channels dropped to make room for others.
+	unsigned long evicted;
+	/// The number of channels remembered.
+	size_t size;
+} bt_sdp_cache_stats_t;
+
+bt_err_t bt_sdp_cache_configure(int ttl_ms, size_t max_entries);
+bt_err_t bt_sdp_cache_open_file(char const *path, size_t slots);
+void bt_sdp_cache_close_file(void);
+bool bt_sdp_cache_lookup(bt_addr_t const *address, bt_uuid_t const *service, uint8_t *channel);
+bool bt_sdp_cache_lookup_ex(bt_addr_t const *address, bt_uuid_t const *service, uint8_t *channel, char *name, size_t size);
+void bt_sdp_cache_store(bt_addr_t const *address, bt_uuid_t const *service, uint8_t channel);
+void bt_sdp_cache_store_ex(bt_addr_t const *address, bt_uuid_t const *service, uint8_t channel, char const *name);
+void bt_sdp_cache_invalidate(bt_addr_t const *address, bt_uuid_t const *service);
+void bt_sdp_cache_clear(void);
+void bt_sdp_cache_get_stats(bt_sdp_cache_stats_t *stats);
+
+#endif //__BTSDPCACHE_H__
@@ -0,0 +1,126 @@
+/**
+ * @file btserver.h
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Header for btserver.c
+ *
+ * Declares functions for running a long-lived server that accepts
+ * connections continuously and hands them to a pool of worker threads.
+ */
+
+#ifndef __BTSERVER_H__
+#define __BTSERVER_H__
+
+#include <stdbool.h>
+#include "bttypes.h"
+
+/// The number of worker threads if none is specified.
+#define BT_SERVER_DEFAULT_WORKERS 4
+/// The number of accepted connections that can wait for a worker if none is specified.
+#define BT_SERVER_DEFAULT_QUEUE 64
+/// The read and write timeout in seconds given to connections if none is specified.
+#define BT_SERVER_DEFAULT_TIMEOUT 20
+/// Timeout value meaning connections have no read or write timeout.
+#define BT_SERVER_NO_TIMEOUT (-1)
+
+struct _bt_server_t;
+
+/**
+ * Called on a worker thread to serve a connection. The socket is blocking;
+ * it's closed by the server when the handler returns.
+ *
+ * @param server The server that accepted the connection.
+ * @param client The connection to serve.
+ * @param data   The user data passed in the server's configuration.
+ */
+typedef void (*bt_server_handler_t)(struct _bt_server_t *server, bt_socket_t *client, void *data);
+
+/**
+ * How a server should be set up. Zero values select the defaults, so a
+ * configuration can be zeroed and only the fields of interest filled in.
+ */
+typedef struct {
+	/// The service to register with SDP, or NULL not to register one.
+	bt_uuid_t const *service;
+	/// The name to register the service under.
+	char const *service_name;
+	/// The RFCOMM channel to listen on, or `0` for any available channel.
+	uint8_t channel;
+	/// The number of worker threads, or `0` for `BT_SERVER_DEFAULT_WORKERS`.
+	unsigned workers;
+	/// The number of connections that can wait for a worker, or `0` for
+	/// `BT_SERVER_DEFAULT_QUEUE`. Connections beyond this are closed.
+	unsigned queue_size;
+	/// The listen backlog, or `0` for `BT_LISTEN_MAX_BACKLOG`.
+	int backlog;
+	/// The read and write timeout for connections in seconds, `0` for
+	/// `BT_SERVER_DEFAULT_TIMEOUT` or `BT_SERVER_NO_TIMEOUT` for none.
+	int timeout;
+	/// The function that serves each connection.
+	bt_server_handler_t handler;
+	/// User data passed to the handler.
+	void *data;
+} bt_server_config_t;
+
+/**
+ * Counters kept by a server.
+ */
+typedef struct {
+	/// The number of connections accepted.
+	unsigned long accepted;
+	/// The number of connections whose handler has returned.
+	unsigned long handled;
+	/// The number of connections closed because the queue was full.
+	unsigned long rejected;
+	/// The number of connections waiting for a worker.
+	unsigned queued;
+	/// The number of handlers running.
+	unsigned active;
+} bt_server_stats_t;
+
+/**
+ * A server that owns a listening socket and its SDP record, and serves
+ * connections on a pool of worker threads.
+ * The contents of this structure should be manipulated only through the
+ * `bt_server_*` functions.
+ */
+typedef struct _bt_server_t {
+	/// The configuration, with defaults filled in.
+	bt_server_config_t config;
+	/// The listening socket.
+	bt_socket_t listener;
+	/// The SDP registration for the service.
+	bt_service_registration_t registration;
+	/// Threads, locks and the connection queue, private to btserver.c.
+	void *state;
+	/// True between a successful start and the following stop.
+	bool running;
+} bt_server_t;
+
+bt_err_t bt_server_init(bt_server_t *server, bt_server_config_t const *config);
+void bt_server_free(bt_server_t *server);
+bt_err_t bt_server_start(bt_server_t *server);
+void bt_server_stop(bt_server_t *server);
+uint8_t bt_server_get_channel(bt_server_t const *server);
+void bt_server_get_stats(bt_server_t *server, bt_server_stats_t *stats);
+
+#endif //__BTSERVER_H__
@@ -37,6 +37,8 @@
 #include <stdint.h>
 
 #else // LINUX
+#include <stdint.h>
+#include <sys/uio.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/rfcomm.h>
@@ -81,6 +83,10 @@ typedef struct {
 	uint32_t cod;
 } bt_device_t;
 
+#ifndef WINDOWS
+struct _bt_services_state_t;
+#endif
+
 /**
  * Generic structure that stores state for a variety of Bluetooth inquiry
  * sessions -- currently device discovery and service discovery.
@@ -114,6 +120,9 @@ typedef struct {
 		struct {
 			sdp_session_t *session;
 			sdp_list_t *response;
+			/// the device queried and any result from the SDP cache, kept
+			/// apart so the structure's size doesn't change
+			struct _bt_services_state_t *state;
 		} sdp;
 	};
 	char *nameBuffer;
@@ -130,12 +139,25 @@ typedef struct __attribute__((packed)) {
 	uint8_t b[16];
 } bt_uuid_t;
 
-struct _bt_sdp_sequence_t;
-
-/// An element in an SDP record.
+/**
+ * An element in an SDP record.
+ * Parsed records are held as a flat array of elements in the order they
+ * appear in the data, so the elements inside a SEQ or ALT follow it
+ * directly, and the next element after it is `descendants + 1` further on.
+ */
 typedef struct {
-	uint8_t type, sizeDesc;
-	uint32_t size, recordSize;
+	/// The element type, one of the `BT_SDP_DATA_ELEMENT_*` values.
+	uint8_t type;
+	/// The size descriptor from the element's header.
+	uint8_t sizeDesc;
+	/// The number of bytes of data, not including the header.
+	uint32_t size;
+	/// The number of bytes taken by the whole element, including the header.
+	uint32_t recordSize;
+	/// For SEQ and ALT, the number of elements directly inside this one.
+	uint32_t count;
+	/// For SEQ and ALT, the number of elements inside this one at any depth.
+	uint32_t descendants;
 	union {
 		uint8_t u8;
 		uint16_t u16;
@@ -145,27 +167,57 @@ typedef struct {
 		int16_t i16;
 		int32_t i32;
 		int64_t i64;
+		/// 128-bit integers, as big-endian bytes.
+		uint8_t u128[16];
 		uint16_t uuid16;
 		uint32_t uuid32;
 		bt_uuid_t uuid;
-		char *text;
+		/// Points into the parsed data, and isn't nil-terminated; size gives its length.
+		char const *text;
 		uint8_t boolean;
-		char *url;
-		struct _bt_sdp_sequence_t *seq;
+		/// Points into the parsed data, and isn't nil-terminated; size gives its length.
+		char const *url;
 	} value;
 } bt_sdp_element_t;
 
-/// A sequence element in an SDP record, which contains further elements itself.
-typedef struct _bt_sdp_sequence_t {
-	bt_sdp_element_t head;
-	struct _bt_sdp_sequence_t *tail;
-} bt_sdp_sequence_t;
-
-/// Represents an SDP record in an easy-to-parse structure.
+/**
+ * Represents an SDP record in an easy-to-parse structure.
+ * The elements and the data they were parsed from both belong to the caller,
+ * and must last as long as the record is used.
+ */
 typedef struct {
-	bt_sdp_element_t root;
+	/// The parsed elements; the first is the record's attribute list.
+	bt_sdp_element_t *elements;
+	/// The number of elements parsed.
+	size_t count;
+	/// The data the record was parsed from.
+	uint8_t const *data;
+	/// The number of bytes of data.
+	size_t length;
 } bt_sdp_record_t;
 
+/**
+ * A position in a packed SDP record, for reading its elements one at a time
+ * without parsing the rest. Elements that aren't wanted are stepped over
+ * using their headers.
+ * The contents of this structure should be manipulated only through the
+ * `bt_sdp_cursor_*` functions.
+ */
+typedef struct {
+	/// The record being read.
+	uint8_t const *data;
+	/// Offset of the next element to read.
+	size_t pos;
+	/// Offset just past the last element at this level.
+	size_t end;
+	/// Offset of the contents of the element just read, if it's a SEQ or ALT, or 0 otherwise.
+	size_t seq;
+	/// Offset just past the element just read, if it's a SEQ or ALT.
+	size_t seq_end;
+	/// How many sequences the cursor is inside.
+	int depth;
+} bt_sdp_cursor_t;
+
 /// Represents a Bluetooth service on a remote device.
 typedef struct {
 	/// The service's human-readable name.
@@ -191,4 +243,143 @@ typedef struct {
 #endif
 } bt_socket_t;
 
+/**
+ * A cross-platform scatter/gather buffer descriptor, used by the vectored
+ * I/O functions such as {@link bt_writev} and {@link bt_readv}. On Linux this
+ * is simply a `struct iovec`; on Windows it has the same members.
+ */
+#ifdef WINDOWS
+typedef struct {
+	/// Pointer to the start of the buffer.
+	void *iov_base;
+	/// Number of bytes in the buffer.
+	size_t iov_len;
+} bt_iovec_t;
+#else // LINUX
+typedef struct iovec bt_iovec_t;
+#endif
+
+/**
+ * An absolute point in time on the clock used by {@link bt_time_now_us}, in
+ * microseconds. Deadlines let a sequence of calls share a single time limit.
+ */
+typedef int64_t bt_deadline_t;
+/// A deadline that never expires.
+#define BT_DEADLINE_NEVER INT64_MAX
+
+/**
+ * A token that lets one thread wake up another that's blocked in a
+ * cancellable call, such as {@link bt_read_cancellable}. The blocked call
+ * waits on the token alongside its socket and returns `BT_ERR_CANCELLED` as
+ * soon as {@link bt_cancel} is called. One token can be shared by any number
+ * of calls, for example to stop every worker thread at shutdown.
+ *
+ * The calls that take a token are the `_cancellable` variants of reads,
+ * sends, RFCOMM and L2CAP connects, accepts, {@link bt_accept_many},
+ * {@link bt_wait_for_connection}, {@link bt_recv_message} and
+ * {@link bt_inquiry_begin}. {@link bt_connect_to_service_cancellable} checks
+ * the token before and after its SDP query but can't interrupt it. Service
+ * queries, vectored I/O and {@link bt_sendfile} can't be cancelled.
+ * The contents of this structure should be manipulated only through the
+ * `bt_cancel_*` functions.
+ */
+typedef struct {
+	/// The eventfd signalled on cancellation, or -1.
+	int fd;
+	/// Set before the eventfd is signalled, so it can be checked without a
+	/// system call. Only ever read and written with atomic operations.
+	int cancelled;
+} bt_cancel_token_t;
+
+/**
+ * A service registered with the local SDP server by
+ * {@link bt_register_service_ex}, kept so that it can be withdrawn.
+ */
+typedef struct {
+	/// The SDP session that holds the registration, or NULL.
+	void *session;
+	/// The registered record.
+	void *record;
+} bt_service_registration_t;
+
+/// The ways {@link bt_sendfile} can move data from a file to a socket.
+typedef enum {
+	/// The kernel copied the file to the socket with `sendfile`.
+	BT_SENDFILE_METHOD_SENDFILE,
+	/// The kernel moved the file through a pipe with `splice`.
+	BT_SENDFILE_METHOD_SPLICE,
+	/// The file was read into a buffer and written to the socket.
+	BT_SENDFILE_METHOD_COPY
+} bt_sendfile_method_t;
+
+/**
+ * What a call to {@link bt_sendfile} did, for comparing the transfer methods.
+ */
+typedef struct {
+	/// The number of bytes sent.
+	uint64_t bytes;
+	/// The time taken, in microseconds.
+	int64_t elapsed_us;
+	/// The method that sent the data.
+	bt_sendfile_method_t method;
+	/// The number of system calls made to move the data.
+	unsigned long calls;
+} bt_sendfile_stats_t;
+
+/// The link security a socket asks for, mapped to the operating system's levels.
+typedef enum {
+	/// Leave the security level as the operating system sets it.
+	BT_SOCKET_SECURITY_DEFAULT = 0,
+	/// No authentication or encryption, except for SDP.
+	BT_SOCKET_SECURITY_LOW,
+	/// Authentication and encryption, without protection against MITM.
+	BT_SOCKET_SECURITY_MEDIUM,
+	/// Authentication and encryption with MITM protection.
+	BT_SOCKET_SECURITY_HIGH
+} bt_socket_security_t;
+
+/// Flag for bt_socket_options_t: create the socket in non-blocking mode.
+#define BT_SOCKET_NONBLOCKING 0x01
+/// Flag for bt_socket_options_t: close the socket when a new program is executed.
+#define BT_SOCKET_CLOEXEC 0x02
+/// Timeout value for bt_socket_options_t that leaves the socket's timeouts unchanged.
+#define BT_SOCKET_TIMEOUT_UNCHANGED (-1)
+
+/**
+ * A set of options applied to a socket as it's created, for example by
+ * {@link bt_connect_to_port_with_options}. Any field other than
+ * `timeout_ms` that's left as zero is left as the operating system sets it,
+ * so only the options that differ cost a system call. A `timeout_ms` of zero
+ * sets the socket to wait forever; use `BT_SOCKET_TIMEOUT_UNCHANGED` to leave
+ * the timeouts alone. Fill one in with {@link bt_socket_options_init} and
+ * adjust it as needed.
+ */
+typedef struct {
+	/// The size of the send buffer in bytes, or 0 for the default.
+	int send_buffer;
+	/// The size of the receive buffer in bytes, or 0 for the default.
+	int recv_buffer;
+	/// The read and write timeout in milliseconds, 0 to wait forever, or
+	/// `BT_SOCKET_TIMEOUT_UNCHANGED`.
+	int timeout_ms;
+	/// The link security to ask for.
+	bt_socket_security_t security;
+	/// The largest packet to send, or 0 for the default. Only L2CAP sockets use this.
+	uint16_t send_mtu;
+	/// The largest packet to receive, or 0 for the default. Only L2CAP sockets use this.
+	uint16_t recv_mtu;
+	/// A combination of `BT_SOCKET_NONBLOCKING` and `BT_SOCKET_CLOEXEC`.
+	int flags;
+} bt_socket_options_t;
+
+/// The predefined sets of socket options offered by {@link bt_socket_options_init}.
+typedef enum {
+	/// The options libpicobt has always used: a 20 second timeout and nothing else.
+	BT_SOCKET_PROFILE_DEFAULT,
+	/// Small buffers, so that data isn't held up behind a long queue.
+	BT_SOCKET_PROFILE_LATENCY,
+	/// Large buffers and MTUs, so that bulk transfers need fewer calls.
+	BT_SOCKET_PROFILE_THROUGHPUT
+} bt_socket_profile_t;
+
 #endif //__BTTYPES_H__
@@ -49,6 +49,16 @@ bt_err_t bt_str_compact_to_addr(const char *str, bt_addr_t *addr);
 void bt_uuid_to_str(const bt_uuid_t *uuid, char *str);
 bt_err_t bt_str_to_uuid(const char *str, bt_uuid_t *uuid);
 
+int64_t bt_time_now_us(void);
+bt_deadline_t bt_deadline_from_ms(int timeout_ms);
+int bt_deadline_remaining_ms(bt_deadline_t deadline);
+
+bt_err_t bt_cancel_init(bt_cancel_token_t *token);
+void bt_cancel_free(bt_cancel_token_t *token);
+bt_err_t bt_cancel(bt_cancel_token_t *token);
+void bt_cancel_reset(bt_cancel_token_t *token);
+bool bt_cancel_requested(bt_cancel_token_t const *token);
+
 #ifdef WINDOWS
 // Windows-specific stuff
 void bt_addr_to_bdaddr(const bt_addr_t *addr, BTH_ADDR *bdAddr);
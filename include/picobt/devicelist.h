@@ -30,6 +30,7 @@
 #define __LIBPICOBT_DEVICELIST_H__
 
 #include "picobt/bttypes.h"
+#include "picobt/btpool.h"
 #include "stdbool.h"
 
 /// A list of Bluetooth devices. This is a simple linked list structure.
@@ -48,6 +49,37 @@ typedef struct {
 	const bt_device_list_t *item;
 } bt_iterator_t;
 
+/// The most devices {@link bt_send_to_list_ex} contacts at once if no limit is specified.
+#define BT_SEND_DEFAULT_CONCURRENCY 8
+/// The time, in milliseconds, {@link bt_send_to_list_ex} allows if none is specified.
+#define BT_SEND_DEFAULT_TIMEOUT 30000
+/// Timeout value for {@link bt_send_to_list_ex} meaning there's no overall deadline.
+#define BT_SEND_NO_TIMEOUT (-1)
+
+/// How {@link bt_send_to_list_ex} should send. Zero values select the defaults.
+typedef struct {
+	/// The most devices to contact at once, or `0` for `BT_SEND_DEFAULT_CONCURRENCY`.
+	unsigned concurrency;
+	/// The time allowed for the whole list in milliseconds, `0` for
+	/// `BT_SEND_DEFAULT_TIMEOUT` or `BT_SEND_NO_TIMEOUT`.
+	int timeout_ms;
+	/// The pool to take connections from, or NULL to connect afresh.
+	bt_pool_t *pool;
+} bt_send_config_t;
+
+/// The outcome of sending to one device with {@link bt_send_to_list_ex}.
+typedef struct {
+	/// The device sent to.
+	bt_addr_t address;
+	/// `BT_SUCCESS` if the whole message was sent, otherwise the error that
+	/// stopped it.
+	bt_err_t result;
+	/// The time taken to connect and send, in microseconds.
+	int64_t latency_us;
+	/// The number of bytes of the message that were sent.
+	size_t bytes_sent;
+} bt_send_result_t;
+
 bt_device_list_t *bt_list_new(void);
 void bt_list_delete(bt_device_list_t *list);
 bt_err_t bt_list_load(bt_device_list_t *list, const char *filename);
@@ -60,5 +92,7 @@ void bt_iterate_list(bt_iterator_t *iterator, const bt_device_list_t *list);
 void bt_iterate_rewind(bt_iterator_t *iterator);
 bt_err_t bt_get_next_device(bt_iterator_t *iterator, bt_addr_t *address);
 void bt_send_to_list(const bt_device_list_t *list, const bt_uuid_t *service, const void *message, size_t length);
+void bt_send_to_list_pooled(bt_pool_t *pool, const bt_device_list_t *list, const bt_uuid_t *service, const void *message, size_t length);
+bt_err_t bt_send_to_list_ex(const bt_device_list_t *list, const bt_uuid_t *service, const void *message, size_t length, bt_send_config_t const *config, bt_send_result_t *results, size_t max_results, size_t *count);
 
 #endif //__LIBPICOBT_DEVICELIST_H__
@@ -0,0 +1,884 @@
+/**
+ * @file btasync.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Completion-callback versions of connect, read and write.
+ *
+ * Each operation is started on a {@link bt_async_t} event loop and runs as
+ * the socket becomes ready, without blocking the caller. When it completes,
+ * fails or times out the callback is invoked with the same `bt_err_t` code
+ * the synchronous call in btmain.c would have returned. A read or write only
+ * completes once all of the bytes have been transferred, as with
+ * {@link bt_read} and {@link bt_write}.
+ *
+ * A socket can have one read and one write outstanding at the same time.
+ * Sockets are watched using a reactor and are left in non-blocking mode.
+ * Callbacks are always invoked from {@link bt_async_run_once}, never from
+ * the call that started the operation, and are free to start further
+ * operations or to close the socket once its operations are complete.
+ *
+ * The event loop is currently only available on Linux. On Windows all of
+ * the functions return `BT_ERR_UNSUPPORTED`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "picobt/bt.h"
+#include "picobt/btasync.h"
+#ifdef WINDOWS
+// nothing further to include
+#else // LINUX
+#include <unistd.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#endif
+
+#include "picobt/log.h"
+
+#ifdef WINDOWS
+
+bt_err_t bt_async_init(bt_async_t *loop) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_async_free(bt_async_t *loop) {
+}
+
+bt_err_t bt_connect_async(bt_async_t *loop, const bt_addr_t *address, unsigned char port, bt_socket_t *sock, int timeout_ms, bt_async_callback_t callback, void *data) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_read_async(bt_async_t *loop, bt_socket_t *socket, void *buffer, size_t numBytes, int timeout_ms, bt_async_callback_t callback, void *data) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_write_async(bt_async_t *loop, bt_socket_t *socket, const void *buffer, size_t numBytes, int timeout_ms, bt_async_callback_t callback, void *data) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_async_cancel(bt_async_t *loop, bt_socket_t *socket) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+size_t bt_async_pending(bt_async_t const *loop) {
+	return 0;
+}
+
+bt_err_t bt_async_run_once(bt_async_t *loop, int timeout_ms, int *completed) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_async_run(bt_async_t *loop) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_async_stop(bt_async_t *loop) {
+}
+
+#else // LINUX
+
+/**
+ * A read or write in progress.
+ */
+typedef struct {
+	/// Set while the operation is outstanding.
+	bool active;
+	/// The buffer to read into or write from.
+	char *buffer;
+	/// The number of bytes to transfer.
+	size_t size;
+	/// The number of bytes transferred so far.
+	size_t done;
+	/// When the operation times out.
+	bt_deadline_t deadline;
+	/// The result, once the operation is complete.
+	bt_err_t result;
+	/// Called on completion.
+	bt_async_callback_t callback;
+	/// User data passed to the callback.
+	void *data;
+} bt_async_op_t;
+
+/**
+ * A socket with operations outstanding. It stays registered with the reactor
+ * for as long as it has any.
+ */
+typedef struct _bt_async_socket_t {
+	/// The next socket in the loop's list.
+	struct _bt_async_socket_t *next;
+	/// The previous socket in the loop's list.
+	struct _bt_async_socket_t *prev;
+	/// The loop the socket belongs to.
+	bt_async_t *loop;
+	/// The socket itself.
+	bt_socket_t *socket;
+	/// Set while the write slot holds a connect rather than a write.
+	bool connecting;
+	/// The outstanding read.
+	bt_async_op_t read;
+	/// The outstanding write or connect.
+	bt_async_op_t write;
+	/// The reactor events currently asked for.
+	int events;
+} bt_async_socket_t;
+
+/**
+ * A completed operation whose callback is still to be invoked.
+ */
+typedef struct {
+	bt_async_callback_t callback;
+	void *data;
+	bt_err_t result;
+	size_t numBytes;
+} bt_async_done_t;
+
+static void bt_async_dispatch(bt_reactor_t *reactor, bt_socket_t *socket, int events, void *data);
+
+/**
+ * Initialise an event loop for asynchronous operations. Free its resources
+ * using {@link bt_async_free}.
+ *
+ * @param loop The event loop to initialise.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The loop was NULL
+ *    `BT_ERR_UNKNOWN`         - the event queue couldn't be created
+ */
+bt_err_t bt_async_init(bt_async_t *loop) {
+	// check parameters
+	if (loop == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	memset(loop, 0, sizeof(bt_async_t));
+
+	return bt_reactor_init(&loop->reactor);
+}
+
+/**
+ * Free the resources associated with an event loop. Outstanding operations
+ * are abandoned without their callbacks being invoked, and their sockets
+ * aren't closed.
+ *
+ * @param loop The event loop to free.
+ */
+void bt_async_free(bt_async_t *loop) {
+	bt_async_socket_t *entry;
+
+	if (loop == NULL)
+		return;
+
+	while (loop->sockets != NULL) {
+		entry = loop->sockets;
+		loop->sockets = entry->next;
+		free(entry);
+	}
+	bt_reactor_free(&loop->reactor);
+	memset(loop, 0, sizeof(bt_async_t));
+}
+
+/**
+ * Find the entry for a socket that already has operations outstanding.
+ *
+ * @param loop   The event loop to search.
+ * @param socket The socket to look for.
+ *
+ * @return The socket's entry, or NULL if it has nothing outstanding.
+ */
+static bt_async_socket_t *bt_async_find(bt_async_t *loop, bt_socket_t const *socket) {
+	bt_reactor_handler_t *handler;
+
+	if (socket->s < 0 || (size_t) socket->s >= loop->reactor.size)
+		return NULL;
+
+	handler = loop->reactor.handlers[socket->s];
+	if (handler == NULL || handler->callback != bt_async_dispatch || handler->socket != socket)
+		return NULL;
+
+	return handler->data;
+}
+
+/**
+ * Get the reactor events needed by a socket's outstanding operations.
+ *
+ * @param entry The socket's entry.
+ *
+ * @return A combination of `BT_REACTOR_*` event flags.
+ */
+static int bt_async_events(bt_async_socket_t const *entry) {
+	int events;
+
+	events = 0;
+	if (entry->read.active)
+		events |= BT_REACTOR_READABLE;
+	if (entry->write.active)
+		events |= BT_REACTOR_WRITABLE;
+
+	return events;
+}
+
+/**
+ * Find or create the entry for a socket that's about to have an operation
+ * started on it.
+ *
+ * @param loop   The event loop to use.
+ * @param socket The socket.
+ * @param entry  Pointer to return the socket's entry.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The socket is registered with the reactor
+ *                               for some other purpose
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+static bt_err_t bt_async_entry(bt_async_t *loop, bt_socket_t *socket, bt_async_socket_t **entry) {
+	bt_async_socket_t *created;
+	bt_err_t e;
+
+	*entry = bt_async_find(loop, socket);
+	if (*entry != NULL)
+		return BT_SUCCESS;
+
+	created = calloc(1, sizeof(bt_async_socket_t));
+	if (created == NULL)
+		return BT_ERR_UNKNOWN;
+	created->loop = loop;
+	created->socket = socket;
+
+	// nothing is asked for until the operation has been set up
+	e = bt_reactor_add(&loop->reactor, socket, 0, bt_async_dispatch, created);
+	if (e != BT_SUCCESS) {
+		free(created);
+		return e;
+	}
+
+	created->next = loop->sockets;
+	if (loop->sockets != NULL)
+		loop->sockets->prev = created;
+	loop->sockets = created;
+	*entry = created;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Bring a socket's registration up to date after its operations have
+ * changed. A socket with nothing left outstanding is removed from the loop
+ * and its entry freed.
+ *
+ * @param entry The socket's entry.
+ */
+static void bt_async_update(bt_async_socket_t *entry) {
+	bt_async_t *loop;
+	int events;
+
+	loop = entry->loop;
+	events = bt_async_events(entry);
+	if (events != 0) {
+		if (events != entry->events && bt_reactor_modify(&loop->reactor, entry->socket, events) == BT_SUCCESS)
+			entry->events = events;
+		return;
+	}
+
+	bt_reactor_remove(&loop->reactor, entry->socket);
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		loop->sockets = entry->next;
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	free(entry);
+}
+
+/**
+ * Start an operation in one of a socket's slots.
+ *
+ * @param entry      The socket's entry.
+ * @param op         The slot to use.
+ * @param buffer     The buffer to read into or write from.
+ * @param numBytes   The number of bytes to transfer.
+ * @param timeout_ms The time limit in milliseconds, or `BT_ASYNC_NO_TIMEOUT`.
+ * @param callback   Called on completion.
+ * @param data       User data to pass to the callback.
+ */
+static void bt_async_start(bt_async_socket_t *entry, bt_async_op_t *op, void *buffer, size_t numBytes, int timeout_ms, bt_async_callback_t callback, void *data) {
+	op->active = true;
+	op->buffer = buffer;
+	op->size = numBytes;
+	op->done = 0;
+	op->deadline = bt_deadline_from_ms(timeout_ms);
+	op->result = BT_SUCCESS;
+	op->callback = callback;
+	op->data = data;
+	entry->loop->pending++;
+	bt_async_update(entry);
+}
+
+/**
+ * Mark an operation as complete and record its callback to be invoked.
+ *
+ * @param entry  The socket's entry.
+ * @param op     The completed operation.
+ * @param result The result to report.
+ * @param done   The array of callbacks to invoke.
+ * @param count  The number of entries in done, which is incremented.
+ */
+static void bt_async_complete(bt_async_socket_t *entry, bt_async_op_t *op, bt_err_t result, bt_async_done_t *done, int *count) {
+	done[*count].callback = op->callback;
+	done[*count].data = op->data;
+	done[*count].result = result;
+	done[*count].numBytes = op->done;
+	(*count)++;
+
+	op->active = false;
+	entry->loop->pending--;
+	entry->loop->completed++;
+}
+
+/**
+ * Finish with a socket whose operations have made progress, then invoke the
+ * callbacks of those that completed. The socket's entry may be freed, so
+ * it mustn't be used afterwards.
+ *
+ * @param entry The socket's entry.
+ * @param done  The callbacks to invoke.
+ * @param count The number of callbacks to invoke.
+ */
+static void bt_async_finish(bt_async_socket_t *entry, bt_async_done_t const *done, int count) {
+	bt_async_t *loop;
+	bt_socket_t *socket;
+	bool failed;
+	int i;
+
+	loop = entry->loop;
+	socket = entry->socket;
+	failed = entry->connecting && (count > 0) && (done[0].result != BT_SUCCESS);
+	if (count > 0)
+		entry->connecting = false;
+
+	// the socket is only removed once nothing is left outstanding, so that the
+	// callbacks can start new operations or close it
+	bt_async_update(entry);
+	if (failed)
+		bt_disconnect(socket);
+
+	for (i = 0; i < count; i++)
+		done[i].callback(loop, socket, done[i].result, done[i].numBytes, done[i].data);
+}
+
+/**
+ * Get the outcome of a connect that has become writable.
+ *
+ * @param socket The connecting socket.
+ *
+ * @return `BT_SUCCESS` if the connection was made, or
+ *         `BT_ERR_CONNECTION_FAILURE` if it was refused or failed.
+ */
+static bt_err_t bt_async_connect_result(bt_socket_t const *socket) {
+	int error;
+	socklen_t len;
+
+	// the outcome of the connect is reported through SO_ERROR
+	error = 0;
+	len = sizeof(error);
+	if (getsockopt(socket->s, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+		LOG("bt_async_connect_result: could not read result on socket %d: %d\n", socket->s, errno);
+		return BT_ERR_CONNECTION_FAILURE;
+	}
+	if (error != 0) {
+		LOG("bt_async_connect_result: could not connect socket %d: %d\n", socket->s, error);
+		return BT_ERR_CONNECTION_FAILURE;
+	}
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Move a read on as far as the data available allows.
+ *
+ * @param socket The socket to read from.
+ * @param op     The read in progress.
+ *
+ * @return `true` if the read is complete, with its result stored in the
+ *         operation, or `false` if it needs more data.
+ */
+static bool bt_async_progress_read(bt_socket_t *socket, bt_async_op_t *op) {
+	size_t len;
+	bt_err_t e;
+
+	while (op->done < op->size) {
+		len = op->size - op->done;
+		e = bt_recv(socket, op->buffer + op->done, &len);
+		if (e == BT_ERR_WOULD_BLOCK)
+			return false;
+		if (e != BT_SUCCESS) {
+			op->result = e;
+			return true;
+		}
+		op->done += len;
+	}
+	op->result = BT_SUCCESS;
+
+	return true;
+}
+
+/**
+ * Move a write on as far as the space available allows.
+ *
+ * @param socket The socket to write to.
+ * @param op     The write in progress.
+ * @param closed Whether the socket has been reported closed, in which case
+ *               a write that can't make progress fails.
+ *
+ * @return `true` if the write is complete, with its result stored in the
+ *         operation, or `false` if it needs more space.
+ */
+static bool bt_async_progress_write(bt_socket_t *socket, bt_async_op_t *op, bool closed) {
+	size_t len;
+	bt_err_t e;
+
+	while (op->done < op->size) {
+		len = op->size - op->done;
+		e = bt_send(socket, op->buffer + op->done, &len);
+		if (e == BT_ERR_WOULD_BLOCK && !closed)
+			return false;
+		if (e == BT_ERR_WOULD_BLOCK)
+			e = BT_SOCKET_CLOSED;
+		if (e != BT_SUCCESS) {
+			op->result = e;
+			return true;
+		}
+		op->done += len;
+	}
+	op->result = BT_SUCCESS;
+
+	return true;
+}
+
+/**
+ * Reactor callback for sockets with operations outstanding.
+ *
+ * @param reactor The loop's reactor.
+ * @param socket  The socket that's ready.
+ * @param events  A combination of `BT_REACTOR_*` event flags.
+ * @param data    The socket's entry.
+ */
+static void bt_async_dispatch(bt_reactor_t *reactor, bt_socket_t *socket, int events, void *data) {
+	bt_async_socket_t *entry;
+	bt_async_done_t done[2];
+	bool closed;
+	int count;
+
+	entry = data;
+	closed = ((events & BT_REACTOR_CLOSED) != 0);
+	count = 0;
+
+	if (entry->connecting) {
+		if (events & (BT_REACTOR_WRITABLE | BT_REACTOR_CLOSED))
+			bt_async_complete(entry, &entry->write, bt_async_connect_result(socket), done, &count);
+	}
+	else {
+		if (entry->write.active && (events & (BT_REACTOR_WRITABLE | BT_REACTOR_CLOSED))) {
+			if (bt_async_progress_write(socket, &entry->write, closed))
+				bt_async_complete(entry, &entry->write, entry->write.result, done, &count);
+		}
+		if (entry->read.active && (events & (BT_REACTOR_READABLE | BT_REACTOR_CLOSED))) {
+			if (bt_async_progress_read(socket, &entry->read))
+				bt_async_complete(entry, &entry->read, entry->read.result, done, &count);
+		}
+	}
+
+	bt_async_finish(entry, done, count);
+}
+
+/**
+ * Start an RFCOMM connection to the specified device and port without
+ * waiting for it to complete. The callback is invoked once the connection
+ * has been made or has failed.
+ *
+ * The service lookup needed to connect by UUID involves a blocking SDP
+ * query, so only connecting by channel is offered here.
+ *
+ * @param loop       The event loop to run the connect on.
+ * @param address    Bluetooth address of the device to connect to.
+ * @param port       The RFCOMM port number to connect to.
+ * @param sock       Pointer to a Bluetooth socket. It must remain valid until
+ *                   the callback has been invoked. On success it's left
+ *                   connected in non-blocking mode; on failure it's closed.
+ * @param timeout_ms The longest time to wait for the connection in
+ *                   milliseconds, or `BT_ASYNC_NO_TIMEOUT`.
+ * @param callback   Called once the connect completes.
+ * @param data       User data to pass to the callback.
+ *
+ * @return `BT_SUCCESS` if the connect was started, or one of the following
+ *         error values, in which case the callback won't be invoked:
+ *    `BT_ERR_BAD_PARAM`          - One of the parameters was NULL
+ *    `BT_ERR_ALLOCATING_SOCKET`  - the socket couldn't be created
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ *    `BT_ERR_UNKNOWN`            - unhelpfully generic failure
+ *
+ * The result passed to the callback is `BT_SUCCESS`, or:
+ *    `BT_ERR_DEVICE_NOT_FOUND`   - the connection didn't complete in time
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ */
+bt_err_t bt_connect_async(bt_async_t *loop, const bt_addr_t *address, unsigned char port, bt_socket_t *sock, int timeout_ms, bt_async_callback_t callback, void *data) {
+	struct sockaddr_rc target;
+	bt_async_socket_t *entry;
+	bt_err_t e;
+
+	// check parameters
+	if (loop == NULL || address == NULL || sock == NULL || callback == NULL) {
+		LOG("bt_connect_async: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	sock->s = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+	if (sock->s < 0) {
+		LOG("bt_connect_async: could not create socket\n");
+		return BT_ERR_ALLOCATING_SOCKET;
+	}
+
+	// registering the socket also makes it non-blocking
+	e = bt_async_entry(loop, sock, &entry);
+	if (e != BT_SUCCESS) {
+		bt_disconnect(sock);
+		return e;
+	}
+
+	memset(&target, 0, sizeof(target));
+	target.rc_family = AF_BLUETOOTH;
+	target.rc_channel = (uint8_t) port;
+	bt_addr_to_bdaddr(address, &target.rc_bdaddr);
+	if (connect(sock->s, (struct sockaddr*) &target, sizeof(target)) < 0 && errno != EINPROGRESS) {
+		LOG("bt_connect_async: could not connect socket: %d\n", errno);
+		bt_async_update(entry);
+		bt_disconnect(sock);
+		return BT_ERR_CONNECTION_FAILURE;
+	}
+
+	// even an immediate connection is reported through the loop
+	entry->connecting = true;
+	bt_async_start(entry, &entry->write, NULL, 0, timeout_ms, callback, data);
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Check the parameters for a read or write and find the socket's entry.
+ *
+ * @param loop     The event loop to use.
+ * @param socket   The socket.
+ * @param buffer   The buffer to read into or write from.
+ * @param numBytes The number of bytes to transfer.
+ * @param callback Called on completion.
+ * @param read     Whether the operation is a read.
+ * @param entry    Pointer to return the socket's entry.
+ *
+ * @return `BT_SUCCESS` if the operation can be started, or
+ *         `BT_ERR_BAD_PARAM` or `BT_ERR_UNKNOWN` if it can't.
+ */
+static bt_err_t bt_async_prepare(bt_async_t *loop, bt_socket_t *socket, const void *buffer, size_t numBytes, bt_async_callback_t callback, bool read, bt_async_socket_t **entry) {
+	bt_async_socket_t *existing;
+
+	// check parameters
+	if (loop == NULL || socket == NULL || socket->s < 0 || (buffer == NULL && numBytes > 0) || callback == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	// only one of each kind at a time, and nothing until a connect is done
+	existing = bt_async_find(loop, socket);
+	if (existing != NULL && (existing->connecting || (read ? existing->read.active : existing->write.active)))
+		return BT_ERR_BAD_PARAM;
+
+	return bt_async_entry(loop, socket, entry);
+}
+
+/**
+ * Start reading a given number of bytes from a socket. The callback is
+ * invoked once all of them have arrived, or the read fails or times out.
+ *
+ * @param loop       The event loop to run the read on.
+ * @param socket     The socket to read from, which is switched to
+ *                   non-blocking mode.
+ * @param buffer     The buffer to read into. It must remain valid until the
+ *                   callback has been invoked.
+ * @param numBytes   The number of bytes to read.
+ * @param timeout_ms The longest time to wait for all of the data in
+ *                   milliseconds, or `BT_ASYNC_NO_TIMEOUT`.
+ * @param callback   Called once the read completes.
+ * @param data       User data to pass to the callback.
+ *
+ * @return `BT_SUCCESS` if the read was started, or one of the following
+ *         error values, in which case the callback won't be invoked:
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL, or a read or
+ *                               connect is already outstanding on the socket
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *
+ * The result passed to the callback is `BT_SUCCESS`, or one of the errors
+ * returned by {@link bt_read_deadline}, with numBytes giving the number of
+ * bytes that arrived.
+ */
+bt_err_t bt_read_async(bt_async_t *loop, bt_socket_t *socket, void *buffer, size_t numBytes, int timeout_ms, bt_async_callback_t callback, void *data) {
+	bt_async_socket_t *entry;
+	bt_err_t e;
+
+	e = bt_async_prepare(loop, socket, buffer, numBytes, callback, true, &entry);
+	if (e != BT_SUCCESS) {
+		LOG("bt_read_async: could not start read\n");
+		return e;
+	}
+
+	bt_async_start(entry, &entry->read, buffer, numBytes, timeout_ms, callback, data);
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Start writing a given number of bytes to a socket. The callback is invoked
+ * once all of them have been sent, or the write fails or times out.
+ *
+ * @param loop       The event loop to run the write on.
+ * @param socket     The socket to write to, which is switched to
+ *                   non-blocking mode.
+ * @param buffer     The data to write. It must remain valid until the
+ *                   callback has been invoked.
+ * @param numBytes   The number of bytes to write.
+ * @param timeout_ms The longest time to wait for all of the data to be sent
+ *                   in milliseconds, or `BT_ASYNC_NO_TIMEOUT`.
+ * @param callback   Called once the write completes.
+ * @param data       User data to pass to the callback.
+ *
+ * @return `BT_SUCCESS` if the write was started, or one of the following
+ *         error values, in which case the callback won't be invoked:
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL, or a write or
+ *                               connect is already outstanding on the socket
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *
+ * The result passed to the callback is `BT_SUCCESS`, or one of the errors
+ * returned by {@link bt_write_deadline}, with numBytes giving the number of
+ * bytes that were sent.
+ */
+bt_err_t bt_write_async(bt_async_t *loop, bt_socket_t *socket, const void *buffer, size_t numBytes, int timeout_ms, bt_async_callback_t callback, void *data) {
+	bt_async_socket_t *entry;
+	bt_err_t e;
+
+	e = bt_async_prepare(loop, socket, buffer, numBytes, callback, false, &entry);
+	if (e != BT_SUCCESS) {
+		LOG("bt_write_async: could not start write\n");
+		return e;
+	}
+
+	// the buffer is only ever read from
+	bt_async_start(entry, &entry->write, (void *) buffer, numBytes, timeout_ms, callback, data);
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Abandon the operations outstanding on a socket without invoking their
+ * callbacks. Call this before closing a socket that may still have a read
+ * or write outstanding. The socket itself is left open.
+ *
+ * @param loop   The event loop the operations are running on.
+ * @param socket The socket.
+ *
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_BAD_PARAM` if the socket
+ *         has nothing outstanding.
+ */
+bt_err_t bt_async_cancel(bt_async_t *loop, bt_socket_t *socket) {
+	bt_async_socket_t *entry;
+
+	// check parameters
+	if (loop == NULL || socket == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	entry = bt_async_find(loop, socket);
+	if (entry == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	if (entry->read.active)
+		loop->pending--;
+	if (entry->write.active)
+		loop->pending--;
+	entry->read.active = false;
+	entry->write.active = false;
+	entry->connecting = false;
+	bt_async_update(entry);
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Get the number of operations still outstanding on an event loop.
+ *
+ * @param loop The event loop to query.
+ *
+ * @return The number of operations whose callbacks are yet to be invoked.
+ */
+size_t bt_async_pending(bt_async_t const *loop) {
+	if (loop == NULL)
+		return 0;
+
+	return loop->pending;
+}
+
+/**
+ * Get the earliest deadline of any outstanding operation.
+ *
+ * @param loop The event loop to check.
+ *
+ * @return The earliest deadline, or `BT_DEADLINE_NEVER` if none of the
+ *         operations has a time limit.
+ */
+static bt_deadline_t bt_async_next_deadline(bt_async_t const *loop) {
+	bt_async_socket_t const *entry;
+	bt_deadline_t deadline;
+
+	deadline = BT_DEADLINE_NEVER;
+	for (entry = loop->sockets; entry != NULL; entry = entry->next) {
+		if (entry->read.active && entry->read.deadline < deadline)
+			deadline = entry->read.deadline;
+		if (entry->write.active && entry->write.deadline < deadline)
+			deadline = entry->write.deadline;
+	}
+
+	return deadline;
+}
+
+/**
+ * Complete the operations whose deadlines have passed.
+ *
+ * @param loop The event loop to check.
+ */
+static void bt_async_expire(bt_async_t *loop) {
+	bt_async_socket_t *entry;
+	bt_async_done_t done[2];
+	int64_t now;
+	int count;
+
+	now = bt_time_now_us();
+	entry = loop->sockets;
+	while (entry != NULL) {
+		count = 0;
+		if (entry->write.active && entry->write.deadline <= now) {
+			// a connect that's taking too long is reported as bt_connect_to_port_ex does
+			bt_async_complete(entry, &entry->write, entry->connecting ? BT_ERR_DEVICE_NOT_FOUND : BT_ERR_TIMEOUT, done, &count);
+		}
+		if (entry->read.active && entry->read.deadline <= now)
+			bt_async_complete(entry, &entry->read, BT_ERR_TIMEOUT, done, &count);
+
+		if (count == 0) {
+			entry = entry->next;
+		}
+		else {
+			// the callbacks may change the list, so start again from the top
+			bt_async_finish(entry, done, count);
+			entry = loop->sockets;
+		}
+	}
+}
+
+/**
+ * Wait for the outstanding operations to make progress, and invoke the
+ * callbacks of any that complete or time out.
+ *
+ * @param loop       The event loop to run.
+ * @param timeout_ms The longest time to wait in milliseconds, `0` to return
+ *                   immediately, or `-1` to wait until something happens.
+ * @param completed  Pointer to return the number of operations completed.
+ *                   It can be `NULL`.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The loop was NULL
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+bt_err_t bt_async_run_once(bt_async_t *loop, int timeout_ms, int *completed) {
+	unsigned long before;
+	int remaining;
+	bt_err_t e;
+
+	// check parameters
+	if (loop == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	// wake up in time to report the first operation that times out
+	remaining = bt_deadline_remaining_ms(bt_async_next_deadline(loop));
+	if (remaining >= 0 && (timeout_ms < 0 || remaining < timeout_ms))
+		timeout_ms = remaining;
+
+	before = loop->completed;
+	e = bt_reactor_run_once(&loop->reactor, timeout_ms, NULL);
+	if (e == BT_SUCCESS)
+		bt_async_expire(loop);
+
+	if (completed != NULL)
+		*completed = (int) (loop->completed - before);
+
+	return e;
+}
+
+/**
+ * Run the event loop until there are no operations left outstanding, or
+ * {@link bt_async_stop} is called. Callbacks can start further operations
+ * to keep the loop running.
+ *
+ * @param loop The event loop to run.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The loop was NULL
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+bt_err_t bt_async_run(bt_async_t *loop) {
+	bt_err_t e;
+
+	// check parameters
+	if (loop == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	loop->stopping = false;
+	e = BT_SUCCESS;
+	while ((e == BT_SUCCESS) && !loop->stopping && (loop->pending > 0)) {
+		e = bt_async_run_once(loop, -1, NULL);
+	}
+
+	return e;
+}
+
+/**
+ * Make {@link bt_async_run} return once the current events have been
+ * handled. This is intended to be called from within a callback.
+ *
+ * @param loop The event loop to stop.
+ */
+void bt_async_stop(bt_async_t *loop) {
+	if (loop == NULL)
+		return;
+
+	loop->stopping = true;
+}
+
+#endif
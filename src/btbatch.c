@@ -0,0 +1,526 @@
+/**
+ * @file btbatch.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Batched socket operations.
+ *
+ * With many connections, much of the time spent in {@link bt_recv} and
+ * {@link bt_send} goes on entering and leaving the kernel. A batch collects
+ * reads, writes and accepts on any number of sockets and submits them
+ * together. When built with `HAVE_LIBURING` (the `PICOBT_IO_URING` CMake
+ * option) and running on a kernel that supports it, the whole batch is
+ * submitted to io_uring with a single system call, and completions are
+ * collected without further calls where possible.
+ *
+ * Otherwise, or if io_uring can't be set up at runtime, the batch falls back
+ * to performing each operation synchronously when it's submitted, using the
+ * ordinary socket calls. The results are reported in the same way either way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "picobt/bt.h"
+#include "picobt/btbatch.h"
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "picobt/log.h"
+
+/**
+ * Initialise a batch. Free its resources using {@link bt_batch_free}.
+ *
+ * @param batch   The batch to initialise.
+ * @param entries The most operations the batch can hold at once, or `0` to
+ *                use `BT_BATCH_DEFAULT_ENTRIES`.
+ * @param flags   `BT_BATCH_SYNC` to run the operations synchronously even if
+ *                io_uring is available, otherwise `0`.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The batch was NULL
+ *    `BT_ERR_UNKNOWN`         - memory couldn't be allocated
+ */
+bt_err_t bt_batch_init(bt_batch_t *batch, unsigned entries, int flags) {
+	unsigned i;
+
+	// check parameters
+	if (batch == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	if (entries == 0)
+		entries = BT_BATCH_DEFAULT_ENTRIES;
+
+	memset(batch, 0, sizeof(bt_batch_t));
+	batch->slots = calloc(entries, sizeof(bt_batch_op_t));
+	batch->free = calloc(entries, sizeof(unsigned));
+	batch->queued = calloc(entries, sizeof(unsigned));
+	batch->done = calloc(entries, sizeof(unsigned));
+	if (batch->slots == NULL || batch->free == NULL || batch->queued == NULL || batch->done == NULL) {
+		LOG("bt_batch_init: could not allocate %u entries\n", entries);
+		bt_batch_free(batch);
+		return BT_ERR_UNKNOWN;
+	}
+	batch->entries = entries;
+
+	// hand out the lowest slots first
+	for (i = 0; i < entries; i++) {
+		batch->free[i] = entries - i - 1;
+	}
+	batch->free_count = entries;
+
+#ifdef HAVE_LIBURING
+	if ((flags & BT_BATCH_SYNC) == 0) {
+		struct io_uring *ring;
+		int result;
+
+		ring = malloc(sizeof(struct io_uring));
+		if (ring != NULL) {
+			result = io_uring_queue_init(entries, ring, 0);
+			if (result == 0) {
+				batch->ring = ring;
+			}
+			else {
+				// probably an old kernel, or io_uring has been disabled
+				LOG("bt_batch_init: io_uring unavailable (%d), falling back to synchronous I/O\n", -result);
+				free(ring);
+			}
+		}
+	}
+#endif
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Free the resources associated with a batch. Any operations still in
+ * flight are abandoned, so their buffers must remain valid until the sockets
+ * involved have been closed.
+ *
+ * @param batch The batch to free.
+ */
+void bt_batch_free(bt_batch_t *batch) {
+	if (batch == NULL)
+		return;
+
+#ifdef HAVE_LIBURING
+	if (batch->ring != NULL) {
+		io_uring_queue_exit(batch->ring);
+		free(batch->ring);
+	}
+#endif
+	free(batch->slots);
+	free(batch->free);
+	free(batch->queued);
+	free(batch->done);
+
+	memset(batch, 0, sizeof(bt_batch_t));
+}
+
+/**
+ * Check whether a batch is submitted using io_uring, rather than falling
+ * back to synchronous calls.
+ *
+ * @param batch The batch to check.
+ *
+ * @return true if io_uring is in use.
+ */
+bool bt_batch_uses_io_uring(bt_batch_t const *batch) {
+	return (batch != NULL) && (batch->ring != NULL);
+}
+
+/**
+ * Take an unused slot and queue it for the next submission.
+ *
+ * @param batch The batch to add to.
+ *
+ * @return The slot, or NULL if the batch is full.
+ */
+static bt_batch_op_t *bt_batch_queue(bt_batch_t *batch) {
+	unsigned index;
+
+	if (batch->free_count == 0) {
+		LOG("bt_batch_queue: batch is full\n");
+		return NULL;
+	}
+
+	index = batch->free[--batch->free_count];
+	batch->queued[batch->queued_count++] = index;
+	memset(&batch->slots[index], 0, sizeof(bt_batch_op_t));
+
+	return &batch->slots[index];
+}
+
+/**
+ * Add a receive to the batch. On completion, up to `size` bytes of whatever
+ * data is available will have been received, as for {@link bt_recv}.
+ *
+ * @param batch  The batch to add to.
+ * @param socket The socket to receive from.
+ * @param buffer Pointer to buffer in which to put received data. This must
+ *               remain valid until the operation completes.
+ * @param size   The size of the buffer.
+ * @param data   User data returned with the result.
+ *
+ * @return `BT_SUCCESS` if successful, `BT_ERR_BAD_PARAM` if a parameter was
+ *         NULL, or `BT_ERR_BUFFER_FULL` if the batch is full.
+ */
+bt_err_t bt_batch_add_recv(bt_batch_t *batch, bt_socket_t *socket, void *buffer, size_t size, void *data) {
+	bt_batch_op_t *op;
+
+	// check parameters
+	if (batch == NULL || socket == NULL || buffer == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	op = bt_batch_queue(batch);
+	if (op == NULL)
+		return BT_ERR_BUFFER_FULL;
+
+	op->type = BT_BATCH_RECV;
+	op->socket = socket;
+	op->buffer = buffer;
+	op->size = size;
+	op->data = data;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Add a send to the batch. On completion, as much of the data as the socket
+ * would accept will have been sent, as for {@link bt_send}.
+ *
+ * @param batch  The batch to add to.
+ * @param socket The socket to send on.
+ * @param buffer Pointer to buffer containing the data to send. This must
+ *               remain valid until the operation completes.
+ * @param size   The number of bytes to send.
+ * @param data   User data returned with the result.
+ *
+ * @return `BT_SUCCESS` if successful, `BT_ERR_BAD_PARAM` if a parameter was
+ *         NULL, or `BT_ERR_BUFFER_FULL` if the batch is full.
+ */
+bt_err_t bt_batch_add_send(bt_batch_t *batch, bt_socket_t *socket, const void *buffer, size_t size, void *data) {
+	bt_batch_op_t *op;
+
+	// check parameters
+	if (batch == NULL || socket == NULL || buffer == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	op = bt_batch_queue(batch);
+	if (op == NULL)
+		return BT_ERR_BUFFER_FULL;
+
+	op->type = BT_BATCH_SEND;
+	op->socket = socket;
+	op->buffer = (void *) buffer;
+	op->size = size;
+	op->data = data;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Add an accept to the batch. On completion, the next connection on the
+ * listening socket will have been accepted into `client`.
+ *
+ * @param batch    The batch to add to.
+ * @param listener The listening socket.
+ * @param client   The structure to store the new connection in. This must
+ *                 remain valid until the operation completes.
+ * @param data     User data returned with the result.
+ *
+ * @return `BT_SUCCESS` if successful, `BT_ERR_BAD_PARAM` if a parameter was
+ *         NULL, or `BT_ERR_BUFFER_FULL` if the batch is full.
+ */
+bt_err_t bt_batch_add_accept(bt_batch_t *batch, bt_socket_t *listener, bt_socket_t *client, void *data) {
+	bt_batch_op_t *op;
+
+	// check parameters
+	if (batch == NULL || listener == NULL || client == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	op = bt_batch_queue(batch);
+	if (op == NULL)
+		return BT_ERR_BUFFER_FULL;
+
+	op->type = BT_BATCH_ACCEPT;
+	op->socket = listener;
+	op->client = client;
+	op->data = data;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Move a slot onto the completed list.
+ *
+ * @param batch The batch the slot belongs to.
+ * @param op    The completed operation.
+ */
+static void bt_batch_complete(bt_batch_t *batch, bt_batch_op_t *op) {
+	unsigned index;
+
+	index = (unsigned) (op - batch->slots);
+	batch->done[(batch->done_start + batch->done_count) % batch->entries] = index;
+	batch->done_count++;
+	batch->stats.ops++;
+}
+
+/**
+ * Perform a single operation synchronously, for when io_uring isn't in use.
+ *
+ * @param batch The batch the operation belongs to.
+ * @param op    The operation to perform.
+ */
+static void bt_batch_run_sync(bt_batch_t *batch, bt_batch_op_t *op) {
+	op->numBytes = op->size;
+	switch (op->type) {
+		case BT_BATCH_RECV:
+			op->result = bt_recv(op->socket, op->buffer, &op->numBytes);
+			break;
+		case BT_BATCH_SEND:
+			op->result = bt_send(op->socket, op->buffer, &op->numBytes);
+			break;
+		case BT_BATCH_ACCEPT:
+			op->numBytes = 0;
+			op->result = bt_accept_deadline(op->socket, op->client, BT_DEADLINE_NEVER);
+			break;
+		default:
+			op->numBytes = 0;
+			op->result = BT_ERR_WTF;
+			break;
+	}
+	batch->stats.kernel_calls++;
+	bt_batch_complete(batch, op);
+}
+
+#ifdef HAVE_LIBURING
+/**
+ * Record the result of an operation completed by io_uring.
+ *
+ * @param batch The batch the operation belongs to.
+ * @param op    The completed operation.
+ * @param res   The result from the completion queue entry.
+ */
+static void bt_batch_uring_result(bt_batch_t *batch, bt_batch_op_t *op, int res) {
+	op->numBytes = 0;
+	if (res < 0) {
+		LOG("bt_batch_uring_result: error %d on socket %d\n", -res, op->socket->s);
+		op->result = bt_err_from_errno(-res);
+	}
+	else if (op->type == BT_BATCH_ACCEPT) {
+		// the same timeout the synchronous accept sets
+		op->client->s = res;
+		bt_set_timeout(op->client, 20);
+		op->result = BT_SUCCESS;
+	}
+	else if (res == 0) {
+		// socket has been closed
+		op->result = BT_SOCKET_CLOSED;
+	}
+	else {
+		op->numBytes = res;
+		op->result = BT_SUCCESS;
+	}
+
+	batch->in_flight--;
+	bt_batch_complete(batch, op);
+}
+
+/**
+ * Collect whatever completions are ready without entering the kernel.
+ *
+ * @param batch The batch to collect for.
+ */
+static void bt_batch_uring_harvest(bt_batch_t *batch) {
+	struct io_uring_cqe *cqe;
+
+	while (io_uring_peek_cqe(batch->ring, &cqe) == 0) {
+		bt_batch_uring_result(batch, io_uring_cqe_get_data(cqe), cqe->res);
+		io_uring_cqe_seen(batch->ring, cqe);
+	}
+}
+#endif
+
+/**
+ * Submit all of the operations added since the last submission. With
+ * io_uring this is a single system call, and the operations complete in the
+ * background. Otherwise each operation is performed now, in the order it was
+ * added, and may block if its socket is blocking.
+ *
+ * If the kernel takes only some of the operations, or submission fails, the
+ * rest stay queued and are submitted by the next call.
+ *
+ * @param batch The batch to submit.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The batch was NULL
+ *    `BT_ERR_UNKNOWN`         - the operations couldn't be submitted
+ */
+bt_err_t bt_batch_submit(bt_batch_t *batch) {
+	bt_batch_op_t *op;
+	unsigned i;
+
+	// check parameters
+	if (batch == NULL)
+		return BT_ERR_BAD_PARAM;
+
+#ifdef HAVE_LIBURING
+	if (batch->ring != NULL) {
+		struct io_uring_sqe *sqe;
+		int result;
+
+		// slots left over from a failed or short submission are already in the ring
+		for (i = batch->prepared; i < batch->queued_count; i++) {
+			op = &batch->slots[batch->queued[i]];
+			sqe = io_uring_get_sqe(batch->ring);
+			// the ring has as many entries as the batch, so this can't fail
+			if (sqe == NULL) {
+				LOG("bt_batch_submit: submission queue full\n");
+				return BT_ERR_WTF;
+			}
+			switch (op->type) {
+				case BT_BATCH_RECV:
+					io_uring_prep_recv(sqe, op->socket->s, op->buffer, op->size, 0);
+					break;
+				case BT_BATCH_SEND:
+					io_uring_prep_send(sqe, op->socket->s, op->buffer, op->size, 0);
+					break;
+				case BT_BATCH_ACCEPT:
+					io_uring_prep_accept(sqe, op->socket->s, NULL, NULL, 0);
+					break;
+			}
+			io_uring_sqe_set_data(sqe, op);
+			batch->prepared++;
+		}
+
+		result = io_uring_submit(batch->ring);
+		batch->stats.kernel_calls++;
+		if (result < 0) {
+			// the entries stay in the ring, to go with the next submission
+			LOG("bt_batch_submit: error %d submitting\n", -result);
+			return BT_ERR_UNKNOWN;
+		}
+
+		// the kernel takes entries in order, so any it didn't take are at the end
+		if ((unsigned) result > batch->prepared)
+			result = batch->prepared;
+		batch->in_flight += result;
+		batch->prepared -= result;
+		batch->queued_count -= result;
+		memmove(batch->queued, batch->queued + result, batch->queued_count * sizeof(unsigned));
+		if (batch->queued_count > 0) {
+			LOG("bt_batch_submit: %u operations left queued\n", batch->queued_count);
+		}
+
+		return BT_SUCCESS;
+	}
+#endif
+
+	for (i = 0; i < batch->queued_count; i++) {
+		op = &batch->slots[batch->queued[i]];
+		bt_batch_run_sync(batch, op);
+	}
+	batch->queued_count = 0;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Collect the results of completed operations, oldest first. Each result
+ * frees a slot in the batch for reuse.
+ *
+ * @param batch   The batch to collect from.
+ * @param results Array to return the completed operations in.
+ * @param max     The size of the results array.
+ * @param wait    The number of results to wait for. Use `0` to collect only
+ *                what has already completed. This is limited to the number
+ *                of operations outstanding.
+ * @param count   Pointer to return the number of results collected.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ *    `BT_ERR_UNKNOWN`         - waiting for completions failed
+ */
+bt_err_t bt_batch_reap(bt_batch_t *batch, bt_batch_op_t *results, unsigned max, unsigned wait, unsigned *count) {
+	unsigned index;
+	unsigned n;
+
+	// check parameters
+	if (batch == NULL || results == NULL || count == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	*count = 0;
+	if (wait > max)
+		wait = max;
+
+#ifdef HAVE_LIBURING
+	if (batch->ring != NULL) {
+		struct io_uring_cqe *cqe;
+		unsigned needed;
+		int result;
+
+		bt_batch_uring_harvest(batch);
+		if (batch->done_count < wait && batch->in_flight > 0) {
+			needed = wait - batch->done_count;
+			if (needed > batch->in_flight)
+				needed = batch->in_flight;
+			result = io_uring_wait_cqe_nr(batch->ring, &cqe, needed);
+			batch->stats.kernel_calls++;
+			if (result < 0) {
+				LOG("bt_batch_reap: error %d waiting for completions\n", -result);
+				return BT_ERR_UNKNOWN;
+			}
+			bt_batch_uring_harvest(batch);
+		}
+	}
+#endif
+
+	n = 0;
+	while (n < max && batch->done_count > 0) {
+		index = batch->done[batch->done_start];
+		batch->done_start = (batch->done_start + 1) % batch->entries;
+		batch->done_count--;
+		results[n++] = batch->slots[index];
+		batch->free[batch->free_count++] = index;
+	}
+
+	*count = n;
+	return BT_SUCCESS;
+}
+
+/**
+ * Get a copy of the counters kept by a batch.
+ *
+ * @param batch The batch to query.
+ * @param stats Structure to return the counters in.
+ */
+void bt_batch_get_stats(bt_batch_t const *batch, bt_batch_stats_t *stats) {
+	if (batch == NULL || stats == NULL)
+		return;
+
+	*stats = batch->stats;
+}
@@ -0,0 +1,1158 @@
+/**
+ * @file btbuffer.c
+ * 
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Buffered I/O on top of Bluetooth sockets.
+ * 
+ * A typical Pico message is read as a 4-byte length followed by the payload.
+ * Reading these directly with {@link bt_read} costs at least one `recv` per
+ * field, and more when RFCOMM splits the payload. The buffered reader here
+ * instead receives as much as it can into a ring buffer with each call, and
+ * serves small reads from that.
+ *
+ * Replies are often built from several small writes in the same way. The
+ * buffered writer collects these and sends them together once a size
+ * threshold is reached, the caller flushes, or a latency budget runs out.
+ *
+ * The buffer pool lets code that handles one message after another reuse the
+ * same few buffers rather than allocating one for each message.
+ *
+ * Finally, the send queue is for producers that mustn't block when a link is
+ * congested. A blocking write would sit out the whole send timeout; instead
+ * the queue takes what the socket won't, up to a fixed limit, and tells the
+ * producer when it's filling up and when it has room again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "picobt/bt.h"
+#include "picobt/log.h"
+
+/**
+ * Initialise a buffered reader. Free its resources using
+ * {@link bt_bufreader_free}.
+ *
+ * @param reader   The reader to initialise.
+ * @param socket   The connected socket to read from. The socket must remain
+ *                 valid for as long as the reader is used.
+ * @param capacity The size of the ring buffer, or `0` to use
+ *                 `BT_BUFREADER_DEFAULT_CAPACITY`.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ *    `BT_ERR_UNKNOWN`         - the buffer couldn't be allocated
+ */
+bt_err_t bt_bufreader_init(bt_bufreader_t *reader, bt_socket_t *socket, size_t capacity) {
+	// check parameters
+	if (reader == NULL || socket == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	if (capacity == 0)
+		capacity = BT_BUFREADER_DEFAULT_CAPACITY;
+
+	memset(reader, 0, sizeof(bt_bufreader_t));
+	reader->buffer = malloc(capacity);
+	if (reader->buffer == NULL) {
+		LOG("bt_bufreader_init: could not allocate %lu byte buffer\n", (unsigned long) capacity);
+		return BT_ERR_UNKNOWN;
+	}
+	reader->socket = socket;
+	reader->capacity = capacity;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Free the resources associated with a buffered reader. Any data still in the
+ * buffer is discarded. The underlying socket is not closed.
+ *
+ * @param reader The reader to free.
+ */
+void bt_bufreader_free(bt_bufreader_t *reader) {
+	if (reader == NULL)
+		return;
+
+	if (reader->buffer != NULL) {
+		free(reader->buffer);
+		reader->buffer = NULL;
+	}
+	reader->capacity = 0;
+	reader->start = 0;
+	reader->count = 0;
+}
+
+/**
+ * Get the number of bytes that can be read without touching the socket.
+ *
+ * @param reader The reader to check.
+ *
+ * @return The number of bytes currently in the buffer.
+ */
+size_t bt_bufreader_available(bt_bufreader_t const *reader) {
+	if (reader == NULL)
+		return 0;
+
+	return reader->count;
+}
+
+/**
+ * Receive as much data as possible into the free space of the ring buffer.
+ * The free space may wrap around the end of the buffer, in which case both
+ * parts are filled using a single scatter read.
+ *
+ * @param reader The reader to fill.
+ *
+ * @return `BT_SUCCESS` if some data was received, otherwise the error from
+ *         {@link bt_recvv}.
+ */
+static bt_err_t bt_bufreader_fill(bt_bufreader_t *reader) {
+	bt_iovec_t iov[2];
+	size_t end;
+	size_t n;
+	int count;
+	bt_err_t e;
+
+	// keep the data contiguous where possible
+	if (reader->count == 0)
+		reader->start = 0;
+
+	end = (reader->start + reader->count) % reader->capacity;
+	if ((end > reader->start) || (reader->count == 0)) {
+		// free space runs to the end of the buffer and then wraps
+		iov[0].iov_base = reader->buffer + end;
+		iov[0].iov_len = reader->capacity - end;
+		iov[1].iov_base = reader->buffer;
+		iov[1].iov_len = reader->start;
+		count = (reader->start > 0) ? 2 : 1;
+	} else {
+		// free space is the gap between the end and the start
+		iov[0].iov_base = reader->buffer + end;
+		iov[0].iov_len = reader->start - end;
+		count = 1;
+	}
+
+	e = bt_recvv(reader->socket, iov, count, &n);
+	reader->stats.recv_calls++;
+	if (e == BT_SUCCESS) {
+		reader->count += n;
+		reader->stats.bytes_received += n;
+	}
+
+	return e;
+}
+
+/**
+ * Copy data out of the ring buffer, removing it from the buffer.
+ *
+ * @param reader   The reader to take data from.
+ * @param buffer   The buffer to copy into.
+ * @param numBytes The number of bytes to copy. Must be no more than the
+ *                 number of bytes available.
+ */
+static void bt_bufreader_take(bt_bufreader_t *reader, uint8_t *buffer, size_t numBytes) {
+	size_t first;
+
+	first = reader->capacity - reader->start;
+	if (first > numBytes)
+		first = numBytes;
+
+	memcpy(buffer, reader->buffer + reader->start, first);
+	memcpy(buffer + first, reader->buffer, numBytes - first);
+
+	reader->start = (reader->start + numBytes) % reader->capacity;
+	reader->count -= numBytes;
+	reader->stats.bytes_delivered += numBytes;
+}
+
+/**
+ * Reverse the order of a range of bytes in place.
+ *
+ * @param data   The first byte of the range.
+ * @param length The number of bytes in the range.
+ */
+static void bt_bufreader_reverse(uint8_t *data, size_t length) {
+	uint8_t swap;
+	size_t i;
+
+	for (i = 0; i < (length >> 1); i++) {
+		swap = data[i];
+		data[i] = data[length - i - 1];
+		data[length - i - 1] = swap;
+	}
+}
+
+/**
+ * Rotate the ring buffer in place so that the unread data starts at the
+ * beginning of the buffer and is therefore contiguous.
+ *
+ * @param reader The reader to rearrange.
+ */
+static void bt_bufreader_linearise(bt_bufreader_t *reader) {
+	// rotate left by start using three reversals, which needs no extra memory
+	bt_bufreader_reverse(reader->buffer, reader->start);
+	bt_bufreader_reverse(reader->buffer + reader->start, reader->capacity - reader->start);
+	bt_bufreader_reverse(reader->buffer, reader->capacity);
+	reader->start = 0;
+}
+
+/**
+ * Read an exact number of bytes through a buffered reader. Like
+ * {@link bt_read} the call blocks until either the desired number of bytes
+ * has been read or the socket gets closed.
+ *
+ * Data already in the buffer is used first. Anything else is received
+ * straight into the caller's buffer, with any surplus data that arrives in
+ * the same `recv` landing in the ring buffer for next time. Large payloads are
+ * therefore not copied twice.
+ *
+ * @param reader   The reader to read from.
+ * @param buffer   Pointer to buffer in which to put received data.
+ * @param numBytes Pointer to number of bytes to receive. On return, this will
+ *                 be set to the actual number of bytes received.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_bufreader_read_exact(bt_bufreader_t *reader, void *buffer, size_t *numBytes) {
+	bt_iovec_t iov[2];
+	size_t wanted;
+	size_t copied;
+	size_t n;
+	unsigned long calls;
+	bt_err_t e;
+
+	// check parameters
+	if (reader == NULL || buffer == NULL || numBytes == NULL) {
+		LOG("bt_bufreader_read_exact: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	reader->stats.requests++;
+	calls = reader->stats.recv_calls;
+	wanted = *numBytes;
+
+	// start with whatever is already buffered
+	copied = (reader->count < wanted) ? reader->count : wanted;
+	bt_bufreader_take(reader, buffer, copied);
+
+	// the buffer is now empty if there's anything left to read
+	e = BT_SUCCESS;
+	while ((copied < wanted) && (e == BT_SUCCESS)) {
+		iov[0].iov_base = (uint8_t *) buffer + copied;
+		iov[0].iov_len = wanted - copied;
+		iov[1].iov_base = reader->buffer;
+		iov[1].iov_len = reader->capacity;
+
+		e = bt_recvv(reader->socket, iov, 2, &n);
+		reader->stats.recv_calls++;
+		if (e == BT_SUCCESS) {
+			reader->stats.bytes_received += n;
+			if (n > wanted - copied) {
+				// the surplus went into the ring buffer
+				reader->start = 0;
+				reader->count = n - (wanted - copied);
+				n = wanted - copied;
+			}
+			copied += n;
+			reader->stats.bytes_delivered += n;
+		}
+	}
+
+	if (calls == reader->stats.recv_calls)
+		reader->stats.buffer_hits++;
+
+	*numBytes = copied;
+	return e;
+}
+
+/**
+ * Look at the next bytes to be read without consuming them. The call blocks
+ * until the requested number of bytes is in the buffer, or the socket gets
+ * closed. The returned pointer refers to the reader's internal buffer and
+ * remains valid until the next call on the reader.
+ *
+ * This is useful for reading a length prefix: peek at the header, then
+ * {@link bt_bufreader_consume} it once the whole message is known to fit.
+ *
+ * @param reader   The reader to read from.
+ * @param numBytes The number of bytes to look at. This must be no larger than
+ *                 the reader's capacity.
+ * @param data     Pointer to return the location of the data in.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL, or numBytes
+ *                               was larger than the buffer
+ */
+bt_err_t bt_bufreader_peek(bt_bufreader_t *reader, size_t numBytes, void const **data) {
+	unsigned long calls;
+	bt_err_t e;
+
+	// check parameters
+	if (reader == NULL || data == NULL || numBytes > reader->capacity) {
+		LOG("bt_bufreader_peek: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	reader->stats.requests++;
+	calls = reader->stats.recv_calls;
+
+	e = BT_SUCCESS;
+	while ((reader->count < numBytes) && (e == BT_SUCCESS)) {
+		e = bt_bufreader_fill(reader);
+	}
+
+	if (e == BT_SUCCESS) {
+		if (reader->start + numBytes > reader->capacity)
+			bt_bufreader_linearise(reader);
+		*data = reader->buffer + reader->start;
+	}
+
+	if (calls == reader->stats.recv_calls)
+		reader->stats.buffer_hits++;
+
+	return e;
+}
+
+/**
+ * Discard bytes from the front of the buffer, normally after they've been
+ * examined using {@link bt_bufreader_peek}. This never touches the socket.
+ *
+ * @param reader   The reader to consume from.
+ * @param numBytes The number of bytes to discard. This must be no more than
+ *                 the number of bytes available.
+ *
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_BAD_PARAM` if there aren't
+ *         enough bytes in the buffer.
+ */
+bt_err_t bt_bufreader_consume(bt_bufreader_t *reader, size_t numBytes) {
+	// check parameters
+	if (reader == NULL || numBytes > reader->count)
+		return BT_ERR_BAD_PARAM;
+
+	reader->start = (reader->start + numBytes) % reader->capacity;
+	reader->count -= numBytes;
+	reader->stats.bytes_delivered += numBytes;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Read up to and including a delimiter byte. The call blocks until either
+ * the delimiter has been read, the caller's buffer is full, or the socket gets
+ * closed.
+ *
+ * @param reader   The reader to read from.
+ * @param delim    The delimiter to stop at.
+ * @param buffer   Pointer to buffer in which to put received data.
+ * @param numBytes Pointer to the size of the buffer. On return, this will be
+ *                 set to the number of bytes read, including the delimiter.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_BUFFER_FULL`     - the buffer filled up before the delimiter
+ *                               was found
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_bufreader_read_until(bt_bufreader_t *reader, uint8_t delim, void *buffer, size_t *numBytes) {
+	uint8_t *out = buffer;
+	size_t space;
+	size_t copied;
+	size_t run;
+	uint8_t *found;
+	unsigned long calls;
+	bt_err_t e;
+
+	// check parameters
+	if (reader == NULL || buffer == NULL || numBytes == NULL) {
+		LOG("bt_bufreader_read_until: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	reader->stats.requests++;
+	calls = reader->stats.recv_calls;
+	space = *numBytes;
+	copied = 0;
+	found = NULL;
+
+	e = BT_SUCCESS;
+	while ((found == NULL) && (e == BT_SUCCESS)) {
+		if (copied == space) {
+			e = BT_ERR_BUFFER_FULL;
+		} else if (reader->count == 0) {
+			e = bt_bufreader_fill(reader);
+		} else {
+			// search the contiguous run at the front of the buffer
+			run = reader->capacity - reader->start;
+			if (run > reader->count)
+				run = reader->count;
+			if (run > space - copied)
+				run = space - copied;
+			found = memchr(reader->buffer + reader->start, delim, run);
+			if (found != NULL)
+				run = found - (reader->buffer + reader->start) + 1;
+			bt_bufreader_take(reader, out + copied, run);
+			copied += run;
+		}
+	}
+
+	if (calls == reader->stats.recv_calls)
+		reader->stats.buffer_hits++;
+
+	*numBytes = copied;
+	return e;
+}
+
+/**
+ * Get a copy of the counters kept by a buffered reader.
+ *
+ * @param reader The reader to query.
+ * @param stats  Structure to return the counters in.
+ */
+void bt_bufreader_get_stats(bt_bufreader_t const *reader, bt_bufreader_stats_t *stats) {
+	if (reader == NULL || stats == NULL)
+		return;
+
+	*stats = reader->stats;
+}
+
+/**
+ * Estimate how many `recv` calls the buffering has saved. Reading the same
+ * data directly with {@link bt_read} would cost at least one call per request,
+ * so this is a lower bound on the saving.
+ *
+ * @param reader The reader to query.
+ *
+ * @return The number of system calls saved.
+ */
+unsigned long bt_bufreader_syscalls_saved(bt_bufreader_t const *reader) {
+	if (reader == NULL || reader->stats.requests < reader->stats.recv_calls)
+		return 0;
+
+	return reader->stats.requests - reader->stats.recv_calls;
+}
+
+/**
+ * Initialise a buffered writer. Any buffered data should be sent using
+ * {@link bt_bufwriter_flush} before freeing the writer with
+ * {@link bt_bufwriter_free}.
+ *
+ * The latency budget bounds how long written data may sit in the buffer.
+ * There's no timer behind it: the budget is checked on each call to
+ * {@link bt_bufwriter_write} and {@link bt_bufwriter_poll}, so a caller that
+ * may go quiet should call {@link bt_bufwriter_poll} no later than
+ * {@link bt_bufwriter_time_remaining_us} says.
+ *
+ * @param writer     The writer to initialise.
+ * @param socket     The connected socket to write to. The socket must remain
+ *                   valid for as long as the writer is used.
+ * @param capacity   The size of the buffer, or `0` to use
+ *                   `BT_BUFWRITER_DEFAULT_CAPACITY`. The flush threshold is
+ *                   initially set to the same value.
+ * @param latency_us The longest time in microseconds that data may wait in
+ *                   the buffer, or `BT_BUFWRITER_NO_LATENCY_BUDGET`.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ *    `BT_ERR_UNKNOWN`         - the buffer couldn't be allocated
+ */
+bt_err_t bt_bufwriter_init(bt_bufwriter_t *writer, bt_socket_t *socket, size_t capacity, int64_t latency_us) {
+	// check parameters
+	if (writer == NULL || socket == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	if (capacity == 0)
+		capacity = BT_BUFWRITER_DEFAULT_CAPACITY;
+
+	memset(writer, 0, sizeof(bt_bufwriter_t));
+	writer->buffer = malloc(capacity);
+	if (writer->buffer == NULL) {
+		LOG("bt_bufwriter_init: could not allocate %lu byte buffer\n", (unsigned long) capacity);
+		return BT_ERR_UNKNOWN;
+	}
+	writer->socket = socket;
+	writer->capacity = capacity;
+	writer->threshold = capacity;
+	writer->latency_us = latency_us;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Free the resources associated with a buffered writer. Any data still in the
+ * buffer is discarded, so call {@link bt_bufwriter_flush} first if it should
+ * be sent. The underlying socket is not closed.
+ *
+ * @param writer The writer to free.
+ */
+void bt_bufwriter_free(bt_bufwriter_t *writer) {
+	if (writer == NULL)
+		return;
+
+	if (writer->count > 0)
+		LOG("bt_bufwriter_free: discarding %lu unsent bytes\n", (unsigned long) writer->count);
+
+	if (writer->buffer != NULL) {
+		free(writer->buffer);
+		writer->buffer = NULL;
+	}
+	writer->capacity = 0;
+	writer->count = 0;
+}
+
+/**
+ * Set the number of buffered bytes at which the buffer gets sent. Lower
+ * values reduce latency, higher ones give fuller frames. The change doesn't
+ * take effect until the next write.
+ *
+ * @param writer    The writer to configure.
+ * @param threshold The new threshold, between 1 and the buffer capacity.
+ *
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_BAD_PARAM` if the threshold
+ *         is out of range.
+ */
+bt_err_t bt_bufwriter_set_threshold(bt_bufwriter_t *writer, size_t threshold) {
+	// check parameters
+	if (writer == NULL || threshold == 0 || threshold > writer->capacity)
+		return BT_ERR_BAD_PARAM;
+
+	writer->threshold = threshold;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Get the number of bytes waiting to be sent.
+ *
+ * @param writer The writer to check.
+ *
+ * @return The number of bytes currently in the buffer.
+ */
+size_t bt_bufwriter_pending(bt_bufwriter_t const *writer) {
+	if (writer == NULL)
+		return 0;
+
+	return writer->count;
+}
+
+/**
+ * Send the buffered data, optionally followed by more data from the caller,
+ * using a single gather write. The buffer is empty afterwards whether or not
+ * the send succeeded, since there's no way to tell how much of it got out.
+ *
+ * @param writer The writer to send from.
+ * @param extra  Data to send after the buffered data, or NULL for none.
+ * @param size   The number of bytes of extra data.
+ *
+ * @return The result of {@link bt_writev}.
+ */
+static bt_err_t bt_bufwriter_send(bt_bufwriter_t *writer, void const *extra, size_t size) {
+	bt_iovec_t iov[2];
+	int count;
+	bt_err_t e;
+
+	count = 0;
+	if (writer->count > 0) {
+		iov[count].iov_base = writer->buffer;
+		iov[count].iov_len = writer->count;
+		count++;
+	}
+	if (size > 0) {
+		iov[count].iov_base = (void *) extra;
+		iov[count].iov_len = size;
+		count++;
+	}
+
+	e = bt_writev(writer->socket, iov, count);
+	if (e == BT_SUCCESS) {
+		writer->stats.bytes_sent += writer->count + size;
+	}
+	else {
+		LOG("bt_bufwriter_send: dropping %lu bytes after error %d\n", (unsigned long) (writer->count + size), e);
+	}
+	writer->count = 0;
+
+	return e;
+}
+
+/**
+ * Check whether the oldest buffered data has used up its latency budget.
+ *
+ * @param writer The writer to check.
+ *
+ * @return true if the buffer should be sent now.
+ */
+static bool bt_bufwriter_expired(bt_bufwriter_t const *writer) {
+	return (writer->count > 0) && (writer->latency_us >= 0)
+		&& (bt_time_now_us() - writer->oldest_us >= writer->latency_us);
+}
+
+/**
+ * Write data through a buffered writer. The data is added to the buffer and
+ * only sent once the threshold is reached or the latency budget has run out.
+ * Data that won't fit in the remaining space is sent along with the buffered
+ * data in a single call, without being copied into the buffer first.
+ *
+ * @param writer The writer to write to.
+ * @param buffer Pointer to the data to write.
+ * @param size   The number of bytes to write.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_bufwriter_write(bt_bufwriter_t *writer, void const *buffer, size_t size) {
+	// check parameters
+	if (writer == NULL || (buffer == NULL && size > 0)) {
+		LOG("bt_bufwriter_write: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	writer->stats.writes++;
+
+	if (writer->count + size > writer->capacity) {
+		writer->stats.flushes_threshold++;
+		return bt_bufwriter_send(writer, buffer, size);
+	}
+
+	if (writer->count == 0)
+		writer->oldest_us = bt_time_now_us();
+	memcpy(writer->buffer + writer->count, buffer, size);
+	writer->count += size;
+
+	if (writer->count >= writer->threshold) {
+		writer->stats.flushes_threshold++;
+		return bt_bufwriter_send(writer, NULL, 0);
+	}
+
+	return bt_bufwriter_poll(writer);
+}
+
+/**
+ * Send any buffered data immediately.
+ *
+ * @param writer The writer to flush.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - The writer was NULL
+ */
+bt_err_t bt_bufwriter_flush(bt_bufwriter_t *writer) {
+	// check parameters
+	if (writer == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	if (writer->count == 0)
+		return BT_SUCCESS;
+
+	writer->stats.flushes_explicit++;
+	return bt_bufwriter_send(writer, NULL, 0);
+}
+
+/**
+ * Send the buffered data if its latency budget has run out, otherwise do
+ * nothing. Call this from an event loop when no more writes are due.
+ *
+ * @param writer The writer to check.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - The writer was NULL
+ */
+bt_err_t bt_bufwriter_poll(bt_bufwriter_t *writer) {
+	// check parameters
+	if (writer == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	if (!bt_bufwriter_expired(writer))
+		return BT_SUCCESS;
+
+	writer->stats.flushes_latency++;
+	return bt_bufwriter_send(writer, NULL, 0);
+}
+
+/**
+ * Get how long the buffered data can wait before its latency budget runs
+ * out. This is the longest a caller can sleep before calling
+ * {@link bt_bufwriter_poll}.
+ *
+ * @param writer The writer to check.
+ *
+ * @return The time remaining in microseconds, `0` if the budget has already
+ *         run out, or `-1` if the buffer is empty or there's no budget.
+ */
+int64_t bt_bufwriter_time_remaining_us(bt_bufwriter_t const *writer) {
+	int64_t remaining;
+
+	if (writer == NULL || writer->count == 0 || writer->latency_us < 0)
+		return -1;
+
+	remaining = writer->oldest_us + writer->latency_us - bt_time_now_us();
+
+	return (remaining > 0) ? remaining : 0;
+}
+
+/**
+ * Get a copy of the counters kept by a buffered writer.
+ *
+ * @param writer The writer to query.
+ * @param stats  Structure to return the counters in.
+ */
+void bt_bufwriter_get_stats(bt_bufwriter_t const *writer, bt_bufwriter_stats_t *stats) {
+	if (writer == NULL || stats == NULL)
+		return;
+
+	*stats = writer->stats;
+}
+
+/**
+ * Initialise a buffer pool. The pool starts empty and buffers are allocated
+ * as they're needed; once returned they're kept for reuse. Free the pool
+ * using {@link bt_bufpool_free}.
+ *
+ * @param pool        The pool to initialise.
+ * @param buffer_size The size of each buffer in bytes.
+ * @param capacity    The most unused buffers the pool will keep. Buffers
+ *                    returned beyond this are freed.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The pool was NULL or a size was zero
+ *    `BT_ERR_UNKNOWN`         - memory couldn't be allocated
+ */
+bt_err_t bt_bufpool_init(bt_bufpool_t *pool, size_t buffer_size, size_t capacity) {
+	// check parameters
+	if (pool == NULL || buffer_size == 0 || capacity == 0)
+		return BT_ERR_BAD_PARAM;
+
+	memset(pool, 0, sizeof(bt_bufpool_t));
+	pool->free = calloc(capacity, sizeof(void *));
+	if (pool->free == NULL) {
+		LOG("bt_bufpool_init: could not allocate pool of %lu buffers\n", (unsigned long) capacity);
+		return BT_ERR_UNKNOWN;
+	}
+	pool->buffer_size = buffer_size;
+	pool->capacity = capacity;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Free a buffer pool and the buffers it holds. Buffers that are still in use
+ * aren't affected and should be freed with `free` rather than returned.
+ *
+ * @param pool The pool to free.
+ */
+void bt_bufpool_free(bt_bufpool_t *pool) {
+	if (pool == NULL)
+		return;
+
+	while (pool->count > 0) {
+		free(pool->free[--pool->count]);
+	}
+	free(pool->free);
+	pool->free = NULL;
+	pool->capacity = 0;
+}
+
+/**
+ * Take a buffer from a pool, allocating a new one if none is available.
+ *
+ * @param pool The pool to take from.
+ *
+ * @return A buffer of the pool's buffer size, or NULL if one couldn't be
+ *         allocated. Return it with {@link bt_bufpool_put}.
+ */
+void *bt_bufpool_get(bt_bufpool_t *pool) {
+	if (pool == NULL)
+		return NULL;
+
+	if (pool->count > 0)
+		return pool->free[--pool->count];
+
+	return malloc(pool->buffer_size);
+}
+
+/**
+ * Return a buffer to a pool for reuse.
+ *
+ * @param pool   The pool the buffer came from.
+ * @param buffer The buffer to return. NULL is ignored.
+ */
+void bt_bufpool_put(bt_bufpool_t *pool, void *buffer) {
+	if (pool == NULL || buffer == NULL)
+		return;
+
+	if (pool->count < pool->capacity) {
+		pool->free[pool->count++] = buffer;
+	}
+	else {
+		free(buffer);
+	}
+}
+
+/**
+ * Initialise a send queue. The socket is switched to non-blocking mode, so
+ * that neither writing nor draining ever waits. Free the queue's resources
+ * using {@link bt_sendq_free}.
+ *
+ * The watermarks start at three quarters and a quarter of the capacity, with
+ * no callbacks set.
+ *
+ * @param queue    The queue to initialise.
+ * @param socket   The connected socket to write to. The socket must remain
+ *                 valid for as long as the queue is used.
+ * @param capacity The most bytes the queue will hold, or `0` to use
+ *                 `BT_SENDQ_DEFAULT_CAPACITY`.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ *    `BT_ERR_UNKNOWN`         - the buffer couldn't be allocated, or the
+ *                               socket couldn't be made non-blocking
+ */
+bt_err_t bt_sendq_init(bt_sendq_t *queue, bt_socket_t *socket, size_t capacity) {
+	bt_err_t e;
+
+	// check parameters
+	if (queue == NULL || socket == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	if (capacity == 0)
+		capacity = BT_SENDQ_DEFAULT_CAPACITY;
+
+	memset(queue, 0, sizeof(bt_sendq_t));
+	e = bt_set_nonblocking(socket, true);
+	if (e != BT_SUCCESS)
+		return e;
+
+	queue->buffer = malloc(capacity);
+	if (queue->buffer == NULL) {
+		LOG("bt_sendq_init: could not allocate %lu byte buffer\n", (unsigned long) capacity);
+		return BT_ERR_UNKNOWN;
+	}
+	queue->socket = socket;
+	queue->capacity = capacity;
+	queue->high_watermark = capacity - capacity / 4;
+	queue->low_watermark = capacity / 4;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Free the resources associated with a send queue. Any data still queued is
+ * discarded. The underlying socket is not closed, and stays non-blocking.
+ *
+ * @param queue The queue to free.
+ */
+void bt_sendq_free(bt_sendq_t *queue) {
+	if (queue == NULL)
+		return;
+
+	if (queue->count > 0)
+		LOG("bt_sendq_free: discarding %lu unsent bytes\n", (unsigned long) queue->count);
+
+	if (queue->buffer != NULL) {
+		free(queue->buffer);
+		queue->buffer = NULL;
+	}
+	queue->capacity = 0;
+	queue->count = 0;
+}
+
+/**
+ * Set the queue lengths at which the callbacks are invoked. The high callback
+ * is invoked once when the queue rises to the high watermark, and the low
+ * callback once when it then drains to the low watermark, so the gap between
+ * them stops the producer flapping between the two.
+ *
+ * @param queue The queue to configure.
+ * @param low   The low watermark in bytes.
+ * @param high  The high watermark in bytes, above the low watermark and no
+ *              more than the capacity.
+ *
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_BAD_PARAM` if the
+ *         watermarks are out of range.
+ */
+bt_err_t bt_sendq_set_watermarks(bt_sendq_t *queue, size_t low, size_t high) {
+	// check parameters
+	if (queue == NULL || low >= high || high > queue->capacity)
+		return BT_ERR_BAD_PARAM;
+
+	queue->low_watermark = low;
+	queue->high_watermark = high;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Set the functions to call when the queue crosses its watermarks. The
+ * callbacks may write to the queue.
+ *
+ * @param queue   The queue to configure.
+ * @param on_high Called when the queue rises to the high watermark, or NULL.
+ * @param on_low  Called when the queue drains to the low watermark, or NULL.
+ * @param data    User data passed to both callbacks.
+ */
+void bt_sendq_set_callbacks(bt_sendq_t *queue, bt_sendq_callback_t on_high, bt_sendq_callback_t on_low, void *data) {
+	if (queue == NULL)
+		return;
+
+	queue->on_high = on_high;
+	queue->on_low = on_low;
+	queue->data = data;
+}
+
+/**
+ * Invoke a callback if the queue has crossed one of its watermarks.
+ *
+ * @param queue The queue to check.
+ */
+static void bt_sendq_check_watermarks(bt_sendq_t *queue) {
+	if (!queue->congested && queue->count >= queue->high_watermark) {
+		queue->congested = true;
+		queue->stats.high_events++;
+		if (queue->on_high != NULL)
+			queue->on_high(queue, queue->count, queue->data);
+	}
+	else if (queue->congested && queue->count <= queue->low_watermark) {
+		queue->congested = false;
+		queue->stats.low_events++;
+		if (queue->on_low != NULL)
+			queue->on_low(queue, queue->count, queue->data);
+	}
+}
+
+/**
+ * Send as much queued data as the socket will take, using a single gather
+ * write for each pass over the ring buffer.
+ *
+ * @param queue The queue to send from.
+ *
+ * @return `BT_SUCCESS` if the queue was emptied or the socket is full, or
+ *         the error returned by {@link bt_sendv}.
+ */
+static bt_err_t bt_sendq_send(bt_sendq_t *queue) {
+	bt_iovec_t iov[2];
+	size_t first;
+	size_t sent;
+	int count;
+	bt_err_t e;
+
+	while (queue->count > 0) {
+		first = queue->capacity - queue->start;
+		if (first > queue->count)
+			first = queue->count;
+		iov[0].iov_base = queue->buffer + queue->start;
+		iov[0].iov_len = first;
+		count = 1;
+		if (first < queue->count) {
+			iov[1].iov_base = queue->buffer;
+			iov[1].iov_len = queue->count - first;
+			count = 2;
+		}
+
+		queue->stats.send_calls++;
+		e = bt_sendv(queue->socket, iov, count, &sent);
+		if (e == BT_ERR_WOULD_BLOCK) {
+			queue->stats.would_block++;
+			return BT_SUCCESS;
+		}
+		if (e != BT_SUCCESS)
+			return e;
+
+		queue->stats.bytes_sent += sent;
+		queue->start = (queue->start + sent) % queue->capacity;
+		queue->count -= sent;
+	}
+	queue->start = 0;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Write a message through a send queue without waiting. If nothing is queued
+ * already the message is sent straight away, and any part the socket won't
+ * take is queued. Otherwise the message goes to the back of the queue, which
+ * is then drained as far as the socket allows.
+ *
+ * A message is either accepted whole or not at all, so a message that won't
+ * fit is turned away without any of it being sent.
+ *
+ * @param queue  The queue to write to.
+ * @param buffer Pointer to the data to write.
+ * @param size   The number of bytes to write.
+ *
+ * @return `BT_SUCCESS` if the message was sent or queued,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_BUFFER_FULL`     - there isn't room in the queue for the message
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_sendq_write(bt_sendq_t *queue, void const *buffer, size_t size) {
+	bt_iovec_t iov;
+	size_t end;
+	size_t first;
+	size_t sent;
+	bool queued;
+	bt_err_t e;
+
+	// check parameters
+	if (queue == NULL || queue->buffer == NULL || (buffer == NULL && size > 0)) {
+		LOG("bt_sendq_write: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	if (size > queue->capacity - queue->count) {
+		queue->stats.rejected++;
+		return BT_ERR_BUFFER_FULL;
+	}
+	queue->stats.writes++;
+
+	e = BT_SUCCESS;
+	queued = false;
+	if (queue->count == 0 && size > 0) {
+		// nothing to wait behind, so try sending without copying
+		iov.iov_base = (void *) buffer;
+		iov.iov_len = size;
+		queue->stats.send_calls++;
+		e = bt_sendv(queue->socket, &iov, 1, &sent);
+		if (e == BT_ERR_WOULD_BLOCK) {
+			queue->stats.would_block++;
+			e = BT_SUCCESS;
+		}
+		if (e != BT_SUCCESS)
+			return e;
+		queue->stats.bytes_sent += sent;
+		buffer = (uint8_t const *) buffer + sent;
+		size -= sent;
+	}
+	else {
+		queued = true;
+	}
+
+	// queue whatever the socket didn't take, in two parts if the ring wraps
+	if (size > 0) {
+		end = (queue->start + queue->count) % queue->capacity;
+		first = queue->capacity - end;
+		if (first > size)
+			first = size;
+		memcpy(queue->buffer + end, buffer, first);
+		memcpy(queue->buffer, (uint8_t const *) buffer + first, size - first);
+		queue->count += size;
+	}
+
+	// then send it along with what was already waiting
+	if (queued)
+		e = bt_sendq_send(queue);
+	bt_sendq_check_watermarks(queue);
+
+	return e;
+}
+
+/**
+ * Send as much queued data as the socket will take without waiting. Call
+ * this when the socket becomes writable, for example from a reactor callback
+ * registered for `BT_REACTOR_WRITABLE` while {@link bt_sendq_pending} is
+ * non-zero.
+ *
+ * @param queue The queue to drain.
+ *
+ * @return `BT_SUCCESS` if successful, even if data remains queued,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - The queue was NULL
+ */
+bt_err_t bt_sendq_drain(bt_sendq_t *queue) {
+	bt_err_t e;
+
+	// check parameters
+	if (queue == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	e = bt_sendq_send(queue);
+	bt_sendq_check_watermarks(queue);
+
+	return e;
+}
+
+/**
+ * Get the number of bytes waiting to be sent.
+ *
+ * @param queue The queue to check.
+ *
+ * @return The number of bytes currently queued.
+ */
+size_t bt_sendq_pending(bt_sendq_t const *queue) {
+	if (queue == NULL)
+		return 0;
+
+	return queue->count;
+}
+
+/**
+ * Check whether the queue has reached its high watermark and not yet drained
+ * to its low watermark. Producers that don't use the callbacks can check this
+ * before writing.
+ *
+ * @param queue The queue to check.
+ *
+ * @return true if the producer should hold off.
+ */
+bool bt_sendq_congested(bt_sendq_t const *queue) {
+	if (queue == NULL)
+		return false;
+
+	return queue->congested;
+}
+
+/**
+ * Get a copy of the counters kept by a send queue.
+ *
+ * @param queue The queue to query.
+ * @param stats Structure to return the counters in.
+ */
+void bt_sendq_get_stats(bt_sendq_t const *queue, bt_sendq_stats_t *stats) {
+	if (queue == NULL || stats == NULL)
+		return;
+
+	*stats = queue->stats;
+}
@@ -0,0 +1,500 @@
+/**
+ * @file btframe.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Length-prefixed message framing
+ *
+ * RFCOMM gives a stream of bytes, so messages have to be delimited somehow.
+ * These functions send each message as a frame: its length, encoded either
+ * as a fixed four-byte big-endian integer or as a varint, followed by the
+ * message itself.
+ *
+ * {@link bt_frame_send} and {@link bt_frame_recv} are for blocking sockets.
+ * For non-blocking sockets, such as those driven by the reactor, the frame
+ * decoder receives whatever is available and hands back each complete frame
+ * as a pointer into its own buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "picobt/bt.h"
+#include "picobt/btframe.h"
+
+#include "picobt/log.h"
+
+/// The format used when none is given.
+static const bt_frame_format_t bt_frame_default_format = {
+	BT_FRAME_LENGTH_FIXED32,
+	BT_FRAME_DEFAULT_MAX_SIZE
+};
+
+/**
+ * Return the format to use, substituting the default for NULL.
+ *
+ * @param format The format passed by the caller.
+ *
+ * @return The format to use.
+ */
+static bt_frame_format_t const *bt_frame_format(bt_frame_format_t const *format) {
+	return (format != NULL) ? format : &bt_frame_default_format;
+}
+
+/**
+ * Encode the length prefix for a frame.
+ *
+ * @param format The frame format.
+ * @param size   The size of the frame body.
+ * @param header Buffer of at least `BT_FRAME_MAX_HEADER` bytes to write the
+ *               prefix into.
+ *
+ * @return The number of bytes written to the header.
+ */
+static size_t bt_frame_encode_header(bt_frame_format_t const *format, uint32_t size, uint8_t *header) {
+	size_t length = 0;
+
+	if (format->length == BT_FRAME_LENGTH_VARINT) {
+		do {
+			header[length] = size & 0x7f;
+			size >>= 7;
+			if (size > 0)
+				header[length] |= 0x80;
+			length++;
+		} while (size > 0);
+	}
+	else {
+		header[0] = (size >> 24) & 0xff;
+		header[1] = (size >> 16) & 0xff;
+		header[2] = (size >> 8) & 0xff;
+		header[3] = size & 0xff;
+		length = 4;
+	}
+
+	return length;
+}
+
+/**
+ * Decode the length prefix at the start of some data.
+ *
+ * @param format     The frame format.
+ * @param data       The data received so far.
+ * @param available  The number of bytes of data.
+ * @param headerSize Returns the number of bytes taken by the prefix.
+ * @param frameSize  Returns the size of the frame body.
+ *
+ * @return `BT_SUCCESS` if the prefix was decoded, or one of the following:
+ *    `BT_ERR_WOULD_BLOCK`     - more data is needed to complete the prefix
+ *    `BT_ERR_BAD_FRAME`       - the prefix is malformed or the frame is larger
+ *                               than the format allows
+ */
+static bt_err_t bt_frame_decode_header(bt_frame_format_t const *format, const uint8_t *data, size_t available, size_t *headerSize, size_t *frameSize) {
+	uint32_t size = 0;
+	size_t pos;
+
+	if (format->length == BT_FRAME_LENGTH_VARINT) {
+		for (pos = 0; ; pos++) {
+			if (pos == available)
+				return BT_ERR_WOULD_BLOCK;
+			if (pos == BT_FRAME_MAX_HEADER - 1 && (data[pos] & 0xf0) != 0) {
+				// would overflow 32 bits or run past the longest prefix
+				LOG("bt_frame: varint length too long\n");
+				return BT_ERR_BAD_FRAME;
+			}
+			size |= (uint32_t) (data[pos] & 0x7f) << (7 * pos);
+			if ((data[pos] & 0x80) == 0)
+				break;
+		}
+		*headerSize = pos + 1;
+	}
+	else {
+		if (available < 4)
+			return BT_ERR_WOULD_BLOCK;
+		size = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16)
+			| ((uint32_t) data[2] << 8) | (uint32_t) data[3];
+		*headerSize = 4;
+	}
+
+	if (size > format->max_size) {
+		LOG("bt_frame: frame of %u bytes exceeds maximum of %lu\n", size, (unsigned long) format->max_size);
+		return BT_ERR_BAD_FRAME;
+	}
+
+	*frameSize = size;
+	return BT_SUCCESS;
+}
+
+/**
+ * Return the size of buffer needed to hold any frame of the given format,
+ * including its length prefix. Use this to size the buffers given to a
+ * decoder or a pool.
+ *
+ * @param format The frame format, or NULL for the default.
+ *
+ * @return The buffer size in bytes.
+ */
+size_t bt_frame_buffer_size(bt_frame_format_t const *format) {
+	return bt_frame_format(format)->max_size + BT_FRAME_MAX_HEADER;
+}
+
+/**
+ * Send a frame on a Bluetooth socket. The length prefix and the payload are
+ * sent together without copying the payload. This function blocks until the
+ * whole frame is sent, as {@link bt_writev}.
+ *
+ * @param socket  The socket to send on.
+ * @param format  The frame format, or NULL for the default.
+ * @param payload The frame body.
+ * @param size    The size of the frame body in bytes.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - A parameter was NULL
+ *    `BT_ERR_BAD_FRAME`       - The frame is larger than the format allows
+ *    `BT_SOCKET_CLOSED`       - the socket has been closed
+ *    `BT_ERR_UNKNOWN`         - some unspecified error occured
+ */
+bt_err_t bt_frame_send(bt_socket_t *socket, bt_frame_format_t const *format, const void *payload, size_t size) {
+	uint8_t header[BT_FRAME_MAX_HEADER];
+	bt_iovec_t iov[2];
+
+	// check parameters
+	if (socket == NULL || (payload == NULL && size > 0)) {
+		LOG("bt_frame_send: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	format = bt_frame_format(format);
+	if (size > format->max_size || size > UINT32_MAX) {
+		LOG("bt_frame_send: frame of %lu bytes exceeds maximum of %lu\n", (unsigned long) size, (unsigned long) format->max_size);
+		return BT_ERR_BAD_FRAME;
+	}
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = bt_frame_encode_header(format, (uint32_t) size, header);
+	iov[1].iov_base = (void *) payload;
+	iov[1].iov_len = size;
+
+	return bt_writev(socket, iov, (size > 0) ? 2 : 1);
+}
+
+/**
+ * Receive a frame from a Bluetooth socket into a buffer supplied by the
+ * caller. This function blocks until the whole frame has been received, as
+ * {@link bt_read}.
+ *
+ * If the frame doesn't fit in the buffer, or is malformed, the body is left
+ * unread and the stream can't be resynchronised, so the connection should be
+ * closed.
+ *
+ * @param socket     The socket to receive from.
+ * @param format     The frame format, or NULL for the default.
+ * @param buffer     The buffer to receive the frame body into.
+ * @param bufferSize The size of the buffer.
+ * @param frameSize  Returns the size of the frame body.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - A parameter was NULL
+ *    `BT_ERR_BAD_FRAME`       - The length prefix was malformed or too large
+ *    `BT_ERR_BUFFER_FULL`     - The frame didn't fit in the buffer
+ *    `BT_SOCKET_CLOSED`       - the socket has been closed
+ *    `BT_ERR_UNKNOWN`         - some unspecified error occured
+ */
+bt_err_t bt_frame_recv(bt_socket_t *socket, bt_frame_format_t const *format, void *buffer, size_t bufferSize, size_t *frameSize) {
+	uint8_t header[BT_FRAME_MAX_HEADER];
+	size_t headerSize;
+	size_t available;
+	size_t size;
+	size_t n;
+	bt_err_t e;
+
+	// check parameters
+	if (socket == NULL || buffer == NULL || frameSize == NULL) {
+		LOG("bt_frame_recv: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	format = bt_frame_format(format);
+
+	// a varint is read a byte at a time so as not to read into the body
+	available = 0;
+	n = (format->length == BT_FRAME_LENGTH_VARINT) ? 1 : 4;
+	do {
+		e = bt_read(socket, header + available, &n);
+		if (e != BT_SUCCESS)
+			return e;
+		available += n;
+		e = bt_frame_decode_header(format, header, available, &headerSize, &size);
+	} while (e == BT_ERR_WOULD_BLOCK);
+
+	if (e != BT_SUCCESS)
+		return e;
+
+	if (size > bufferSize) {
+		LOG("bt_frame_recv: frame of %lu bytes too large for buffer of %lu\n", (unsigned long) size, (unsigned long) bufferSize);
+		return BT_ERR_BUFFER_FULL;
+	}
+
+	n = size;
+	e = bt_read(socket, buffer, &n);
+	if (e == BT_SUCCESS)
+		*frameSize = size;
+
+	return e;
+}
+
+/**
+ * Receive a frame from a Bluetooth socket into a buffer taken from a pool.
+ * This avoids allocating memory for each message. The pool's buffers should
+ * be at least {@link bt_frame_buffer_size} bytes. This function blocks until
+ * the whole frame has been received.
+ *
+ * @param socket    The socket to receive from.
+ * @param format    The frame format, or NULL for the default.
+ * @param pool      The pool to take the buffer from.
+ * @param frame     Returns the buffer holding the frame body. Return it to
+ *                  the pool with {@link bt_bufpool_put} once finished with.
+ * @param frameSize Returns the size of the frame body.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the errors returned by
+ *         {@link bt_frame_recv}. On error no buffer is returned.
+ */
+bt_err_t bt_frame_recv_pooled(bt_socket_t *socket, bt_frame_format_t const *format, bt_bufpool_t *pool, void **frame, size_t *frameSize) {
+	void *buffer;
+	bt_err_t e;
+
+	// check parameters
+	if (pool == NULL || frame == NULL) {
+		LOG("bt_frame_recv_pooled: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	buffer = bt_bufpool_get(pool);
+	if (buffer == NULL) {
+		LOG("bt_frame_recv_pooled: could not get buffer\n");
+		return BT_ERR_UNKNOWN;
+	}
+
+	e = bt_frame_recv(socket, format, buffer, pool->buffer_size, frameSize);
+	if (e != BT_SUCCESS) {
+		bt_bufpool_put(pool, buffer);
+		buffer = NULL;
+	}
+	*frame = buffer;
+
+	return e;
+}
+
+/**
+ * Initialise a frame decoder using a buffer supplied by the caller. The
+ * buffer must remain valid until the decoder is freed.
+ *
+ * @param decoder  The decoder to initialise.
+ * @param format   The frame format, or NULL for the default.
+ * @param buffer   The buffer to receive into.
+ * @param capacity The size of the buffer, which must be at least
+ *                 {@link bt_frame_buffer_size} bytes.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - A parameter was NULL or the buffer too small
+ */
+bt_err_t bt_frame_decoder_init(bt_frame_decoder_t *decoder, bt_frame_format_t const *format, void *buffer, size_t capacity) {
+	// check parameters
+	if (decoder == NULL || buffer == NULL || capacity < bt_frame_buffer_size(format)) {
+		LOG("bt_frame_decoder_init: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	memset(decoder, 0, sizeof(bt_frame_decoder_t));
+	decoder->format = *bt_frame_format(format);
+	decoder->buffer = buffer;
+	decoder->capacity = capacity;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Initialise a frame decoder using a buffer taken from a pool. The buffer is
+ * returned to the pool by {@link bt_frame_decoder_free}.
+ *
+ * @param decoder The decoder to initialise.
+ * @param format  The frame format, or NULL for the default.
+ * @param pool    The pool to take the buffer from. Its buffers must be at
+ *                least {@link bt_frame_buffer_size} bytes.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - A parameter was NULL or the buffers too small
+ *    `BT_ERR_UNKNOWN`         - memory couldn't be allocated
+ */
+bt_err_t bt_frame_decoder_init_pooled(bt_frame_decoder_t *decoder, bt_frame_format_t const *format, bt_bufpool_t *pool) {
+	void *buffer;
+	bt_err_t e;
+
+	// check parameters
+	if (pool == NULL) {
+		LOG("bt_frame_decoder_init_pooled: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	buffer = bt_bufpool_get(pool);
+	if (buffer == NULL) {
+		LOG("bt_frame_decoder_init_pooled: could not get buffer\n");
+		return BT_ERR_UNKNOWN;
+	}
+
+	e = bt_frame_decoder_init(decoder, format, buffer, pool->buffer_size);
+	if (e != BT_SUCCESS) {
+		bt_bufpool_put(pool, buffer);
+		return e;
+	}
+	decoder->pool = pool;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Free a frame decoder, returning its buffer to the pool if it came from
+ * one. Any data not yet returned as a frame is discarded.
+ *
+ * @param decoder The decoder to free.
+ */
+void bt_frame_decoder_free(bt_frame_decoder_t *decoder) {
+	if (decoder == NULL)
+		return;
+
+	if (decoder->pool != NULL) {
+		bt_bufpool_put(decoder->pool, decoder->buffer);
+		decoder->pool = NULL;
+	}
+	decoder->buffer = NULL;
+	decoder->start = 0;
+	decoder->end = 0;
+}
+
+/**
+ * Return the next complete frame already received by a decoder, without
+ * touching the socket. The frame is returned in place, as a pointer into the
+ * decoder's buffer, and stays valid until the decoder next receives data.
+ *
+ * @param decoder   The decoder to take the frame from.
+ * @param frame     Returns a pointer to the frame body.
+ * @param frameSize Returns the size of the frame body.
+ *
+ * @return `BT_SUCCESS` if a frame was returned, or one of the following:
+ *    `BT_ERR_BAD_PARAM`       - A parameter was NULL
+ *    `BT_ERR_WOULD_BLOCK`     - no complete frame has been received yet
+ *    `BT_ERR_BAD_FRAME`       - the length prefix was malformed or too large;
+ *                               the connection should be closed
+ */
+bt_err_t bt_frame_decoder_next(bt_frame_decoder_t *decoder, const void **frame, size_t *frameSize) {
+	size_t headerSize;
+	size_t size;
+	bt_err_t e;
+
+	// check parameters
+	if (decoder == NULL || decoder->buffer == NULL || frame == NULL || frameSize == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	e = bt_frame_decode_header(&decoder->format, decoder->buffer + decoder->start, decoder->end - decoder->start, &headerSize, &size);
+	if (e != BT_SUCCESS)
+		return e;
+
+	if (decoder->end - decoder->start < headerSize + size)
+		return BT_ERR_WOULD_BLOCK;
+
+	*frame = decoder->buffer + decoder->start + headerSize;
+	*frameSize = size;
+	decoder->start += headerSize + size;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Receive whatever data is available on a socket into a decoder. Any partial
+ * frame left over from earlier is first moved to the start of the buffer,
+ * which invalidates frames previously returned by the decoder.
+ *
+ * @param decoder The decoder to receive into.
+ * @param socket  The socket to receive from.
+ *
+ * @return `BT_SUCCESS` if some data was received, or one of the errors
+ *         returned by {@link bt_recv}, including `BT_ERR_WOULD_BLOCK` if the
+ *         socket is non-blocking and no data is available.
+ */
+bt_err_t bt_frame_decoder_fill(bt_frame_decoder_t *decoder, bt_socket_t *socket) {
+	size_t n;
+	bt_err_t e;
+
+	// check parameters
+	if (decoder == NULL || decoder->buffer == NULL || socket == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	if (decoder->start > 0) {
+		memmove(decoder->buffer, decoder->buffer + decoder->start, decoder->end - decoder->start);
+		decoder->end -= decoder->start;
+		decoder->start = 0;
+	}
+
+	// can't happen while the buffer is big enough for the largest frame
+	if (decoder->end == decoder->capacity)
+		return BT_ERR_BUFFER_FULL;
+
+	n = decoder->capacity - decoder->end;
+	e = bt_recv(socket, decoder->buffer + decoder->end, &n);
+	if (e == BT_SUCCESS)
+		decoder->end += n;
+
+	return e;
+}
+
+/**
+ * Return the next frame from a socket, receiving more data if needed. With a
+ * non-blocking socket this is the function to call from a reactor handler:
+ * call it until it returns `BT_ERR_WOULD_BLOCK`, handling each frame as it's
+ * returned. Frames are returned in place and stay valid until the next call.
+ *
+ * @param decoder   The decoder to use.
+ * @param socket    The socket to receive from.
+ * @param frame     Returns a pointer to the frame body.
+ * @param frameSize Returns the size of the frame body.
+ *
+ * @return `BT_SUCCESS` if a frame was returned, `BT_ERR_WOULD_BLOCK` if the
+ *         socket is non-blocking and no complete frame is available, or one of
+ *         the errors returned by {@link bt_frame_decoder_next} and
+ *         {@link bt_recv}.
+ */
+bt_err_t bt_frame_decoder_read(bt_frame_decoder_t *decoder, bt_socket_t *socket, const void **frame, size_t *frameSize) {
+	bt_err_t e;
+
+	e = bt_frame_decoder_next(decoder, frame, frameSize);
+	while (e == BT_ERR_WOULD_BLOCK) {
+		e = bt_frame_decoder_fill(decoder, socket);
+		if (e != BT_SUCCESS)
+			return e;
+		e = bt_frame_decoder_next(decoder, frame, frameSize);
+	}
+
+	return e;
+}
@@ -0,0 +1,200 @@
+/**
+ * @file btlistener.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Several services served from one event loop
+ *
+ * {@link bt_wait_for_connection} ties up a thread for each service it waits
+ * on, and {@link bt_bind} finds a channel by trying to bind to each in turn.
+ * A listener instead takes a table of services, gives each a listening
+ * socket on a channel picked by the operating system, registers them all
+ * with the local SDP server, and adds the sockets to a reactor. Connections
+ * are then accepted by whichever thread runs the reactor and passed to the
+ * handler for their service. The same reactor can serve the accepted
+ * connections too.
+ *
+ * Listeners rely on the reactor, so are currently only available on Linux.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "picobt/bt.h"
+#include "picobt/btlistener.h"
+#include "picobt/log.h"
+
+/**
+ * A service being listened for.
+ */
+typedef struct {
+	/// The listener the service belongs to.
+	bt_listener_t *listener;
+	/// Called for each connection to the service.
+	bt_listener_handler_t handler;
+	/// User data passed to the handler.
+	void *data;
+	/// The listening socket.
+	bt_socket_t sock;
+	/// The service's SDP record.
+	bt_service_registration_t registration;
+	/// Whether the socket has been added to the reactor.
+	bool added;
+} bt_listener_entry_t;
+
+/**
+ * Pass a connection accepted by the reactor on to its service's handler.
+ *
+ * @param reactor The reactor that accepted the connection.
+ * @param sock    The listening socket.
+ * @param client  The new connection.
+ * @param data    The service's entry.
+ */
+static void bt_listener_accept(bt_reactor_t *reactor, bt_socket_t *sock, bt_socket_t *client, void *data) {
+	bt_listener_entry_t *entry = data;
+
+	entry->handler(entry->listener, client, entry->data);
+}
+
+/**
+ * Start listening for a set of services. Each service is given a listening
+ * socket on a free RFCOMM channel and registered with the local SDP server,
+ * and the sockets are added to the reactor. Nothing is accepted until the
+ * reactor is run.
+ *
+ * @param listener The listener to initialise.
+ * @param reactor  The reactor to serve the services from. It must outlive the
+ *                 listener.
+ * @param services The services to offer. The table is copied, so needn't be
+ *                 kept.
+ * @param count    The number of services.
+ * @param options  The options to create the listening sockets with, which
+ *                 the accepted connections inherit, or NULL for the default
+ *                 profile.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_BAD_PARAM`   - a parameter was NULL, or a service had no handler
+ *    `BT_ERR_UNKNOWN`     - a socket couldn't be created, a service couldn't
+ *                           be registered, or memory ran out
+ *    `BT_ERR_UNSUPPORTED` - the reactor isn't supported on this platform
+ */
+bt_err_t bt_listener_init(bt_listener_t *listener, bt_reactor_t *reactor, bt_listener_service_t const *services, size_t count, bt_socket_options_t const *options) {
+	bt_listener_entry_t *entries;
+	bt_socket_options_t defaults;
+	size_t i;
+	bt_err_t e;
+
+	if (listener == NULL || reactor == NULL || services == NULL || count == 0)
+		return BT_ERR_BAD_PARAM;
+	for (i = 0; i < count; i++) {
+		if (services[i].handler == NULL || services[i].name == NULL)
+			return BT_ERR_BAD_PARAM;
+	}
+
+	if (options == NULL) {
+		bt_socket_options_init(&defaults, BT_SOCKET_PROFILE_DEFAULT);
+		options = &defaults;
+	}
+
+	entries = calloc(count, sizeof(bt_listener_entry_t));
+	if (entries == NULL) {
+		LOG("bt_listener_init: could not allocate %lu services\n", (unsigned long) count);
+		return BT_ERR_UNKNOWN;
+	}
+	listener->reactor = reactor;
+	listener->count = count;
+	listener->state = entries;
+	for (i = 0; i < count; i++) {
+		entries[i].sock.s = -1;
+	}
+
+	e = BT_SUCCESS;
+	for (i = 0; (i < count) && (e == BT_SUCCESS); i++) {
+		entries[i].listener = listener;
+		entries[i].handler = services[i].handler;
+		entries[i].data = services[i].data;
+
+		e = bt_listen_on_free_channel(&entries[i].sock, options, BT_LISTEN_MAX_BACKLOG);
+		if (e == BT_SUCCESS) {
+			e = bt_register_service_ex(&services[i].uuid, services[i].name, &entries[i].sock, &entries[i].registration);
+		}
+		if (e == BT_SUCCESS) {
+			e = bt_reactor_add_listener(reactor, &entries[i].sock, bt_listener_accept, &entries[i]);
+			entries[i].added = (e == BT_SUCCESS);
+		}
+		if (e == BT_SUCCESS) {
+			LOG("bt_listener_init: %s listening on channel %d\n", services[i].name, bt_get_socket_channel(entries[i].sock));
+		}
+	}
+
+	if (e != BT_SUCCESS) {
+		LOG("bt_listener_init: could not start service %lu, error %d\n", (unsigned long) (i - 1), e);
+		bt_listener_free(listener);
+	}
+
+	return e;
+}
+
+/**
+ * Stop listening for a listener's services. The services are withdrawn from
+ * the SDP server, their sockets removed from the reactor and closed.
+ * Connections already accepted aren't affected.
+ *
+ * @param listener The listener to free.
+ */
+void bt_listener_free(bt_listener_t *listener) {
+	bt_listener_entry_t *entries;
+	size_t i;
+
+	if (listener == NULL || listener->state == NULL)
+		return;
+	entries = listener->state;
+
+	for (i = 0; i < listener->count; i++) {
+		if (entries[i].added)
+			bt_reactor_remove(listener->reactor, &entries[i].sock);
+		bt_unregister_service(&entries[i].registration);
+		bt_disconnect(&entries[i].sock);
+	}
+	free(entries);
+	listener->state = NULL;
+	listener->count = 0;
+}
+
+/**
+ * Get the RFCOMM channel a service is listening on.
+ *
+ * @param listener The listener to query.
+ * @param index    The position of the service in the table given to
+ *                 {@link bt_listener_init}.
+ *
+ * @return The channel, or `0` if there's no such service.
+ */
+uint8_t bt_listener_get_channel(bt_listener_t const *listener, size_t index) {
+	bt_listener_entry_t const *entries;
+
+	if (listener == NULL || listener->state == NULL || index >= listener->count)
+		return 0;
+	entries = listener->state;
+
+	return bt_get_socket_channel(entries[index].sock);
+}
@@ -24,6 +24,11 @@
  * @brief Core Bluetooth stuff.
  */
 
+#ifndef _GNU_SOURCE
+/// Needed on Linux for splice and accept4.
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -36,12 +41,18 @@
 #include <BluetoothAPIs.h>
 #include <Windows.h>
 #include <cguid.h>
+#include <io.h>
 // nothing further to include
 #else // LINUX
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <bluetooth/hci_lib.h>
 #include <bluetooth/sdp_lib.h>
+#include <bluetooth/l2cap.h>
 #endif
 
 #include "picobt/log.h"
@@ -54,7 +65,23 @@
 #define INVALID_SOCKET -1
 #endif
 
+/// Flag asking a single `recv` or `send` not to block, where supported.
+#ifdef WINDOWS
+#define SOCKET_FLAG_DONTWAIT 0
+#else
+#define SOCKET_FLAG_DONTWAIT MSG_DONTWAIT
+#endif
+
+/// True if the error number means a non-blocking socket operation would block.
+#ifdef WINDOWS
+#define SOCKET_WOULD_BLOCK(err) ((err) == WSAEWOULDBLOCK)
+#else
+#define SOCKET_WOULD_BLOCK(err) (((err) == EAGAIN) || ((err) == EWOULDBLOCK))
+#endif
+
 #ifdef WINDOWS
+/// The time limit used by the Windows connect functions that don't take one.
+#define BT_CONNECT_DEFAULT_TIMEOUT_WINDOWS 5000
 #else // LINUX
 int dynamic_bind_rc(int sock, struct sockaddr_rc * sockaddr, socklen_t addrlen, uint8_t * port);
 #endif
@@ -70,11 +97,13 @@ int dynamic_bind_rc(int sock, struct sockaddr_rc * sockaddr, socklen_t addrlen,
  * @param s Socket as in connect
  * @param name sockaddr structure as in connect
  * @param namelen size of name as in connect
+ * @param timeout_ms Time to wait for the connection in milliseconds, or
+ *        `BT_CONNECT_NO_TIMEOUT` to wait indefinitely
  * @return `BT_SUCCESS` if successful, or one of the following:
  *    `BT_ERR_DEVICE_NOT_FOUND` - Timeout searching for device.
  *    `BT_ERR_UNKNWON`          - unhelpfully generic failure
  */
-bt_err_t async_connect(SOCKET s, const struct sockaddr * name, int namelen) {
+bt_err_t async_connect(SOCKET s, const struct sockaddr * name, int namelen, int timeout_ms) {
 	bt_err_t ret = BT_SUCCESS;
 	int sockResult;
 	int wsaError;
@@ -102,10 +131,10 @@ bt_err_t async_connect(SOCKET s, const struct sockaddr * name, int namelen) {
 			FD_SET(s, &write);
 			FD_SET(s, &err);
 
-			timeout.tv_sec = 5;
-			timeout.tv_usec = 0;
+			timeout.tv_sec = timeout_ms / 1000;
+			timeout.tv_usec = (timeout_ms % 1000) * 1000;
 
-			sockResult = select(0, NULL, &write, &err, &timeout);
+			sockResult = select(0, NULL, &write, &err, (timeout_ms < 0) ? NULL : &timeout);
 			if (sockResult == 0) {
 				LOG("Connect timed out %d\n", s);
 				ret = BT_ERR_DEVICE_NOT_FOUND;
@@ -139,6 +168,67 @@ bt_err_t async_connect(SOCKET s, const struct sockaddr * name, int namelen) {
 }
 #endif
 
+/**
+ * Wait until a socket is ready or a deadline passes. Unlike `select`, this
+ * works for any socket descriptor, however large.
+ *
+ * @param sock The socket to wait on.
+ * @param events The `poll` events to wait for, `POLLIN` or `POLLOUT`.
+ * @param deadline The time by which the socket must be ready.
+ * @param cancel A token to wait on alongside the socket, or NULL.
+ *
+ * @return `BT_SUCCESS` if the socket is ready, or one of the following:
+ *    `BT_ERR_TIMEOUT`         - the deadline passed first
+ *    `BT_ERR_CANCELLED`       - the token was cancelled first
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+static bt_err_t bt_wait_socket(bt_socket_t const * sock, short events, bt_deadline_t deadline, bt_cancel_token_t const * cancel) {
+	struct pollfd pfd[2];
+	unsigned long count;
+	int result;
+
+	if (bt_cancel_requested(cancel)) {
+		return BT_ERR_CANCELLED;
+	}
+
+	// the token's eventfd becomes readable when it's cancelled
+	count = 1;
+	pfd[1].fd = -1;
+	if (cancel != NULL && cancel->fd >= 0) {
+		pfd[1].fd = cancel->fd;
+		count = 2;
+	}
+
+	do {
+		pfd[0].fd = sock->s;
+		pfd[0].events = events;
+		pfd[0].revents = 0;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+#ifdef WINDOWS
+		result = WSAPoll(pfd, count, bt_deadline_remaining_ms(deadline));
+	} while (0);
+#else
+		result = poll(pfd, (nfds_t) count, bt_deadline_remaining_ms(deadline));
+	} while (result < 0 && errno == EINTR);
+#endif
+
+	if (result == 0) {
+		return BT_ERR_TIMEOUT;
+	}
+	if (result < 0) {
+		LOG("bt_wait_socket: error %d waiting on socket %d\n", ERRNO, sock->s);
+		return BT_ERR_UNKNOWN;
+	}
+	if (count > 1 && pfd[1].revents != 0) {
+		LOG("bt_wait_socket: wait on socket %d cancelled\n", sock->s);
+		return BT_ERR_CANCELLED;
+	}
+
+	// errors and hang-ups count as ready, so the next call reports them
+	return BT_SUCCESS;
+}
+
 /**
  * Initialise use of Bluetooth. Call at start of program.
  * 
@@ -233,6 +323,85 @@ int bt_is_present() {
  *    `BT_ERR_UNKNWON`          - unhelpfully generic failure
  */
 bt_err_t bt_inquiry_begin(bt_inquiry_t *inquiry, int cached) {
+	return bt_inquiry_begin_cancellable(inquiry, cached, NULL);
+}
+
+#ifndef WINDOWS
+/**
+ * What an inquiry watcher needs to know, shared with the thread running the
+ * inquiry.
+ */
+typedef struct {
+	/// The HCI socket to send the cancel command on.
+	int hci;
+	/// The token to watch.
+	bt_cancel_token_t const *cancel;
+	/// Signalled by the inquiring thread when the inquiry is over.
+	bt_cancel_token_t done;
+} bt_inquiry_watcher_t;
+
+/**
+ * Thread that waits for an inquiry's cancel token, and when it's signalled
+ * tells the controller to stop the inquiry. The kernel then wakes up the
+ * thread blocked in `hci_inquiry`, which can't be interrupted any other way.
+ *
+ * @param arg The {@link bt_inquiry_watcher_t} for the inquiry.
+ *
+ * @return NULL.
+ */
+static void *bt_inquiry_watch(void *arg) {
+	bt_inquiry_watcher_t *watcher = (bt_inquiry_watcher_t *) arg;
+	struct pollfd pfd[2];
+	int result;
+
+	pfd[0].fd = watcher->cancel->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = watcher->done.fd;
+	pfd[1].events = POLLIN;
+	do {
+		pfd[0].revents = 0;
+		pfd[1].revents = 0;
+		result = poll(pfd, 2, -1);
+	} while (result < 0 && errno == EINTR);
+
+	if (result > 0 && pfd[0].revents != 0 && pfd[1].revents == 0) {
+		LOG("bt_inquiry_watch: cancelling inquiry\n");
+		if (hci_send_cmd(watcher->hci, OGF_LINK_CTL, OCF_INQUIRY_CANCEL, 0, NULL) < 0) {
+			LOG("bt_inquiry_watch: error %d cancelling inquiry\n", errno);
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+/**
+ * Start a device inquiry, as {@link bt_inquiry_begin}, but stop it early if
+ * a cancel token is signalled. The controller is told to abandon the
+ * inquiry, so the call returns within a few milliseconds rather than after
+ * the whole inquiry period.
+ *
+ * Windows doesn't support cancel tokens, so there the call behaves exactly
+ * like {@link bt_inquiry_begin}.
+ * 
+ * @param inquiry Pointer to an uninitialised {@link bt_inquiry_t} object.
+ * @param cached  Include cached devices.
+ * @param cancel  A token from {@link bt_cancel_init}, or NULL.
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_CANCELLED`        - the token was cancelled before the inquiry
+ *                                finished; there are no results to enumerate
+ *    `BT_ERR_UNSUPPORTED`      - no Bluetooth adapter found
+ *    `BT_ERR_UNKNOWN`          - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`        - the inquiry was NULL
+ */
+bt_err_t bt_inquiry_begin_cancellable(bt_inquiry_t *inquiry, int cached, bt_cancel_token_t const *cancel) {
+#ifndef WINDOWS
+	bt_inquiry_watcher_t watcher;
+	pthread_t thread;
+	bool watching;
+#endif
 	// check parameters
 	if (inquiry == NULL)
 		return BT_ERR_BAD_PARAM;
@@ -291,6 +460,9 @@ bt_err_t bt_inquiry_begin(bt_inquiry_t *inquiry, int cached) {
 	return BT_SUCCESS;
 	
 #else // LINUX
+	if (bt_cancel_requested(cancel))
+		return BT_ERR_CANCELLED;
+
 	inquiry->dev.dev_id = hci_get_route(NULL);
 	if (inquiry->dev.dev_id < 0)
 		return BT_ERR_UNSUPPORTED;
@@ -303,14 +475,39 @@ bt_err_t bt_inquiry_begin(bt_inquiry_t *inquiry, int cached) {
 	#define MAX_INQUIRY_RESULTS 256
 	inquiry->dev.info = malloc(MAX_INQUIRY_RESULTS * sizeof(inquiry_info));
 	inquiry->dev.current = inquiry->dev.info;
+
+	// hci_inquiry can't be interrupted, so a second thread stops the inquiry if asked
+	watching = false;
+	if (cancel != NULL && cancel->fd >= 0 && inquiry->dev.socket >= 0) {
+		watcher.hci = inquiry->dev.socket;
+		watcher.cancel = cancel;
+		if (bt_cancel_init(&watcher.done) == BT_SUCCESS) {
+			watching = (pthread_create(&thread, NULL, bt_inquiry_watch, &watcher) == 0);
+			if (!watching) {
+				LOG("bt_inquiry_begin_cancellable: could not start watcher, inquiry can't be cancelled\n");
+				bt_cancel_free(&watcher.done);
+			}
+		}
+	}
 	
 	inquiry->dev.count = hci_inquiry(inquiry->dev.dev_id, 8, MAX_INQUIRY_RESULTS, NULL,
 			&inquiry->dev.info, inquiry->dev.flags);
-	if (inquiry->dev.count < 0) {
+
+	if (watching) {
+		bt_cancel(&watcher.done);
+		pthread_join(thread, NULL);
+		bt_cancel_free(&watcher.done);
+	}
+
+	if (inquiry->dev.count < 0 || bt_cancel_requested(cancel)) {
 		free(inquiry->dev.info);
+		inquiry->dev.info = NULL;
+		inquiry->dev.count = 0;
 		if (inquiry->dev.socket != -1)
 			close(inquiry->dev.socket);
-		return BT_ERR_UNKNOWN;
+		inquiry->dev.socket = -1;
+		inquiry->nameBuffer = NULL;
+		return bt_cancel_requested(cancel) ? BT_ERR_CANCELLED : BT_ERR_UNKNOWN;
 	}
 	
 	inquiry->nameBuffer = malloc(DEVICE_NAME_BUFFER_SIZE);
@@ -479,7 +676,10 @@ void bt_inquiry_end(bt_inquiry_t *inquiry) {
  * @param service_class Service class UUID. You may pass `NULL` to get all
  *                      (public) services back.
  * @param cached        Find only services in cache (generally you always want
- *                      to pass `0` here).
+ *                      to pass `0` here). On Linux, if a service class is
+ *                      given and its channel is remembered by the SDP cache
+ *                      (see {@link bt_sdp_cache_open_file}), the service is
+ *                      returned from there without querying the device.
  * 
  * @return `BT_SUCCESS` if successful, or one of the following if there's an
  *         error:
@@ -492,6 +692,70 @@ bt_err_t bt_services_begin(bt_inquiry_t *inquiry,
 						const bt_addr_t *device,
 						const bt_uuid_t *service_class,
 						int cached) {
+	return bt_services_begin_ex(inquiry, device, service_class, cached, BT_SERVICE_ATTR_DEFAULT);
+}
+
+#ifndef WINDOWS
+/// The SDP attribute requested for each BT_SERVICE_ATTR_* bit, in ascending order.
+static uint16_t const bt_service_attr_ids[] = {
+	SDP_ATTR_SVCLASS_ID_LIST,
+	SDP_ATTR_PROTO_DESC_LIST,
+	SDP_ATTR_SVCNAME_PRIMARY,
+	SDP_ATTR_SVCDESC_PRIMARY
+};
+
+/// The number of entries in bt_service_attr_ids.
+#define BT_SERVICE_ATTR_IDS (sizeof(bt_service_attr_ids) / sizeof(bt_service_attr_ids[0]))
+
+/**
+ * The part of a service inquiry's state that didn't fit in
+ * {@link bt_inquiry_t} without changing its size.
+ */
+typedef struct _bt_services_state_t {
+	/// The device queried, so that what's found can be cached.
+	bdaddr_t device;
+	/// Set if the result came from the SDP cache rather than the device.
+	bool from_cache;
+	/// The service class found in the cache.
+	uuid_t cached_class;
+	/// The channel found in the cache, or 0 once it's been returned.
+	int cached_port;
+} bt_services_state_t;
+#endif
+
+/**
+ * Start a service inquiry, as {@link bt_services_begin}, but asking the
+ * device for only the attributes that are needed. Each attribute left out is
+ * one the device doesn't have to send; for a device with many services, the
+ * full records often need several SDP round trips where the selection fits
+ * in one.
+ * 
+ * Fields of {@link bt_service_t} whose attributes aren't requested are
+ * filled in as though the device hadn't provided them: `"<no name>"`,
+ * `"<no description>"`, and an unset UUID or port.
+ * 
+ * On Windows the query can't be narrowed, so the selection is ignored.
+ * 
+ * @param inquiry       Pointer to an uninitialised {@link bt_inquiry_t} object.
+ * @param device        Device to query services from.
+ * @param service_class Service class UUID. You may pass `NULL` to get all
+ *                      (public) services back.
+ * @param cached        As for {@link bt_services_begin}.
+ * @param attributes    The `BT_SERVICE_ATTR_*` flags for the attributes to
+ *                      fetch, or `BT_SERVICE_ATTR_ALL` for every attribute.
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`         - you passed in a `NULL` pointer, or no attributes
+ *    `BT_ERR_UNINITIALISED`     - you forgot to call {@link bt_init()}
+ *    `BT_ERR_SERVICE_NOT_FOUND` - no services found during inquiry, or device not available
+ *    `BT_ERR_UNKNWON`           - unhelpfully generic failure
+ */
+bt_err_t bt_services_begin_ex(bt_inquiry_t *inquiry,
+						const bt_addr_t *device,
+						const bt_uuid_t *service_class,
+						int cached,
+						unsigned attributes) {
 	bt_uuid_t temp;
 	int e;
 #ifdef WINDOWS
@@ -502,13 +766,23 @@ bt_err_t bt_services_begin(bt_inquiry_t *inquiry,
 	uuid_t uuid;
 	sdp_list_t *search_list, *attrid_list;
 	sdp_list_t *response_list = NULL;
+	sdp_attrreq_type_t reqtype;
 	uint32_t range = 0xffff;
+	char name[BT_SDP_CACHE_NAME_LENGTH];
+	uint8_t channel;
+	bool browsing;
+	size_t i;
 #endif
 	
 	// check parameters
 	if (inquiry == NULL || device == NULL)
 		return BT_ERR_BAD_PARAM;
+	if ((attributes & BT_SERVICE_ATTR_DEFAULT) == 0)
+		return BT_ERR_BAD_PARAM;
 	
+#ifndef WINDOWS
+	browsing = (service_class == NULL);
+#endif
 	// a NULL class means we use the public browse group UUID
 	if (service_class == NULL) {
 		bt_str_to_uuid("00001002-0000-1000-8000-00805f9b34fb", &temp);
@@ -600,17 +874,49 @@ bt_err_t bt_services_begin(bt_inquiry_t *inquiry,
 #else // LINUX
 	bt_addr_to_bdaddr(device, &addr);
 	bt_uuid_to_uuid(service_class, &uuid);
+	inquiry->sdp.session = NULL;
+	inquiry->sdp.response = NULL;
+	inquiry->sdp.state = calloc(1, sizeof(bt_services_state_t));
+	if (inquiry->sdp.state == NULL)
+		return BT_ERR_UNKNOWN;
+	inquiry->sdp.state->device = addr;
+
+	// a service that's already known needn't be looked up on the device
+	if (cached && !browsing && bt_sdp_cache_lookup_ex(device, service_class, &channel, name, sizeof(name))) {
+		inquiry->sdp.state->from_cache = true;
+		inquiry->sdp.state->cached_class = uuid;
+		inquiry->sdp.state->cached_port = channel;
+		inquiry->nameBuffer = malloc(SERVICE_NAME_BUFFER_SIZE);
+		inquiry->descBuffer = malloc(SERVICE_DESCRIPTION_BUFFER_SIZE);
+		snprintf(inquiry->nameBuffer, SERVICE_NAME_BUFFER_SIZE, "%s", (name[0] != '\0') ? name : "<no name>");
+		strcpy(inquiry->descBuffer, "<no description>");
+		return BT_SUCCESS;
+	}
 	
 	// connect to the remote SDP server
 	inquiry->sdp.session = sdp_connect(BDADDR_ANY, &addr, SDP_RETRY_IF_BUSY);
-	if (inquiry->sdp.session == NULL)
+	if (inquiry->sdp.session == NULL) {
+		free(inquiry->sdp.state);
+		inquiry->sdp.state = NULL;
 		return BT_ERR_DEVICE_NOT_FOUND;
+	}
 	
 	// get SDP records
 	search_list = sdp_list_append(NULL, &uuid);
-	attrid_list = sdp_list_append(NULL, &range);
+	if (attributes == BT_SERVICE_ATTR_ALL) {
+		reqtype = SDP_ATTR_REQ_RANGE;
+		attrid_list = sdp_list_append(NULL, &range);
+	} else {
+		// only the attributes asked for, so the device sends less back
+		reqtype = SDP_ATTR_REQ_INDIVIDUAL;
+		attrid_list = NULL;
+		for (i = 0; i < BT_SERVICE_ATTR_IDS; i++) {
+			if (attributes & (1u << i))
+				attrid_list = sdp_list_append(attrid_list, (void*) &bt_service_attr_ids[i]);
+		}
+	}
 	e = sdp_service_search_attr_req(inquiry->sdp.session, search_list,
-			SDP_ATTR_REQ_RANGE, attrid_list, &response_list);
+			reqtype, attrid_list, &response_list);
 	// don't need these any more
 	sdp_list_free(search_list, 0);
 	sdp_list_free(attrid_list, 0);
@@ -618,6 +924,8 @@ bt_err_t bt_services_begin(bt_inquiry_t *inquiry,
 	if (e < 0) {
 		sdp_close(inquiry->sdp.session);
 		inquiry->sdp.session = NULL;
+		free(inquiry->sdp.state);
+		inquiry->sdp.state = NULL;
 		return BT_ERR_DEVICE_NOT_FOUND;
 	}
 	
@@ -656,6 +964,9 @@ bt_err_t bt_services_next(bt_inquiry_t *inquiry, bt_service_t *service) {
 	sdp_record_t *record;
 	sdp_list_t *list = NULL;
 	uuid_t *uuid;
+	bt_addr_t address;
+	bool classified;
+	bool named;
 	int e;
 #endif
 	
@@ -715,6 +1026,19 @@ bt_err_t bt_services_next(bt_inquiry_t *inquiry, bt_service_t *service) {
 	return BT_SUCCESS;
 	
 #else // LINUX
+	if (inquiry->sdp.state == NULL)
+		return BT_ERR_BAD_PARAM;
+	if (inquiry->sdp.state->from_cache) {
+		// there's just the one service, remembered from an earlier query
+		if (inquiry->sdp.state->cached_port == 0)
+			return BT_ERR_END_OF_ENUM;
+		service->name = inquiry->nameBuffer;
+		service->description = inquiry->descBuffer;
+		bt_uuidt_to_uuid(&inquiry->sdp.state->cached_class, &service->uuid);
+		service->port = inquiry->sdp.state->cached_port;
+		inquiry->sdp.state->cached_port = 0;
+		return BT_SUCCESS;
+	}
 	if (inquiry->sdp.session == NULL)
 		return BT_ERR_BAD_PARAM;
 	
@@ -730,6 +1054,7 @@ bt_err_t bt_services_next(bt_inquiry_t *inquiry, bt_service_t *service) {
 	// get the service's name
 	e = sdp_get_service_name(record, inquiry->nameBuffer,
 			SERVICE_NAME_BUFFER_SIZE);
+	named = (e == 0);
 	if (e) strcpy(inquiry->nameBuffer, "<no name>");
 	// get its description
 	e = sdp_get_service_desc(record, inquiry->descBuffer,
@@ -740,16 +1065,25 @@ bt_err_t bt_services_next(bt_inquiry_t *inquiry, bt_service_t *service) {
 	service->description = inquiry->descBuffer;
 	
 	// get its class UUID
+	classified = false;
 	if (sdp_get_service_classes(record, &list) == 0) {
 		uuid = (uuid_t*) list->data;
 		bt_uuidt_to_uuid(uuid, &service->uuid);
 		sdp_list_free(list, 0);
+		classified = true;
 	}
 	
 	// get the service's channel number
 	if (sdp_get_access_protos(record, &list) == 0) {
 		service->port = sdp_get_proto_port(list, RFCOMM_UUID);
 		sdp_list_free(list, 0);
+
+		// remember it, so that connecting to it later needn't ask again
+		if (classified && service->port > 0) {
+			bt_bdaddr_to_addr(&inquiry->sdp.state->device, &address);
+			bt_sdp_cache_store_ex(&address, &service->uuid, (uint8_t) service->port,
+					named ? inquiry->nameBuffer : NULL);
+		}
 	}
 	
 	// free this SDP record
@@ -781,6 +1115,10 @@ void bt_services_end(bt_inquiry_t *inquiry) {
 		sdp_close(inquiry->sdp.session);
 		inquiry->sdp.session = NULL;
 	}
+	if (inquiry->sdp.state != NULL) {
+		free(inquiry->sdp.state);
+		inquiry->sdp.state = NULL;
+	}
 	if (inquiry->nameBuffer != NULL) {
 		free(inquiry->nameBuffer);
 		inquiry->nameBuffer = NULL;
@@ -794,6 +1132,193 @@ void bt_services_end(bt_inquiry_t *inquiry) {
 }
 
 
+/******************************************************************************\
+ * SOCKET OPTIONS                                                             *
+\******************************************************************************/
+
+/// The largest MTU an L2CAP channel can use.
+#define BT_SOCKET_MAX_MTU 65535
+
+/// The options for each of the predefined profiles, indexed by bt_socket_profile_t.
+static const bt_socket_options_t bt_socket_profiles[] = {
+	// BT_SOCKET_PROFILE_DEFAULT
+	{ 0, 0, 20000, BT_SOCKET_SECURITY_DEFAULT, 0, 0, 0 },
+	// BT_SOCKET_PROFILE_LATENCY
+	{ 8 * 1024, 0, 20000, BT_SOCKET_SECURITY_DEFAULT, 0, 0, BT_SOCKET_CLOEXEC },
+	// BT_SOCKET_PROFILE_THROUGHPUT
+	{ 256 * 1024, 256 * 1024, 20000, BT_SOCKET_SECURITY_DEFAULT, BT_SOCKET_MAX_MTU, BT_SOCKET_MAX_MTU, BT_SOCKET_CLOEXEC },
+};
+
+/**
+ * Fill in a set of socket options from one of the predefined profiles.
+ * The options can then be adjusted before they're used.
+ *
+ * The latency profile keeps the send buffer small, so that a short message
+ * isn't queued behind a large amount of earlier data. The throughput profile
+ * asks for large buffers and, for L2CAP, the largest MTU, so that bulk
+ * transfers need fewer calls and fewer packets.
+ *
+ * @param options The options to fill in.
+ * @param profile Which profile to use.
+ *
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_BAD_PARAM` if the options
+ *         were NULL or the profile isn't known.
+ */
+bt_err_t bt_socket_options_init(bt_socket_options_t *options, bt_socket_profile_t profile) {
+	// check parameters
+	if (options == NULL || (unsigned) profile >= sizeof(bt_socket_profiles) / sizeof(bt_socket_profiles[0]))
+		return BT_ERR_BAD_PARAM;
+
+	*options = bt_socket_profiles[profile];
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Get the flags to add to the type of a new socket for a set of options, so
+ * that they're applied without any further calls.
+ *
+ * @param options The options, or NULL.
+ *
+ * @return The flags to pass to `socket` or `accept4`. On Windows these are
+ *         always zero.
+ */
+static int bt_socket_type_flags(bt_socket_options_t const *options) {
+	int flags;
+
+	flags = 0;
+#ifndef WINDOWS
+	if (options != NULL && (options->flags & BT_SOCKET_NONBLOCKING))
+		flags |= SOCK_NONBLOCK;
+	if (options != NULL && (options->flags & BT_SOCKET_CLOEXEC))
+		flags |= SOCK_CLOEXEC;
+#endif
+
+	return flags;
+}
+
+/**
+ * Set both the read and write timeout on a socket.
+ *
+ * @param sock The socket to set the timeout on.
+ * @param timeout_ms Timeout duration in milliseconds, or 0 to wait forever.
+ *
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_UNKNOWN` if either timeout
+ *         couldn't be set.
+ */
+static bt_err_t bt_set_timeout_ms(bt_socket_t *sock, int timeout_ms) {
+	bt_err_t result;
+	int sockresult;
+
+	result = BT_SUCCESS;
+
+#ifdef WINDOWS
+	DWORD timeout = timeout_ms;
+#else
+	struct timeval timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+#endif
+
+	sockresult = setsockopt (sock->s, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+	if (sockresult < 0) {
+		result = BT_ERR_UNKNOWN;
+	}
+
+	sockresult = setsockopt (sock->s, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout));
+	if (sockresult < 0) {
+		result = BT_ERR_UNKNOWN;
+	}
+
+	return result;
+}
+
+/**
+ * Apply a set of options to a socket that's just been created or accepted.
+ * Only the options that aren't left at zero are set, so the default profile
+ * costs just the two timeout calls. The flags are expected to have been
+ * passed to `socket` or `accept4` already, except on Windows where
+ * non-blocking mode is set here.
+ *
+ * @param sock    The socket to configure.
+ * @param options The options to apply, or NULL to leave the socket as it is.
+ * @param l2cap   Whether the socket is an L2CAP socket, for which the MTU
+ *                hints are applied.
+ *
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_UNKNOWN` if one of the
+ *         options couldn't be set.
+ */
+static bt_err_t bt_socket_apply_options(bt_socket_t *sock, bt_socket_options_t const *options, bool l2cap) {
+	bt_err_t result;
+
+	if (options == NULL)
+		return BT_SUCCESS;
+
+	result = BT_SUCCESS;
+	if (options->send_buffer > 0 && setsockopt(sock->s, SOL_SOCKET, SO_SNDBUF, (char *)&options->send_buffer, sizeof(int)) < 0) {
+		LOG("bt_socket_apply_options: error %d setting send buffer on socket %d\n", ERRNO, sock->s);
+		result = BT_ERR_UNKNOWN;
+	}
+	if (options->recv_buffer > 0 && setsockopt(sock->s, SOL_SOCKET, SO_RCVBUF, (char *)&options->recv_buffer, sizeof(int)) < 0) {
+		LOG("bt_socket_apply_options: error %d setting receive buffer on socket %d\n", ERRNO, sock->s);
+		result = BT_ERR_UNKNOWN;
+	}
+	if (options->timeout_ms >= 0 && bt_set_timeout_ms(sock, options->timeout_ms) != BT_SUCCESS) {
+		LOG("bt_socket_apply_options: error %d setting timeout on socket %d\n", ERRNO, sock->s);
+		result = BT_ERR_UNKNOWN;
+	}
+
+#ifdef WINDOWS
+	if (options->security != BT_SOCKET_SECURITY_DEFAULT) {
+		LOG("bt_socket_apply_options: security levels aren't supported, ignoring\n");
+	}
+	if (result == BT_SUCCESS && (options->flags & BT_SOCKET_NONBLOCKING)) {
+		result = bt_set_nonblocking(sock, true);
+	}
+#else // LINUX
+	if (options->security != BT_SOCKET_SECURITY_DEFAULT) {
+		struct bt_security security = { 0 };
+
+		switch (options->security) {
+		case BT_SOCKET_SECURITY_LOW:
+			security.level = BT_SECURITY_LOW;
+			break;
+		case BT_SOCKET_SECURITY_MEDIUM:
+			security.level = BT_SECURITY_MEDIUM;
+			break;
+		default:
+			security.level = BT_SECURITY_HIGH;
+			break;
+		}
+		if (setsockopt(sock->s, SOL_BLUETOOTH, BT_SECURITY, &security, sizeof(security)) < 0) {
+			LOG("bt_socket_apply_options: error %d setting security on socket %d\n", errno, sock->s);
+			result = BT_ERR_UNKNOWN;
+		}
+	}
+
+	// the MTUs are only hints, so the kernel turning them down isn't an error
+	if (l2cap && (options->send_mtu > 0 || options->recv_mtu > 0)) {
+		struct l2cap_options l2opts;
+		socklen_t len;
+
+		memset(&l2opts, 0, sizeof(l2opts));
+		len = sizeof(l2opts);
+		if (getsockopt(sock->s, SOL_L2CAP, L2CAP_OPTIONS, &l2opts, &len) == 0) {
+			if (options->send_mtu > 0)
+				l2opts.omtu = options->send_mtu;
+			if (options->recv_mtu > 0)
+				l2opts.imtu = options->recv_mtu;
+			if (setsockopt(sock->s, SOL_L2CAP, L2CAP_OPTIONS, &l2opts, sizeof(l2opts)) < 0) {
+				LOG("bt_socket_apply_options: MTUs %u/%u not accepted on socket %d\n", options->send_mtu, options->recv_mtu, sock->s);
+			}
+		}
+	}
+#endif
+
+	return result;
+}
+
+
 /******************************************************************************\
  * CONNECTIONS                                                                *
 \******************************************************************************/
@@ -824,13 +1349,13 @@ static int bt_find_service_channel(const bdaddr_t *device, uuid_t *uuid) {
 	// specify the UUID of the application we're searching for
 	search_list = sdp_list_append(NULL, uuid);
 	
-	// specify that we want a list of all the matching applications' attributes
-	uint32_t range = 0xffff;
-	attrid_list = sdp_list_append(NULL, &range);
+	// the channel is all we need, so ask for nothing but the protocol list
+	uint16_t protocols = SDP_ATTR_PROTO_DESC_LIST;
+	attrid_list = sdp_list_append(NULL, &protocols);
 	
 	// get a list of service records that have the given UUID
 	sdp_service_search_attr_req(session, search_list,
-			SDP_ATTR_REQ_RANGE, attrid_list, &response_list);
+			SDP_ATTR_REQ_INDIVIDUAL, attrid_list, &response_list);
 	sdp_list_t *r = response_list;
 	
 	// go through each of the service records
@@ -851,6 +1376,8 @@ static int bt_find_service_channel(const bdaddr_t *device, uuid_t *uuid) {
 
 /**
  * Create an RFCOMM connection to the specified device and service.
+ * On Linux this blocks for as long as the kernel takes to give up on the
+ * device; use {@link bt_connect_to_service_ex} to set a time limit.
  * 
  * @param address  Bluetooth address of the device to connect to
  * @param service  UUID of the remote service to connect to
@@ -865,6 +1392,74 @@ static int bt_find_service_channel(const bdaddr_t *device, uuid_t *uuid) {
 bt_err_t bt_connect_to_service(const bt_addr_t *address,
 							const bt_uuid_t *service,
 							bt_socket_t *sock) {
+#ifdef WINDOWS
+	return bt_connect_to_service_ex(address, service, sock, BT_CONNECT_DEFAULT_TIMEOUT_WINDOWS);
+#else // LINUX
+	return bt_connect_to_service_ex(address, service, sock, BT_CONNECT_NO_TIMEOUT);
+#endif
+}
+
+/**
+ * Create an RFCOMM connection to the specified device and service, giving up
+ * if the connection hasn't been made within a time limit. On Linux the time
+ * taken to look up the service's channel counts towards the limit, but the
+ * lookup itself can't be cut short.
+ *
+ * On Linux the channel is remembered for next time (see
+ * {@link bt_sdp_cache_configure}). If a connection to a remembered channel
+ * fails, the channel is forgotten and looked up again before giving up.
+ * 
+ * @param address    Bluetooth address of the device to connect to
+ * @param service    UUID of the remote service to connect to
+ * @param sock       Pointer to a Bluetooth socket, that, if the operation is
+ *                   successful, is connected to the remote service
+ * @param timeout_ms The longest time to wait for the connection in
+ *                   milliseconds, or `BT_CONNECT_NO_TIMEOUT` to wait as long
+ *                   as the operating system does
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_DEVICE_NOT_FOUND`   - the desired device could not be connected
+ *                                  to in time
+ *    `BT_ERR_SERVICE_NOT_FOUND`  - the desired service was not found on the device
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ *    `BT_ERR_UNKNOWN`            - unhelpfully generic failure
+ */
+bt_err_t bt_connect_to_service_ex(const bt_addr_t *address,
+							const bt_uuid_t *service,
+							bt_socket_t *sock, int timeout_ms) {
+	return bt_connect_to_service_cancellable(address, service, sock, timeout_ms, NULL);
+}
+
+/**
+ * Create an RFCOMM connection to the specified device and service, as
+ * {@link bt_connect_to_service_ex}, but giving up as soon as a cancel token
+ * is signalled. The SDP query that finds the service's channel can't be
+ * interrupted, so the token is checked before and after it; the connection
+ * itself stops as soon as the token is signalled.
+ *
+ * Windows doesn't support cancel tokens, so there the call behaves exactly
+ * like {@link bt_connect_to_service_ex}.
+ * 
+ * @param address    Bluetooth address of the device to connect to
+ * @param service    UUID of the remote service to connect to
+ * @param sock       Pointer to a Bluetooth socket, that, if the operation is
+ *                   successful, is connected to the remote service
+ * @param timeout_ms The longest time to wait for the connection in
+ *                   milliseconds, or `BT_CONNECT_NO_TIMEOUT`
+ * @param cancel     A token from {@link bt_cancel_init}, or NULL
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_DEVICE_NOT_FOUND`   - the desired device could not be connected
+ *                                  to in time
+ *    `BT_ERR_SERVICE_NOT_FOUND`  - the desired service was not found on the device
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ *    `BT_ERR_CANCELLED`          - the token was cancelled first
+ *    `BT_ERR_UNKNOWN`            - unhelpfully generic failure
+ */
+bt_err_t bt_connect_to_service_cancellable(const bt_addr_t *address,
+							const bt_uuid_t *service,
+							bt_socket_t *sock, int timeout_ms,
+							bt_cancel_token_t const *cancel) {
 #ifdef WINDOWS
 	SOCKADDR_BTH addr;
 	SOCKET s;
@@ -888,7 +1483,7 @@ bt_err_t bt_connect_to_service(const bt_addr_t *address,
 
 	// connect to the remote device
 	if (ret == BT_SUCCESS) {
-		ret = async_connect(s, (SOCKADDR*)&addr, sizeof(addr));
+		ret = async_connect(s, (SOCKADDR*)&addr, sizeof(addr), timeout_ms);
 	}
 
 	if (ret == BT_SUCCESS) {
@@ -902,27 +1497,69 @@ bt_err_t bt_connect_to_service(const bt_addr_t *address,
 #else // LINUX
 	uuid_t uuid;
 	int channel;
+	uint8_t cached_channel;
+	bool cached;
 	bdaddr_t bdaddr;
+	bt_deadline_t deadline;
+	bt_err_t ret;
 
-	// first we have to find what channel to connect to
-	bt_addr_to_bdaddr(address, &bdaddr);
-	bt_uuid_to_uuid(service, &uuid);
-	
-	channel = bt_find_service_channel(&bdaddr, &uuid);
-	if (channel == -2) {
-		LOG("bt_connect_to_service: device unavailable\n");
-		return BT_ERR_DEVICE_NOT_FOUND;
-	} else if (channel == -1) {
-		LOG("bt_connect_to_service: service not running\n");
-		return BT_ERR_SERVICE_NOT_FOUND;
+	deadline = bt_deadline_from_ms(timeout_ms);
+
+	// first we have to find what channel to connect to, unless it's remembered
+	cached = bt_sdp_cache_lookup(address, service, &cached_channel);
+	if (cached) {
+		channel = cached_channel;
+	} else {
+		bt_addr_to_bdaddr(address, &bdaddr);
+		bt_uuid_to_uuid(service, &uuid);
+
+		if (bt_cancel_requested(cancel)) {
+			return BT_ERR_CANCELLED;
+		}
+		channel = bt_find_service_channel(&bdaddr, &uuid);
+		if (channel == -2) {
+			LOG("bt_connect_to_service: device unavailable\n");
+			return BT_ERR_DEVICE_NOT_FOUND;
+		} else if (channel == -1) {
+			LOG("bt_connect_to_service: service not running\n");
+			return BT_ERR_SERVICE_NOT_FOUND;
+		}
+		bt_sdp_cache_store(address, service, (uint8_t) channel);
+	}
+
+	if (timeout_ms != BT_CONNECT_NO_TIMEOUT) {
+		timeout_ms = bt_deadline_remaining_ms(deadline);
+		if (timeout_ms == 0) {
+			LOG("bt_connect_to_service: no time left to connect\n");
+			return BT_ERR_DEVICE_NOT_FOUND;
+		}
 	}
 	
-	return bt_connect_to_port(address, channel, sock);
+	ret = bt_connect_to_port_cancellable(address, channel, sock, timeout_ms, NULL, cancel);
+
+	// the service may have moved since it was last looked up
+	if (ret == BT_ERR_CONNECTION_FAILURE) {
+		bt_sdp_cache_invalidate(address, service);
+		if (cached) {
+			LOG("bt_connect_to_service: cached channel %d refused, looking up again\n", channel);
+			if (timeout_ms != BT_CONNECT_NO_TIMEOUT) {
+				timeout_ms = bt_deadline_remaining_ms(deadline);
+				if (timeout_ms == 0) {
+					return ret;
+				}
+			}
+			ret = bt_connect_to_service_cancellable(address, service, sock, timeout_ms, cancel);
+		}
+	}
+
+	return ret;
 #endif
 }
 
 /**
  * Create an RFCOMM connection to the specified device and port.
+ * On Linux this blocks for as long as the kernel takes to give up on the
+ * device; use {@link bt_connect_to_port_ex} to set a time limit.
  * 
  * @param address Bluetooth address of the device to connect to
  * @param port The RFCOMM port number to connect to
@@ -935,8 +1572,215 @@ bt_err_t bt_connect_to_service(const bt_addr_t *address,
  */
 bt_err_t bt_connect_to_port(const bt_addr_t *address, unsigned char port, bt_socket_t *sock) {
 #ifdef WINDOWS
-	SOCKADDR_BTH addr;
-	SOCKET s;
+	return bt_connect_to_port_ex(address, port, sock, BT_CONNECT_DEFAULT_TIMEOUT_WINDOWS);
+#else // LINUX
+	return bt_connect_to_port_ex(address, port, sock, BT_CONNECT_NO_TIMEOUT);
+#endif
+}
+
+#ifdef WINDOWS
+#else // LINUX
+/**
+ * Wait for a non-blocking connect to complete and collect its result.
+ *
+ * @param s The socket being connected.
+ * @param deadline The time by which the connection must complete.
+ * @param cancel A token that abandons the connection, or NULL.
+ *
+ * @return `BT_SUCCESS` if the connection was made, or one of the following:
+ *    `BT_ERR_DEVICE_NOT_FOUND`   - the connection didn't complete in time
+ *    `BT_ERR_CANCELLED`          - the token was cancelled first
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ */
+static bt_err_t bt_connect_wait(bt_socket_t const *s, bt_deadline_t deadline, bt_cancel_token_t const *cancel) {
+	bt_err_t ret;
+	int error;
+	socklen_t len;
+
+	ret = bt_wait_socket(s, POLLOUT, deadline, cancel);
+	if (ret == BT_ERR_TIMEOUT) {
+		LOG("bt_connect_wait: connect timed out on socket %d\n", s->s);
+		return BT_ERR_DEVICE_NOT_FOUND;
+	}
+	if (ret == BT_ERR_CANCELLED) {
+		return ret;
+	}
+	if (ret != BT_SUCCESS) {
+		return BT_ERR_CONNECTION_FAILURE;
+	}
+
+	// the outcome of the connect is reported through SO_ERROR
+	error = 0;
+	len = sizeof(error);
+	if (getsockopt(s->s, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+		LOG("bt_connect_wait: could not read result on socket %d: %d\n", s->s, errno);
+		return BT_ERR_CONNECTION_FAILURE;
+	}
+	if (error != 0) {
+		LOG("bt_connect_wait: could not connect socket %d: %d\n", s->s, error);
+		return BT_ERR_CONNECTION_FAILURE;
+	}
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Create a socket and connect it to a remote address, applying a set of
+ * options first and optionally giving up after a time limit. This is the
+ * part of connecting that RFCOMM and L2CAP have in common.
+ *
+ * @param type The socket type, `SOCK_STREAM` or `SOCK_SEQPACKET`.
+ * @param protocol The protocol, `BTPROTO_RFCOMM` or `BTPROTO_L2CAP`.
+ * @param target The address to connect to.
+ * @param size The size of the address.
+ * @param sock Returns the connected socket.
+ * @param timeout_ms The longest time to wait for the connection in
+ *        milliseconds, or `BT_CONNECT_NO_TIMEOUT`.
+ * @param options The options to create the socket with, or NULL.
+ * @param cancel A token that abandons the connection, or NULL.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_DEVICE_NOT_FOUND`   - the connection didn't complete in time
+ *    `BT_ERR_ALLOCATING_SOCKET`  - the socket couldn't be created
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ *    `BT_ERR_CANCELLED`          - the token was cancelled first
+ *    `BT_ERR_UNKNOWN`            - unhelpfully generic failure
+ */
+static bt_err_t bt_connect_sockaddr(int type, int protocol, const struct sockaddr *target, socklen_t size, bt_socket_t *sock, int timeout_ms, bt_socket_options_t const *options, bt_cancel_token_t const *cancel) {
+    int result;
+    bt_socket_t s;
+    bt_err_t ret;
+    bool nonblocking;
+    bool waiting;
+
+    // allocate a socket, with the flags asked for set as it's created
+    nonblocking = (options != NULL) && (options->flags & BT_SOCKET_NONBLOCKING);
+    s.s = socket(AF_BLUETOOTH, type | bt_socket_type_flags(options), protocol);
+    if (s.s == INVALID_SOCKET) {
+        LOG("bt_connect_to_service: could not create socket\n");
+        return BT_ERR_ALLOCATING_SOCKET;
+    }
+
+    ret = bt_socket_apply_options(&s, options, protocol == BTPROTO_L2CAP);
+
+    // with a time limit or a cancel token, start the connect without waiting for it
+    waiting = (timeout_ms >= 0) || (cancel != NULL);
+    if (ret == BT_SUCCESS && waiting && !nonblocking) {
+        ret = bt_set_nonblocking(&s, true);
+    }
+
+    // connect
+    if (ret == BT_SUCCESS) {
+        result = connect(s.s, target, size);
+        if (result && (waiting || nonblocking) && errno == EINPROGRESS) {
+            ret = bt_connect_wait(&s, bt_deadline_from_ms(timeout_ms), cancel);
+        }
+        else if (result) {
+            LOG("bt_connect_to_service: could not connect socket (%d): %d\n", result, errno);
+            ret = BT_ERR_CONNECTION_FAILURE;
+        }
+    }
+
+    // the rest of the code expects a blocking socket, unless asked otherwise
+    if (ret == BT_SUCCESS && waiting && !nonblocking) {
+        ret = bt_set_nonblocking(&s, false);
+    }
+
+    if (ret != BT_SUCCESS) {
+        close(s.s);
+        return ret;
+    }
+
+    // Success. Assign socket
+    sock->s = s.s;
+
+    return BT_SUCCESS;
+}
+#endif
+
+/**
+ * Create an RFCOMM connection to the specified device and port, giving up if
+ * the connection hasn't been made within a time limit. This is useful when
+ * the device may be out of range, since otherwise the connect can take as
+ * long as the Bluetooth page timeout.
+ * 
+ * @param address Bluetooth address of the device to connect to
+ * @param port The RFCOMM port number to connect to
+ * @param sock Pointer to a Bluetooth socket, that, if the operation is
+ *             successful, is connected to the remote service. The socket
+ *             is left in blocking mode.
+ * @param timeout_ms The longest time to wait for the connection in
+ *             milliseconds, or `BT_CONNECT_NO_TIMEOUT` to wait as long as the
+ *             operating system does
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_DEVICE_NOT_FOUND`   - the connection didn't complete in time
+ *    `BT_ERR_ALLOCATING_SOCKET`  - the socket couldn't be created
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ *    `BT_ERR_UNKNOWN`            - unhelpfully generic failure
+ */
+bt_err_t bt_connect_to_port_ex(const bt_addr_t *address, unsigned char port, bt_socket_t *sock, int timeout_ms) {
+	return bt_connect_to_port_with_options(address, port, sock, timeout_ms, NULL);
+}
+
+/**
+ * Create an RFCOMM connection to the specified device and port, applying a
+ * set of socket options before connecting. The security level in particular
+ * has to be set before the link is made.
+ * 
+ * @param address Bluetooth address of the device to connect to
+ * @param port The RFCOMM port number to connect to
+ * @param sock Pointer to a Bluetooth socket, that, if the operation is
+ *             successful, is connected to the remote service. The socket
+ *             is left in blocking mode unless the options ask for it to be
+ *             non-blocking.
+ * @param timeout_ms The longest time to wait for the connection in
+ *             milliseconds, or `BT_CONNECT_NO_TIMEOUT` to wait as long as the
+ *             operating system does
+ * @param options The options to create the socket with, for example from
+ *             {@link bt_socket_options_init}, or NULL to leave the socket
+ *             as the operating system creates it.
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_DEVICE_NOT_FOUND`   - the connection didn't complete in time
+ *    `BT_ERR_ALLOCATING_SOCKET`  - the socket couldn't be created
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ *    `BT_ERR_UNKNOWN`            - unhelpfully generic failure
+ */
+bt_err_t bt_connect_to_port_with_options(const bt_addr_t *address, unsigned char port, bt_socket_t *sock, int timeout_ms, bt_socket_options_t const *options) {
+	return bt_connect_to_port_cancellable(address, port, sock, timeout_ms, options, NULL);
+}
+
+/**
+ * Create an RFCOMM connection to the specified device and port, as
+ * {@link bt_connect_to_port_with_options}, but giving up as soon as a cancel
+ * token is signalled. This lets another thread abandon a connection to a
+ * device that's out of range without waiting for the page timeout.
+ *
+ * Windows doesn't support cancel tokens, so there the call behaves exactly
+ * like {@link bt_connect_to_port_with_options}.
+ * 
+ * @param address Bluetooth address of the device to connect to
+ * @param port The RFCOMM port number to connect to
+ * @param sock Pointer to a Bluetooth socket, that, if the operation is
+ *             successful, is connected to the remote service
+ * @param timeout_ms The longest time to wait for the connection in
+ *             milliseconds, or `BT_CONNECT_NO_TIMEOUT`
+ * @param options The options to create the socket with, or NULL
+ * @param cancel A token from {@link bt_cancel_init}, or NULL
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_DEVICE_NOT_FOUND`   - the connection didn't complete in time
+ *    `BT_ERR_ALLOCATING_SOCKET`  - the socket couldn't be created
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ *    `BT_ERR_CANCELLED`          - the token was cancelled first
+ *    `BT_ERR_UNKNOWN`            - unhelpfully generic failure
+ */
+bt_err_t bt_connect_to_port_cancellable(const bt_addr_t *address, unsigned char port, bt_socket_t *sock, int timeout_ms, bt_socket_options_t const *options, bt_cancel_token_t const *cancel) {
+#ifdef WINDOWS
+	SOCKADDR_BTH addr;
+	bt_socket_t s;
+	bt_socket_options_t blocking;
 	bt_err_t ret = BT_SUCCESS;
 	
 	// be safe
@@ -948,31 +1792,40 @@ bt_err_t bt_connect_to_port(const bt_addr_t *address, unsigned char port, bt_soc
 	bt_addr_to_bdaddr(address, &addr.btAddr);
 	
 	// create an RFCOMM socket
-	s = socket(AF_BTH, SOCK_STREAM, BTHPROTO_RFCOMM);
-	if (s == INVALID_SOCKET) {
+	s.s = socket(AF_BTH, SOCK_STREAM, BTHPROTO_RFCOMM);
+	if (s.s == INVALID_SOCKET) {
 		LOG("bt_connect_to_service: could not create socket\n");
 		ret = BT_ERR_UNKNOWN;
 	}
+
+	// async_connect needs a blocking socket, so non-blocking mode is set afterwards
+	if (ret == BT_SUCCESS && options != NULL) {
+		blocking = *options;
+		blocking.flags &= ~BT_SOCKET_NONBLOCKING;
+		ret = bt_socket_apply_options(&s, &blocking, false);
+	}
 	
 	// connect to the remote device
 	if (ret == BT_SUCCESS) {
-		ret = async_connect(s, (SOCKADDR*)&addr, sizeof(addr));
+		ret = async_connect(s.s, (SOCKADDR*)&addr, sizeof(addr), timeout_ms);
+	}
+
+	if (ret == BT_SUCCESS && options != NULL && (options->flags & BT_SOCKET_NONBLOCKING)) {
+		ret = bt_set_nonblocking(&s, true);
 	}
 
 	if (ret == BT_SUCCESS) {
 		// success, update the bt_socket_t
-		sock->s = s;
-	} else if (s != INVALID_SOCKET) {
-		closesocket(s);
+		sock->s = s.s;
+	} else if (s.s != INVALID_SOCKET) {
+		closesocket(s.s);
 	}
 
-	return BT_SUCCESS;
+	return ret;
 
 #else // LINUX
     struct sockaddr_rc target = { 0 };
-    int result;
     char showaddress[256];
-    int s;
 
     // be safe
     sock->s = INVALID_SOCKET;
@@ -982,59 +1835,59 @@ bt_err_t bt_connect_to_port(const bt_addr_t *address, unsigned char port, bt_soc
     bt_addr_to_str(address, showaddress);
     LOG("Connecting to: %s on port: %d\n", showaddress, port);
 
-    // allocate a socket
-    s = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-    if (s == INVALID_SOCKET) {
-        LOG("bt_connect_to_service: could not create socket\n");
-        return BT_ERR_ALLOCATING_SOCKET;
-    }
-
-    // set remaining connection parameters and connect
     target.rc_family = AF_BLUETOOTH;
     target.rc_channel = (uint8_t) port;
-    result = connect(s, (struct sockaddr*) &target, sizeof(target));
-    if (result) {
-        LOG("bt_connect_to_service: could not connect socket (%d): %d\n", result, errno);
-        close(s);
-        return BT_ERR_CONNECTION_FAILURE;
-    }
-
-    // Success. Assign socket
-    sock->s = s;
 
-    return BT_SUCCESS;
+    return bt_connect_sockaddr(SOCK_STREAM, BTPROTO_RFCOMM, (struct sockaddr*) &target, sizeof(target), sock, timeout_ms, options, cancel);
 #endif
 }
 
 /**
- * Listen on a bluetooth socket and return the first connection accepted.
+ * Set up a listening socket for a service, registered with the local SDP
+ * server, for {@link bt_wait_for_connection} to accept from.
  * @param service The UUID of the service.
  * @param service_name The name of the service.
- * @param sock Returns the socket of the accepted connection.
- * @param timeout Time to wait for a connection
- *        If NULL, will wait indefinitely
+ * @param listener Returns the listening socket.
  * 
  * @return `BT_SUCCESS` if successful.
  */
-bt_err_t bt_wait_for_connection(bt_uuid_t const * service, char const * service_name, bt_socket_t * sock, struct timeval* timeout) {
-	bt_socket_t listener;
+static bt_err_t bt_wait_for_connection_listen(bt_uuid_t const * service, char const * service_name, bt_socket_t * listener) {
 	bt_err_t err;
 	
 	err = BT_SUCCESS;
 
 	if (err == BT_SUCCESS) {
-		err = bt_bind(&listener);
+		err = bt_bind(listener);
 	}
 
 	if (err == BT_SUCCESS) {
 		// Register service
-		err = bt_register_service(service, service_name, &listener);
+		err = bt_register_service(service, service_name, listener);
 	}
 
 	if (err == BT_SUCCESS) {
-		err = bt_listen(&listener);
+		err = bt_listen(listener);
 	}
 
+	return err;
+}
+
+/**
+ * Listen on a bluetooth socket and return the first connection accepted.
+ * @param service The UUID of the service.
+ * @param service_name The name of the service.
+ * @param sock Returns the socket of the accepted connection.
+ * @param timeout Time to wait for a connection
+ *        If NULL, will wait indefinitely
+ * 
+ * @return `BT_SUCCESS` if successful.
+ */
+bt_err_t bt_wait_for_connection(bt_uuid_t const * service, char const * service_name, bt_socket_t * sock, struct timeval* timeout) {
+	bt_socket_t listener;
+	bt_err_t err;
+	
+	err = bt_wait_for_connection_listen(service, service_name, &listener);
+
 	if (err == BT_SUCCESS) {
 		err = bt_accept_with_timeout(&listener, sock, timeout);
 	}
@@ -1042,6 +1895,34 @@ bt_err_t bt_wait_for_connection(bt_uuid_t const * service, char const * service_
 	return err;
 }
 
+/**
+ * Listen on a bluetooth socket and return the first connection accepted, as
+ * {@link bt_wait_for_connection}, but giving up as soon as a cancel token is
+ * signalled.
+ * @param service The UUID of the service.
+ * @param service_name The name of the service.
+ * @param sock Returns the socket of the accepted connection.
+ * @param deadline The time by which a connection must arrive, or
+ *        `BT_DEADLINE_NEVER`.
+ * @param cancel A token from {@link bt_cancel_init}, or NULL.
+ * 
+ * @return `BT_SUCCESS` if successful, `BT_ERR_TIMEOUT` if no connection
+ *         arrived before the deadline, or `BT_ERR_CANCELLED` if the token
+ *         was cancelled first.
+ */
+bt_err_t bt_wait_for_connection_cancellable(bt_uuid_t const * service, char const * service_name, bt_socket_t * sock, bt_deadline_t deadline, bt_cancel_token_t const * cancel) {
+	bt_socket_t listener;
+	bt_err_t err;
+	
+	err = bt_wait_for_connection_listen(service, service_name, &listener);
+
+	if (err == BT_SUCCESS) {
+		err = bt_accept_cancellable(&listener, sock, deadline, &bt_socket_profiles[BT_SOCKET_PROFILE_DEFAULT], cancel);
+	}
+	
+	return err;
+}
+
 
 /**
  * Bind a Bluetooth socket to an available address. This call does not block (a
@@ -1113,37 +1994,63 @@ bt_err_t bt_bind(bt_socket_t * listener) {
  * @return `BT_SUCCESS` if successful.
  */
 bt_err_t bt_bind_to_channel(bt_socket_t * listener, uint8_t channel) {
+	return bt_bind_to_channel_with_options(listener, channel, &bt_socket_profiles[BT_SOCKET_PROFILE_DEFAULT]);
+}
+
+/**
+ * Bind a Bluetooth socket to a given RFCOMM channel, creating it with a set
+ * of socket options. Buffer sizes and the security level set on a listener
+ * are also used for the connections accepted on it.
+ * 
+ * @param listener The socket structure to store the listener details in
+ * @param channel  Which RFCOMM channel to bind to, or `0` to leave the choice
+ *                 to the operating system.
+ * @param options  The options to create the socket with, for example from
+ *                 {@link bt_socket_options_init}, or NULL to leave the socket
+ *                 as the operating system creates it.
+ * 
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_UNKNOWN` if the socket
+ *         couldn't be created, configured or bound.
+ */
+bt_err_t bt_bind_to_channel_with_options(bt_socket_t * listener, uint8_t channel, bt_socket_options_t const * options) {
 	bt_err_t err;
 #ifdef WINDOWS
 	SOCKADDR_BTH loc_addr;
 
-	err = BT_SUCCESS;
-
 	// Allocate socket
 	listener->s = socket(AF_BTH, SOCK_STREAM, BTHPROTO_RFCOMM);
-	bt_set_timeout(listener, 20);
+	err = bt_socket_apply_options(listener, options, false);
+	if (err != BT_SUCCESS) {
+		closesocket(listener->s);
+		listener->s = INVALID_SOCKET;
+		return err;
+	}
 
 	// Bind socket to random port of the first available local bluetooth adapter
 	memset(&loc_addr, 0, sizeof(loc_addr));
 	loc_addr.addressFamily = AF_BTH;
 	loc_addr.btAddr = 0;
 	loc_addr.serviceClassId = GUID_NULL;
-	loc_addr.port = channel;
+	loc_addr.port = (channel == 0) ? BT_PORT_ANY : channel;
 	if (bind(listener->s, (struct sockaddr *)&loc_addr, sizeof(loc_addr))) {
 		DWORD e = WSAGetLastError();
 		printf("Bind failed with error: %ld\n", e);
 		err = BT_ERR_UNKNOWN;
 		closesocket (listener->s);
+		listener->s = INVALID_SOCKET;
 	}
 #else
 	struct sockaddr_rc loc_addr = { 0 };
 	int result;
 
-	err = BT_SUCCESS;
-
 	// Allocate socket
-	listener->s = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-	bt_set_timeout(listener, 20);
+	listener->s = socket(AF_BLUETOOTH, SOCK_STREAM | bt_socket_type_flags(options), BTPROTO_RFCOMM);
+	err = bt_socket_apply_options(listener, options, false);
+	if (err != BT_SUCCESS) {
+		close(listener->s);
+		listener->s = INVALID_SOCKET;
+		return err;
+	}
 
 	// Bind socket to random port of the first available local bluetooth adapter
 	loc_addr.rc_family = AF_BLUETOOTH;
@@ -1167,19 +2074,40 @@ bt_err_t bt_bind_to_channel(bt_socket_t * listener, uint8_t channel) {
  * Listen on a bound socket. This should be called after {@link bt_bind} to
  * start listening on the socket. This call does not block (a subsequent call
  * to {@link bt_accept} will block).
+ * At most `BT_LISTEN_DEFAULT_BACKLOG` connections can be waiting to be
+ * accepted; use {@link bt_listen_with_backlog} to allow more.
  * 
  * @param listener The socket to start listening on.
  * 
  * @return `BT_SUCCESS` if successful.
  */
 bt_err_t bt_listen(bt_socket_t * listener) {
+	return bt_listen_with_backlog(listener, BT_LISTEN_DEFAULT_BACKLOG);
+}
+
+/**
+ * Listen on a bound socket, allowing a given number of connections to queue
+ * before they're accepted. A larger backlog stops connections being refused
+ * when many clients connect at once, for example when a server restarts.
+ * 
+ * @param listener The socket to start listening on.
+ * @param backlog The number of pending connections to allow, or
+ *        `BT_LISTEN_MAX_BACKLOG` for as many as the operating system allows.
+ * 
+ * @return `BT_SUCCESS` if successful.
+ */
+bt_err_t bt_listen_with_backlog(bt_socket_t * listener, int backlog) {
 	bt_err_t err;
 	int result;
 
 	err = BT_SUCCESS;
 
+	if (backlog < 0) {
+		backlog = SOMAXCONN;
+	}
+
 	// Put socket into listening mode
-	result = listen(listener->s, 2);
+	result = listen(listener->s, backlog);
 	if (result < 0) {
 		LOG("Failed to listen on socket, error %d: %s", errno, strerror(errno));
 		err = BT_ERR_UNKNOWN;
@@ -1189,25 +2117,78 @@ bt_err_t bt_listen(bt_socket_t * listener) {
 }
 
 /**
- * Accept the next connection from the listening socket. This should be
- * called after {@link bt_listen} has been called (and consequently after
- * {@link bt_bind} has been called before this).
- * This call will block until a connection is made, or the listen times out.
+ * Create a listening RFCOMM socket on whichever channel is free. Rather than
+ * trying each channel in turn as {@link bt_bind} does, the socket is bound
+ * to channel 0 so that the operating system picks the channel when it starts
+ * listening, at the cost of a single `bind`. Kernels that don't pick a
+ * channel themselves fall back to trying each one. Use
+ * {@link bt_get_socket_channel} to find out which channel was chosen.
+ * 
+ * @param listener The socket structure to store the listener details in
+ * @param options  The options to create the socket with, for example from
+ *                 {@link bt_socket_options_init}, or NULL to leave the socket
+ *                 as the operating system creates it.
+ * @param backlog  The number of pending connections to allow, or
+ *                 `BT_LISTEN_MAX_BACKLOG` for as many as the operating system
+ *                 allows.
  * 
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_UNKNOWN` if the socket
+ *         couldn't be created, bound or put into listening mode.
+ */
+bt_err_t bt_listen_on_free_channel(bt_socket_t * listener, bt_socket_options_t const * options, int backlog) {
+	bt_err_t err;
+
+	err = bt_bind_to_channel_with_options(listener, 0, options);
+	if (err == BT_SUCCESS) {
+		err = bt_listen_with_backlog(listener, backlog);
+	}
+
+#ifndef WINDOWS
+	if (err == BT_SUCCESS && bt_get_socket_channel(*listener) == 0) {
+		struct sockaddr_rc loc_addr = { 0 };
+
+		LOG("bt_listen_on_free_channel: no channel assigned, searching for one\n");
+		close(listener->s);
+		listener->s = socket(AF_BLUETOOTH, SOCK_STREAM | bt_socket_type_flags(options), BTPROTO_RFCOMM);
+		err = bt_socket_apply_options(listener, options, false);
+		if (err == BT_SUCCESS) {
+			loc_addr.rc_family = AF_BLUETOOTH;
+			loc_addr.rc_bdaddr = *BDADDR_ANY;
+			if (dynamic_bind_rc(listener->s, &loc_addr, sizeof(loc_addr), NULL) < 0) {
+				err = BT_ERR_UNKNOWN;
+			}
+		}
+		if (err == BT_SUCCESS) {
+			err = bt_listen_with_backlog(listener, backlog);
+		}
+	}
+#endif
+
+	if (err != BT_SUCCESS && listener->s != INVALID_SOCKET) {
+#ifdef WINDOWS
+		closesocket(listener->s);
+#else // LINUX
+		close(listener->s);
+#endif
+		listener->s = INVALID_SOCKET;
+	}
+
+	return err;
+}
+
+/**
+ * Accept a connection that's known to be waiting on a listening socket.
+ *
  * @param listener The socket that's listening for connections.
- * @param sock The structure to store the details of the next connection
- *        made on the listening socket. This will create a different socket
- *        to the listening socket.
- * @param timeout Time to wait for a connection. If NULL, we will wait
- *        indefinitely
+ * @param sock The structure to store the details of the accepted connection.
+ * @param options The options to apply to the accepted socket, or NULL.
  *
- * @return `BT_SUCCESS` if successful.
- * 	       `BT_ERR_TIMEOUT` if the clock timed out
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_UNKNOWN` if the connection
+ *         couldn't be accepted or configured.
  */
-bt_err_t bt_accept_with_timeout(bt_socket_t const * listener, bt_socket_t * sock, struct timeval* timeout) {
+static bt_err_t bt_accept_ready(bt_socket_t const * listener, bt_socket_t * sock, bt_socket_options_t const * options) {
 	bt_err_t err;
-	int sock_result;
-	fd_set rfds;
+	int flags;
 
 #ifdef WINDOWS
 	SOCKADDR_BTH rem_addr;
@@ -1216,41 +2197,81 @@ bt_err_t bt_accept_with_timeout(bt_socket_t const * listener, bt_socket_t * sock
 	struct sockaddr_rc rem_addr = { 0 };
 	socklen_t opt = sizeof(rem_addr);
 #endif
-	
+
 	err = BT_SUCCESS;
 
-	if (err == BT_SUCCESS) {
-		FD_ZERO(&rfds);
-		FD_SET(listener->s, &rfds);
+	// Accept the first connection, setting any flags as it's created
+	flags = bt_socket_type_flags(options);
+#ifdef WINDOWS
+	sock->s = accept(listener->s, (struct sockaddr *)&rem_addr, &opt);
+#else
+	if (flags != 0) {
+		sock->s = accept4(listener->s, (struct sockaddr *)&rem_addr, &opt, flags);
+	}
+	else {
+		sock->s = accept(listener->s, (struct sockaddr *)&rem_addr, &opt);
+	}
+#endif
+	LOG("Accept on %d", sock->s);
 
-		sock_result = select(listener->s + 1, &rfds, NULL, NULL, timeout);
-		if (sock_result > 0) {
-			err = BT_SUCCESS;
-		}
-		else if (sock_result == 0) {
-			err = BT_ERR_TIMEOUT;
-		}
-		else {
-			err = BT_ERR_UNKNOWN;
+	if (sock->s < 0 || sock->s == INVALID_SOCKET) {
+		LOG("Failed to accept connection, errno = %d", errno);
+		err = BT_ERR_UNKNOWN;
+	}
+	else {
+		err = bt_socket_apply_options(sock, options, false);
+		if (err != BT_SUCCESS) {
+			bt_disconnect(sock);
 		}
 	}
 
-	if (err == BT_SUCCESS) {
-		// Accept the first connection
-		sock->s = accept(listener->s, (struct sockaddr *)&rem_addr, &opt);
-		LOG("Accept on %d", sock->s);
+	return err;
+}
 
-		if (sock->s < 0 || sock->s == INVALID_SOCKET) {
-			LOG("Failed to accept connection, errno = %d", errno);
-			err = BT_ERR_UNKNOWN;
-		}
-		else {
-			bt_set_timeout(sock, 20);
+/**
+ * Accept a connection without blocking, making the new socket non-blocking
+ * and close-on-exec. On Linux `accept4` does all of this in one call.
+ *
+ * @param listener The socket that's listening for connections.
+ * @param sock The structure to store the details of the accepted connection.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following:
+ *    `BT_ERR_WOULD_BLOCK`     - no connection is waiting
+ *    `BT_ERR_UNKNOWN`         - the connection couldn't be accepted
+ */
+static bt_err_t bt_accept_nonblocking(bt_socket_t const * listener, bt_socket_t * sock) {
+	bt_err_t err;
+
+#ifdef WINDOWS
+	sock->s = accept(listener->s, NULL, NULL);
+	if (sock->s == INVALID_SOCKET) {
+		err = bt_err_from_errno(ERRNO);
+	}
+	else {
+		// Windows sockets inherit blocking mode from the listener, so set it
+		err = bt_set_nonblocking(sock, true);
+		if (err != BT_SUCCESS) {
+			closesocket(sock->s);
+			sock->s = INVALID_SOCKET;
 		}
 	}
+#else // LINUX
+	do {
+		sock->s = accept4(listener->s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		// a connection that was reset while queued is simply skipped
+	} while (sock->s < 0 && (errno == EINTR || errno == ECONNABORTED));
+
+	err = BT_SUCCESS;
+	if (sock->s < 0) {
+		err = SOCKET_WOULD_BLOCK(errno) ? BT_ERR_WOULD_BLOCK : BT_ERR_UNKNOWN;
+	}
+#endif
+
+	if (err == BT_ERR_UNKNOWN) {
+		LOG("Failed to accept connection, errno = %d", ERRNO);
+	}
 
 	return err;
-
 }
 
 /**
@@ -1258,7 +2279,54 @@ bt_err_t bt_accept_with_timeout(bt_socket_t const * listener, bt_socket_t * sock
  * called after {@link bt_listen} has been called (and consequently after
  * {@link bt_bind} has been called before this).
  * This call will block until a connection is made, or the listen times out.
- * The timeout for this function will be the same that was set using
+ * 
+ * @param listener The socket that's listening for connections.
+ * @param sock The structure to store the details of the next connection
+ *        made on the listening socket. This will create a different socket
+ *        to the listening socket.
+ * @param timeout Time to wait for a connection. If NULL, we will wait
+ *        indefinitely
+ *
+ * @return `BT_SUCCESS` if successful.
+ * 	       `BT_ERR_TIMEOUT` if the clock timed out
+ */
+bt_err_t bt_accept_with_timeout(bt_socket_t const * listener, bt_socket_t * sock, struct timeval* timeout) {
+	bt_err_t err;
+	int sock_result;
+	fd_set rfds;
+
+	err = BT_SUCCESS;
+
+	if (err == BT_SUCCESS) {
+		FD_ZERO(&rfds);
+		FD_SET(listener->s, &rfds);
+
+		sock_result = select(listener->s + 1, &rfds, NULL, NULL, timeout);
+		if (sock_result > 0) {
+			err = BT_SUCCESS;
+		}
+		else if (sock_result == 0) {
+			err = BT_ERR_TIMEOUT;
+		}
+		else {
+			err = BT_ERR_UNKNOWN;
+		}
+	}
+
+	if (err == BT_SUCCESS) {
+		err = bt_accept_ready(listener, sock, &bt_socket_profiles[BT_SOCKET_PROFILE_DEFAULT]);
+	}
+
+	return err;
+
+}
+
+/**
+ * Accept the next connection from the listening socket. This should be
+ * called after {@link bt_listen} has been called (and consequently after
+ * {@link bt_bind} has been called before this).
+ * This call will block until a connection is made, or the listen times out.
+ * The timeout for this function will be the same that was set using
  * {@link bt_set_timeout}
  * 
  * @param listener The socket that's listening for connections.
@@ -1330,7 +2398,7 @@ int dynamic_bind_rc(int sock, struct sockaddr_rc * sockaddr, socklen_t addrlen,
 		}
 	}
 
-	if (check == 31) {
+	if (found == 0) {
 		err = -1;
 		errno = EINVAL;
 	}
@@ -1444,52 +2512,20 @@ bt_err_t bt_get_device_name(bt_addr_t * addr) {
 #endif
 }
 
+#ifndef WINDOWS
 /**
- * Register a service with local SDP server.
+ * Build a service record and register it with the local SDP server.
  * 
  * @param service      The UUID of the service to register.
  * @param service_name The name of the service to register.
- * @param sock         The Bluetooth server socket used by the service.
+ * @param protocol     `RFCOMM_UUID` or `L2CAP_UUID`, for the protocol the
+ *                     service is reached over.
+ * @param port         The RFCOMM channel or L2CAP PSM the service is bound to.
+ * @param registration Returns the registration, or NULL if it's not needed.
  * 
  * @return `BT_SUCCESS` if the service was registered.
  */
-bt_err_t bt_register_service(bt_uuid_t const * service, char const * service_name, bt_socket_t *sock) {
-#ifdef WINDOWS
-	bt_err_t ret;
-	WSAQUERYSET _service;
-	GUID guid;
-	bt_uuid_to_guid(service, &guid);
-	memset(&_service, 0, sizeof(_service));
-	_service.dwSize = sizeof(_service);
-	_service.lpszServiceInstanceName = service_name;
-	_service.lpszComment = L"";
-	GUID serviceID = guid;
-	_service.lpServiceClassId = &serviceID;
-	_service.dwNumberOfCsAddrs = 1; // This member is ignored for queries.
-	_service.dwNameSpace = NS_BTH;
-	SOCKADDR_BTH address;
-	struct sockaddr *pAddr = (struct sockaddr*)&address;
-	int length = sizeof(SOCKADDR_BTH);
-
-	ret = BT_SUCCESS;
-
-	getsockname(sock->s, pAddr, &length);
-
-	CSADDR_INFO csAddr;
-	memset(&csAddr, 0, sizeof(csAddr));
-	csAddr.LocalAddr.iSockaddrLength = sizeof(SOCKADDR_BTH);
-	csAddr.LocalAddr.lpSockaddr = pAddr;
-	csAddr.iSocketType = SOCK_STREAM;
-	csAddr.iProtocol = BTHPROTO_RFCOMM;
-	_service.lpcsaBuffer = &csAddr;
-
-	if (0 != WSASetService(&_service, RNRSERVICE_REGISTER, 0))
-	{
-		ret = BT_ERR_UNKNOWN;
-	}
-
-	return ret;
-#else
+static bt_err_t bt_register_sdp_record(bt_uuid_t const * service, char const * service_name, uint16_t protocol, uint16_t port, bt_service_registration_t *registration) {
 	bt_err_t ret;
 	uint8_t rfcomm_channel;
 	char const *service_dsc = "";
@@ -1508,8 +2544,6 @@ bt_err_t bt_register_service(bt_uuid_t const * service, char const * service_nam
 
 	ret = BT_SUCCESS;
 
-	rfcomm_channel = bt_get_socket_channel(*sock);
-
 	bt_uuid_to_uuid(service, & svc_uuid);
 
 	sdp_record_t *record = sdp_record_alloc();
@@ -1528,14 +2562,22 @@ bt_err_t bt_register_service(bt_uuid_t const * service, char const * service_nam
 	// Set l2cap info
 	sdp_uuid16_create(&l2cap_uuid, L2CAP_UUID);
 	l2cap_list = sdp_list_append(0, &l2cap_uuid);
+	if (protocol == L2CAP_UUID) {
+		// an L2CAP service is reached directly through its PSM
+		channel = sdp_data_alloc(SDP_UINT16, &port);
+		sdp_list_append(l2cap_list, channel);
+	}
 	proto_list = sdp_list_append(0, l2cap_list);
 
 	// Set RFCOMM info
-	sdp_uuid16_create(&rfcomm_uuid, RFCOMM_UUID);
-	channel = sdp_data_alloc(SDP_UINT8, &rfcomm_channel);
-	rfcomm_list = sdp_list_append(0, &rfcomm_uuid);
-	sdp_list_append(rfcomm_list, channel);
-	sdp_list_append(proto_list, rfcomm_list);
+	if (protocol == RFCOMM_UUID) {
+		rfcomm_channel = (uint8_t) port;
+		sdp_uuid16_create(&rfcomm_uuid, RFCOMM_UUID);
+		channel = sdp_data_alloc(SDP_UINT8, &rfcomm_channel);
+		rfcomm_list = sdp_list_append(0, &rfcomm_uuid);
+		sdp_list_append(rfcomm_list, channel);
+		sdp_list_append(proto_list, rfcomm_list);
+	}
 
 	// Attach protocol info to service record
 	access_proto_list = sdp_list_append(0, proto_list);
@@ -1559,6 +2601,11 @@ bt_err_t bt_register_service(bt_uuid_t const * service, char const * service_nam
 		if (err < 0) {
 			ret = BT_ERR_UNKNOWN;
 		}
+		else if (registration != NULL) {
+			// the record stays registered for as long as the session is open
+			registration->session = session;
+			registration->record = record;
+		}
 	} else {
 		ret = BT_ERR_UNKNOWN;
 	}
@@ -1571,7 +2618,104 @@ bt_err_t bt_register_service(bt_uuid_t const * service, char const * service_nam
 	sdp_list_free(access_proto_list, 0);
 
 	return ret;
+}
+#endif
+
+/**
+ * Register a service with local SDP server. The registration lasts until the
+ * program exits.
+ * 
+ * @param service      The UUID of the service to register.
+ * @param service_name The name of the service to register.
+ * @param sock         The Bluetooth server socket used by the service.
+ * 
+ * @return `BT_SUCCESS` if the service was registered.
+ */
+bt_err_t bt_register_service(bt_uuid_t const * service, char const * service_name, bt_socket_t *sock) {
+	return bt_register_service_ex(service, service_name, sock, NULL);
+}
+
+/**
+ * Register a service with local SDP server, keeping hold of the registration
+ * so that it can be withdrawn by {@link bt_unregister_service} once the
+ * service stops.
+ * 
+ * @param service      The UUID of the service to register.
+ * @param service_name The name of the service to register.
+ * @param sock         The Bluetooth server socket used by the service.
+ * @param registration Returns the registration, or NULL if it's not needed.
+ * 
+ * @return `BT_SUCCESS` if the service was registered.
+ */
+bt_err_t bt_register_service_ex(bt_uuid_t const * service, char const * service_name, bt_socket_t *sock, bt_service_registration_t *registration) {
+	if (registration != NULL) {
+		registration->session = NULL;
+		registration->record = NULL;
+	}
+
+#ifdef WINDOWS
+	bt_err_t ret;
+	WSAQUERYSET _service;
+	GUID guid;
+	bt_uuid_to_guid(service, &guid);
+	memset(&_service, 0, sizeof(_service));
+	_service.dwSize = sizeof(_service);
+	_service.lpszServiceInstanceName = service_name;
+	_service.lpszComment = L"";
+	GUID serviceID = guid;
+	_service.lpServiceClassId = &serviceID;
+	_service.dwNumberOfCsAddrs = 1; // This member is ignored for queries.
+	_service.dwNameSpace = NS_BTH;
+	SOCKADDR_BTH address;
+	struct sockaddr *pAddr = (struct sockaddr*)&address;
+	int length = sizeof(SOCKADDR_BTH);
+
+	ret = BT_SUCCESS;
+
+	getsockname(sock->s, pAddr, &length);
+
+	CSADDR_INFO csAddr;
+	memset(&csAddr, 0, sizeof(csAddr));
+	csAddr.LocalAddr.iSockaddrLength = sizeof(SOCKADDR_BTH);
+	csAddr.LocalAddr.lpSockaddr = pAddr;
+	csAddr.iSocketType = SOCK_STREAM;
+	csAddr.iProtocol = BTHPROTO_RFCOMM;
+	_service.lpcsaBuffer = &csAddr;
+
+	if (0 != WSASetService(&_service, RNRSERVICE_REGISTER, 0))
+	{
+		ret = BT_ERR_UNKNOWN;
+	}
+
+	return ret;
+#else
+	return bt_register_sdp_record(service, service_name, RFCOMM_UUID, bt_get_socket_channel(*sock), registration);
+#endif
+}
+
+/**
+ * Withdraw a service registered with {@link bt_register_service_ex}. On
+ * Windows the registration can't be withdrawn this way and lasts until the
+ * program exits.
+ * 
+ * @param registration The registration to withdraw.
+ */
+void bt_unregister_service(bt_service_registration_t *registration) {
+	if (registration == NULL)
+		return;
+
+#ifndef WINDOWS
+	if (registration->session != NULL) {
+		// this also frees the record
+		if (sdp_record_unregister(registration->session, registration->record) < 0) {
+			LOG("bt_unregister_service: failed to unregister service record\n");
+		}
+		sdp_close(registration->session);
+	}
 #endif
+
+	registration->session = NULL;
+	registration->record = NULL;
 }
 
 /**
@@ -1581,28 +2725,102 @@ bt_err_t bt_register_service(bt_uuid_t const * service, char const * service_nam
  * @return `BT_SUCCESS` if successful.
  */
 bt_err_t bt_set_timeout(bt_socket_t *sock, int duration) {
-	bt_err_t result;
-	int sockresult;
+	return bt_set_timeout_ms(sock, duration * 1000);
+}
 
-	result = BT_SUCCESS;
+/**
+ * Convert the error number from a failed socket read or write into a
+ * `bt_err_t`. This is the mapping used by {@link bt_recv} and
+ * {@link bt_send}, for use by other parts of the library that perform
+ * socket operations themselves, except that on a blocking socket those
+ * report an expired timeout as `BT_ERR_TIMEOUT`.
+ * @param error The error number, as returned by `ERRNO`.
+ * @return `BT_SOCKET_CLOSED` if the connection was reset,
+ *         `BT_ERR_WOULD_BLOCK` if the operation would have blocked, or
+ *         `BT_ERR_UNKNOWN` for anything else.
+ */
+bt_err_t bt_err_from_errno(int error) {
+	if (error == ECONNRESET) {
+		return BT_SOCKET_CLOSED;
+	}
+	else if (SOCKET_WOULD_BLOCK(error)) {
+		return BT_ERR_WOULD_BLOCK;
+	}
+	else {
+		// error
+		return BT_ERR_UNKNOWN;
+	}
+}
 
+/**
+ * Convert the error number from a failed read or write on a socket into a
+ * `bt_err_t`, as {@link bt_err_from_errno} does, but reporting a timeout set
+ * by {@link bt_set_timeout} as `BT_ERR_TIMEOUT`. On a blocking socket Linux
+ * reports the timeout as `EAGAIN`, which would otherwise read as
+ * `BT_ERR_WOULD_BLOCK`; Windows reports it as `WSAETIMEDOUT`.
+ * @param socket The socket the operation failed on.
+ * @param error The error number, as returned by `ERRNO`.
+ * @param flags The flags passed to the operation.
+ * @return As for {@link bt_err_from_errno}, or `BT_ERR_TIMEOUT` if the
+ *         socket's timeout expired.
+ */
+static bt_err_t bt_err_from_socket_errno(bt_socket_t const *socket, int error, int flags) {
 #ifdef WINDOWS
-	DWORD timeout = duration * 1000;
+	if (error == WSAETIMEDOUT) {
+		return BT_ERR_TIMEOUT;
+	}
 #else
-	struct timeval timeout;
-	timeout.tv_sec = duration;
-	timeout.tv_usec = 0;
+	// the socket is only asked whether it blocks when it matters, since that's a system call
+	if (SOCKET_WOULD_BLOCK(error) && !(flags & MSG_DONTWAIT)
+			&& !(fcntl(socket->s, F_GETFL) & O_NONBLOCK)) {
+		return BT_ERR_TIMEOUT;
+	}
 #endif
 
-	sockresult = setsockopt (sock->s, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
-	if (sockresult < 0) {
+	return bt_err_from_errno(error);
+}
+
+/**
+ * Put a socket into or out of non-blocking mode. In non-blocking mode, calls
+ * that would otherwise wait for data or buffer space return
+ * `BT_ERR_WOULD_BLOCK` instead.
+ * @param sock The socket to change.
+ * @param nonblocking true to make the socket non-blocking, false to make it
+ *        blocking again.
+ * @return `BT_SUCCESS` if successful.
+ */
+bt_err_t bt_set_nonblocking(bt_socket_t *sock, bool nonblocking) {
+	bt_err_t result;
+
+	if (sock == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	result = BT_SUCCESS;
+
+#ifdef WINDOWS
+	u_long mode = nonblocking ? 1 : 0;
+
+	if (ioctlsocket(sock->s, FIONBIO, &mode) != 0) {
 		result = BT_ERR_UNKNOWN;
 	}
+#else
+	int flags;
 
-	sockresult = setsockopt (sock->s, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout));
-	if (sockresult < 0) {
+	flags = fcntl(sock->s, F_GETFL, 0);
+	if (flags < 0) {
 		result = BT_ERR_UNKNOWN;
 	}
+	else {
+		flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+		if (fcntl(sock->s, F_SETFL, flags) < 0) {
+			result = BT_ERR_UNKNOWN;
+		}
+	}
+#endif
+
+	if (result != BT_SUCCESS) {
+		LOG("bt_set_nonblocking: error %d changing mode of socket %d\n", ERRNO, sock->s);
+	}
 
 	return result;
 }
@@ -1633,22 +2851,13 @@ void bt_disconnect(bt_socket_t *socket) {
 }
 
 /**
- * Read data from a Bluetooth socket.
- * This functions is basically a proxy the socket recv function.
- * 
- * @param socket   The socket to read from.
- * @param buffer   Pointer to buffer in which to put received data.
- * @param numBytes Pointer to number of bytes to receive. On return, this will
- *                 be set to the actual number of bytes received.
- * 
- * @return `BT_SUCCESS` if successful,
- *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
- *     there's an error:
- *    `BT_SOCKET_CLOSED`       - Socket was closed during read
- *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
- *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ * Receive data from a Bluetooth socket, passing flags through to `recv`.
+ * This does the work for {@link bt_recv}, which describes the parameters and
+ * return values.
+ *
+ * @param flags Flags to pass to `recv`.
  */
-bt_err_t bt_recv(bt_socket_t *socket, void *buffer, size_t *numBytes) {
+static bt_err_t bt_recv_flags(bt_socket_t *socket, void *buffer, size_t *numBytes, int flags) {
 	// this is one of the few bits that is actually the same on Windows and Linux (for now)
 	int n;
 	size_t bytesToRead = *numBytes;
@@ -1660,26 +2869,42 @@ bt_err_t bt_recv(bt_socket_t *socket, void *buffer, size_t *numBytes) {
 	}
 
 	*numBytes = 0;
-	n = recv(socket->s, buffer, bytesToRead, 0);
+	n = recv(socket->s, buffer, bytesToRead, flags);
 	if (n == 0) {
 		// socket has been closed
 		LOG("bt_recv: socket %d closed on write (returned 0 bytes)\n", socket->s);
 		return BT_SOCKET_CLOSED;
 	} else if (n < 0) {
 		LOG("bt_recv: error %d reading from socket %d\n", ERRNO, socket->s);
-		if (ERRNO == ECONNRESET) {
-			return BT_SOCKET_CLOSED;
-		}
-		else {
-			// error
-			return BT_ERR_UNKNOWN;
-		}
+		return bt_err_from_socket_errno(socket, ERRNO, flags);
 	}
 
 	*numBytes = n;
 	return BT_SUCCESS;
 }
 
+/**
+ * Read data from a Bluetooth socket.
+ * This functions is basically a proxy the socket recv function.
+ * 
+ * @param socket   The socket to read from.
+ * @param buffer   Pointer to buffer in which to put received data.
+ * @param numBytes Pointer to number of bytes to receive. On return, this will
+ *                 be set to the actual number of bytes received.
+ * 
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_SOCKET_CLOSED`       - Socket was closed during read
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_WOULD_BLOCK`     - the socket is non-blocking and isn't ready
+ *    `BT_ERR_TIMEOUT`         - a timeout set by bt_set_timeout expired
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_recv(bt_socket_t *socket, void *buffer, size_t *numBytes) {
+	return bt_recv_flags(socket, buffer, numBytes, 0);
+}
+
 /**
  * Read data from a Bluetooth socket.
  * The exact semantics of this function are perhaps not as intuitive as they
@@ -1733,21 +2958,13 @@ bt_err_t bt_read(bt_socket_t *socket, void *buffer, size_t *numBytes) {
 }
 
 /**
- * Write data to a Bluetooth socket.
- * This functions is basically a proxy the socket send function.
- *
- * @param socket   The socket to write to.
- * @param buffer   Pointer to buffer containing data to send.
- * @param numBytes Pointer to number of bytes to send. On return, this will
- *                 be set to the actual number of bytes sent.
+ * Send data on a Bluetooth socket, passing flags through to `send`.
+ * This does the work for {@link bt_send}, which describes the parameters and
+ * return values.
  *
- * @return `BT_SUCCESS` if successful,
- *    `BT_SOCKET_CLOSED`       - Socket was closed during read
- *     or one of the following if there's an error:
- *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
- *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ * @param flags Flags to pass to `send`.
  */
-bt_err_t bt_send(bt_socket_t *socket, const void *buffer, size_t *numBytes) {
+static bt_err_t bt_send_flags(bt_socket_t *socket, const void *buffer, size_t *numBytes, int flags) {
 	// this is one of the few bits that is actually the same on Windows and Linux (for now)
 	int n;
 	size_t bytesToSend = *numBytes;
@@ -1759,26 +2976,41 @@ bt_err_t bt_send(bt_socket_t *socket, const void *buffer, size_t *numBytes) {
 	}
 
 	*numBytes = 0;
-	n = send(socket->s, buffer, bytesToSend, 0);
+	n = send(socket->s, buffer, bytesToSend, flags);
 	if (n == 0) {
 		// socket has been closed
 		LOG("bt_send: socket %d closed on write (returned 0 bytes)\n", socket->s);
 		return BT_SOCKET_CLOSED;
 	} else if (n < 0) {
 		LOG("bt_send: error %d writing to socket %d\n", ERRNO, socket->s);
-		if (ERRNO == ECONNRESET) {
-			return BT_SOCKET_CLOSED;
-		}
-		else {
-			// error
-			return BT_ERR_UNKNOWN;
-		}
+		return bt_err_from_socket_errno(socket, ERRNO, flags);
 	}
 
 	*numBytes = n;
 	return BT_SUCCESS;
 }
 
+/**
+ * Write data to a Bluetooth socket.
+ * This functions is basically a proxy the socket send function.
+ *
+ * @param socket   The socket to write to.
+ * @param buffer   Pointer to buffer containing data to send.
+ * @param numBytes Pointer to number of bytes to send. On return, this will
+ *                 be set to the actual number of bytes sent.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED`       - Socket was closed during read
+ *     or one of the following if there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_WOULD_BLOCK`     - the socket is non-blocking and isn't ready
+ *    `BT_ERR_TIMEOUT`         - a timeout set by bt_set_timeout expired
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_send(bt_socket_t *socket, const void *buffer, size_t *numBytes) {
+	return bt_send_flags(socket, buffer, numBytes, 0);
+}
+
 /**
  * Write data to a Bluetooth socket. This functions guarantees to write
  * the specified amount. Unless some error happens.
@@ -1870,3 +3102,1426 @@ bt_err_t bt_write(bt_socket_t *socket, const void *buffer, size_t numBytes) {
 }
 
 
+/******************************************************************************\
+ * L2CAP                                                                      *
+\******************************************************************************/
+
+/**
+ * Check that a PSM is one a connection-oriented channel can use: odd, with
+ * the lowest bit of its upper byte clear.
+ *
+ * @param psm The PSM to check.
+ *
+ * @return `true` if the PSM is valid.
+ */
+static bool bt_l2cap_psm_valid(uint16_t psm) {
+	return (psm & 0x0101) == 0x0001;
+}
+
+/**
+ * Create an L2CAP connection-oriented channel to the specified device and
+ * PSM. Unlike RFCOMM, the channel keeps message boundaries: each call to
+ * {@link bt_send_message} arrives as a single {@link bt_recv_message}.
+ * 
+ * @param address Bluetooth address of the device to connect to
+ * @param psm The PSM to connect to
+ * @param sock Pointer to a Bluetooth socket, that, if the operation is
+ *             successful, is connected to the remote service
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the errors returned by
+ *         {@link bt_connect_l2cap_with_options}.
+ */
+bt_err_t bt_connect_l2cap(const bt_addr_t *address, uint16_t psm, bt_socket_t *sock) {
+	return bt_connect_l2cap_with_options(address, psm, sock, BT_CONNECT_NO_TIMEOUT, NULL);
+}
+
+/**
+ * Create an L2CAP connection-oriented channel to the specified device and
+ * PSM, applying a set of socket options before connecting. The MTU hints in
+ * the options are used for the channel. L2CAP isn't currently supported on
+ * Windows.
+ * 
+ * @param address Bluetooth address of the device to connect to
+ * @param psm The PSM to connect to
+ * @param sock Pointer to a Bluetooth socket, that, if the operation is
+ *             successful, is connected to the remote service. The socket
+ *             is left in blocking mode unless the options ask for it to be
+ *             non-blocking.
+ * @param timeout_ms The longest time to wait for the connection in
+ *             milliseconds, or `BT_CONNECT_NO_TIMEOUT` to wait as long as the
+ *             operating system does
+ * @param options The options to create the socket with, for example from
+ *             {@link bt_socket_options_init}, or NULL to leave the socket
+ *             as the operating system creates it.
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_BAD_PARAM`          - One of the parameters was NULL, or the
+ *                                  PSM isn't valid
+ *    `BT_ERR_DEVICE_NOT_FOUND`   - the connection didn't complete in time
+ *    `BT_ERR_ALLOCATING_SOCKET`  - the socket couldn't be created
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ *    `BT_ERR_UNSUPPORTED`        - L2CAP isn't supported on this platform
+ *    `BT_ERR_UNKNOWN`            - unhelpfully generic failure
+ */
+bt_err_t bt_connect_l2cap_with_options(const bt_addr_t *address, uint16_t psm, bt_socket_t *sock, int timeout_ms, bt_socket_options_t const *options) {
+	return bt_connect_l2cap_cancellable(address, psm, sock, timeout_ms, options, NULL);
+}
+
+/**
+ * Create an L2CAP connection to the specified device and PSM, as
+ * {@link bt_connect_l2cap_with_options}, but giving up as soon as a cancel
+ * token is signalled.
+ * 
+ * @param address Bluetooth address of the device to connect to
+ * @param psm The PSM to connect to
+ * @param sock Pointer to a Bluetooth socket, that, if the operation is
+ *             successful, is connected to the remote service
+ * @param timeout_ms The longest time to wait for the connection in
+ *             milliseconds, or `BT_CONNECT_NO_TIMEOUT`
+ * @param options The options to create the socket with, or NULL
+ * @param cancel A token from {@link bt_cancel_init}, or NULL
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_BAD_PARAM`          - One of the parameters was NULL, or the
+ *                                  PSM isn't valid
+ *    `BT_ERR_DEVICE_NOT_FOUND`   - the connection didn't complete in time
+ *    `BT_ERR_ALLOCATING_SOCKET`  - the socket couldn't be created
+ *    `BT_ERR_CONNECTION_FAILURE` - the connection was refused or failed
+ *    `BT_ERR_CANCELLED`          - the token was cancelled first
+ *    `BT_ERR_UNSUPPORTED`        - L2CAP isn't supported on this platform
+ *    `BT_ERR_UNKNOWN`            - unhelpfully generic failure
+ */
+bt_err_t bt_connect_l2cap_cancellable(const bt_addr_t *address, uint16_t psm, bt_socket_t *sock, int timeout_ms, bt_socket_options_t const *options, bt_cancel_token_t const *cancel) {
+	// check parameters
+	if (address == NULL || sock == NULL || !bt_l2cap_psm_valid(psm)) {
+		LOG("bt_connect_l2cap: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+#ifdef WINDOWS
+	sock->s = INVALID_SOCKET;
+
+	return BT_ERR_UNSUPPORTED;
+#else // LINUX
+	struct sockaddr_l2 target;
+	char showaddress[256];
+
+	// be safe
+	sock->s = INVALID_SOCKET;
+
+	memset(&target, 0, sizeof(target));
+	bt_addr_to_bdaddr(address, &target.l2_bdaddr);
+	bt_addr_to_str(address, showaddress);
+	LOG("Connecting to: %s on PSM: 0x%04x\n", showaddress, psm);
+
+	target.l2_family = AF_BLUETOOTH;
+	target.l2_psm = htobs(psm);
+
+	return bt_connect_sockaddr(SOCK_SEQPACKET, BTPROTO_L2CAP, (struct sockaddr*) &target, sizeof(target), sock, timeout_ms, options, cancel);
+#endif
+}
+
+/**
+ * Bind an L2CAP socket to a PSM, ready for {@link bt_listen}. Connections
+ * accepted from it with {@link bt_accept} keep message boundaries.
+ * 
+ * @param listener The socket structure to store the listener details in.
+ * @param psm      The PSM to bind to, or `BT_L2CAP_PSM_DYNAMIC` to have one
+ *                 assigned when the socket starts listening.
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the errors returned by
+ *         {@link bt_bind_l2cap_with_options}.
+ */
+bt_err_t bt_bind_l2cap(bt_socket_t * listener, uint16_t psm) {
+	return bt_bind_l2cap_with_options(listener, psm, &bt_socket_profiles[BT_SOCKET_PROFILE_DEFAULT]);
+}
+
+/**
+ * Bind an L2CAP socket to a PSM, creating it with a set of socket options.
+ * With `BT_L2CAP_PSM_DYNAMIC` the PSM is only assigned once the socket is
+ * listening, so call {@link bt_listen} before registering the service with
+ * {@link bt_register_l2cap_service}.
+ * 
+ * @param listener The socket structure to store the listener details in.
+ * @param psm      The PSM to bind to, or `BT_L2CAP_PSM_DYNAMIC`.
+ * @param options  The options to create the socket with, or NULL to leave
+ *                 the socket as the operating system creates it.
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_BAD_PARAM`       - The listener was NULL, or the PSM isn't valid
+ *    `BT_ERR_UNSUPPORTED`     - L2CAP isn't supported on this platform
+ *    `BT_ERR_UNKNOWN`         - the socket couldn't be created, configured or
+ *                               bound
+ */
+bt_err_t bt_bind_l2cap_with_options(bt_socket_t * listener, uint16_t psm, bt_socket_options_t const * options) {
+	// check parameters
+	if (listener == NULL || (psm != BT_L2CAP_PSM_DYNAMIC && !bt_l2cap_psm_valid(psm))) {
+		LOG("bt_bind_l2cap: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+#ifdef WINDOWS
+	listener->s = INVALID_SOCKET;
+
+	return BT_ERR_UNSUPPORTED;
+#else // LINUX
+	struct sockaddr_l2 loc_addr;
+	bt_err_t err;
+
+	// Allocate socket
+	listener->s = socket(AF_BLUETOOTH, SOCK_SEQPACKET | bt_socket_type_flags(options), BTPROTO_L2CAP);
+	if (listener->s < 0) {
+		LOG("bt_bind_l2cap: could not create socket\n");
+		return BT_ERR_UNKNOWN;
+	}
+
+	err = bt_socket_apply_options(listener, options, true);
+	if (err == BT_SUCCESS) {
+		memset(&loc_addr, 0, sizeof(loc_addr));
+		loc_addr.l2_family = AF_BLUETOOTH;
+		loc_addr.l2_bdaddr = *BDADDR_ANY;
+		loc_addr.l2_psm = htobs(psm);
+		if (bind(listener->s, (struct sockaddr *)&loc_addr, sizeof(loc_addr)) < 0) {
+			LOG("bt_bind_l2cap: failed to bind to PSM 0x%04x: %d\n", psm, errno);
+			err = BT_ERR_UNKNOWN;
+		}
+	}
+
+	if (err != BT_SUCCESS) {
+		close(listener->s);
+		listener->s = INVALID_SOCKET;
+	}
+
+	return err;
+#endif
+}
+
+/**
+ * Get the PSM an L2CAP socket is bound or connected to.
+ * 
+ * @param sock The socket to get the PSM for.
+ * 
+ * @return The PSM of the socket, or 0 if it couldn't be found.
+ */
+uint16_t bt_get_socket_psm(bt_socket_t sock) {
+#ifdef WINDOWS
+	return 0;
+#else
+	struct sockaddr_l2 src;
+	socklen_t olen;
+
+	memset(&src, 0, sizeof(src));
+	olen = sizeof(src);
+	if (getsockname(sock.s, (void *)&src, &olen) < 0) {
+		return 0;
+	}
+
+	return btohs(src.l2_psm);
+#endif
+}
+
+/**
+ * Get the MTUs negotiated for a connected L2CAP socket. A message larger
+ * than the send MTU can't be sent, and one larger than the receive MTU
+ * can't arrive, so the receive MTU is the buffer size needed by
+ * {@link bt_recv_message}.
+ * 
+ * @param sock     The connected socket.
+ * @param send_mtu Returns the largest message that can be sent. It can be
+ *                 NULL.
+ * @param recv_mtu Returns the largest message that can be received. It can
+ *                 be NULL.
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_BAD_PARAM`       - The socket was NULL
+ *    `BT_ERR_UNSUPPORTED`     - L2CAP isn't supported on this platform
+ *    `BT_ERR_UNKNOWN`         - the MTUs couldn't be read
+ */
+bt_err_t bt_get_l2cap_mtu(bt_socket_t const *sock, uint16_t *send_mtu, uint16_t *recv_mtu) {
+	// check parameters
+	if (sock == NULL)
+		return BT_ERR_BAD_PARAM;
+
+#ifdef WINDOWS
+	return BT_ERR_UNSUPPORTED;
+#else
+	struct l2cap_options l2opts;
+	socklen_t len;
+
+	memset(&l2opts, 0, sizeof(l2opts));
+	len = sizeof(l2opts);
+	if (getsockopt(sock->s, SOL_L2CAP, L2CAP_OPTIONS, &l2opts, &len) < 0) {
+		LOG("bt_get_l2cap_mtu: error %d reading options on socket %d\n", errno, sock->s);
+		return BT_ERR_UNKNOWN;
+	}
+
+	if (send_mtu != NULL)
+		*send_mtu = l2opts.omtu;
+	if (recv_mtu != NULL)
+		*recv_mtu = l2opts.imtu;
+
+	return BT_SUCCESS;
+#endif
+}
+
+/**
+ * Register a service reached over L2CAP with the local SDP server. The
+ * record's protocol descriptor list gives the PSM the socket is bound to,
+ * rather than an RFCOMM channel.
+ * 
+ * @param service      The UUID of the service to register.
+ * @param service_name The name of the service to register.
+ * @param sock         The listening L2CAP socket used by the service.
+ * @param registration Returns the registration, or NULL if it's not needed.
+ * 
+ * @return `BT_SUCCESS` if the service was registered, `BT_ERR_UNSUPPORTED`
+ *         on Windows, or `BT_ERR_UNKNOWN` if the PSM couldn't be found or the
+ *         service couldn't be registered.
+ */
+bt_err_t bt_register_l2cap_service(bt_uuid_t const * service, char const * service_name, bt_socket_t *sock, bt_service_registration_t *registration) {
+	if (registration != NULL) {
+		registration->session = NULL;
+		registration->record = NULL;
+	}
+
+#ifdef WINDOWS
+	return BT_ERR_UNSUPPORTED;
+#else
+	uint16_t psm;
+
+	psm = bt_get_socket_psm(*sock);
+	if (psm == 0) {
+		LOG("bt_register_l2cap_service: socket %d has no PSM\n", sock->s);
+		return BT_ERR_UNKNOWN;
+	}
+
+	return bt_register_sdp_record(service, service_name, L2CAP_UUID, psm, registration);
+#endif
+}
+
+/**
+ * Send a single message over an L2CAP socket. The message arrives at the
+ * other end as a whole, from a single call to {@link bt_recv_message}, so
+ * no framing is needed.
+ *
+ * Empty messages can't be sent, since the receiver couldn't tell one apart
+ * from the connection closing.
+ * 
+ * @param socket   The connected L2CAP socket.
+ * @param buffer   The message to send.
+ * @param numBytes The length of the message, which must be at least one
+ *                 byte and not more than the send MTU (see
+ *                 {@link bt_get_l2cap_mtu}).
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL, or the
+ *                               message is empty or larger than the MTU
+ *    `BT_SOCKET_CLOSED`       - the connection was closed
+ *    `BT_ERR_WOULD_BLOCK`     - the socket is non-blocking and isn't ready
+ *    `BT_ERR_TIMEOUT`         - a timeout set by bt_set_timeout expired
+ *    `BT_ERR_UNSUPPORTED`     - L2CAP isn't supported on this platform
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+bt_err_t bt_send_message(bt_socket_t *socket, const void *buffer, size_t numBytes) {
+	// check parameters
+	if (socket == NULL || buffer == NULL || numBytes == 0) {
+		LOG("bt_send_message: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+#ifdef WINDOWS
+	return BT_ERR_UNSUPPORTED;
+#else
+	ssize_t n;
+
+	do {
+		n = send(socket->s, buffer, numBytes, 0);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		LOG("bt_send_message: error %d sending on socket %d\n", errno, socket->s);
+		return (errno == EMSGSIZE) ? BT_ERR_BAD_PARAM : bt_err_from_socket_errno(socket, errno, 0);
+	}
+	if ((size_t) n != numBytes) {
+		// a packet socket sends all or nothing, so this shouldn't happen
+		LOG("bt_send_message: only %ld of %lu bytes sent on socket %d\n", (long) n, (unsigned long) numBytes, socket->s);
+		return BT_ERR_UNKNOWN;
+	}
+
+	return BT_SUCCESS;
+#endif
+}
+
+#ifndef WINDOWS
+/**
+ * Receive a single message from an L2CAP socket, passing flags to `recvmsg`.
+ *
+ * @param socket   The connected L2CAP socket.
+ * @param buffer   The buffer to receive the message into.
+ * @param numBytes Pointer to the size of the buffer. On return this is the
+ *                 length of the message, or of the part of it that fitted.
+ * @param flags    Flags for `recvmsg`, such as `MSG_DONTWAIT`.
+ *
+ * @return As for {@link bt_recv_message}.
+ */
+static bt_err_t bt_recv_message_flags(bt_socket_t *socket, void *buffer, size_t *numBytes, int flags) {
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buffer;
+	iov.iov_len = *numBytes;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	*numBytes = 0;
+	do {
+		n = recvmsg(socket->s, &msg, flags);
+	} while (n < 0 && errno == EINTR);
+
+	if (n == 0) {
+		LOG("bt_recv_message: socket %d closed\n", socket->s);
+		return BT_SOCKET_CLOSED;
+	}
+	if (n < 0) {
+		LOG("bt_recv_message: error %d reading from socket %d\n", errno, socket->s);
+		return bt_err_from_socket_errno(socket, errno, flags);
+	}
+
+	*numBytes = n;
+	if (msg.msg_flags & MSG_TRUNC) {
+		LOG("bt_recv_message: message on socket %d truncated to %ld bytes\n", socket->s, (long) n);
+		return BT_ERR_BUFFER_FULL;
+	}
+
+	return BT_SUCCESS;
+}
+#endif
+
+/**
+ * Receive a single message from an L2CAP socket, as sent by one call to
+ * {@link bt_send_message} at the other end. A read of zero bytes is taken
+ * to mean the other end has closed the connection, which is why
+ * {@link bt_send_message} won't send an empty message.
+ * 
+ * @param socket   The connected L2CAP socket.
+ * @param buffer   The buffer to receive the message into.
+ * @param numBytes Pointer to the size of the buffer. On return this is the
+ *                 length of the message, or of the part of it that fitted.
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_BUFFER_FULL`     - the message was larger than the buffer, and
+ *                               the rest of it has been discarded
+ *    `BT_SOCKET_CLOSED`       - the connection was closed
+ *    `BT_ERR_WOULD_BLOCK`     - the socket is non-blocking and isn't ready
+ *    `BT_ERR_TIMEOUT`         - a timeout set by bt_set_timeout expired
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ *    `BT_ERR_UNSUPPORTED`     - L2CAP isn't supported on this platform
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+bt_err_t bt_recv_message(bt_socket_t *socket, void *buffer, size_t *numBytes) {
+	// check parameters
+	if (socket == NULL || buffer == NULL || numBytes == NULL) {
+		LOG("bt_recv_message: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+#ifdef WINDOWS
+	*numBytes = 0;
+
+	return BT_ERR_UNSUPPORTED;
+#else
+	return bt_recv_message_flags(socket, buffer, numBytes, 0);
+#endif
+}
+
+/**
+ * Receive a single message from an L2CAP socket, as
+ * {@link bt_recv_message}, but giving up at a deadline or as soon as a
+ * cancel token is signalled.
+ * 
+ * @param socket   The connected L2CAP socket.
+ * @param buffer   The buffer to receive the message into.
+ * @param numBytes Pointer to the size of the buffer. On return this is the
+ *                 length of the message, or of the part of it that fitted.
+ * @param deadline The time by which a message must arrive, or
+ *                 `BT_DEADLINE_NEVER`.
+ * @param cancel   A token from {@link bt_cancel_init}, or NULL.
+ * 
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_BUFFER_FULL`     - the message was larger than the buffer, and
+ *                               the rest of it has been discarded
+ *    `BT_SOCKET_CLOSED`       - the connection was closed
+ *    `BT_ERR_TIMEOUT`         - no message arrived before the deadline
+ *    `BT_ERR_CANCELLED`       - the token was cancelled first
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ *    `BT_ERR_UNSUPPORTED`     - L2CAP isn't supported on this platform
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+bt_err_t bt_recv_message_cancellable(bt_socket_t *socket, void *buffer, size_t *numBytes, bt_deadline_t deadline, bt_cancel_token_t const *cancel) {
+	// check parameters
+	if (socket == NULL || buffer == NULL || numBytes == NULL) {
+		LOG("bt_recv_message_cancellable: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+#ifdef WINDOWS
+	*numBytes = 0;
+
+	return BT_ERR_UNSUPPORTED;
+#else
+	size_t size;
+	bt_err_t e;
+
+	size = *numBytes;
+	do {
+		*numBytes = 0;
+		e = bt_wait_socket(socket, POLLIN, deadline, cancel);
+		if (e == BT_SUCCESS) {
+			*numBytes = size;
+			// spurious wake-ups would block, so wait again
+			e = bt_recv_message_flags(socket, buffer, numBytes, MSG_DONTWAIT);
+		}
+	} while (e == BT_ERR_WOULD_BLOCK);
+
+	return e;
+#endif
+}
+
+
+/******************************************************************************\
+ * VECTORED I/O                                                               *
+\******************************************************************************/
+
+/**
+ * Count the total number of bytes described by an array of buffers.
+ *
+ * @param iov    The array of buffers.
+ * @param iovcnt The number of buffers in the array.
+ *
+ * @return The sum of the lengths of all the buffers.
+ */
+static size_t bt_iov_total(const bt_iovec_t *iov, int iovcnt) {
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+
+	return total;
+}
+
+/**
+ * Fill a window with the portion of an array of buffers that still has to be
+ * transferred. The caller's array is never modified; instead the first entry
+ * of the window is adjusted to skip any bytes already transferred.
+ *
+ * @param iov    The complete array of buffers.
+ * @param iovcnt The number of buffers in the array.
+ * @param index  Index of the first buffer that isn't yet complete.
+ * @param offset Number of bytes of buffer `index` already transferred.
+ * @param window Array of at least `BT_IOV_MAX` entries to fill.
+ *
+ * @return The number of entries written into the window.
+ */
+static int bt_iov_window(const bt_iovec_t *iov, int iovcnt, int index, size_t offset, bt_iovec_t *window) {
+	int count = 0;
+
+	while ((index < iovcnt) && (count < BT_IOV_MAX)) {
+		if (iov[index].iov_len > offset) {
+			window[count].iov_base = (char*) iov[index].iov_base + offset;
+			window[count].iov_len = iov[index].iov_len - offset;
+			count++;
+		}
+		offset = 0;
+		index++;
+	}
+
+	return count;
+}
+
+/**
+ * Move the position within an array of buffers forwards by a number of bytes.
+ *
+ * @param iov    The complete array of buffers.
+ * @param iovcnt The number of buffers in the array.
+ * @param index  Index of the current buffer; updated on return.
+ * @param offset Offset into the current buffer; updated on return.
+ * @param n      The number of bytes to move forwards by.
+ */
+static void bt_iov_advance(const bt_iovec_t *iov, int iovcnt, int *index, size_t *offset, size_t n) {
+	while ((*index < iovcnt) && (n > 0)) {
+		if (n < iov[*index].iov_len - *offset) {
+			*offset += n;
+			n = 0;
+		} else {
+			n -= iov[*index].iov_len - *offset;
+			*offset = 0;
+			(*index)++;
+		}
+	}
+}
+
+/**
+ * Read data from a Bluetooth socket into several buffers at once (scatter
+ * read). This is the vectored equivalent of {@link bt_recv}: it makes a single
+ * `recvmsg` call and returns as soon as any data is available, filling the
+ * buffers in order. At most `BT_IOV_MAX` buffers are used in one call.
+ *
+ * @param socket   The socket to read from.
+ * @param iov      Array of buffers in which to put received data.
+ * @param iovcnt   The number of buffers in the array.
+ * @param numBytes Pointer to return the number of bytes received.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_WOULD_BLOCK`     - the socket is non-blocking and isn't ready
+ *    `BT_ERR_TIMEOUT`         - a timeout set by bt_set_timeout expired
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_recvv(bt_socket_t *socket, const bt_iovec_t *iov, int iovcnt, size_t *numBytes) {
+	int n;
+#ifdef WINDOWS
+	WSABUF buffers[BT_IOV_MAX];
+	DWORD received;
+	DWORD flags;
+	int i;
+#else
+	struct msghdr msg;
+#endif
+
+	// check parameters
+	if (socket == NULL || iov == NULL || iovcnt < 0 || numBytes == NULL) {
+		LOG("bt_recvv: error reading from socket: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	*numBytes = 0;
+	if (iovcnt > BT_IOV_MAX) {
+		iovcnt = BT_IOV_MAX;
+	}
+	// nothing to read, and a zero return would look like a closed socket
+	if (bt_iov_total(iov, iovcnt) == 0) {
+		return BT_SUCCESS;
+	}
+
+#ifdef WINDOWS
+	for (i = 0; i < iovcnt; i++) {
+		buffers[i].buf = (char*) iov[i].iov_base;
+		buffers[i].len = (ULONG) iov[i].iov_len;
+	}
+	flags = 0;
+	if (WSARecv(socket->s, buffers, iovcnt, &received, &flags, NULL, NULL) == SOCKET_ERROR) {
+		n = -1;
+	} else {
+		n = (int) received;
+	}
+#else
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
+	n = recvmsg(socket->s, &msg, 0);
+#endif
+	if (n == 0) {
+		// socket has been closed
+		LOG("bt_recvv: socket %d closed on read (returned 0 bytes)\n", socket->s);
+		return BT_SOCKET_CLOSED;
+	} else if (n < 0) {
+		LOG("bt_recvv: error %d reading from socket %d\n", ERRNO, socket->s);
+		return bt_err_from_socket_errno(socket, ERRNO, 0);
+	}
+
+	*numBytes = n;
+	return BT_SUCCESS;
+}
+
+/**
+ * Read data from a Bluetooth socket into several buffers (scatter read). Like
+ * {@link bt_read}, the call blocks until either the socket gets closed or
+ * every buffer has been completely filled, looping over `recvmsg` calls as
+ * necessary.
+ *
+ * @param socket   The socket to read from.
+ * @param iov      Array of buffers in which to put received data. The array
+ *                 itself is not modified.
+ * @param iovcnt   The number of buffers in the array.
+ * @param numBytes Pointer to return the total number of bytes received. This
+ *                 may be `NULL` if the caller isn't interested.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_readv(bt_socket_t *socket, const bt_iovec_t *iov, int iovcnt, size_t *numBytes) {
+	bt_iovec_t window[BT_IOV_MAX];
+	size_t received = 0;
+	size_t offset = 0;
+	int index = 0;
+	int count;
+	size_t n;
+	bt_err_t e;
+
+	// check parameters
+	if (socket == NULL || iov == NULL || iovcnt < 0) {
+		LOG("bt_readv: error reading from socket: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	e = BT_SUCCESS;
+	count = bt_iov_window(iov, iovcnt, index, offset, window);
+	while ((count > 0) && (e == BT_SUCCESS)) {
+		e = bt_recvv(socket, window, count, &n);
+		// Error log will be generated by bt_recvv(), so no need to duplicate
+		if (e == BT_SUCCESS) {
+			received += n;
+			bt_iov_advance(iov, iovcnt, &index, &offset, n);
+			count = bt_iov_window(iov, iovcnt, index, offset, window);
+		}
+	}
+
+	if (numBytes != NULL) {
+		*numBytes = received;
+	}
+	return e;
+}
+
+/**
+ * Write data from several buffers to a Bluetooth socket (gather write). This
+ * is the vectored equivalent of {@link bt_send}: it makes a single `sendmsg`
+ * call, so for example a header, body and MAC can be sent without first being
+ * copied into a staging buffer. At most `BT_IOV_MAX` buffers are used in one
+ * call.
+ *
+ * @param socket   The socket to write to.
+ * @param iov      Array of buffers containing the data to send.
+ * @param iovcnt   The number of buffers in the array.
+ * @param numBytes Pointer to return the number of bytes actually sent.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED`       - Socket was closed during write
+ *     or one of the following if there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_WOULD_BLOCK`     - the socket is non-blocking and isn't ready
+ *    `BT_ERR_TIMEOUT`         - a timeout set by bt_set_timeout expired
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_sendv(bt_socket_t *socket, const bt_iovec_t *iov, int iovcnt, size_t *numBytes) {
+	int n;
+#ifdef WINDOWS
+	WSABUF buffers[BT_IOV_MAX];
+	DWORD sent;
+	int i;
+#else
+	struct msghdr msg;
+#endif
+
+	// check parameters
+	if (socket == NULL || iov == NULL || iovcnt < 0 || numBytes == NULL) {
+		LOG("bt_sendv: error writing to socket: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	*numBytes = 0;
+	if (iovcnt > BT_IOV_MAX) {
+		iovcnt = BT_IOV_MAX;
+	}
+	// nothing to send, and a zero return would look like a closed socket
+	if (bt_iov_total(iov, iovcnt) == 0) {
+		return BT_SUCCESS;
+	}
+
+#ifdef WINDOWS
+	for (i = 0; i < iovcnt; i++) {
+		buffers[i].buf = (char*) iov[i].iov_base;
+		buffers[i].len = (ULONG) iov[i].iov_len;
+	}
+	if (WSASend(socket->s, buffers, iovcnt, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+		n = -1;
+	} else {
+		n = (int) sent;
+	}
+#else
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
+	n = sendmsg(socket->s, &msg, 0);
+#endif
+	if (n == 0) {
+		// socket has been closed
+		LOG("bt_sendv: socket %d closed on write (returned 0 bytes)\n", socket->s);
+		return BT_SOCKET_CLOSED;
+	} else if (n < 0) {
+		LOG("bt_sendv: error %d writing to socket %d\n", ERRNO, socket->s);
+		return bt_err_from_socket_errno(socket, ERRNO, 0);
+	}
+
+	*numBytes = n;
+	return BT_SUCCESS;
+}
+
+/**
+ * Write data from several buffers to a Bluetooth socket (gather write). Like
+ * {@link bt_write}, this function guarantees to write everything in all of
+ * the buffers, unless some error happens, looping over `sendmsg` calls in
+ * case the OS accepts only part of the data at a time.
+ *
+ * @param socket The socket to send to.
+ * @param iov    Array of buffers containing the data to send. The array
+ *               itself is not modified.
+ * @param iovcnt The number of buffers in the array.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED`       - Socket was closed during write
+ *     or one of the following if there's an error:
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_writev(bt_socket_t *socket, const bt_iovec_t *iov, int iovcnt) {
+	bt_iovec_t window[BT_IOV_MAX];
+	size_t offset = 0;
+	int index = 0;
+	int count;
+	size_t n;
+	bt_err_t e;
+
+	// check parameters
+	if (socket == NULL || iov == NULL || iovcnt < 0) {
+		LOG("bt_writev: error writing to socket: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	// loop in case sendmsg doesn't send everything at once for whatever reason
+	count = bt_iov_window(iov, iovcnt, index, offset, window);
+	while (count > 0) {
+		e = bt_sendv(socket, window, count, &n);
+
+		if (e != BT_SUCCESS) {
+			// Error log will be generated by bt_sendv(), so no need to duplicate
+			return e;
+		}
+
+		bt_iov_advance(iov, iovcnt, &index, &offset, n);
+		count = bt_iov_window(iov, iovcnt, index, offset, window);
+	}
+
+	return BT_SUCCESS;
+}
+
+
+/******************************************************************************\
+ * DEADLINES                                                                  *
+\******************************************************************************/
+
+/**
+ * Read data from a Bluetooth socket, giving up at a deadline. Like
+ * {@link bt_read} the call waits until the desired number of bytes has been
+ * read, but the deadline applies to the whole read however many `recv` calls
+ * it takes, rather than to each call as with {@link bt_set_timeout}.
+ *
+ * @param socket   The socket to read from.
+ * @param buffer   Pointer to buffer in which to put received data.
+ * @param numBytes Pointer to number of bytes to receive. On return, this will
+ *                 be set to the actual number of bytes received, which may be
+ *                 fewer than requested if there was an error.
+ * @param deadline The time by which the read must complete, for example from
+ *                 {@link bt_deadline_from_ms}.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_TIMEOUT`         - the deadline passed before all of the data
+ *                               arrived
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_read_deadline(bt_socket_t *socket, void *buffer, size_t *numBytes, bt_deadline_t deadline) {
+	return bt_read_cancellable(socket, buffer, numBytes, deadline, NULL);
+}
+
+/**
+ * Read data from a Bluetooth socket, as {@link bt_read_deadline}, but giving
+ * up as soon as a cancel token is signalled. Any data read before then is
+ * kept, and its length returned.
+ *
+ * @param socket   The socket to read from.
+ * @param buffer   Pointer to buffer in which to put received data.
+ * @param numBytes Pointer to number of bytes to receive. On return, this will
+ *                 be set to the actual number of bytes received.
+ * @param deadline The time by which the read must complete, or
+ *                 `BT_DEADLINE_NEVER`.
+ * @param cancel   A token from {@link bt_cancel_init}, or NULL.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_TIMEOUT`         - the deadline passed before all of the data
+ *                               arrived
+ *    `BT_ERR_CANCELLED`       - the token was cancelled first
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_read_cancellable(bt_socket_t *socket, void *buffer, size_t *numBytes, bt_deadline_t deadline, bt_cancel_token_t const *cancel) {
+	size_t bytesRead;
+	size_t n;
+	bt_err_t e;
+
+	// check parameters
+	if (socket == NULL || buffer == NULL || numBytes == NULL) {
+		LOG("bt_read_cancellable: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	bytesRead = 0;
+	e = BT_SUCCESS;
+	while ((bytesRead < *numBytes) && (e == BT_SUCCESS)) {
+		e = bt_wait_socket(socket, POLLIN, deadline, cancel);
+		if (e == BT_SUCCESS) {
+			n = *numBytes - bytesRead;
+			e = bt_recv_flags(socket, (char *) buffer + bytesRead, &n, SOCKET_FLAG_DONTWAIT);
+			bytesRead += n;
+			if (e == BT_ERR_WOULD_BLOCK) {
+				// spurious wake-up, so wait again
+				e = BT_SUCCESS;
+			}
+		}
+	}
+
+	*numBytes = bytesRead;
+	return e;
+}
+
+/**
+ * Send data on a Bluetooth socket, giving up at a deadline. Like
+ * {@link bt_write_deadline} the call waits until all of the data has been
+ * sent, but if it fails part way through the number of bytes that did go is
+ * returned.
+ *
+ * @param socket   The socket to write to.
+ * @param buffer   Pointer to buffer containing data to send.
+ * @param numBytes The number of bytes to send. On return, the number of bytes
+ *                 actually sent.
+ * @param deadline The time by which the write must complete, for example from
+ *                 {@link bt_deadline_from_ms}.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_TIMEOUT`         - the deadline passed before all of the data
+ *                               was sent
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_send_deadline(bt_socket_t *socket, const void *buffer, size_t *numBytes, bt_deadline_t deadline) {
+	return bt_send_cancellable(socket, buffer, numBytes, deadline, NULL);
+}
+
+/**
+ * Send data on a Bluetooth socket, as {@link bt_send_deadline}, but giving
+ * up as soon as a cancel token is signalled.
+ *
+ * @param socket   The socket to write to.
+ * @param buffer   Pointer to buffer containing data to send.
+ * @param numBytes The number of bytes to send. On return, the number of bytes
+ *                 actually sent.
+ * @param deadline The time by which the write must complete, or
+ *                 `BT_DEADLINE_NEVER`.
+ * @param cancel   A token from {@link bt_cancel_init}, or NULL.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_TIMEOUT`         - the deadline passed before all of the data
+ *                               was sent
+ *    `BT_ERR_CANCELLED`       - the token was cancelled first
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_send_cancellable(bt_socket_t *socket, const void *buffer, size_t *numBytes, bt_deadline_t deadline, bt_cancel_token_t const *cancel) {
+	size_t bytesSent;
+	size_t n;
+	bt_err_t e;
+
+	// check parameters
+	if (socket == NULL || buffer == NULL || numBytes == NULL) {
+		LOG("bt_send_cancellable: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	bytesSent = 0;
+	e = BT_SUCCESS;
+	while ((bytesSent < *numBytes) && (e == BT_SUCCESS)) {
+		e = bt_wait_socket(socket, POLLOUT, deadline, cancel);
+		if (e == BT_SUCCESS) {
+			n = *numBytes - bytesSent;
+			e = bt_send_flags(socket, (const char *) buffer + bytesSent, &n, SOCKET_FLAG_DONTWAIT);
+			bytesSent += n;
+			if (e == BT_ERR_WOULD_BLOCK) {
+				// spurious wake-up, so wait again
+				e = BT_SUCCESS;
+			}
+		}
+	}
+
+	*numBytes = bytesSent;
+	return e;
+}
+
+/**
+ * Write data to a Bluetooth socket, giving up at a deadline. Like
+ * {@link bt_write} the call waits until all of the data has been sent, but
+ * the deadline applies to the whole write however many `send` calls it takes.
+ *
+ * @param socket   The socket to write to.
+ * @param buffer   Pointer to buffer containing data to send.
+ * @param numBytes The number of bytes to send.
+ * @param deadline The time by which the write must complete, for example from
+ *                 {@link bt_deadline_from_ms}.
+ *
+ * @return `BT_SUCCESS` if successful,
+ *    `BT_SOCKET_CLOSED` if the socket was closed, or one of the following if
+ *     there's an error:
+ *    `BT_ERR_TIMEOUT`         - the deadline passed before all of the data
+ *                               was sent
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_write_deadline(bt_socket_t *socket, const void *buffer, size_t numBytes, bt_deadline_t deadline) {
+	// check parameters
+	if (socket == NULL || buffer == NULL) {
+		LOG("bt_write_deadline: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	return bt_send_deadline(socket, buffer, &numBytes, deadline);
+}
+
+/**
+ * Accept the next connection from the listening socket, giving up at a
+ * deadline. This is the same as {@link bt_accept_with_timeout} except that it
+ * takes an absolute deadline, and isn't limited by `FD_SETSIZE`.
+ *
+ * @param listener The socket that's listening for connections.
+ * @param sock The structure to store the details of the next connection
+ *        made on the listening socket.
+ * @param deadline The time by which a connection must arrive, for example
+ *        from {@link bt_deadline_from_ms}.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_TIMEOUT`         - no connection arrived before the deadline
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_accept_deadline(bt_socket_t const * listener, bt_socket_t * sock, bt_deadline_t deadline) {
+	return bt_accept_with_options(listener, sock, deadline, &bt_socket_profiles[BT_SOCKET_PROFILE_DEFAULT]);
+}
+
+/**
+ * Accept the next connection from a listening socket, waiting no later than
+ * a deadline, and apply a set of socket options to it. On Linux the
+ * non-blocking and close-on-exec flags are set as the connection is
+ * accepted, without any further calls.
+ *
+ * @param listener The socket that's listening for connections.
+ * @param sock The structure to store the details of the connection.
+ * @param deadline The time by which a connection must arrive, for example
+ *        from {@link bt_deadline_from_ms}.
+ * @param options The options to apply to the connection, for example from
+ *        {@link bt_socket_options_init}, or NULL to leave it as the
+ *        operating system creates it.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_TIMEOUT`         - no connection arrived before the deadline
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_accept_with_options(bt_socket_t const * listener, bt_socket_t * sock, bt_deadline_t deadline, bt_socket_options_t const * options) {
+	return bt_accept_cancellable(listener, sock, deadline, options, NULL);
+}
+
+/**
+ * Accept the next connection from a listening socket, as
+ * {@link bt_accept_with_options}, but giving up as soon as a cancel token is
+ * signalled. This is the way to stop a thread that's waiting for clients
+ * when the program shuts down.
+ *
+ * @param listener The socket that's listening for connections.
+ * @param sock The structure to store the details of the connection.
+ * @param deadline The time by which a connection must arrive, or
+ *        `BT_DEADLINE_NEVER`.
+ * @param options The options to apply to the connection, or NULL.
+ * @param cancel A token from {@link bt_cancel_init}, or NULL.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_TIMEOUT`         - no connection arrived before the deadline
+ *    `BT_ERR_CANCELLED`       - the token was cancelled first
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL
+ */
+bt_err_t bt_accept_cancellable(bt_socket_t const * listener, bt_socket_t * sock, bt_deadline_t deadline, bt_socket_options_t const * options, bt_cancel_token_t const * cancel) {
+	bt_err_t err;
+
+	// check parameters
+	if (listener == NULL || sock == NULL) {
+		LOG("bt_accept_cancellable: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	err = bt_wait_socket(listener, POLLIN, deadline, cancel);
+
+	if (err == BT_SUCCESS) {
+		err = bt_accept_ready(listener, sock, options);
+	}
+
+	return err;
+}
+
+/**
+ * Accept every connection waiting on a listening socket, up to a limit, in
+ * one go. The call waits until at least one connection arrives or the
+ * deadline passes, then drains the listen queue without waiting further.
+ * This is much cheaper than accepting connections one at a time when many
+ * clients connect at once.
+ *
+ * The accepted sockets are non-blocking and close-on-exec, set as they're
+ * accepted rather than with separate calls for each socket. This differs from
+ * {@link bt_accept}, which returns blocking sockets with a 20 second read and
+ * write timeout: no timeout is set here, so a caller that wants to use the
+ * sockets that way should call {@link bt_set_nonblocking} and
+ * {@link bt_set_timeout} on each. Other options, such as buffer sizes, are
+ * inherited from the listener on Linux, so set them once on the listener to
+ * apply them to every connection.
+ *
+ * The queue is drained most efficiently if the listener itself is
+ * non-blocking (see {@link bt_set_nonblocking}); otherwise the listener is
+ * polled before each further connection is accepted.
+ *
+ * @param listener The socket that's listening for connections.
+ * @param socks Array to store the accepted connections in.
+ * @param max The number of entries in the array.
+ * @param deadline The time by which a connection must arrive, for example
+ *        from {@link bt_deadline_from_ms}.
+ * @param count Returns the number of connections accepted.
+ *
+ * @return `BT_SUCCESS` if at least one connection was accepted, or one of
+ *         the following if there's an error:
+ *    `BT_ERR_TIMEOUT`         - no connection arrived before the deadline
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL, or max zero
+ */
+bt_err_t bt_accept_many(bt_socket_t const * listener, bt_socket_t * socks, size_t max, bt_deadline_t deadline, size_t * count) {
+	return bt_accept_many_cancellable(listener, socks, max, deadline, count, NULL);
+}
+
+/**
+ * Accept every connection waiting on a listening socket, as
+ * {@link bt_accept_many}, but giving up as soon as a cancel token is
+ * signalled while waiting for the first connection. Once connections are
+ * being accepted the queue is drained without waiting, so the token isn't
+ * checked again.
+ *
+ * @param listener The socket that's listening for connections.
+ * @param socks Array to store the accepted connections in.
+ * @param max The number of entries in the array.
+ * @param deadline The time by which a connection must arrive, or
+ *        `BT_DEADLINE_NEVER`.
+ * @param count Returns the number of connections accepted.
+ * @param cancel A token from {@link bt_cancel_init}, or NULL.
+ *
+ * @return `BT_SUCCESS` if at least one connection was accepted, or one of
+ *         the following if there's an error:
+ *    `BT_ERR_TIMEOUT`         - no connection arrived before the deadline
+ *    `BT_ERR_CANCELLED`       - the token was cancelled first
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL, or max zero
+ */
+bt_err_t bt_accept_many_cancellable(bt_socket_t const * listener, bt_socket_t * socks, size_t max, bt_deadline_t deadline, size_t * count, bt_cancel_token_t const * cancel) {
+	bool nonblocking;
+	size_t accepted;
+	bt_err_t err;
+
+	// check parameters
+	if (listener == NULL || socks == NULL || count == NULL || max == 0) {
+		LOG("bt_accept_many: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	*count = 0;
+
+#ifdef WINDOWS
+	// there's no way to ask, so assume the worst
+	nonblocking = false;
+#else
+	nonblocking = (fcntl(listener->s, F_GETFL) & O_NONBLOCK) != 0;
+#endif
+
+	accepted = 0;
+	err = BT_ERR_WOULD_BLOCK;
+	while (accepted == 0 && err == BT_ERR_WOULD_BLOCK) {
+		err = bt_wait_socket(listener, POLLIN, deadline, cancel);
+		while (err == BT_SUCCESS && accepted < max) {
+			if (accepted > 0 && !nonblocking) {
+				// don't block on an empty queue
+				err = bt_wait_socket(listener, POLLIN, bt_deadline_from_ms(0), NULL);
+				if (err != BT_SUCCESS) {
+					break;
+				}
+			}
+			err = bt_accept_nonblocking(listener, &socks[accepted]);
+			if (err == BT_SUCCESS) {
+				accepted++;
+			}
+		}
+		// a connection may have gone away after the listener became ready
+	}
+
+	*count = accepted;
+	LOG("bt_accept_many: accepted %lu connections\n", (unsigned long) accepted);
+
+	return (accepted > 0) ? BT_SUCCESS : err;
+}
+
+/******************************************************************************\
+ * FILE TRANSFER                                                              *
+\******************************************************************************/
+
+/// The most data moved by a single system call when sending a file.
+#define BT_SENDFILE_CHUNK (64 * 1024)
+/// The size of the buffer used when a file has to be copied through memory.
+#define BT_SENDFILE_COPY_BUFFER (16 * 1024)
+
+#ifndef WINDOWS
+/**
+ * Send part of a file using `sendfile`, which copies it to the socket without
+ * it passing through user memory.
+ *
+ * @param socket    The socket to send on.
+ * @param fd        The file to send from.
+ * @param offset    The position in the file, advanced as data is sent.
+ * @param remaining The number of bytes to send, reduced as data is sent.
+ * @param calls     Incremented for each system call made.
+ *
+ * @return `BT_SUCCESS` once everything has been sent, `BT_ERR_UNSUPPORTED` if
+ *         `sendfile` can't be used with this file and socket, or an error from
+ *         sending. Whatever was sent before an error is accounted for in
+ *         `offset` and `remaining`.
+ */
+static bt_err_t bt_sendfile_kernel(bt_socket_t *socket, int fd, int64_t *offset, size_t *remaining, unsigned long *calls) {
+	off_t position;
+	ssize_t n;
+	bt_err_t e;
+
+	while (*remaining > 0) {
+		position = (off_t) *offset;
+		n = sendfile(socket->s, fd, &position, (*remaining < BT_SENDFILE_CHUNK) ? *remaining : BT_SENDFILE_CHUNK);
+		(*calls)++;
+		if (n > 0) {
+			*offset += n;
+			*remaining -= n;
+		}
+		else if (n == 0) {
+			LOG("bt_sendfile: file ended with %lu bytes left to send\n", (unsigned long) *remaining);
+			return BT_ERR_UNKNOWN;
+		}
+		else if (SOCKET_WOULD_BLOCK(errno)) {
+			e = bt_wait_socket(socket, POLLOUT, BT_DEADLINE_NEVER, NULL);
+			if (e != BT_SUCCESS)
+				return e;
+		}
+		else if ((errno == EINVAL) || (errno == ENOSYS)) {
+			return BT_ERR_UNSUPPORTED;
+		}
+		else if (errno != EINTR) {
+			LOG("bt_sendfile: error %d sending to socket %d\n", errno, socket->s);
+			return bt_err_from_errno(errno);
+		}
+	}
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Send part of a file using `splice`, moving it through a pipe without it
+ * passing through user memory. The parameters and return values are the same
+ * as for {@link bt_sendfile_kernel}.
+ */
+static bt_err_t bt_sendfile_splice(bt_socket_t *socket, int fd, int64_t *offset, size_t *remaining, unsigned long *calls) {
+	int pipefd[2];
+	loff_t position;
+	size_t queued;
+	ssize_t n;
+	bt_err_t e;
+
+	if (pipe2(pipefd, O_CLOEXEC) != 0) {
+		LOG("bt_sendfile: error %d creating pipe\n", errno);
+		return BT_ERR_UNSUPPORTED;
+	}
+	(*calls)++;
+
+	e = BT_SUCCESS;
+	while ((*remaining > 0) && (e == BT_SUCCESS)) {
+		// fill the pipe from the file
+		position = (loff_t) *offset;
+		n = splice(fd, &position, pipefd[1], NULL, (*remaining < BT_SENDFILE_CHUNK) ? *remaining : BT_SENDFILE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+		(*calls)++;
+		if (n < 0) {
+			if (errno != EINTR) {
+				e = ((errno == EINVAL) || (errno == ENOSYS)) ? BT_ERR_UNSUPPORTED : BT_ERR_UNKNOWN;
+			}
+			continue;
+		}
+		if (n == 0) {
+			LOG("bt_sendfile: file ended with %lu bytes left to send\n", (unsigned long) *remaining);
+			e = BT_ERR_UNKNOWN;
+			continue;
+		}
+
+		// then drain it into the socket; the offset only moves on once data
+		// reaches the socket, so anything left in the pipe can be discarded
+		queued = n;
+		while ((queued > 0) && (e == BT_SUCCESS)) {
+			n = splice(pipefd[0], NULL, socket->s, NULL, queued, SPLICE_F_MOVE | SPLICE_F_MORE);
+			(*calls)++;
+			if (n > 0) {
+				queued -= n;
+				*offset += n;
+				*remaining -= n;
+			}
+			else if (n == 0) {
+				e = BT_SOCKET_CLOSED;
+			}
+			else if (SOCKET_WOULD_BLOCK(errno)) {
+				e = bt_wait_socket(socket, POLLOUT, BT_DEADLINE_NEVER, NULL);
+			}
+			else if (errno == EINVAL) {
+				e = BT_ERR_UNSUPPORTED;
+			}
+			else if (errno != EINTR) {
+				LOG("bt_sendfile: error %d sending to socket %d\n", errno, socket->s);
+				e = bt_err_from_errno(errno);
+			}
+		}
+	}
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+	return e;
+}
+#endif
+
+/**
+ * Send part of a file by reading it into a buffer and writing that to the
+ * socket. This works for any file and socket. The parameters and return
+ * values are the same as for {@link bt_sendfile_kernel}, except that
+ * `BT_ERR_UNSUPPORTED` is never returned.
+ */
+static bt_err_t bt_sendfile_copy(bt_socket_t *socket, int fd, int64_t *offset, size_t *remaining, unsigned long *calls) {
+	char buffer[BT_SENDFILE_COPY_BUFFER];
+	size_t size;
+	ssize_t n;
+	bt_err_t e;
+
+	while (*remaining > 0) {
+		size = (*remaining < sizeof(buffer)) ? *remaining : sizeof(buffer);
+#ifdef WINDOWS
+		n = -1;
+		if (_lseeki64(fd, *offset, SEEK_SET) >= 0) {
+			n = _read(fd, buffer, (unsigned int) size);
+		}
+#else
+		n = pread(fd, buffer, size, (off_t) *offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+#endif
+		(*calls)++;
+		if (n <= 0) {
+			LOG("bt_sendfile: error reading file with %lu bytes left to send\n", (unsigned long) *remaining);
+			return BT_ERR_UNKNOWN;
+		}
+
+		// blocks even if the socket doesn't, like the other methods
+		e = bt_write_deadline(socket, buffer, n, BT_DEADLINE_NEVER);
+		(*calls)++;
+		if (e != BT_SUCCESS)
+			return e;
+
+		*offset += n;
+		*remaining -= n;
+	}
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Send part of a file on a Bluetooth socket. On Linux the data is moved by
+ * the kernel using `sendfile`, or `splice` if that isn't possible, so it
+ * never passes through user memory. If neither can be used with the socket,
+ * and on Windows, the file is read into a buffer and written to the socket.
+ *
+ * The call blocks until all the data has been sent, even if the socket is
+ * non-blocking. The file's own position isn't changed.
+ *
+ * @param socket The socket to send on.
+ * @param fd     The file descriptor to send from.
+ * @param offset The position in the file to start from.
+ * @param length The number of bytes to send.
+ * @param stats  If not NULL, returns how many bytes were sent, how long it
+ *               took and which method was used last. This is filled in even
+ *               if there's an error.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The socket was NULL, or the file or offset
+ *                               invalid
+ *    `BT_SOCKET_CLOSED`       - the socket has been closed
+ *    `BT_ERR_UNKNOWN`         - the file couldn't be read or ended early, or
+ *                               some other error occured
+ */
+bt_err_t bt_sendfile(bt_socket_t *socket, int fd, int64_t offset, size_t length, bt_sendfile_stats_t *stats) {
+	bt_sendfile_stats_t result;
+	size_t remaining;
+	int64_t start;
+	bt_err_t e;
+
+	// check parameters
+	if (socket == NULL || fd < 0 || offset < 0) {
+		LOG("bt_sendfile: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	memset(&result, 0, sizeof(result));
+	remaining = length;
+	start = bt_time_now_us();
+
+#ifdef WINDOWS
+	e = BT_ERR_UNSUPPORTED;
+#else
+	result.method = BT_SENDFILE_METHOD_SENDFILE;
+	e = bt_sendfile_kernel(socket, fd, &offset, &remaining, &result.calls);
+	if (e == BT_ERR_UNSUPPORTED) {
+		result.method = BT_SENDFILE_METHOD_SPLICE;
+		e = bt_sendfile_splice(socket, fd, &offset, &remaining, &result.calls);
+	}
+#endif
+	if (e == BT_ERR_UNSUPPORTED) {
+		result.method = BT_SENDFILE_METHOD_COPY;
+		e = bt_sendfile_copy(socket, fd, &offset, &remaining, &result.calls);
+	}
+
+	result.bytes = length - remaining;
+	result.elapsed_us = bt_time_now_us() - start;
+	if (stats != NULL) {
+		*stats = result;
+	}
+
+	return e;
+}
@@ -0,0 +1,543 @@
+/**
+ * @file btpool.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Pool of reusable connections
+ *
+ * Making an RFCOMM connection means an SDP query followed by a connect, which
+ * together take far longer than sending a short message. The pool keeps
+ * connections open once they've been used, keyed by the device address and
+ * service UUID, so that the next message to the same service can go straight
+ * out.
+ *
+ * A connection is checked out with {@link bt_pool_get} and checked back in
+ * with {@link bt_pool_put}, saying whether it's still good. A connection
+ * that failed is closed rather than kept, and an idle connection is checked
+ * before it's handed out again in case the other end has gone away in the
+ * meantime. Connections left idle for longer than the idle timeout are
+ * closed, and when the pool is full the one idle for longest makes way.
+ *
+ * The lock is never held while connecting or checking a connection, so one
+ * slow device doesn't hold up threads using the pool for others.
+ *
+ * The pool is currently only available on Linux. On Windows initialising a
+ * pool returns `BT_ERR_UNSUPPORTED`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "picobt/bt.h"
+#include "picobt/btpool.h"
+#ifdef WINDOWS
+// nothing further to include
+#else // LINUX
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+#include "picobt/log.h"
+
+#ifdef WINDOWS
+
+bt_err_t bt_pool_init(bt_pool_t *pool, bt_pool_config_t const *config) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_pool_free(bt_pool_t *pool) {
+}
+
+bt_err_t bt_pool_get(bt_pool_t *pool, bt_addr_t const *address, bt_uuid_t const *service, bt_socket_t *sock) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_pool_get_ex(bt_pool_t *pool, bt_addr_t const *address, bt_uuid_t const *service, bt_socket_t *sock, int timeout_ms) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_pool_checkout(bt_pool_t *pool, bt_addr_t const *address, bt_uuid_t const *service, bt_socket_t *sock, int timeout_ms, bool *reused) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_pool_put(bt_pool_t *pool, bt_socket_t *sock, bt_err_t status) {
+	bt_disconnect(sock);
+}
+
+void bt_pool_expire(bt_pool_t *pool) {
+}
+
+void bt_pool_get_stats(bt_pool_t *pool, bt_pool_stats_t *stats) {
+	if (stats != NULL)
+		memset(stats, 0, sizeof(bt_pool_stats_t));
+}
+
+#else // LINUX
+
+/**
+ * A connection held by the pool.
+ */
+typedef struct _bt_pool_entry_t {
+	/// The device the connection is to.
+	bt_addr_t address;
+	/// The service the connection is for.
+	bt_uuid_t service;
+	/// The connection.
+	bt_socket_t sock;
+	/// Whether the connection is checked out.
+	bool in_use;
+	/// When the connection was last checked in, from {@link bt_time_now_us}.
+	int64_t last_used;
+	/// The next connection in the pool.
+	struct _bt_pool_entry_t *next;
+} bt_pool_entry_t;
+
+/**
+ * The private state of a pool.
+ */
+typedef struct {
+	/// Protects everything else here.
+	pthread_mutex_t lock;
+	/// The connections, most recently added first.
+	bt_pool_entry_t *entries;
+	/// The number of connections held.
+	size_t count;
+	/// Counters for monitoring the pool.
+	bt_pool_stats_t stats;
+} bt_pool_state_t;
+
+/**
+ * Unlink an entry from the pool. The lock must be held.
+ *
+ * @param state The pool's state
+ * @param entry The entry to remove
+ */
+static void bt_pool_unlink(bt_pool_state_t *state, bt_pool_entry_t *entry) {
+	bt_pool_entry_t **link;
+
+	for (link = &state->entries; *link != NULL; link = &(*link)->next) {
+		if (*link == entry) {
+			*link = entry->next;
+			state->count--;
+			return;
+		}
+	}
+}
+
+/**
+ * Close and remove an entry. The lock must be held.
+ *
+ * @param state The pool's state
+ * @param entry The entry to close
+ */
+static void bt_pool_drop(bt_pool_state_t *state, bt_pool_entry_t *entry) {
+	bt_pool_unlink(state, entry);
+	bt_disconnect(&entry->sock);
+	free(entry);
+}
+
+/**
+ * Close idle connections that have gone unused for longer than the idle
+ * timeout. The lock must be held.
+ *
+ * @param pool The pool to sweep
+ * @param state The pool's state
+ */
+static void bt_pool_expire_locked(bt_pool_t *pool, bt_pool_state_t *state) {
+	bt_pool_entry_t *entry;
+	bt_pool_entry_t *next;
+	int64_t cutoff;
+
+	if (pool->config.idle_timeout_ms == BT_POOL_NO_IDLE_TIMEOUT)
+		return;
+
+	cutoff = bt_time_now_us() - (int64_t) pool->config.idle_timeout_ms * 1000;
+	for (entry = state->entries; entry != NULL; entry = next) {
+		next = entry->next;
+		if (!entry->in_use && entry->last_used <= cutoff) {
+			LOG("bt_pool: closing idle connection %d\n", entry->sock.s);
+			bt_pool_drop(state, entry);
+			state->stats.expired++;
+		}
+	}
+}
+
+/**
+ * Check whether an idle connection is still open at the other end. A
+ * connection the other end has closed shows up as readable with nothing to
+ * read, or as a hangup or error.
+ *
+ * @param sock The connection to check
+ *
+ * @return true if the connection looks usable
+ */
+static bool bt_pool_alive(bt_socket_t const *sock) {
+	struct pollfd pfd;
+	unsigned char byte;
+	ssize_t result;
+
+	pfd.fd = sock->s;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) < 0)
+		return false;
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return false;
+	if (pfd.revents & POLLIN) {
+		result = recv(sock->s, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+		if (result == 0)
+			return false;
+		if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Find the idle connection that has gone unused for longest, preferring the
+ * one made first if several were returned together. The lock must
+ * be held.
+ *
+ * @param state The pool's state
+ *
+ * @return The least recently used idle connection, or NULL if all the
+ *         connections are checked out
+ */
+static bt_pool_entry_t *bt_pool_oldest_idle(bt_pool_state_t *state) {
+	bt_pool_entry_t *entry;
+	bt_pool_entry_t *oldest;
+
+	oldest = NULL;
+	for (entry = state->entries; entry != NULL; entry = entry->next) {
+		if (!entry->in_use && (oldest == NULL || entry->last_used <= oldest->last_used))
+			oldest = entry;
+	}
+
+	return oldest;
+}
+
+/**
+ * Initialise a connection pool. It starts empty.
+ *
+ * @param pool The pool to initialise
+ * @param config How to set up the pool, or NULL to use the defaults
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following error values:
+ *    `BT_ERR_BAD_PARAM`   - the pool is NULL or the idle timeout is negative
+ *    `BT_ERR_UNKNOWN`     - memory for the pool couldn't be allocated
+ *    `BT_ERR_UNSUPPORTED` - pools aren't supported on this platform
+ */
+bt_err_t bt_pool_init(bt_pool_t *pool, bt_pool_config_t const *config) {
+	bt_pool_state_t *state;
+
+	if (pool == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	memset(&pool->config, 0, sizeof(bt_pool_config_t));
+	if (config != NULL)
+		pool->config = *config;
+	if (pool->config.max_size == 0)
+		pool->config.max_size = BT_POOL_DEFAULT_SIZE;
+	if (pool->config.idle_timeout_ms == 0)
+		pool->config.idle_timeout_ms = BT_POOL_DEFAULT_IDLE_TIMEOUT;
+	if (pool->config.idle_timeout_ms < 0 && pool->config.idle_timeout_ms != BT_POOL_NO_IDLE_TIMEOUT)
+		return BT_ERR_BAD_PARAM;
+
+	state = calloc(1, sizeof(bt_pool_state_t));
+	if (state == NULL) {
+		LOG("bt_pool_init: could not allocate pool\n");
+		return BT_ERR_UNKNOWN;
+	}
+	pthread_mutex_init(&state->lock, NULL);
+	pool->state = state;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Close every connection in the pool and free its resources. No connections
+ * should be checked out; any that are must still be returned with
+ * {@link bt_pool_put} or closed with {@link bt_disconnect}, and the pool
+ * mustn't be used again.
+ *
+ * @param pool The pool to free
+ */
+void bt_pool_free(bt_pool_t *pool) {
+	bt_pool_state_t *state;
+	bt_pool_entry_t *entry;
+
+	if (pool == NULL || pool->state == NULL)
+		return;
+	state = pool->state;
+
+	while (state->entries != NULL) {
+		entry = state->entries;
+		state->entries = entry->next;
+		if (!entry->in_use)
+			bt_disconnect(&entry->sock);
+		free(entry);
+	}
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+	pool->state = NULL;
+}
+
+/**
+ * Check out a connection to a service on a device. This is the same as
+ * {@link bt_pool_get_ex} with no time limit on making a new connection.
+ *
+ * @param pool The pool to take the connection from
+ * @param address Bluetooth address of the device to connect to
+ * @param service UUID of the service to connect to
+ * @param sock Pointer to a Bluetooth socket, that, if the operation is
+ *             successful, is connected to the remote service
+ *
+ * @return `BT_SUCCESS` if successful, `BT_ERR_BAD_PARAM` if any parameter is
+ *         NULL, or any of the errors returned by {@link bt_connect_to_service}
+ */
+bt_err_t bt_pool_get(bt_pool_t *pool, bt_addr_t const *address, bt_uuid_t const *service, bt_socket_t *sock) {
+	return bt_pool_get_ex(pool, address, service, sock, BT_CONNECT_NO_TIMEOUT);
+}
+
+/**
+ * Check out a connection to a service on a device. An idle connection to the
+ * same service is reused if there is one and it's still open; otherwise a
+ * new connection is made with {@link bt_connect_to_service_ex}. A connection
+ * checked out must be returned with {@link bt_pool_put}, even if it fails.
+ *
+ * If the pool is full and every connection in it is checked out, the new
+ * connection is returned anyway but isn't kept; {@link bt_pool_put} closes
+ * it.
+ *
+ * @param pool The pool to take the connection from
+ * @param address Bluetooth address of the device to connect to
+ * @param service UUID of the service to connect to
+ * @param sock Pointer to a Bluetooth socket, that, if the operation is
+ *             successful, is connected to the remote service
+ * @param timeout_ms The longest time to wait for a new connection in
+ *             milliseconds, or `BT_CONNECT_NO_TIMEOUT` to wait as long as the
+ *             operating system does
+ *
+ * @return `BT_SUCCESS` if successful, `BT_ERR_BAD_PARAM` if any parameter is
+ *         NULL, or any of the errors returned by
+ *         {@link bt_connect_to_service_ex}
+ */
+bt_err_t bt_pool_get_ex(bt_pool_t *pool, bt_addr_t const *address, bt_uuid_t const *service, bt_socket_t *sock, int timeout_ms) {
+	return bt_pool_checkout(pool, address, service, sock, timeout_ms, NULL);
+}
+
+/**
+ * Check out a connection to a service on a device, as
+ * {@link bt_pool_get_ex} does, also saying whether the connection was
+ * reused. A reused connection can still turn out to have been closed by the
+ * other end when it's written to, so a caller that gets an error from it may
+ * want to return it and try again with a new one.
+ *
+ * @param pool The pool to take the connection from
+ * @param address Bluetooth address of the device to connect to
+ * @param service UUID of the service to connect to
+ * @param sock Pointer to a Bluetooth socket, that, if the operation is
+ *             successful, is connected to the remote service
+ * @param timeout_ms The longest time to wait for a new connection in
+ *             milliseconds, or `BT_CONNECT_NO_TIMEOUT` to wait as long as the
+ *             operating system does
+ * @param reused If not NULL, set to true if an idle connection was reused,
+ *             or false if a new connection was made
+ *
+ * @return `BT_SUCCESS` if successful, `BT_ERR_BAD_PARAM` if any parameter
+ *         other than `reused` is NULL, or any of the errors returned by
+ *         {@link bt_connect_to_service_ex}
+ */
+bt_err_t bt_pool_checkout(bt_pool_t *pool, bt_addr_t const *address, bt_uuid_t const *service, bt_socket_t *sock, int timeout_ms, bool *reused) {
+	bt_pool_state_t *state;
+	bt_pool_entry_t *entry;
+	bt_pool_entry_t *victim;
+	bt_err_t result;
+
+	if (pool == NULL || pool->state == NULL || address == NULL || service == NULL || sock == NULL)
+		return BT_ERR_BAD_PARAM;
+	state = pool->state;
+	if (reused != NULL)
+		*reused = false;
+
+	pthread_mutex_lock(&state->lock);
+	bt_pool_expire_locked(pool, state);
+
+	entry = state->entries;
+	while (entry != NULL) {
+		if (entry->in_use || memcmp(&entry->address, address, sizeof(bt_addr_t)) != 0
+			|| memcmp(&entry->service, service, sizeof(bt_uuid_t)) != 0) {
+			entry = entry->next;
+			continue;
+		}
+
+		// reserve the connection before checking it, so no other thread takes it
+		entry->in_use = true;
+		pthread_mutex_unlock(&state->lock);
+		if (bt_pool_alive(&entry->sock)) {
+			pthread_mutex_lock(&state->lock);
+			state->stats.hits++;
+			pthread_mutex_unlock(&state->lock);
+			*sock = entry->sock;
+			if (reused != NULL)
+				*reused = true;
+			return BT_SUCCESS;
+		}
+
+		LOG("bt_pool_get: connection %d closed by the other end\n", entry->sock.s);
+		pthread_mutex_lock(&state->lock);
+		bt_pool_drop(state, entry);
+		state->stats.evicted++;
+		// the list may have changed while the lock was released
+		entry = state->entries;
+	}
+
+	state->stats.misses++;
+	pthread_mutex_unlock(&state->lock);
+
+	result = bt_connect_to_service_ex(address, service, sock, timeout_ms);
+	if (result != BT_SUCCESS)
+		return result;
+
+	pthread_mutex_lock(&state->lock);
+	if (state->count >= pool->config.max_size) {
+		// make room by closing the connection that's been idle longest
+		victim = bt_pool_oldest_idle(state);
+		if (victim != NULL) {
+			bt_pool_drop(state, victim);
+			state->stats.expired++;
+		}
+	}
+	if (state->count < pool->config.max_size) {
+		entry = calloc(1, sizeof(bt_pool_entry_t));
+		if (entry != NULL) {
+			entry->address = *address;
+			entry->service = *service;
+			entry->sock = *sock;
+			entry->in_use = true;
+			entry->next = state->entries;
+			state->entries = entry;
+			state->count++;
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return result;
+}
+
+/**
+ * Check a connection back in to the pool it was taken from. If the
+ * connection failed while it was checked out it's closed and removed from
+ * the pool; otherwise it's kept open for reuse. Either way the socket
+ * passed in is invalidated, and mustn't be used again.
+ *
+ * @param pool The pool the connection was taken from
+ * @param sock The connection returned by {@link bt_pool_get}
+ * @param status `BT_SUCCESS` if the connection is still good, otherwise the
+ *               error that it failed with
+ */
+void bt_pool_put(bt_pool_t *pool, bt_socket_t *sock, bt_err_t status) {
+	bt_pool_state_t *state;
+	bt_pool_entry_t *entry;
+
+	if (sock == NULL || sock->s < 0)
+		return;
+	if (pool == NULL || pool->state == NULL) {
+		bt_disconnect(sock);
+		return;
+	}
+	state = pool->state;
+
+	pthread_mutex_lock(&state->lock);
+	for (entry = state->entries; entry != NULL; entry = entry->next) {
+		if (entry->in_use && entry->sock.s == sock->s)
+			break;
+	}
+
+	if (entry == NULL) {
+		// the pool was full when the connection was made
+		bt_disconnect(sock);
+	} else if (status != BT_SUCCESS) {
+		LOG("bt_pool_put: dropping failed connection %d\n", entry->sock.s);
+		bt_pool_drop(state, entry);
+		state->stats.evicted++;
+	} else {
+		entry->in_use = false;
+		entry->last_used = bt_time_now_us();
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	sock->s = -1;
+}
+
+/**
+ * Close any connections that have been idle for longer than the pool's idle
+ * timeout. This happens anyway whenever a connection is checked out, but can
+ * be called periodically to release connections sooner.
+ *
+ * @param pool The pool to sweep
+ */
+void bt_pool_expire(bt_pool_t *pool) {
+	bt_pool_state_t *state;
+
+	if (pool == NULL || pool->state == NULL)
+		return;
+	state = pool->state;
+
+	pthread_mutex_lock(&state->lock);
+	bt_pool_expire_locked(pool, state);
+	pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Get a snapshot of a pool's counters.
+ *
+ * @param pool The pool to query
+ * @param stats Filled with the counters
+ */
+void bt_pool_get_stats(bt_pool_t *pool, bt_pool_stats_t *stats) {
+	bt_pool_state_t *state;
+	bt_pool_entry_t *entry;
+
+	if (stats == NULL)
+		return;
+	memset(stats, 0, sizeof(bt_pool_stats_t));
+	if (pool == NULL || pool->state == NULL)
+		return;
+	state = pool->state;
+
+	pthread_mutex_lock(&state->lock);
+	*stats = state->stats;
+	stats->size = state->count;
+	for (entry = state->entries; entry != NULL; entry = entry->next) {
+		if (entry->in_use)
+			stats->in_use++;
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+#endif
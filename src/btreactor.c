@@ -0,0 +1,581 @@
+/**
+ * @file btreactor.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Event loop for serving many sockets from one thread.
+ *
+ * The blocking calls in btmain.c need a thread per connection, and the
+ * `select` used by {@link bt_accept_with_timeout} can't handle descriptors
+ * above `FD_SETSIZE`. The reactor here instead waits on all registered
+ * sockets at once using epoll, and calls back when one becomes ready.
+ * Registered sockets are switched to non-blocking mode, so callbacks should
+ * read and write until `BT_ERR_WOULD_BLOCK` is returned.
+ *
+ * Events are level-triggered: a socket that still has data waiting will be
+ * reported again on the next pass of the loop.
+ *
+ * The reactor is currently only available on Linux. On Windows all of the
+ * functions return `BT_ERR_UNSUPPORTED`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "picobt/bt.h"
+#include "picobt/btreactor.h"
+#ifdef WINDOWS
+// nothing further to include
+#else // LINUX
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#endif
+
+#include "picobt/log.h"
+
+#ifdef WINDOWS
+
+bt_err_t bt_reactor_init(bt_reactor_t *reactor) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_reactor_free(bt_reactor_t *reactor) {
+}
+
+bt_err_t bt_reactor_add(bt_reactor_t *reactor, bt_socket_t *socket, int events, bt_reactor_callback_t callback, void *data) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_reactor_add_listener(bt_reactor_t *reactor, bt_socket_t *listener, bt_reactor_accept_callback_t callback, void *data) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_reactor_modify(bt_reactor_t *reactor, bt_socket_t *socket, int events) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_reactor_remove(bt_reactor_t *reactor, bt_socket_t *socket) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+size_t bt_reactor_count(bt_reactor_t const *reactor) {
+	return 0;
+}
+
+bt_err_t bt_reactor_run_once(bt_reactor_t *reactor, int timeout_ms, int *dispatched) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_reactor_run(bt_reactor_t *reactor) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_reactor_stop(bt_reactor_t *reactor) {
+}
+
+#else // LINUX
+
+/**
+ * Initialise a reactor. Free its resources using {@link bt_reactor_free}.
+ *
+ * @param reactor The reactor to initialise.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The reactor was NULL
+ *    `BT_ERR_UNKNOWN`         - the event queue couldn't be created
+ */
+bt_err_t bt_reactor_init(bt_reactor_t *reactor) {
+	// check parameters
+	if (reactor == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	memset(reactor, 0, sizeof(bt_reactor_t));
+	reactor->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->fd < 0) {
+		LOG("bt_reactor_init: error %d creating event queue\n", errno);
+		return BT_ERR_UNKNOWN;
+	}
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Free the handlers that were removed while events were being dispatched.
+ *
+ * @param reactor The reactor to tidy up.
+ */
+static void bt_reactor_free_removed(bt_reactor_t *reactor) {
+	bt_reactor_handler_t *handler;
+
+	while (reactor->removed != NULL) {
+		handler = reactor->removed;
+		reactor->removed = handler->next;
+		free(handler);
+	}
+}
+
+/**
+ * Free the resources associated with a reactor. Sockets still registered are
+ * removed from the reactor, but are not closed.
+ *
+ * @param reactor The reactor to free.
+ */
+void bt_reactor_free(bt_reactor_t *reactor) {
+	size_t i;
+
+	if (reactor == NULL)
+		return;
+
+	for (i = 0; i < reactor->size; i++) {
+		if (reactor->handlers[i] != NULL)
+			free(reactor->handlers[i]);
+	}
+	free(reactor->handlers);
+	bt_reactor_free_removed(reactor);
+
+	if (reactor->fd >= 0)
+		close(reactor->fd);
+
+	memset(reactor, 0, sizeof(bt_reactor_t));
+	reactor->fd = -1;
+}
+
+/**
+ * Convert the reactor's event flags into those used by epoll.
+ *
+ * @param events A combination of `BT_REACTOR_*` event flags.
+ *
+ * @return The equivalent epoll event mask.
+ */
+static uint32_t bt_reactor_to_epoll(int events) {
+	uint32_t mask;
+
+	// closure is always reported
+	mask = EPOLLRDHUP;
+	if (events & BT_REACTOR_READABLE)
+		mask |= EPOLLIN;
+	if (events & BT_REACTOR_WRITABLE)
+		mask |= EPOLLOUT;
+
+	return mask;
+}
+
+/**
+ * Convert the events reported by epoll into the reactor's event flags.
+ *
+ * @param mask The epoll event mask.
+ *
+ * @return The equivalent combination of `BT_REACTOR_*` event flags.
+ */
+static int bt_reactor_from_epoll(uint32_t mask) {
+	int events;
+
+	events = 0;
+	if (mask & EPOLLIN)
+		events |= BT_REACTOR_READABLE;
+	if (mask & EPOLLOUT)
+		events |= BT_REACTOR_WRITABLE;
+	if (mask & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		events |= BT_REACTOR_CLOSED;
+
+	return events;
+}
+
+/**
+ * Find the handler for a registered socket.
+ *
+ * @param reactor The reactor to search.
+ * @param socket  The socket to find.
+ *
+ * @return The handler, or NULL if the socket isn't registered.
+ */
+static bt_reactor_handler_t *bt_reactor_find(bt_reactor_t const *reactor, bt_socket_t const *socket) {
+	if (socket->s < 0 || (size_t) socket->s >= reactor->size)
+		return NULL;
+
+	return reactor->handlers[socket->s];
+}
+
+/**
+ * Register a handler for a socket, switching the socket to non-blocking mode
+ * and adding it to the event queue.
+ *
+ * @param reactor The reactor to register with.
+ * @param handler The handler to register. On success the reactor takes
+ *                ownership of it.
+ *
+ * @return `BT_SUCCESS` if successful, `BT_ERR_BAD_PARAM` if the socket is
+ *         already registered, or `BT_ERR_UNKNOWN` on any other failure.
+ */
+static bt_err_t bt_reactor_register(bt_reactor_t *reactor, bt_reactor_handler_t *handler) {
+	struct epoll_event event;
+	bt_reactor_handler_t **handlers;
+	size_t size;
+	int fd;
+
+	fd = handler->socket->s;
+	if (bt_reactor_find(reactor, handler->socket) != NULL) {
+		LOG("bt_reactor_register: socket %d is already registered\n", fd);
+		return BT_ERR_BAD_PARAM;
+	}
+
+	// make sure there's a slot for the descriptor
+	if ((size_t) fd >= reactor->size) {
+		size = (reactor->size > 0) ? reactor->size : 16;
+		while (size <= (size_t) fd)
+			size *= 2;
+		handlers = realloc(reactor->handlers, size * sizeof(bt_reactor_handler_t *));
+		if (handlers == NULL) {
+			LOG("bt_reactor_register: could not allocate %lu handler slots\n", (unsigned long) size);
+			return BT_ERR_UNKNOWN;
+		}
+		memset(handlers + reactor->size, 0, (size - reactor->size) * sizeof(bt_reactor_handler_t *));
+		reactor->handlers = handlers;
+		reactor->size = size;
+	}
+
+	if (bt_set_nonblocking(handler->socket, true) != BT_SUCCESS)
+		return BT_ERR_UNKNOWN;
+
+	memset(&event, 0, sizeof(event));
+	event.events = bt_reactor_to_epoll(handler->events);
+	event.data.ptr = handler;
+	if (epoll_ctl(reactor->fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		LOG("bt_reactor_register: error %d adding socket %d\n", errno, fd);
+		return BT_ERR_UNKNOWN;
+	}
+
+	reactor->handlers[fd] = handler;
+	reactor->count++;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Register a connected socket with the reactor. The socket is switched to
+ * non-blocking mode, and the callback is invoked whenever one of the
+ * requested events occurs. Closure of the socket is always reported.
+ *
+ * @param reactor  The reactor to register with.
+ * @param socket   The socket to watch. The structure must remain valid until
+ *                 the socket is removed from the reactor.
+ * @param events   A combination of `BT_REACTOR_READABLE` and
+ *                 `BT_REACTOR_WRITABLE`.
+ * @param callback The function to call when the socket is ready.
+ * @param data     User data to pass to the callback.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL, or the socket
+ *                               is already registered
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+bt_err_t bt_reactor_add(bt_reactor_t *reactor, bt_socket_t *socket, int events, bt_reactor_callback_t callback, void *data) {
+	bt_reactor_handler_t *handler;
+	bt_err_t e;
+
+	// check parameters
+	if (reactor == NULL || socket == NULL || callback == NULL || socket->s < 0) {
+		LOG("bt_reactor_add: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	handler = calloc(1, sizeof(bt_reactor_handler_t));
+	if (handler == NULL)
+		return BT_ERR_UNKNOWN;
+	handler->socket = socket;
+	handler->events = events;
+	handler->callback = callback;
+	handler->data = data;
+
+	e = bt_reactor_register(reactor, handler);
+	if (e != BT_SUCCESS)
+		free(handler);
+
+	return e;
+}
+
+/**
+ * Register a listening socket with the reactor. The socket should already
+ * have been bound and had {@link bt_listen} called on it. Whenever
+ * connections arrive they're accepted and passed to the callback one at a
+ * time.
+ *
+ * @param reactor  The reactor to register with.
+ * @param listener The listening socket. The structure must remain valid until
+ *                 the socket is removed from the reactor.
+ * @param callback The function to call for each new connection.
+ * @param data     User data to pass to the callback.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL, or the socket
+ *                               is already registered
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+bt_err_t bt_reactor_add_listener(bt_reactor_t *reactor, bt_socket_t *listener, bt_reactor_accept_callback_t callback, void *data) {
+	bt_reactor_handler_t *handler;
+	bt_err_t e;
+
+	// check parameters
+	if (reactor == NULL || listener == NULL || callback == NULL || listener->s < 0) {
+		LOG("bt_reactor_add_listener: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	handler = calloc(1, sizeof(bt_reactor_handler_t));
+	if (handler == NULL)
+		return BT_ERR_UNKNOWN;
+	handler->socket = listener;
+	handler->events = BT_REACTOR_READABLE;
+	handler->on_accept = callback;
+	handler->data = data;
+
+	e = bt_reactor_register(reactor, handler);
+	if (e != BT_SUCCESS)
+		free(handler);
+
+	return e;
+}
+
+/**
+ * Change the events a registered socket is watched for. A typical use is to
+ * ask for `BT_REACTOR_WRITABLE` only while there's data queued to send.
+ *
+ * @param reactor The reactor the socket is registered with.
+ * @param socket  The registered socket.
+ * @param events  A combination of `BT_REACTOR_READABLE` and
+ *                `BT_REACTOR_WRITABLE`.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - One of the parameters was NULL, or the socket
+ *                               isn't registered
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+bt_err_t bt_reactor_modify(bt_reactor_t *reactor, bt_socket_t *socket, int events) {
+	bt_reactor_handler_t *handler;
+	struct epoll_event event;
+
+	// check parameters
+	if (reactor == NULL || socket == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	handler = bt_reactor_find(reactor, socket);
+	if (handler == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	memset(&event, 0, sizeof(event));
+	event.events = bt_reactor_to_epoll(events);
+	event.data.ptr = handler;
+	if (epoll_ctl(reactor->fd, EPOLL_CTL_MOD, socket->s, &event) < 0) {
+		LOG("bt_reactor_modify: error %d modifying socket %d\n", errno, socket->s);
+		return BT_ERR_UNKNOWN;
+	}
+	handler->events = events;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Stop watching a socket. This is safe to call from within a callback,
+ * including for the socket whose callback is running. The socket is left in
+ * non-blocking mode and isn't closed, so call this before
+ * {@link bt_disconnect}.
+ *
+ * @param reactor The reactor the socket is registered with.
+ * @param socket  The registered socket.
+ *
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_BAD_PARAM` if the socket
+ *         isn't registered.
+ */
+bt_err_t bt_reactor_remove(bt_reactor_t *reactor, bt_socket_t *socket) {
+	bt_reactor_handler_t *handler;
+
+	// check parameters
+	if (reactor == NULL || socket == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	handler = bt_reactor_find(reactor, socket);
+	if (handler == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	if (epoll_ctl(reactor->fd, EPOLL_CTL_DEL, socket->s, NULL) < 0) {
+		// the socket will still be dropped from our table
+		LOG("bt_reactor_remove: error %d removing socket %d\n", errno, socket->s);
+	}
+
+	// events for this handler may still be waiting to be dispatched
+	reactor->handlers[socket->s] = NULL;
+	reactor->count--;
+	handler->removed = true;
+	handler->next = reactor->removed;
+	reactor->removed = handler;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Get the number of sockets registered with a reactor.
+ *
+ * @param reactor The reactor to query.
+ *
+ * @return The number of registered sockets.
+ */
+size_t bt_reactor_count(bt_reactor_t const *reactor) {
+	if (reactor == NULL)
+		return 0;
+
+	return reactor->count;
+}
+
+/**
+ * Accept all of the connections waiting on a listener and pass them to its
+ * callback.
+ *
+ * @param reactor The reactor the listener is registered with.
+ * @param handler The listener's handler.
+ */
+static void bt_reactor_accept(bt_reactor_t *reactor, bt_reactor_handler_t *handler) {
+	struct sockaddr_rc rem_addr;
+	socklen_t opt;
+	bt_socket_t client;
+
+	// the listener is non-blocking, so this stops once the backlog is empty
+	while (!handler->removed) {
+		memset(&rem_addr, 0, sizeof(rem_addr));
+		opt = sizeof(rem_addr);
+		client.s = accept(handler->socket->s, (struct sockaddr *)&rem_addr, &opt);
+		if (client.s < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOG("bt_reactor_accept: error %d accepting on socket %d\n", errno, handler->socket->s);
+			break;
+		}
+		LOG("Accept on %d", client.s);
+		handler->on_accept(reactor, handler->socket, &client, handler->data);
+	}
+}
+
+/**
+ * Wait for events on the registered sockets and dispatch them to their
+ * callbacks.
+ *
+ * @param reactor    The reactor to run.
+ * @param timeout_ms The longest time to wait in milliseconds, `0` to return
+ *                   immediately, or `-1` to wait indefinitely.
+ * @param dispatched Pointer to return the number of sockets whose callbacks
+ *                   were invoked. It can be `NULL`.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The reactor was NULL
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+bt_err_t bt_reactor_run_once(bt_reactor_t *reactor, int timeout_ms, int *dispatched) {
+	struct epoll_event events[BT_REACTOR_MAX_EVENTS];
+	bt_reactor_handler_t *handler;
+	int n;
+	int i;
+	int count;
+
+	// check parameters
+	if (reactor == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	count = 0;
+	n = epoll_wait(reactor->fd, events, BT_REACTOR_MAX_EVENTS, timeout_ms);
+	if (n < 0) {
+		if (dispatched != NULL)
+			*dispatched = 0;
+		if (errno == EINTR)
+			return BT_SUCCESS;
+		LOG("bt_reactor_run_once: error %d waiting for events\n", errno);
+		return BT_ERR_UNKNOWN;
+	}
+
+	for (i = 0; i < n; i++) {
+		handler = events[i].data.ptr;
+		// an earlier callback may have removed this socket
+		if (handler->removed)
+			continue;
+
+		if (handler->on_accept != NULL) {
+			bt_reactor_accept(reactor, handler);
+		}
+		else {
+			handler->callback(reactor, handler->socket, bt_reactor_from_epoll(events[i].events), handler->data);
+		}
+		count++;
+	}
+
+	bt_reactor_free_removed(reactor);
+
+	if (dispatched != NULL)
+		*dispatched = count;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Run the event loop until {@link bt_reactor_stop} is called, or until no
+ * sockets remain registered.
+ *
+ * @param reactor The reactor to run.
+ *
+ * @return `BT_SUCCESS` if the loop was stopped, or one of the following if
+ *         there's an error:
+ *    `BT_ERR_BAD_PARAM`       - The reactor was NULL
+ *    `BT_ERR_UNKNOWN`         - unhelpfully generic failure
+ */
+bt_err_t bt_reactor_run(bt_reactor_t *reactor) {
+	bt_err_t e;
+
+	// check parameters
+	if (reactor == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	reactor->stopping = false;
+	e = BT_SUCCESS;
+	while ((e == BT_SUCCESS) && !reactor->stopping && (reactor->count > 0)) {
+		e = bt_reactor_run_once(reactor, -1, NULL);
+	}
+
+	return e;
+}
+
+/**
+ * Make {@link bt_reactor_run} return once the current events have been
+ * dispatched. This is intended to be called from within a callback.
+ *
+ * @param reactor The reactor to stop.
+ */
+void bt_reactor_stop(bt_reactor_t *reactor) {
+	if (reactor == NULL)
+		return;
+
+	reactor->stopping = true;
+}
+
+#endif
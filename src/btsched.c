@@ -0,0 +1,529 @@
+/**
+ * @file btsched.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Work-stealing task scheduler
+ *
+ * A pool with one shared queue makes every worker contend for the same lock,
+ * and handler costs vary widely: a quick ping and a long key exchange may
+ * arrive on neighbouring connections. Here each worker has its own queue
+ * instead. A task submitted from a worker, such as the continuation of a
+ * connection's handler, goes on that worker's own queue, where it's taken
+ * newest first while its data is still in the cache. Tasks submitted from
+ * elsewhere, for example a thread accepting connections with
+ * {@link bt_accept_with_timeout}, are spread over the workers in turn. A
+ * worker whose queue is empty steals the oldest task from another worker
+ * before going to sleep.
+ *
+ * Each queue has its own lock, which its owner rarely has to wait for, and
+ * thieves only try the lock rather than waiting on it.
+ *
+ * The scheduler is currently only available on Linux. On Windows
+ * initialising a scheduler returns `BT_ERR_UNSUPPORTED`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "picobt/bt.h"
+#include "picobt/btsched.h"
+#ifdef WINDOWS
+// nothing further to include
+#else // LINUX
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#include "picobt/log.h"
+
+/// The number of tasks a worker's queue can hold before it has to grow.
+#define BT_SCHED_INITIAL_CAPACITY 64
+
+#ifdef WINDOWS
+
+bt_err_t bt_sched_init(bt_sched_t *sched, unsigned workers) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_sched_free(bt_sched_t *sched) {
+}
+
+bt_err_t bt_sched_submit(bt_sched_t *sched, bt_sched_task_t task, void *data) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_sched_wait_idle(bt_sched_t *sched) {
+}
+
+void bt_sched_get_stats(bt_sched_t *sched, bt_sched_stats_t *stats) {
+	if (stats != NULL)
+		memset(stats, 0, sizeof(bt_sched_stats_t));
+}
+
+#else // LINUX
+
+/**
+ * A task waiting to run.
+ */
+typedef struct {
+	/// The function to call.
+	bt_sched_task_t task;
+	/// The data to pass to it.
+	void *data;
+} bt_sched_item_t;
+
+/**
+ * A worker thread and its queue.
+ */
+typedef struct {
+	/// The scheduler the worker belongs to.
+	bt_sched_t *sched;
+	/// The thread.
+	pthread_t thread;
+	/// Protects the queue.
+	pthread_mutex_t lock;
+	/// The queued tasks, as a ring. The owner works at the bottom and
+	/// thieves take from the top.
+	bt_sched_item_t *items;
+	/// The size of the ring.
+	size_t capacity;
+	/// Position of the oldest task in the ring.
+	size_t top;
+	/// The number of tasks queued.
+	size_t count;
+	/// The number of tasks this worker has run.
+	unsigned long executed;
+	/// The number of tasks this worker has stolen.
+	unsigned long stolen;
+	/// State for choosing which worker to steal from.
+	unsigned seed;
+} bt_sched_worker_t;
+
+/**
+ * The parts of a scheduler that are private to this file.
+ */
+typedef struct {
+	/// The workers.
+	bt_sched_worker_t *workers;
+	/// The number of worker threads running.
+	unsigned started;
+	/// The worker to give the next task submitted from outside the pool.
+	unsigned next;
+	/// Protects sleeping and waking.
+	pthread_mutex_t idle_lock;
+	/// Signalled when tasks are submitted and workers are asleep.
+	pthread_cond_t work;
+	/// Signalled when the last outstanding task finishes.
+	pthread_cond_t idle;
+	/// The number of tasks queued and not yet taken by a worker.
+	long queued;
+	/// The number of tasks submitted and not yet finished.
+	long outstanding;
+	/// The number of workers asleep.
+	long sleeping;
+	/// The number of tasks submitted.
+	unsigned long submitted;
+	/// Set to ask the workers to finish.
+	bool stopping;
+} bt_sched_state_t;
+
+/// The worker running on the current thread, if any.
+static __thread bt_sched_worker_t *bt_sched_current = NULL;
+
+/**
+ * Add a task to the bottom of a worker's queue, growing it if needed.
+ *
+ * @param worker The worker.
+ * @param item   The task.
+ *
+ * @return `BT_SUCCESS`, or `BT_ERR_UNKNOWN` if the queue couldn't grow.
+ */
+static bt_err_t bt_sched_push(bt_sched_worker_t *worker, bt_sched_item_t item) {
+	bt_sched_item_t *items;
+	size_t i;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->count == worker->capacity) {
+		items = malloc(worker->capacity * 2 * sizeof(bt_sched_item_t));
+		if (items == NULL) {
+			pthread_mutex_unlock(&worker->lock);
+			return BT_ERR_UNKNOWN;
+		}
+		for (i = 0; i < worker->count; i++) {
+			items[i] = worker->items[(worker->top + i) % worker->capacity];
+		}
+		free(worker->items);
+		worker->items = items;
+		worker->capacity *= 2;
+		worker->top = 0;
+	}
+	worker->items[(worker->top + worker->count) % worker->capacity] = item;
+	worker->count++;
+	pthread_mutex_unlock(&worker->lock);
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Take the newest task from the bottom of a worker's own queue.
+ *
+ * @param worker The worker.
+ * @param item   Returns the task.
+ *
+ * @return True if there was a task.
+ */
+static bool bt_sched_pop(bt_sched_worker_t *worker, bt_sched_item_t *item) {
+	bool found = false;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->count > 0) {
+		worker->count--;
+		*item = worker->items[(worker->top + worker->count) % worker->capacity];
+		found = true;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return found;
+}
+
+/**
+ * Take the oldest task from the top of another worker's queue. The victim's
+ * lock is only tried, so a thief never waits on a busy worker.
+ *
+ * @param victim The worker to steal from.
+ * @param item   Returns the task.
+ *
+ * @return True if a task was stolen.
+ */
+static bool bt_sched_steal_from(bt_sched_worker_t *victim, bt_sched_item_t *item) {
+	bool found = false;
+
+	if (pthread_mutex_trylock(&victim->lock) != 0)
+		return false;
+	if (victim->count > 0) {
+		*item = victim->items[victim->top];
+		victim->top = (victim->top + 1) % victim->capacity;
+		victim->count--;
+		found = true;
+	}
+	pthread_mutex_unlock(&victim->lock);
+
+	return found;
+}
+
+/**
+ * Find a task for a worker: its own newest, or failing that the oldest of
+ * another worker's, trying the others starting from a random one.
+ *
+ * @param worker The worker looking for a task.
+ * @param item   Returns the task.
+ *
+ * @return True if a task was found.
+ */
+static bool bt_sched_find(bt_sched_worker_t *worker, bt_sched_item_t *item) {
+	bt_sched_state_t *state = worker->sched->state;
+	unsigned count = worker->sched->workers;
+	unsigned start;
+	unsigned i;
+
+	if (bt_sched_pop(worker, item))
+		return true;
+
+	start = rand_r(&worker->seed) % count;
+	for (i = 0; i < count; i++) {
+		bt_sched_worker_t *victim = &state->workers[(start + i) % count];
+		if (victim != worker && bt_sched_steal_from(victim, item)) {
+			__atomic_add_fetch(&worker->stolen, 1, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Run tasks until the scheduler is freed.
+ *
+ * @param arg The worker.
+ *
+ * @return NULL.
+ */
+static void *bt_sched_worker_thread(void *arg) {
+	bt_sched_worker_t *worker = arg;
+	bt_sched_t *sched = worker->sched;
+	bt_sched_state_t *state = sched->state;
+	bt_sched_item_t item;
+	bool stop = false;
+
+	bt_sched_current = worker;
+
+	while (!stop) {
+		if (bt_sched_find(worker, &item)) {
+			__atomic_sub_fetch(&state->queued, 1, __ATOMIC_SEQ_CST);
+			item.task(sched, item.data);
+			__atomic_add_fetch(&worker->executed, 1, __ATOMIC_RELAXED);
+			if (__atomic_sub_fetch(&state->outstanding, 1, __ATOMIC_SEQ_CST) == 0) {
+				pthread_mutex_lock(&state->idle_lock);
+				pthread_cond_broadcast(&state->idle);
+				pthread_mutex_unlock(&state->idle_lock);
+			}
+		}
+		else {
+			// counting ourselves as asleep before checking for work means a
+			// submitter either sees us asleep or we see its task
+			pthread_mutex_lock(&state->idle_lock);
+			__atomic_add_fetch(&state->sleeping, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&state->queued, __ATOMIC_SEQ_CST) == 0 && !state->stopping) {
+				pthread_cond_wait(&state->work, &state->idle_lock);
+			}
+			__atomic_sub_fetch(&state->sleeping, 1, __ATOMIC_SEQ_CST);
+			stop = state->stopping && __atomic_load_n(&state->queued, __ATOMIC_SEQ_CST) == 0;
+			pthread_mutex_unlock(&state->idle_lock);
+		}
+	}
+
+	bt_sched_current = NULL;
+
+	return NULL;
+}
+
+/**
+ * Initialise a scheduler and start its worker threads. Free it using
+ * {@link bt_sched_free}.
+ *
+ * @param sched   The scheduler to initialise.
+ * @param workers The number of worker threads, or `0` for one for each
+ *                processor.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The scheduler was NULL
+ *    `BT_ERR_UNKNOWN`         - memory couldn't be allocated or the threads
+ *                               started
+ */
+bt_err_t bt_sched_init(bt_sched_t *sched, unsigned workers) {
+	bt_sched_state_t *state;
+	bt_sched_worker_t *worker;
+	long processors;
+	bt_err_t e;
+	unsigned i;
+
+	// check parameters
+	if (sched == NULL) {
+		LOG("bt_sched_init: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	if (workers == 0) {
+		processors = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = (processors > 0) ? (unsigned) processors : 1;
+	}
+
+	memset(sched, 0, sizeof(bt_sched_t));
+	state = calloc(1, sizeof(bt_sched_state_t));
+	if (state == NULL)
+		return BT_ERR_UNKNOWN;
+	state->workers = calloc(workers, sizeof(bt_sched_worker_t));
+	if (state->workers == NULL) {
+		free(state);
+		return BT_ERR_UNKNOWN;
+	}
+	pthread_mutex_init(&state->idle_lock, NULL);
+	pthread_cond_init(&state->work, NULL);
+	pthread_cond_init(&state->idle, NULL);
+	sched->workers = workers;
+	sched->state = state;
+
+	e = BT_SUCCESS;
+	for (i = 0; i < workers && e == BT_SUCCESS; i++) {
+		worker = &state->workers[i];
+		worker->sched = sched;
+		worker->seed = i + 1;
+		worker->capacity = BT_SCHED_INITIAL_CAPACITY;
+		worker->items = malloc(worker->capacity * sizeof(bt_sched_item_t));
+		pthread_mutex_init(&worker->lock, NULL);
+		if (worker->items == NULL) {
+			e = BT_ERR_UNKNOWN;
+		}
+	}
+
+	while (state->started < workers && e == BT_SUCCESS) {
+		worker = &state->workers[state->started];
+		if (pthread_create(&worker->thread, NULL, bt_sched_worker_thread, worker) != 0) {
+			LOG("bt_sched_init: could not start worker thread\n");
+			e = BT_ERR_UNKNOWN;
+		}
+		else {
+			state->started++;
+		}
+	}
+
+	if (e != BT_SUCCESS) {
+		bt_sched_free(sched);
+	}
+
+	return e;
+}
+
+/**
+ * Free a scheduler. Tasks already submitted, and any they submit in turn,
+ * are run before the workers finish. This must not be called from a task.
+ *
+ * @param sched The scheduler to free.
+ */
+void bt_sched_free(bt_sched_t *sched) {
+	bt_sched_state_t *state;
+	unsigned i;
+
+	if (sched == NULL || sched->state == NULL)
+		return;
+	state = sched->state;
+
+	pthread_mutex_lock(&state->idle_lock);
+	state->stopping = true;
+	pthread_cond_broadcast(&state->work);
+	pthread_mutex_unlock(&state->idle_lock);
+
+	for (i = 0; i < state->started; i++) {
+		pthread_join(state->workers[i].thread, NULL);
+	}
+
+	for (i = 0; i < sched->workers; i++) {
+		pthread_mutex_destroy(&state->workers[i].lock);
+		free(state->workers[i].items);
+	}
+	pthread_cond_destroy(&state->idle);
+	pthread_cond_destroy(&state->work);
+	pthread_mutex_destroy(&state->idle_lock);
+	free(state->workers);
+	free(state);
+	sched->state = NULL;
+}
+
+/**
+ * Submit a task to run on one of the scheduler's workers. When called from a
+ * task running on the same scheduler, the new task goes on the current
+ * worker's own queue and will normally run next on the same thread, which
+ * suits continuations. Otherwise tasks are given to each worker in turn.
+ * Either way, idle workers may steal the task.
+ *
+ * @param sched The scheduler.
+ * @param task  The function to run.
+ * @param data  User data to pass to the function.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The scheduler or task was NULL
+ *    `BT_ERR_UNKNOWN`         - memory couldn't be allocated
+ */
+bt_err_t bt_sched_submit(bt_sched_t *sched, bt_sched_task_t task, void *data) {
+	bt_sched_state_t *state;
+	bt_sched_worker_t *worker;
+	bt_sched_item_t item;
+	unsigned next;
+	bt_err_t e;
+
+	// check parameters
+	if (sched == NULL || sched->state == NULL || task == NULL) {
+		LOG("bt_sched_submit: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+	state = sched->state;
+
+	worker = bt_sched_current;
+	if (worker == NULL || worker->sched != sched) {
+		next = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED);
+		worker = &state->workers[next % sched->workers];
+	}
+
+	// counted before the push so that the count is never short
+	__atomic_add_fetch(&state->outstanding, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&state->queued, 1, __ATOMIC_SEQ_CST);
+
+	item.task = task;
+	item.data = data;
+	e = bt_sched_push(worker, item);
+	if (e != BT_SUCCESS) {
+		LOG("bt_sched_submit: could not queue task\n");
+		__atomic_sub_fetch(&state->queued, 1, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&state->outstanding, 1, __ATOMIC_SEQ_CST);
+		return e;
+	}
+	__atomic_add_fetch(&state->submitted, 1, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&state->sleeping, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&state->idle_lock);
+		pthread_cond_signal(&state->work);
+		pthread_mutex_unlock(&state->idle_lock);
+	}
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Wait until every task submitted to a scheduler, including the tasks they
+ * submit in turn, has finished. This must not be called from a task.
+ *
+ * @param sched The scheduler.
+ */
+void bt_sched_wait_idle(bt_sched_t *sched) {
+	bt_sched_state_t *state;
+
+	if (sched == NULL || sched->state == NULL)
+		return;
+	state = sched->state;
+
+	pthread_mutex_lock(&state->idle_lock);
+	while (__atomic_load_n(&state->outstanding, __ATOMIC_SEQ_CST) > 0) {
+		pthread_cond_wait(&state->idle, &state->idle_lock);
+	}
+	pthread_mutex_unlock(&state->idle_lock);
+}
+
+/**
+ * Return a snapshot of a scheduler's counters.
+ *
+ * @param sched The scheduler.
+ * @param stats Returns the counters.
+ */
+void bt_sched_get_stats(bt_sched_t *sched, bt_sched_stats_t *stats) {
+	bt_sched_state_t *state;
+	unsigned i;
+
+	if (stats == NULL)
+		return;
+
+	memset(stats, 0, sizeof(bt_sched_stats_t));
+	if (sched == NULL || sched->state == NULL)
+		return;
+	state = sched->state;
+
+	stats->submitted = __atomic_load_n(&state->submitted, __ATOMIC_RELAXED);
+	for (i = 0; i < sched->workers; i++) {
+		stats->executed += __atomic_load_n(&state->workers[i].executed, __ATOMIC_RELAXED);
+		stats->stolen += __atomic_load_n(&state->workers[i].stolen, __ATOMIC_RELAXED);
+	}
+}
+
+#endif
@@ -24,291 +24,494 @@
  * @brief Stuff relating to the Bluetooth service discovery protocol.
  * 
  * Stuff relating to the Bluetooth service discovery protocol (SDP).
- * Very much a work-in-progress.
  * This was written because Windows lacks functions to extract fields from a
  * service's SDP record, but does provide the whole record as a binary blob.
- * However I think that everything we actually need is available in the
- * WASQUERYSET fields.
+ * The parser works in a single pass over the blob, writing elements into an
+ * array supplied by the caller, so it never allocates memory. Records come
+ * from remote devices, so every length is checked against the data before
+ * it's used, and nesting is limited to BT_SDP_MAX_DEPTH. To pick out one
+ * or two attributes, a cursor reads elements one at a time instead, stepping
+ * over whole sequences without looking inside them.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "picobt/bt.h"
 #include "picobt/log.h"
 
-#if 0
-
 /** Uncomment this to print the record to stdout as we parse it. */
 //#define DUMP_SDP_RECORD
 
 #ifdef DUMP_SDP_RECORD
-static bt_err_t bt_sdp_read_data_element(uint8_t *data, bt_sdp_element_t *e, int indent);
-#else
-static bt_err_t bt_sdp_read_data_element(uint8_t *data, bt_sdp_element_t *e);
+static void bt_sdp_dump_element(uint8_t const *data, bt_sdp_element_t const *e, int indent);
 #endif
-static void bt_sdp_free_element(bt_sdp_element_t *e);
 
 /**
- * Parse an SDP record to produce an attribute list.
- * 
- * @param data    Packed binary SDP record
- * @param length  Number of bytes of data
- * @param out     SDP record structure to populate
+ * Read a big-endian unsigned integer of up to eight bytes.
+ *
+ * @param data Pointer to the first byte
+ * @param size The number of bytes
+ *
+ * @return The value
  */
-bt_err_t bt_sdp_parse_record(uint8_t *data, int length, bt_sdp_record_t *out) {
-	bt_err_t result;
-	
-	// check parameters
-	if (data == NULL || length <= 0 || out == NULL)
-		return BT_ERR_BAD_PARAM;
-	
-	// clear the record initially
-	memset(out, 0, sizeof(bt_sdp_record_t));
-	
-	// parse the data
-	#ifdef DUMP_SDP_RECORD
-	result = bt_sdp_read_data_element(data, &out->root, 0);
-	LOG("\n");
-	#else
-	result = bt_sdp_read_data_element(data, &out->root);
-	#endif
-	
-	return result;
+static uint64_t bt_sdp_read_uint(uint8_t const *data, uint32_t size) {
+	uint64_t value = 0;
+	uint32_t i;
+
+	for (i = 0; i < size; i++)
+		value = (value << 8) | data[i];
+
+	return value;
 }
 
-#ifdef DUMP_SDP_RECORD
 /**
- * Parse a data element out of its binary representation.
- * This function is recursive: SEQ and ALT elements contain further elements
- * themselves.
- * 
- * @param data   Pointer to the first byte of this element's binary
- *               representation.
- * @parma e      Pointer to the element that will be read from data.
- * @param indent How much indentation to add when printing this element.
- * 
- * @return `BT_SUCCESS` if the element was read successfully, or
- *         `BT_ERR_SDP_BAD_RECORD` if it was malformed.
- */
-static bt_err_t bt_sdp_read_data_element(uint8_t *data, bt_sdp_element_t *e, int indent) {
-#else
-/**
- * Parse a data element out of its binary representation.
- * This function is recursive: SEQ and ALT elements contain further elements
- * themselves.
- * 
- * @param data Pointer to the first byte of this element's binary
- *             representation.
- * @parma e    Pointer to the element that will be read from data.
- * 
+ * Parse a single data element out of its binary representation. For SEQ and
+ * ALT elements only the header is read; the elements inside are left for
+ * the caller to read in turn.
+ *
+ * @param data      Pointer to the first byte of this element's binary
+ *                  representation.
+ * @param available The number of bytes the element may take up, which is
+ *                  whatever's left of the element containing it.
+ * @param e         Pointer to the element that will be read from data.
+ * @param header    Returns the number of bytes taken by the element's header.
+ *
  * @return `BT_SUCCESS` if the element was read successfully, or
- *         `BT_ERR_SDP_BAD_RECORD` if it was malformed.
+ *         `BT_ERR_SDP_BAD_RECORD` if it was malformed or overran the space
+ *         available.
  */
-static bt_err_t bt_sdp_read_data_element(uint8_t *data, bt_sdp_element_t *e) {
-#endif
-	uint8_t *b, bb;
-	bt_sdp_sequence_t *seq;
-	uint32_t i;
-	bt_err_t result;
-	
-	#ifdef DUMP_SDP_RECORD
-	char is[64];
-	for (i = 0; i < indent * 3; i++)
-		is[i] = 32;
-	is[i] = 0;
-	#endif
-	
+static bt_err_t bt_sdp_read_data_element(uint8_t const *data, size_t available, bt_sdp_element_t *e, uint32_t *header) {
+	uint64_t value;
+
+	if (available < 1)
+		return BT_ERR_SDP_BAD_RECORD;
+
 	memset(e, 0, sizeof(bt_sdp_element_t));
 	e->type = data[0] >> 3;
 	e->sizeDesc = data[0] & 7;
-	data++;
-	if (e->type != BT_SDP_DATA_ELEMENT_NIL) {
-		if (e->sizeDesc < 5) {
-			e->recordSize = 1;
-			e->size = 1 << e->sizeDesc;
-		} else if (e->sizeDesc == 5) {
-			e->recordSize = 2;
-			e->size = (uint32_t) *data;
-			data++;
-		} else if (e->sizeDesc == 6) {
-			e->recordSize = 3;
-			e->size = ((uint32_t) data[0] << 8) | (uint32_t) data[1];
-			data += 2;
-		} else if (e->sizeDesc == 7) {
-			e->recordSize = 5;
-			e->size = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) |
-					((uint32_t) data[2] << 8) | (uint32_t) data[3];
-			data += 4;
-		}
-		e->recordSize += e->size;
-	} else {
+
+	// work out how big the element is, and make sure it fits
+	if (e->type == BT_SDP_DATA_ELEMENT_NIL) {
+		*header = 1;
 		e->size = 0;
-		e->recordSize = 1;
+	} else if (e->sizeDesc < 5) {
+		*header = 1;
+		e->size = 1 << e->sizeDesc;
+	} else {
+		*header = 1 + (1 << (e->sizeDesc - 5));
+		if (available < *header)
+			return BT_ERR_SDP_BAD_RECORD;
+		e->size = (uint32_t) bt_sdp_read_uint(data + 1, *header - 1);
 	}
-	
-	#ifdef DUMP_SDP_RECORD
-	//LOG("%sdata element: type=%d, sizeDesc=%d, size=%d\n", is, e->type, e->sizeDesc, e->size);
-	#endif
-	
+	if (e->size > available - *header || e->size > UINT32_MAX - *header)
+		return BT_ERR_SDP_BAD_RECORD;
+	e->recordSize = *header + e->size;
+	data += *header;
+
 	switch (e->type) {
 	case BT_SDP_DATA_ELEMENT_NIL:
 		if (e->sizeDesc != 0)
 			return BT_ERR_SDP_BAD_RECORD;
-		#ifdef DUMP_SDP_RECORD
-		LOG("%snil element\n", is);
-		#endif
 		break;
-		
+
 	case BT_SDP_DATA_ELEMENT_UINT:
 	case BT_SDP_DATA_ELEMENT_INT:
 		if (e->sizeDesc > 4)
 			return BT_ERR_SDP_BAD_RECORD;
-		b = (uint8_t*) &e->value;
-		memcpy(b, data, e->size);
-		if (e->size > 1) {
-			// endian-swap
-			for (i = 0; i < (e->size >> 1); i++) {
-				bb = b[i];
-				b[i] = b[e->size - i - 1];
-				b[e->size - i - 1] = bb;
-			}
+		if (e->size == 16) {
+			memcpy(e->value.u128, data, 16);
+			break;
 		}
-		#ifdef DUMP_SDP_RECORD
+		value = bt_sdp_read_uint(data, e->size);
 		if (e->type == BT_SDP_DATA_ELEMENT_UINT) {
-			if (e->size == 1) {
-				LOG("%suint8 element: 0x%02x\n", is, e->value.u8);
-			} else if (e->size == 2) {
-				LOG("%suint16 element: 0x%04x\n", is, e->value.u16);
-			} else if (e->size == 4) {
-				LOG("%suint32 element: 0x%08x\n", is, e->value.u32);
-			} else if (e->size == 8) {
-				LOG("%suint64 element: 0x%08x%08x\n", is, (unsigned int) (e->value.u64 >> 32), (unsigned int) (e->value.u64 & -1LL));
+			switch (e->size) {
+			case 1: e->value.u8 = (uint8_t) value; break;
+			case 2: e->value.u16 = (uint16_t) value; break;
+			case 4: e->value.u32 = (uint32_t) value; break;
+			default: e->value.u64 = value; break;
 			}
 		} else {
-			LOG("%sint element: %d\n", is, e->value.i32);
+			switch (e->size) {
+			case 1: e->value.i8 = (int8_t) value; break;
+			case 2: e->value.i16 = (int16_t) value; break;
+			case 4: e->value.i32 = (int32_t) value; break;
+			default: e->value.i64 = (int64_t) value; break;
+			}
 		}
-		#endif
 		break;
-		
+
 	case BT_SDP_DATA_ELEMENT_UUID:
-		if (e->sizeDesc != 1 && e->sizeDesc != 2 && e->sizeDesc != 4)
-			return BT_ERR_SDP_BAD_RECORD;
-		memcpy(&e->value, data, e->size);
-		#ifdef DUMP_SDP_RECORD
 		if (e->sizeDesc == 1) {
-			LOG("%sUUID16: 0x%04x\n", is, e->value.uuid16);
+			e->value.uuid16 = (uint16_t) bt_sdp_read_uint(data, 2);
 		} else if (e->sizeDesc == 2) {
-			LOG("%sUUID32: 0x%08x\n", is, e->value.uuid32);
+			e->value.uuid32 = (uint32_t) bt_sdp_read_uint(data, 4);
+		} else if (e->sizeDesc == 4) {
+			// the byte order on the wire is the same as bt_uuid_t's
+			memcpy(&e->value.uuid, data, 16);
 		} else {
-			char u[40];
-			bt_uuid_to_str(&e->value.uuid, u);
-			LOG("%sUUID: %s\n", is, u);
+			return BT_ERR_SDP_BAD_RECORD;
 		}
-		#endif
 		break;
-		
+
 	case BT_SDP_DATA_ELEMENT_TEXT:
 	case BT_SDP_DATA_ELEMENT_URL:
 		if (e->sizeDesc < 5)
 			return BT_ERR_SDP_BAD_RECORD;
-		if (e->size > 0) {
-			e->value.text = malloc(e->size);
-			memcpy(e->value.text, data, e->size);
-			#ifdef DUMP_SDP_RECORD
-			LOG("%s%s: \"%s\"\n", is, (e->type == BT_SDP_DATA_ELEMENT_TEXT) ? "text" : "url", e->value.text);
-			#endif
-		} else {
-			e->value.text = NULL;
-			#ifdef DUMP_SDP_RECORD
-			LOG("%s%s (zero-length)\n", is, (e->type == BT_SDP_DATA_ELEMENT_TEXT) ? "text" : "url");
-			#endif
-		}
+		// leave the text where it is rather than copying it
+		e->value.text = (char const *) data;
 		break;
-		
+
 	case BT_SDP_DATA_ELEMENT_BOOL:
 		if (e->sizeDesc != 0)
 			return BT_ERR_SDP_BAD_RECORD;
 		e->value.boolean = *data;
-		#ifdef DUMP_SDP_RECORD
-		LOG("%sbool: %s\n", is, (e->value.boolean) ? "true" : "false");
-		#endif
 		break;
-		
+
 	case BT_SDP_DATA_ELEMENT_SEQ:
 	case BT_SDP_DATA_ELEMENT_ALT:
-		#ifdef DUMP_SDP_RECORD
-		LOG("%s%s\n", is, e->type == BT_SDP_DATA_ELEMENT_SEQ ? "sequence" : "alternative");
-		#endif
-		i = 0;
-		e->value.seq = seq = malloc(sizeof(bt_sdp_sequence_t));
-		do {
-			#ifdef DUMP_SDP_RECORD
-			result = bt_sdp_read_data_element(data, &seq->head, indent + 1);
-			#else
-			result = bt_sdp_read_data_element(data, &seq->head);
-			#endif
-			if (result != BT_SUCCESS)
-				return result;
-			data += seq->head.recordSize;
-			i += seq->head.recordSize;
-			if (i >= e->size) {
-				seq->tail = NULL;
-				break;
-			} else {
-				seq->tail = malloc(sizeof(bt_sdp_sequence_t));
-				seq = seq->tail;
-			}
-		} while (1);
+		if (e->sizeDesc < 5)
+			return BT_ERR_SDP_BAD_RECORD;
 		break;
-		
+
 	default:
+		// reserved data element type
+		return BT_ERR_SDP_BAD_RECORD;
+	}
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Parse an SDP record into a flat array of elements. The record must be a
+ * single data element, normally the sequence of attribute IDs and values,
+ * filling the data exactly.
+ *
+ * Nothing is allocated: the elements are written to the array passed in,
+ * and text and URL values point into the data. To find out how many
+ * elements a record needs, pass `NULL` for the array; the record is still
+ * checked, and the count is returned in `out`.
+ *
+ * @param data     Packed binary SDP record
+ * @param length   Number of bytes of data
+ * @param elements Array to write the elements to, or `NULL` to only count them
+ * @param capacity The number of elements the array can hold
+ * @param out      SDP record structure to populate
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - you passed in a `NULL` pointer
+ *    `BT_ERR_SDP_BAD_RECORD`  - the record is malformed or nested more than
+ *                               `BT_SDP_MAX_DEPTH` deep
+ *    `BT_ERR_BUFFER_FULL`     - the record has more elements than capacity
+ */
+bt_err_t bt_sdp_parse_record(uint8_t const *data, size_t length, bt_sdp_element_t *elements, size_t capacity, bt_sdp_record_t *out) {
+	// the containers the current element is inside, innermost last
+	size_t open[BT_SDP_MAX_DEPTH];
+	size_t end[BT_SDP_MAX_DEPTH];
+	uint32_t count[BT_SDP_MAX_DEPTH];
+	int depth;
+	size_t limit;
+	size_t pos;
+	size_t n;
+	bt_sdp_element_t e;
+	uint32_t header;
+	bt_err_t result;
+
+	// check parameters
+	if (data == NULL || out == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	memset(out, 0, sizeof(bt_sdp_record_t));
+
+	pos = 0;
+	n = 0;
+	depth = 0;
+	limit = length;
+	do {
+		result = bt_sdp_read_data_element(data + pos, limit - pos, &e, &header);
+		if (result != BT_SUCCESS) {
+			LOG("bt_sdp_parse_record: bad element at offset %lu\n", (unsigned long) pos);
+			return result;
+		}
 		#ifdef DUMP_SDP_RECORD
-		LOG("%sreserved data element type %d\n", is, e->type);
+		bt_sdp_dump_element(data + pos + header, &e, depth);
 		#endif
+
+		if (elements != NULL) {
+			if (n >= capacity)
+				return BT_ERR_BUFFER_FULL;
+			elements[n] = e;
+		}
+		if (depth > 0)
+			count[depth - 1]++;
+		n++;
+
+		if (e.type == BT_SDP_DATA_ELEMENT_SEQ || e.type == BT_SDP_DATA_ELEMENT_ALT) {
+			// step inside, and read its contents next
+			if (depth == BT_SDP_MAX_DEPTH) {
+				LOG("bt_sdp_parse_record: sequences nested too deeply at offset %lu\n", (unsigned long) pos);
+				return BT_ERR_SDP_BAD_RECORD;
+			}
+			open[depth] = n - 1;
+			end[depth] = pos + e.recordSize;
+			count[depth] = 0;
+			depth++;
+			pos += header;
+			limit = pos + e.size;
+		} else {
+			pos += e.recordSize;
+		}
+
+		// step out of any sequences that have now been read completely
+		while (depth > 0 && pos == end[depth - 1]) {
+			depth--;
+			if (elements != NULL) {
+				elements[open[depth]].count = count[depth];
+				elements[open[depth]].descendants = (uint32_t) (n - open[depth] - 1);
+			}
+			limit = (depth > 0) ? end[depth - 1] : length;
+		}
+	} while (depth > 0);
+
+	if (pos != length) {
+		LOG("bt_sdp_parse_record: %lu bytes left over\n", (unsigned long) (length - pos));
 		return BT_ERR_SDP_BAD_RECORD;
 	}
-	
+
+	out->elements = elements;
+	out->count = n;
+	out->data = data;
+	out->length = length;
+
 	return BT_SUCCESS;
 }
 
 /**
- * Frees resources allocated for SDP record data.
- * 
- * @param rec The record structure to free.
+ * Start reading a packed SDP record an element at a time. The first call to
+ * {@link bt_sdp_cursor_next} returns the record's attribute list, which can
+ * then be entered with {@link bt_sdp_cursor_enter_seq}.
+ *
+ * The data is only read as far as the elements asked for, so a record that's
+ * malformed further on won't be noticed.
+ *
+ * @param cursor The cursor to initialise
+ * @param data   Packed binary SDP record, which must last as long as the
+ *               cursor is used
+ * @param length Number of bytes of data
+ *
+ * @return `BT_SUCCESS` if successful, or `BT_ERR_BAD_PARAM` if you passed in
+ *         a `NULL` pointer
  */
-void bt_sdp_free(bt_sdp_record_t *rec) {
-	bt_sdp_free_element(&rec->root);
+bt_err_t bt_sdp_cursor_init(bt_sdp_cursor_t *cursor, uint8_t const *data, size_t length) {
+	// check parameters
+	if (cursor == NULL || data == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	cursor->data = data;
+	cursor->pos = 0;
+	cursor->end = length;
+	cursor->seq = 0;
+	cursor->seq_end = 0;
+	cursor->depth = 0;
+
+	return BT_SUCCESS;
 }
 
 /**
- * Free an SDP record element.
- * 
- * @param e The element to free.
+ * Read the next element at the cursor's level and move past it. A SEQ or
+ * ALT is stepped over whole, using the size in its header; the `count` and
+ * `descendants` fields of the element aren't filled in. Use
+ * {@link bt_sdp_cursor_enter_seq} straight afterwards to read what's inside.
+ *
+ * @param cursor The cursor to read from
+ * @param e      Returns the element read
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - you passed in a `NULL` pointer
+ *    `BT_ERR_END_OF_ENUM`     - there are no more elements at this level
+ *    `BT_ERR_SDP_BAD_RECORD`  - the element is malformed or overruns the
+ *                               sequence it's in
+ */
+bt_err_t bt_sdp_cursor_next(bt_sdp_cursor_t *cursor, bt_sdp_element_t *e) {
+	uint32_t header;
+	bt_err_t result;
+
+	// check parameters
+	if (cursor == NULL || e == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	cursor->seq = 0;
+	if (cursor->pos >= cursor->end)
+		return BT_ERR_END_OF_ENUM;
+
+	result = bt_sdp_read_data_element(cursor->data + cursor->pos, cursor->end - cursor->pos, e, &header);
+	if (result != BT_SUCCESS) {
+		LOG("bt_sdp_cursor_next: bad element at offset %lu\n", (unsigned long) cursor->pos);
+		return result;
+	}
+
+	if (e->type == BT_SDP_DATA_ELEMENT_SEQ || e->type == BT_SDP_DATA_ELEMENT_ALT) {
+		cursor->seq = cursor->pos + header;
+		cursor->seq_end = cursor->pos + e->recordSize;
+	}
+	cursor->pos += e->recordSize;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Get a cursor over the contents of the SEQ or ALT element that was just
+ * read with {@link bt_sdp_cursor_next}. The original cursor carries on after
+ * the sequence, so both can be used. Passing the same cursor for both
+ * parameters steps inside without keeping the outer position.
+ *
+ * @param cursor The cursor that has just read a SEQ or ALT
+ * @param inner  Returns a cursor over the elements inside it
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - you passed in a `NULL` pointer, or the last
+ *                               element read wasn't a SEQ or ALT
+ *    `BT_ERR_SDP_BAD_RECORD`  - sequences are nested more than
+ *                               `BT_SDP_MAX_DEPTH` deep
+ */
+bt_err_t bt_sdp_cursor_enter_seq(bt_sdp_cursor_t const *cursor, bt_sdp_cursor_t *inner) {
+	size_t pos;
+	size_t end;
+
+	// check parameters
+	if (cursor == NULL || inner == NULL || cursor->seq == 0)
+		return BT_ERR_BAD_PARAM;
+	if (cursor->depth >= BT_SDP_MAX_DEPTH)
+		return BT_ERR_SDP_BAD_RECORD;
+
+	pos = cursor->seq;
+	end = cursor->seq_end;
+	inner->data = cursor->data;
+	inner->pos = pos;
+	inner->end = end;
+	inner->seq = 0;
+	inner->seq_end = 0;
+	inner->depth = cursor->depth + 1;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Find an attribute in a packed SDP record. Attribute IDs are read in turn,
+ * and each value is stepped over without being decoded. The search stops as
+ * soon as it passes the ID, since records list their attributes in
+ * ascending order.
+ *
+ * The cursor must be at the start of a record, from
+ * {@link bt_sdp_cursor_init}, or left in the attribute list by an earlier
+ * search. On success it's left just after the value, so a SEQ value can be
+ * entered with {@link bt_sdp_cursor_enter_seq}, and later attributes can be
+ * found by searching again from there. If the attribute isn't found, the
+ * cursor is left where the attribute would have been.
+ *
+ * @param record  Cursor over the record
+ * @param attr_id The attribute ID to look for
+ * @param value   Returns the attribute's value
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`          - you passed in a `NULL` pointer
+ *    `BT_ERR_SDP_ATTR_NOT_FOUND` - the record doesn't have the attribute
+ *    `BT_ERR_SDP_BAD_RECORD`     - the record is malformed
  */
-static void bt_sdp_free_element(bt_sdp_element_t *e) {
-	bt_sdp_sequence_t *seq, *next;
-	
+bt_err_t bt_sdp_find_attr(bt_sdp_cursor_t *record, uint16_t attr_id, bt_sdp_element_t *value) {
+	bt_sdp_cursor_t before;
+	bt_sdp_element_t e;
+	bt_err_t result;
+
+	// check parameters
+	if (record == NULL || value == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	if (record->depth == 0) {
+		// step inside the attribute list
+		result = bt_sdp_cursor_next(record, &e);
+		if (result == BT_ERR_END_OF_ENUM || (result == BT_SUCCESS && e.type != BT_SDP_DATA_ELEMENT_SEQ))
+			return BT_ERR_SDP_BAD_RECORD;
+		if (result != BT_SUCCESS)
+			return result;
+		bt_sdp_cursor_enter_seq(record, record);
+	}
+
+	do {
+		before = *record;
+		result = bt_sdp_cursor_next(record, &e);
+		if (result == BT_ERR_END_OF_ENUM)
+			return BT_ERR_SDP_ATTR_NOT_FOUND;
+		if (result != BT_SUCCESS)
+			return result;
+		if (e.type != BT_SDP_DATA_ELEMENT_UINT || e.size != 2)
+			return BT_ERR_SDP_BAD_RECORD;
+		if (e.value.u16 > attr_id) {
+			// gone past it; leave the next attribute to be read again
+			*record = before;
+			record->seq = 0;
+			return BT_ERR_SDP_ATTR_NOT_FOUND;
+		}
+
+		result = bt_sdp_cursor_next(record, value);
+		if (result == BT_ERR_END_OF_ENUM)
+			return BT_ERR_SDP_BAD_RECORD;
+		if (result != BT_SUCCESS)
+			return result;
+	} while (e.value.u16 != attr_id);
+
+	return BT_SUCCESS;
+}
+
+#ifdef DUMP_SDP_RECORD
+/**
+ * Print a parsed data element.
+ *
+ * @param data   Pointer to the element's data, after its header.
+ * @param e      The element to print.
+ * @param indent How much indentation to add when printing this element.
+ */
+static void bt_sdp_dump_element(uint8_t const *data, bt_sdp_element_t const *e, int indent) {
+	char u[BT_UUID_LENGTH];
+
+	LOG("%*s", indent * 3, "");
 	switch (e->type) {
-	case BT_SDP_DATA_ELEMENT_TEXT:
-	case BT_SDP_DATA_ELEMENT_URL:
-		// free text element
-		if (e->value.text != NULL) {
-			free(e->value.text);
-			e->value.text = NULL;
+	case BT_SDP_DATA_ELEMENT_NIL:
+		LOG("nil element\n");
+		break;
+	case BT_SDP_DATA_ELEMENT_UINT:
+	case BT_SDP_DATA_ELEMENT_INT:
+		if (e->size == 16) {
+			LOG("%s128 element\n", e->type == BT_SDP_DATA_ELEMENT_UINT ? "uint" : "int");
+		} else {
+			LOG("%s%u element: 0x%llx\n", e->type == BT_SDP_DATA_ELEMENT_UINT ? "uint" : "int",
+					(unsigned) e->size * 8, (unsigned long long) bt_sdp_read_uint(data, e->size));
 		}
 		break;
-		
-	case BT_SDP_DATA_ELEMENT_SEQ:
-	case BT_SDP_DATA_ELEMENT_ALT:
-		// free each sequence element
-		seq = e->value.seq;
-		while (seq != NULL) {
-			next = seq->tail;
-			free(seq);
-			seq = next;
+	case BT_SDP_DATA_ELEMENT_UUID:
+		if (e->sizeDesc == 1) {
+			LOG("UUID16: 0x%04x\n", e->value.uuid16);
+		} else if (e->sizeDesc == 2) {
+			LOG("UUID32: 0x%08x\n", e->value.uuid32);
+		} else {
+			bt_uuid_to_str(&e->value.uuid, u);
+			LOG("UUID: %s\n", u);
 		}
-		e->value.seq = NULL;
+		break;
+	case BT_SDP_DATA_ELEMENT_TEXT:
+	case BT_SDP_DATA_ELEMENT_URL:
+		LOG("%s: \"%.*s\"\n", (e->type == BT_SDP_DATA_ELEMENT_TEXT) ? "text" : "url", (int) e->size, e->value.text);
+		break;
+	case BT_SDP_DATA_ELEMENT_BOOL:
+		LOG("bool: %s\n", (e->value.boolean) ? "true" : "false");
+		break;
+	default:
+		LOG("%s\n", e->type == BT_SDP_DATA_ELEMENT_SEQ ? "sequence" : "alternative");
+		break;
 	}
 }
-
 #endif
@@ -0,0 +1,845 @@
+/**
+ * @file btsdpcache.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Cache of the RFCOMM channels services were found on
+ *
+ * On Linux, connecting to a service means first asking the device's SDP
+ * server which RFCOMM channel it's on. That takes a connection of its own
+ * and a full attribute search, and can add hundreds of milliseconds to every
+ * connect. Services rarely move, so {@link bt_connect_to_service} remembers
+ * the channel it found for each device and service and uses it next time.
+ *
+ * A channel is forgotten once it's been kept for longer than the TTL, or as
+ * soon as a connection to it fails, since the service may have been
+ * restarted on a different channel. When the cache is full the channel used
+ * least recently makes way.
+ *
+ * Short-lived processes can also share what they've found through a cache
+ * file, opened with {@link bt_sdp_cache_open_file}. The file is a header
+ * followed by fixed-size slots, and is mapped into every process using it.
+ * Readers never lock it: a sequence number in the header is made odd while
+ * a slot is being written, and a reader that sees it odd or changed reads
+ * again. Writers, which are rare, take an exclusive `flock` on the file so
+ * there's only ever one at a time across all processes.
+ *
+ * The cache is shared by every thread in the process. It's currently only
+ * available on Linux; Windows finds the channel itself as part of
+ * connecting.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "picobt/bt.h"
+#include "picobt/btsdpcache.h"
+
+#ifdef WINDOWS
+// nothing further to include
+#else // LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "picobt/log.h"
+
+#ifdef WINDOWS
+
+bt_err_t bt_sdp_cache_configure(int ttl_ms, size_t max_entries) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+bt_err_t bt_sdp_cache_open_file(char const *path, size_t slots) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_sdp_cache_close_file(void) {
+}
+
+bool bt_sdp_cache_lookup(bt_addr_t const *address, bt_uuid_t const *service, uint8_t *channel) {
+	return false;
+}
+
+bool bt_sdp_cache_lookup_ex(bt_addr_t const *address, bt_uuid_t const *service, uint8_t *channel, char *name, size_t size) {
+	return false;
+}
+
+void bt_sdp_cache_store(bt_addr_t const *address, bt_uuid_t const *service, uint8_t channel) {
+}
+
+void bt_sdp_cache_store_ex(bt_addr_t const *address, bt_uuid_t const *service, uint8_t channel, char const *name) {
+}
+
+void bt_sdp_cache_invalidate(bt_addr_t const *address, bt_uuid_t const *service) {
+}
+
+void bt_sdp_cache_clear(void) {
+}
+
+void bt_sdp_cache_get_stats(bt_sdp_cache_stats_t *stats) {
+	if (stats != NULL)
+		memset(stats, 0, sizeof(bt_sdp_cache_stats_t));
+}
+
+#else // LINUX
+
+/// Identifies a cache file: "PBTS" read as a little-endian integer.
+#define BT_SDP_CACHE_FILE_MAGIC 0x53544250
+/// The version of the cache file layout.
+#define BT_SDP_CACHE_FILE_VERSION 1
+/// How many times a reader retries while the file is being written.
+#define BT_SDP_CACHE_FILE_RETRIES 100
+
+/**
+ * A remembered channel.
+ */
+typedef struct {
+	/// The device the service is on.
+	bt_addr_t address;
+	/// The service.
+	bt_uuid_t service;
+	/// The RFCOMM channel the service was found on.
+	uint8_t channel;
+	/// The service's name, or an empty string if it isn't known.
+	char name[BT_SDP_CACHE_NAME_LENGTH];
+	/// When the channel was found, from {@link bt_time_now_us}.
+	int64_t stored;
+	/// When the channel was last looked up, as a count of uses of the cache.
+	unsigned long last_used;
+} bt_sdp_cache_entry_t;
+
+/**
+ * The start of a cache file. All fields are in the host's byte order, since
+ * the file is only shared by processes on the same machine.
+ */
+typedef struct {
+	/// `BT_SDP_CACHE_FILE_MAGIC`.
+	uint32_t magic;
+	/// `BT_SDP_CACHE_FILE_VERSION`.
+	uint16_t version;
+	/// The size of each slot, so a change in layout is noticed.
+	uint16_t slot_size;
+	/// The number of slots following the header.
+	uint32_t slots;
+	/// Odd while a slot is being written, and changed by every write.
+	uint32_t sequence;
+	/// Padding to keep the slots aligned.
+	uint8_t reserved[16];
+} bt_sdp_cache_file_header_t;
+
+/**
+ * A channel remembered in a cache file, packed into 64 bytes.
+ */
+typedef struct {
+	/// The device the service is on.
+	uint8_t address[6];
+	/// The RFCOMM channel, or `0` if the slot is empty.
+	uint8_t channel;
+	/// Unused, and zero.
+	uint8_t reserved;
+	/// The service UUID.
+	uint8_t service[16];
+	/// When the channel was found, in microseconds since the epoch.
+	int64_t stored;
+	/// The service's name, nul-terminated.
+	char name[BT_SDP_CACHE_NAME_LENGTH];
+} bt_sdp_cache_slot_t;
+
+/// Protects everything else here.
+static pthread_mutex_t bt_sdp_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/// The remembered channels, allocated when the first is stored.
+static bt_sdp_cache_entry_t *bt_sdp_cache_entries = NULL;
+/// The number of channels remembered.
+static size_t bt_sdp_cache_count = 0;
+/// The most channels that can be remembered.
+static size_t bt_sdp_cache_capacity = BT_SDP_CACHE_DEFAULT_SIZE;
+/// How long a channel is remembered, in milliseconds.
+static int bt_sdp_cache_ttl_ms = BT_SDP_CACHE_DEFAULT_TTL;
+/// Counters for monitoring the cache.
+static bt_sdp_cache_stats_t bt_sdp_cache_stats;
+/// Counts uses of the cache, to order entries by when they were last used.
+static unsigned long bt_sdp_cache_uses = 0;
+/// The cache file, or -1 if there isn't one.
+static int bt_sdp_cache_fd = -1;
+/// The cache file mapped into memory.
+static bt_sdp_cache_file_header_t *bt_sdp_cache_file = NULL;
+/// The size of the mapping.
+static size_t bt_sdp_cache_file_size = 0;
+/// The number of slots in the mapping, kept here in case the file is corrupted.
+static uint32_t bt_sdp_cache_file_slots = 0;
+/// Whether the cache file could only be opened for reading.
+static bool bt_sdp_cache_read_only = false;
+
+/**
+ * Get the time used to stamp entries in a cache file. Unlike
+ * {@link bt_time_now_us} this is the same in every process.
+ *
+ * @return Microseconds since the epoch
+ */
+static int64_t bt_sdp_cache_wall_time_us(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return ((int64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/**
+ * Check whether something stored at a given time has been kept for longer
+ * than the TTL.
+ *
+ * @param stored When it was stored
+ * @param now The current time, on the same clock
+ *
+ * @return `true` if it should be forgotten
+ */
+static bool bt_sdp_cache_expired(int64_t stored, int64_t now) {
+	return (bt_sdp_cache_ttl_ms > 0) &&
+			(now - stored >= (int64_t) bt_sdp_cache_ttl_ms * 1000);
+}
+
+/**
+ * Copy a name into a fixed-size buffer, truncating it if need be.
+ *
+ * @param out The buffer
+ * @param size The size of the buffer
+ * @param name The name, or NULL for an empty one
+ */
+static void bt_sdp_cache_copy_name(char *out, size_t size, char const *name) {
+	if (size == 0)
+		return;
+	if (name == NULL)
+		name = "";
+	strncpy(out, name, size - 1);
+	out[size - 1] = '\0';
+}
+
+/**
+ * Get a slot in the cache file.
+ *
+ * @param index The slot number
+ *
+ * @return The slot
+ */
+static bt_sdp_cache_slot_t *bt_sdp_cache_slot(uint32_t index) {
+	return ((bt_sdp_cache_slot_t *) (bt_sdp_cache_file + 1)) + index;
+}
+
+/**
+ * Check whether a slot in the cache file holds a device and service.
+ *
+ * @param slot The slot
+ * @param address The device address
+ * @param service The service UUID
+ *
+ * @return `true` if the slot is in use and matches
+ */
+static bool bt_sdp_cache_slot_matches(bt_sdp_cache_slot_t const *slot, bt_addr_t const *address, bt_uuid_t const *service) {
+	return (slot->channel != 0) &&
+			!memcmp(slot->address, address->b, sizeof(slot->address)) &&
+			!memcmp(slot->service, service, sizeof(slot->service));
+}
+
+/**
+ * Look a device and service up in the cache file, without locking it. The
+ * in-process lock must be held, so that the file isn't closed meanwhile.
+ *
+ * @param address The device address
+ * @param service The service UUID
+ * @param out Returns a copy of the matching slot
+ *
+ * @return `true` if a consistent match was found
+ */
+static bool bt_sdp_cache_file_read(bt_addr_t const *address, bt_uuid_t const *service, bt_sdp_cache_slot_t *out) {
+	uint32_t before;
+	uint32_t after;
+	uint32_t i;
+	int tries;
+	bool found;
+
+	for (tries = 0; tries < BT_SDP_CACHE_FILE_RETRIES; tries++) {
+		before = __atomic_load_n(&bt_sdp_cache_file->sequence, __ATOMIC_ACQUIRE);
+		if (before & 1) {
+			// a writer is part way through, so give it a moment
+			sched_yield();
+			continue;
+		}
+
+		found = false;
+		for (i = 0; i < bt_sdp_cache_file_slots && !found; i++) {
+			if (bt_sdp_cache_slot_matches(bt_sdp_cache_slot(i), address, service)) {
+				memcpy(out, bt_sdp_cache_slot(i), sizeof(bt_sdp_cache_slot_t));
+				found = true;
+			}
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&bt_sdp_cache_file->sequence, __ATOMIC_RELAXED);
+		if (before == after) {
+			return found && bt_sdp_cache_slot_matches(out, address, service);
+		}
+	}
+
+	LOG("bt_sdp_cache_file_read: gave up waiting for the writer\n");
+	return false;
+}
+
+/**
+ * Begin changing the cache file. This excludes writers in other processes
+ * and tells readers to retry. The in-process lock must be held.
+ *
+ * @return `true` if the file may be written, in which case
+ *         {@link bt_sdp_cache_file_end_write} must be called
+ */
+static bool bt_sdp_cache_file_begin_write(void) {
+	uint32_t sequence;
+
+	if (bt_sdp_cache_file == NULL || bt_sdp_cache_read_only)
+		return false;
+
+	if (flock(bt_sdp_cache_fd, LOCK_EX) < 0) {
+		LOG("bt_sdp_cache_file_begin_write: error %d locking file\n", errno);
+		return false;
+	}
+
+	// if a writer died part way through the sequence is already odd
+	sequence = __atomic_load_n(&bt_sdp_cache_file->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&bt_sdp_cache_file->sequence, sequence | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return true;
+}
+
+/**
+ * Finish changing the cache file, letting readers and other writers in.
+ */
+static void bt_sdp_cache_file_end_write(void) {
+	uint32_t sequence;
+
+	sequence = __atomic_load_n(&bt_sdp_cache_file->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&bt_sdp_cache_file->sequence, sequence + 1, __ATOMIC_RELEASE);
+	flock(bt_sdp_cache_fd, LOCK_UN);
+}
+
+/**
+ * Write a channel into the cache file, replacing the entry for the same
+ * device and service if there is one, or else the oldest. The in-process
+ * lock must be held.
+ *
+ * @param address The device address
+ * @param service The service UUID
+ * @param channel The channel
+ * @param name The service's name, or NULL to keep the name already stored
+ *        for the same channel
+ */
+static void bt_sdp_cache_file_write(bt_addr_t const *address, bt_uuid_t const *service, uint8_t channel, char const *name) {
+	bt_sdp_cache_slot_t *slot;
+	bt_sdp_cache_slot_t *candidate;
+	uint32_t i;
+
+	if (!bt_sdp_cache_file_begin_write())
+		return;
+
+	slot = NULL;
+	for (i = 0; i < bt_sdp_cache_file_slots && slot == NULL; i++) {
+		if (bt_sdp_cache_slot_matches(bt_sdp_cache_slot(i), address, service))
+			slot = bt_sdp_cache_slot(i);
+	}
+
+	if (slot == NULL) {
+		// take an empty slot, or else the oldest
+		for (i = 0; i < bt_sdp_cache_file_slots; i++) {
+			candidate = bt_sdp_cache_slot(i);
+			if (slot == NULL || candidate->channel == 0 || candidate->stored < slot->stored)
+				slot = candidate;
+			if (slot->channel == 0)
+				break;
+		}
+		slot->name[0] = '\0';
+	} else if (name == NULL && slot->channel != channel) {
+		// the name was for the old channel, so may be out of date
+		slot->name[0] = '\0';
+	}
+
+	memcpy(slot->address, address->b, sizeof(slot->address));
+	memcpy(slot->service, service, sizeof(slot->service));
+	slot->channel = channel;
+	slot->reserved = 0;
+	slot->stored = bt_sdp_cache_wall_time_us();
+	if (name != NULL)
+		bt_sdp_cache_copy_name(slot->name, sizeof(slot->name), name);
+
+	bt_sdp_cache_file_end_write();
+}
+
+/**
+ * Remove the entry for a device and service from the cache file. The
+ * in-process lock must be held.
+ *
+ * @param address The device address, or NULL to remove every entry
+ * @param service The service UUID
+ */
+static void bt_sdp_cache_file_erase(bt_addr_t const *address, bt_uuid_t const *service) {
+	uint32_t i;
+
+	if (!bt_sdp_cache_file_begin_write())
+		return;
+
+	for (i = 0; i < bt_sdp_cache_file_slots; i++) {
+		if (address == NULL || bt_sdp_cache_slot_matches(bt_sdp_cache_slot(i), address, service))
+			memset(bt_sdp_cache_slot(i), 0, sizeof(bt_sdp_cache_slot_t));
+	}
+
+	bt_sdp_cache_file_end_write();
+}
+
+/**
+ * Unmap and close the cache file. The in-process lock must be held.
+ */
+static void bt_sdp_cache_file_unmap(void) {
+	if (bt_sdp_cache_file != NULL)
+		munmap(bt_sdp_cache_file, bt_sdp_cache_file_size);
+	if (bt_sdp_cache_fd >= 0)
+		close(bt_sdp_cache_fd);
+	bt_sdp_cache_file = NULL;
+	bt_sdp_cache_file_size = 0;
+	bt_sdp_cache_file_slots = 0;
+	bt_sdp_cache_fd = -1;
+	bt_sdp_cache_read_only = false;
+}
+
+/**
+ * Find the entry for a device and service. The lock must be held.
+ *
+ * @param address The device address
+ * @param service The service UUID
+ *
+ * @return The entry, or NULL if the channel isn't remembered
+ */
+static bt_sdp_cache_entry_t *bt_sdp_cache_find(bt_addr_t const *address, bt_uuid_t const *service) {
+	size_t i;
+
+	for (i = 0; i < bt_sdp_cache_count; i++) {
+		if (bt_addr_equals(&bt_sdp_cache_entries[i].address, address) &&
+				!memcmp(&bt_sdp_cache_entries[i].service, service, sizeof(bt_uuid_t))) {
+			return &bt_sdp_cache_entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Forget an entry. The lock must be held.
+ *
+ * @param entry The entry to remove
+ */
+static void bt_sdp_cache_remove(bt_sdp_cache_entry_t *entry) {
+	// the order doesn't matter, so fill the gap with the last entry
+	bt_sdp_cache_count--;
+	*entry = bt_sdp_cache_entries[bt_sdp_cache_count];
+}
+
+/**
+ * Remember a channel in this process. The lock must be held.
+ *
+ * @param address The device address
+ * @param service The service UUID
+ * @param channel The channel
+ * @param name The service's name, or NULL to keep the name already stored
+ *        for the same channel
+ * @param now The current time, from {@link bt_time_now_us}
+ */
+static void bt_sdp_cache_insert(bt_addr_t const *address, bt_uuid_t const *service, uint8_t channel, char const *name, int64_t now) {
+	bt_sdp_cache_entry_t *entry;
+	bt_sdp_cache_entry_t *oldest;
+	size_t i;
+
+	if (bt_sdp_cache_entries == NULL) {
+		bt_sdp_cache_entries = malloc(bt_sdp_cache_capacity * sizeof(bt_sdp_cache_entry_t));
+		if (bt_sdp_cache_entries == NULL) {
+			LOG("bt_sdp_cache_insert: could not allocate %lu entries\n", (unsigned long) bt_sdp_cache_capacity);
+			return;
+		}
+	}
+
+	entry = bt_sdp_cache_find(address, service);
+	if (entry != NULL && name == NULL && entry->channel != channel) {
+		// the name was for the old channel, so may be out of date
+		entry->name[0] = '\0';
+	}
+	if (entry == NULL && bt_sdp_cache_count == bt_sdp_cache_capacity) {
+		oldest = &bt_sdp_cache_entries[0];
+		for (i = 1; i < bt_sdp_cache_count; i++) {
+			if (bt_sdp_cache_entries[i].last_used < oldest->last_used)
+				oldest = &bt_sdp_cache_entries[i];
+		}
+		if (bt_sdp_cache_expired(oldest->stored, now))
+			bt_sdp_cache_stats.expired++;
+		else
+			bt_sdp_cache_stats.evicted++;
+		oldest->name[0] = '\0';
+		entry = oldest;
+	}
+	if (entry == NULL) {
+		entry = &bt_sdp_cache_entries[bt_sdp_cache_count];
+		entry->name[0] = '\0';
+		bt_sdp_cache_count++;
+	}
+
+	entry->address = *address;
+	entry->service = *service;
+	entry->channel = channel;
+	if (name != NULL)
+		bt_sdp_cache_copy_name(entry->name, sizeof(entry->name), name);
+	entry->stored = now;
+	entry->last_used = ++bt_sdp_cache_uses;
+}
+
+/**
+ * Set how long channels are remembered and how many. Any channels already
+ * remembered in this process are forgotten. The cache is on by default,
+ * keeping up to `BT_SDP_CACHE_DEFAULT_SIZE` channels for
+ * `BT_SDP_CACHE_DEFAULT_TTL` milliseconds. The TTL applies to entries in the
+ * cache file too.
+ *
+ * @param ttl_ms How long a channel is remembered in milliseconds,
+ *        `BT_SDP_CACHE_NO_EXPIRY` to keep channels until a connection to
+ *        them fails, or `BT_SDP_CACHE_DISABLED` to query SDP every time
+ * @param max_entries The most channels to remember, or `0` for
+ *        `BT_SDP_CACHE_DEFAULT_SIZE`
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_UNSUPPORTED`     - the cache isn't available on Windows
+ *    `BT_ERR_BAD_PARAM`       - the TTL was negative but not
+ *                               `BT_SDP_CACHE_NO_EXPIRY`
+ */
+bt_err_t bt_sdp_cache_configure(int ttl_ms, size_t max_entries) {
+	if (ttl_ms < 0 && ttl_ms != BT_SDP_CACHE_NO_EXPIRY) {
+		LOG("bt_sdp_cache_configure: bad TTL %d\n", ttl_ms);
+		return BT_ERR_BAD_PARAM;
+	}
+
+	pthread_mutex_lock(&bt_sdp_cache_lock);
+	free(bt_sdp_cache_entries);
+	bt_sdp_cache_entries = NULL;
+	bt_sdp_cache_count = 0;
+	bt_sdp_cache_capacity = (max_entries > 0) ? max_entries : BT_SDP_CACHE_DEFAULT_SIZE;
+	bt_sdp_cache_ttl_ms = ttl_ms;
+	pthread_mutex_unlock(&bt_sdp_cache_lock);
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Share remembered channels with other processes through a file. Channels
+ * not remembered in this process are looked for in the file before an SDP
+ * query is made, and channels found are written to it, so a process that
+ * has just started can connect to a known device straight away.
+ *
+ * The file is created if need be. If it can't be written, for example
+ * because it belongs to another user, it's opened for reading only. A file
+ * that isn't a cache file, or is from an incompatible version, is started
+ * afresh. Any file opened earlier is closed.
+ *
+ * @param path The file's path
+ * @param slots The number of channels a new file holds, or `0` for
+ *        `BT_SDP_CACHE_DEFAULT_FILE_SLOTS`. An existing file keeps its size.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_FILE_NOT_FOUND`  - the file couldn't be opened or created
+ *    `BT_ERR_UNSUPPORTED`     - the cache isn't available on Windows
+ *    `BT_ERR_UNKNOWN`         - the file couldn't be mapped, or is
+ *                               read-only and not a cache file
+ *    `BT_ERR_BAD_PARAM`       - the path was NULL
+ */
+bt_err_t bt_sdp_cache_open_file(char const *path, size_t slots) {
+	bt_sdp_cache_file_header_t *file;
+	struct stat st;
+	size_t size;
+	bool valid;
+	int prot;
+	int fd;
+
+	if (path == NULL)
+		return BT_ERR_BAD_PARAM;
+	if (slots == 0)
+		slots = BT_SDP_CACHE_DEFAULT_FILE_SLOTS;
+
+	pthread_mutex_lock(&bt_sdp_cache_lock);
+	bt_sdp_cache_file_unmap();
+
+	bt_sdp_cache_read_only = false;
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+		bt_sdp_cache_read_only = true;
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0) {
+		LOG("bt_sdp_cache_open_file: error %d opening %s\n", errno, path);
+		pthread_mutex_unlock(&bt_sdp_cache_lock);
+		return BT_ERR_FILE_NOT_FOUND;
+	}
+
+	// hold the lock while checking the file, so two processes don't both set it up
+	flock(fd, bt_sdp_cache_read_only ? LOCK_SH : LOCK_EX);
+	prot = bt_sdp_cache_read_only ? PROT_READ : (PROT_READ | PROT_WRITE);
+	file = MAP_FAILED;
+	valid = false;
+	size = 0;
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(bt_sdp_cache_file_header_t)) {
+		size = st.st_size;
+		file = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	}
+	if (file != MAP_FAILED) {
+		valid = (file->magic == BT_SDP_CACHE_FILE_MAGIC) &&
+				(file->version == BT_SDP_CACHE_FILE_VERSION) &&
+				(file->slot_size == sizeof(bt_sdp_cache_slot_t)) &&
+				(file->slots > 0) &&
+				(size >= sizeof(bt_sdp_cache_file_header_t) + (size_t) file->slots * sizeof(bt_sdp_cache_slot_t));
+		if (!valid) {
+			munmap(file, size);
+			file = MAP_FAILED;
+		}
+	}
+
+	if (!valid && !bt_sdp_cache_read_only) {
+		// start afresh; zero-filling the file empties every slot
+		size = sizeof(bt_sdp_cache_file_header_t) + slots * sizeof(bt_sdp_cache_slot_t);
+		if (ftruncate(fd, 0) == 0 && ftruncate(fd, size) == 0) {
+			file = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+		}
+		if (file != MAP_FAILED) {
+			file->version = BT_SDP_CACHE_FILE_VERSION;
+			file->slot_size = sizeof(bt_sdp_cache_slot_t);
+			file->slots = (uint32_t) slots;
+			file->sequence = 0;
+			// set last, so the file isn't taken as valid until it is
+			__atomic_store_n(&file->magic, BT_SDP_CACHE_FILE_MAGIC, __ATOMIC_RELEASE);
+			valid = true;
+			LOG("bt_sdp_cache_open_file: created %s with %lu slots\n", path, (unsigned long) slots);
+		}
+	}
+	flock(fd, LOCK_UN);
+
+	if (!valid) {
+		LOG("bt_sdp_cache_open_file: %s isn't a usable cache file\n", path);
+		close(fd);
+		bt_sdp_cache_read_only = false;
+		pthread_mutex_unlock(&bt_sdp_cache_lock);
+		return BT_ERR_UNKNOWN;
+	}
+
+	bt_sdp_cache_fd = fd;
+	bt_sdp_cache_file = file;
+	bt_sdp_cache_file_size = size;
+	bt_sdp_cache_file_slots = file->slots;
+	pthread_mutex_unlock(&bt_sdp_cache_lock);
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Stop sharing channels through the cache file opened with
+ * {@link bt_sdp_cache_open_file}. The file itself is left in place.
+ */
+void bt_sdp_cache_close_file(void) {
+	pthread_mutex_lock(&bt_sdp_cache_lock);
+	bt_sdp_cache_file_unmap();
+	pthread_mutex_unlock(&bt_sdp_cache_lock);
+}
+
+/**
+ * Look up the RFCOMM channel a service was last found on.
+ *
+ * @param address The device the service is on
+ * @param service The service UUID
+ * @param channel Returns the channel, if it's remembered
+ *
+ * @return `true` if the channel is remembered, `false` if it has to be found
+ *         with an SDP query
+ */
+bool bt_sdp_cache_lookup(bt_addr_t const *address, bt_uuid_t const *service, uint8_t *channel) {
+	return bt_sdp_cache_lookup_ex(address, service, channel, NULL, 0);
+}
+
+/**
+ * Look up the RFCOMM channel a service was last found on, and its name if
+ * that's known. Channels not remembered in this process are looked for in
+ * the cache file, if one is open.
+ *
+ * @param address The device the service is on
+ * @param service The service UUID
+ * @param channel Returns the channel, if it's remembered
+ * @param name Returns the service's name, or an empty string if it isn't
+ *        known. May be NULL.
+ * @param size The size of the name buffer. `BT_SDP_CACHE_NAME_LENGTH` is
+ *        enough for any name.
+ *
+ * @return `true` if the channel is remembered, `false` if it has to be found
+ *         with an SDP query
+ */
+bool bt_sdp_cache_lookup_ex(bt_addr_t const *address, bt_uuid_t const *service, uint8_t *channel, char *name, size_t size) {
+	bt_sdp_cache_entry_t *entry;
+	bt_sdp_cache_slot_t slot;
+	int64_t now;
+	int64_t wall;
+	int64_t age;
+	bool found;
+
+	if (address == NULL || service == NULL || channel == NULL)
+		return false;
+
+	found = false;
+	now = bt_time_now_us();
+	pthread_mutex_lock(&bt_sdp_cache_lock);
+	if (bt_sdp_cache_ttl_ms != BT_SDP_CACHE_DISABLED) {
+		entry = bt_sdp_cache_find(address, service);
+		if (entry != NULL && bt_sdp_cache_expired(entry->stored, now)) {
+			bt_sdp_cache_remove(entry);
+			bt_sdp_cache_stats.expired++;
+			entry = NULL;
+		}
+
+		if (entry == NULL && bt_sdp_cache_file != NULL &&
+				bt_sdp_cache_file_read(address, service, &slot) &&
+				!bt_sdp_cache_expired(slot.stored, wall = bt_sdp_cache_wall_time_us())) {
+			// keep it here too, so the file needn't be searched next time
+			slot.name[sizeof(slot.name) - 1] = '\0';
+			bt_sdp_cache_insert(address, service, slot.channel, slot.name, now);
+			entry = bt_sdp_cache_find(address, service);
+			if (entry != NULL) {
+				// it keeps the age it has in the file, rather than starting afresh
+				age = wall - slot.stored;
+				entry->stored = now - (age > 0 ? age : 0);
+			}
+			bt_sdp_cache_stats.file_hits++;
+		}
+
+		if (entry != NULL) {
+			entry->last_used = ++bt_sdp_cache_uses;
+			*channel = entry->channel;
+			if (name != NULL)
+				bt_sdp_cache_copy_name(name, size, entry->name);
+			bt_sdp_cache_stats.hits++;
+			found = true;
+		} else {
+			bt_sdp_cache_stats.misses++;
+		}
+	}
+	pthread_mutex_unlock(&bt_sdp_cache_lock);
+
+	return found;
+}
+
+/**
+ * Remember the RFCOMM channel a service was found on. If the cache is full,
+ * the channel looked up least recently is forgotten to make room.
+ *
+ * @param address The device the service is on
+ * @param service The service UUID
+ * @param channel The channel, in [1..30]
+ */
+void bt_sdp_cache_store(bt_addr_t const *address, bt_uuid_t const *service, uint8_t channel) {
+	bt_sdp_cache_store_ex(address, service, channel, NULL);
+}
+
+/**
+ * Remember the RFCOMM channel a service was found on, along with its name.
+ * The channel is written to the cache file too, if one is open for
+ * writing; there the oldest entry makes way when the file is full.
+ *
+ * @param address The device the service is on
+ * @param service The service UUID
+ * @param channel The channel, in [1..30]
+ * @param name The service's name, or NULL to keep any name already
+ *        remembered for the same channel. Names longer than
+ *        `BT_SDP_CACHE_NAME_LENGTH - 1` characters are truncated.
+ */
+void bt_sdp_cache_store_ex(bt_addr_t const *address, bt_uuid_t const *service, uint8_t channel, char const *name) {
+	if (address == NULL || service == NULL || channel < 1 || channel > 30)
+		return;
+
+	pthread_mutex_lock(&bt_sdp_cache_lock);
+	if (bt_sdp_cache_ttl_ms != BT_SDP_CACHE_DISABLED) {
+		bt_sdp_cache_insert(address, service, channel, name, bt_time_now_us());
+		bt_sdp_cache_file_write(address, service, channel, name);
+	}
+	pthread_mutex_unlock(&bt_sdp_cache_lock);
+}
+
+/**
+ * Forget the channel a service was found on, for example because a
+ * connection to it has been refused. It's removed from the cache file too.
+ *
+ * @param address The device the service is on
+ * @param service The service UUID
+ */
+void bt_sdp_cache_invalidate(bt_addr_t const *address, bt_uuid_t const *service) {
+	bt_sdp_cache_entry_t *entry;
+
+	if (address == NULL || service == NULL)
+		return;
+
+	pthread_mutex_lock(&bt_sdp_cache_lock);
+	entry = bt_sdp_cache_find(address, service);
+	if (entry != NULL) {
+		bt_sdp_cache_remove(entry);
+		bt_sdp_cache_stats.invalidated++;
+	}
+	bt_sdp_cache_file_erase(address, service);
+	pthread_mutex_unlock(&bt_sdp_cache_lock);
+}
+
+/**
+ * Forget every remembered channel, including those in the cache file.
+ */
+void bt_sdp_cache_clear(void) {
+	pthread_mutex_lock(&bt_sdp_cache_lock);
+	bt_sdp_cache_count = 0;
+	bt_sdp_cache_file_erase(NULL, NULL);
+	pthread_mutex_unlock(&bt_sdp_cache_lock);
+}
+
+/**
+ * Get the cache's counters.
+ *
+ * @param stats Returns the counters
+ */
+void bt_sdp_cache_get_stats(bt_sdp_cache_stats_t *stats) {
+	if (stats == NULL)
+		return;
+
+	pthread_mutex_lock(&bt_sdp_cache_lock);
+	*stats = bt_sdp_cache_stats;
+	stats->size = bt_sdp_cache_count;
+	pthread_mutex_unlock(&bt_sdp_cache_lock);
+}
+
+#endif
@@ -0,0 +1,465 @@
+/**
+ * @file btserver.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Multi-threaded connection server
+ *
+ * {@link bt_wait_for_connection} binds, registers a service, listens and
+ * accepts a single connection, so serving another client means paying for
+ * all of that again. A server instead keeps one listener and SDP record for
+ * its whole life. An acceptor thread drains the listen queue using
+ * {@link bt_accept_many} and queues the connections for a fixed pool of
+ * worker threads, each of which passes a connection to the handler and
+ * closes it once the handler returns.
+ *
+ * The server is currently only available on Linux. On Windows starting a
+ * server returns `BT_ERR_UNSUPPORTED`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "picobt/bt.h"
+#include "picobt/btserver.h"
+#ifdef WINDOWS
+// nothing further to include
+#else // LINUX
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include "picobt/log.h"
+
+/// The most connections the acceptor takes from the listen queue at once.
+#define BT_SERVER_ACCEPT_BATCH 16
+/// How often, in milliseconds, the acceptor checks whether it should stop.
+#define BT_SERVER_STOP_CHECK_MS 200
+/// How long, in milliseconds, the acceptor backs off after an accept error.
+#define BT_SERVER_ERROR_BACKOFF_MS 100
+
+#ifdef WINDOWS
+
+bt_err_t bt_server_init(bt_server_t *server, bt_server_config_t const *config) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_server_free(bt_server_t *server) {
+}
+
+bt_err_t bt_server_start(bt_server_t *server) {
+	return BT_ERR_UNSUPPORTED;
+}
+
+void bt_server_stop(bt_server_t *server) {
+}
+
+uint8_t bt_server_get_channel(bt_server_t const *server) {
+	return 0;
+}
+
+void bt_server_get_stats(bt_server_t *server, bt_server_stats_t *stats) {
+	if (stats != NULL)
+		memset(stats, 0, sizeof(bt_server_stats_t));
+}
+
+#else // LINUX
+
+/**
+ * The parts of a server that are private to this file.
+ */
+typedef struct {
+	/// Protects everything below.
+	pthread_mutex_t lock;
+	/// Signalled when a connection is queued or the server is stopping.
+	pthread_cond_t ready;
+	/// The thread accepting connections.
+	pthread_t acceptor;
+	/// The worker threads.
+	pthread_t *workers;
+	/// The number of worker threads running.
+	unsigned started;
+	/// Connections waiting for a worker, as a ring.
+	bt_socket_t *queue;
+	/// Position of the oldest waiting connection in the ring.
+	unsigned head;
+	/// Set to ask the threads to finish.
+	bool stopping;
+	/// Counters for monitoring the server.
+	bt_server_stats_t stats;
+} bt_server_state_t;
+
+/**
+ * Accept connections until the server is stopped, queueing them for the
+ * workers.
+ *
+ * @param arg The server.
+ *
+ * @return NULL.
+ */
+static void *bt_server_accept_thread(void *arg) {
+	bt_server_t *server = arg;
+	bt_server_state_t *state = server->state;
+	bt_socket_t clients[BT_SERVER_ACCEPT_BATCH];
+	struct timespec backoff;
+	unsigned queued;
+	size_t count;
+	size_t i;
+	bool stopping;
+	bt_err_t e;
+
+	stopping = false;
+	while (!stopping) {
+		e = bt_accept_many(&server->listener, clients, BT_SERVER_ACCEPT_BATCH, bt_deadline_from_ms(BT_SERVER_STOP_CHECK_MS), &count);
+		if (e != BT_SUCCESS) {
+			count = 0;
+			if (e != BT_ERR_TIMEOUT) {
+				// for example out of descriptors, so give the workers a chance
+				LOG("bt_server: error %d accepting connections\n", e);
+				backoff.tv_sec = 0;
+				backoff.tv_nsec = BT_SERVER_ERROR_BACKOFF_MS * 1000000L;
+				nanosleep(&backoff, NULL);
+			}
+		}
+
+		queued = 0;
+		pthread_mutex_lock(&state->lock);
+		stopping = state->stopping;
+		for (i = 0; i < count; i++) {
+			state->stats.accepted++;
+			if (!stopping && state->stats.queued < server->config.queue_size) {
+				state->queue[(state->head + state->stats.queued) % server->config.queue_size] = clients[i];
+				state->stats.queued++;
+				clients[i].s = -1;
+				queued++;
+			}
+			else {
+				state->stats.rejected++;
+			}
+		}
+		if (queued > 1) {
+			pthread_cond_broadcast(&state->ready);
+		}
+		else if (queued == 1) {
+			pthread_cond_signal(&state->ready);
+		}
+		pthread_mutex_unlock(&state->lock);
+
+		// close whatever couldn't be queued
+		for (i = 0; i < count; i++) {
+			bt_disconnect(&clients[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Serve queued connections until the server is stopped.
+ *
+ * @param arg The server.
+ *
+ * @return NULL.
+ */
+static void *bt_server_worker_thread(void *arg) {
+	bt_server_t *server = arg;
+	bt_server_state_t *state = server->state;
+	bt_socket_t client;
+
+	pthread_mutex_lock(&state->lock);
+	while (true) {
+		while (state->stats.queued == 0 && !state->stopping) {
+			pthread_cond_wait(&state->ready, &state->lock);
+		}
+		if (state->stopping)
+			break;
+
+		client = state->queue[state->head];
+		state->head = (state->head + 1) % server->config.queue_size;
+		state->stats.queued--;
+		state->stats.active++;
+		pthread_mutex_unlock(&state->lock);
+
+		// accepted sockets are non-blocking, but handlers expect otherwise
+		bt_set_nonblocking(&client, false);
+		if (server->config.timeout > 0) {
+			bt_set_timeout(&client, server->config.timeout);
+		}
+		server->config.handler(server, &client, server->config.data);
+		bt_disconnect(&client);
+
+		pthread_mutex_lock(&state->lock);
+		state->stats.active--;
+		state->stats.handled++;
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+/**
+ * Ask the server's threads to finish and wait for them.
+ *
+ * @param server The server.
+ */
+static void bt_server_join(bt_server_t *server) {
+	bt_server_state_t *state = server->state;
+	unsigned i;
+
+	pthread_mutex_lock(&state->lock);
+	state->stopping = true;
+	pthread_cond_broadcast(&state->ready);
+	pthread_mutex_unlock(&state->lock);
+
+	for (i = 0; i < state->started; i++) {
+		pthread_join(state->workers[i], NULL);
+	}
+	state->started = 0;
+}
+
+/**
+ * Initialise a server. This allocates its resources but doesn't bind or
+ * start any threads; call {@link bt_server_start} for that. Free the server
+ * using {@link bt_server_free}.
+ *
+ * @param server The server to initialise.
+ * @param config How the server should be set up. Unset fields take their
+ *               defaults, but the handler must be given.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - A parameter or the handler was NULL, or a
+ *                               service was given without a name
+ *    `BT_ERR_UNKNOWN`         - memory couldn't be allocated
+ */
+bt_err_t bt_server_init(bt_server_t *server, bt_server_config_t const *config) {
+	bt_server_state_t *state;
+
+	// check parameters
+	if (server == NULL || config == NULL || config->handler == NULL || (config->service != NULL && config->service_name == NULL)) {
+		LOG("bt_server_init: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+
+	memset(server, 0, sizeof(bt_server_t));
+	server->config = *config;
+	if (server->config.workers == 0)
+		server->config.workers = BT_SERVER_DEFAULT_WORKERS;
+	if (server->config.queue_size == 0)
+		server->config.queue_size = BT_SERVER_DEFAULT_QUEUE;
+	if (server->config.backlog == 0)
+		server->config.backlog = BT_LISTEN_MAX_BACKLOG;
+	if (server->config.timeout == 0)
+		server->config.timeout = BT_SERVER_DEFAULT_TIMEOUT;
+	server->listener.s = -1;
+
+	state = calloc(1, sizeof(bt_server_state_t));
+	if (state == NULL)
+		return BT_ERR_UNKNOWN;
+	state->workers = calloc(server->config.workers, sizeof(pthread_t));
+	state->queue = calloc(server->config.queue_size, sizeof(bt_socket_t));
+	if (state->workers == NULL || state->queue == NULL) {
+		LOG("bt_server_init: could not allocate %u workers\n", server->config.workers);
+		free(state->workers);
+		free(state->queue);
+		free(state);
+		return BT_ERR_UNKNOWN;
+	}
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->ready, NULL);
+	server->state = state;
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Free a server, stopping it first if it's running.
+ *
+ * @param server The server to free.
+ */
+void bt_server_free(bt_server_t *server) {
+	bt_server_state_t *state;
+
+	if (server == NULL || server->state == NULL)
+		return;
+
+	bt_server_stop(server);
+
+	state = server->state;
+	pthread_cond_destroy(&state->ready);
+	pthread_mutex_destroy(&state->lock);
+	free(state->workers);
+	free(state->queue);
+	free(state);
+	server->state = NULL;
+}
+
+/**
+ * Start a server. This binds the listening socket, registers the service if
+ * one was given, and starts the acceptor and worker threads. The call
+ * returns straight away; connections are served in the background until
+ * {@link bt_server_stop} is called.
+ *
+ * @param server The server to start.
+ *
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_BAD_PARAM`       - The server was NULL, uninitialised or
+ *                               already running
+ *    `BT_ERR_UNKNOWN`         - the socket couldn't be set up, the service
+ *                               registered or the threads started
+ */
+bt_err_t bt_server_start(bt_server_t *server) {
+	bt_server_state_t *state;
+	bt_err_t e;
+
+	// check parameters
+	if (server == NULL || server->state == NULL || server->running) {
+		LOG("bt_server_start: bad parameters\n");
+		return BT_ERR_BAD_PARAM;
+	}
+	state = server->state;
+
+	if (server->config.channel == 0) {
+		e = bt_bind(&server->listener);
+	}
+	else {
+		e = bt_bind_to_channel(&server->listener, server->config.channel);
+	}
+
+	if (e == BT_SUCCESS && server->config.service != NULL) {
+		e = bt_register_service_ex(server->config.service, server->config.service_name, &server->listener, &server->registration);
+	}
+
+	if (e == BT_SUCCESS) {
+		e = bt_listen_with_backlog(&server->listener, server->config.backlog);
+	}
+
+	if (e == BT_SUCCESS) {
+		// so that the acceptor can drain the queue without blocking
+		e = bt_set_nonblocking(&server->listener, true);
+	}
+
+	if (e == BT_SUCCESS) {
+		state->stopping = false;
+		memset(&state->stats, 0, sizeof(bt_server_stats_t));
+		while (state->started < server->config.workers && e == BT_SUCCESS) {
+			if (pthread_create(&state->workers[state->started], NULL, bt_server_worker_thread, server) != 0) {
+				LOG("bt_server_start: could not start worker thread\n");
+				e = BT_ERR_UNKNOWN;
+			}
+			else {
+				state->started++;
+			}
+		}
+	}
+
+	if (e == BT_SUCCESS) {
+		if (pthread_create(&state->acceptor, NULL, bt_server_accept_thread, server) != 0) {
+			LOG("bt_server_start: could not start acceptor thread\n");
+			e = BT_ERR_UNKNOWN;
+		}
+	}
+
+	if (e != BT_SUCCESS) {
+		bt_server_join(server);
+		bt_unregister_service(&server->registration);
+		bt_disconnect(&server->listener);
+		return e;
+	}
+
+	server->running = true;
+	LOG("bt_server_start: serving on channel %d with %u workers\n", bt_server_get_channel(server), server->config.workers);
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Stop a server. No more connections are accepted. Handlers that are running
+ * are allowed to finish, and this call waits for them; connections still
+ * waiting for a worker are closed. The listening socket is closed and the
+ * service withdrawn. The server can be started again afterwards.
+ *
+ * @param server The server to stop.
+ */
+void bt_server_stop(bt_server_t *server) {
+	bt_server_state_t *state;
+
+	if (server == NULL || server->state == NULL || !server->running)
+		return;
+	state = server->state;
+
+	bt_server_join(server);
+	pthread_join(state->acceptor, NULL);
+
+	while (state->stats.queued > 0) {
+		bt_disconnect(&state->queue[state->head]);
+		state->head = (state->head + 1) % server->config.queue_size;
+		state->stats.queued--;
+	}
+
+	bt_unregister_service(&server->registration);
+	bt_disconnect(&server->listener);
+	server->running = false;
+}
+
+/**
+ * Return the RFCOMM channel a running server is listening on. This is useful
+ * when the server was configured to use any available channel.
+ *
+ * @param server The server.
+ *
+ * @return The channel, or `0` if the server isn't running.
+ */
+uint8_t bt_server_get_channel(bt_server_t const *server) {
+	if (server == NULL || server->listener.s < 0)
+		return 0;
+
+	return bt_get_socket_channel(server->listener);
+}
+
+/**
+ * Return a snapshot of a server's counters. These are reset each time the
+ * server is started.
+ *
+ * @param server The server.
+ * @param stats  Returns the counters.
+ */
+void bt_server_get_stats(bt_server_t *server, bt_server_stats_t *stats) {
+	bt_server_state_t *state;
+
+	if (stats == NULL)
+		return;
+
+	if (server == NULL || server->state == NULL) {
+		memset(stats, 0, sizeof(bt_server_stats_t));
+		return;
+	}
+	state = server->state;
+
+	pthread_mutex_lock(&state->lock);
+	*stats = state->stats;
+	pthread_mutex_unlock(&state->lock);
+}
+
+#endif
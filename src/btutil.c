@@ -29,6 +29,13 @@
  */
 
 #include <stdio.h>
+#include <limits.h>
+#ifndef WINDOWS
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
 #include "picobt/bt.h"
 #include "picobt/log.h"
 
@@ -186,6 +193,187 @@ bt_err_t bt_str_to_uuid(const char *str, bt_uuid_t *uuid) {
 }
 
 
+/******************************************************************************\
+ * TIME                                                                       *
+\******************************************************************************/
+
+/**
+ * Get the current time from a monotonic clock. The clock isn't affected by
+ * changes to the system time, so it's suitable for measuring intervals and
+ * deadlines, but its zero point is arbitrary.
+ * @return The current monotonic time in microseconds.
+ */
+int64_t bt_time_now_us(void) {
+#ifdef WINDOWS
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (int64_t) ((counter.QuadPart / frequency.QuadPart) * 1000000 +
+			((counter.QuadPart % frequency.QuadPart) * 1000000) / frequency.QuadPart);
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((int64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+#endif
+}
+
+/**
+ * Create a deadline a given number of milliseconds from now.
+ * @param timeout_ms The time until the deadline in milliseconds. A negative
+ *        value gives a deadline that never expires.
+ * @return The deadline.
+ */
+bt_deadline_t bt_deadline_from_ms(int timeout_ms) {
+	if (timeout_ms < 0)
+		return BT_DEADLINE_NEVER;
+
+	return bt_time_now_us() + ((int64_t) timeout_ms * 1000);
+}
+
+/**
+ * Get the time left before a deadline, in the form taken by `poll`. The time
+ * is rounded up so that waiting for it doesn't wake up just too early.
+ * @param deadline The deadline to check.
+ * @return The number of milliseconds remaining, `0` if the deadline has
+ *         passed, or `-1` if it never expires.
+ */
+int bt_deadline_remaining_ms(bt_deadline_t deadline) {
+	int64_t remaining;
+
+	if (deadline == BT_DEADLINE_NEVER)
+		return -1;
+
+	remaining = deadline - bt_time_now_us();
+	if (remaining <= 0)
+		return 0;
+
+	remaining = (remaining + 999) / 1000;
+
+	return (remaining > INT_MAX) ? INT_MAX : (int) remaining;
+}
+
+
+/******************************************************************************\
+ * CANCELLATION                                                               *
+\******************************************************************************/
+
+/**
+ * Create a cancel token. The token starts out uncancelled.
+ * @param token The token to initialise.
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_UNSUPPORTED`     - cancellation isn't supported on Windows
+ *    `BT_ERR_UNKNOWN`         - the eventfd couldn't be created
+ *    `BT_ERR_BAD_PARAM`       - the token was NULL
+ */
+bt_err_t bt_cancel_init(bt_cancel_token_t *token) {
+	if (token == NULL)
+		return BT_ERR_BAD_PARAM;
+
+	token->fd = -1;
+	token->cancelled = 0;
+
+#ifdef WINDOWS
+	return BT_ERR_UNSUPPORTED;
+#else
+	token->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (token->fd < 0) {
+		LOG("bt_cancel_init: error %d creating eventfd\n", errno);
+		return BT_ERR_UNKNOWN;
+	}
+
+	return BT_SUCCESS;
+#endif
+}
+
+/**
+ * Release the resources held by a cancel token. No call may still be
+ * waiting on it.
+ * @param token The token to free.
+ */
+void bt_cancel_free(bt_cancel_token_t *token) {
+	if (token == NULL)
+		return;
+
+#ifndef WINDOWS
+	if (token->fd >= 0)
+		close(token->fd);
+#endif
+	token->fd = -1;
+}
+
+/**
+ * Cancel every call waiting on a token, and any that start waiting on it
+ * until it's reset. This is safe to call from any thread, but not from a
+ * signal handler.
+ * @param token The token to signal.
+ * @return `BT_SUCCESS` if successful, or one of the following if there's an
+ *         error:
+ *    `BT_ERR_UNKNOWN`         - the eventfd couldn't be signalled
+ *    `BT_ERR_BAD_PARAM`       - the token was NULL or wasn't initialised
+ */
+bt_err_t bt_cancel(bt_cancel_token_t *token) {
+#ifndef WINDOWS
+	uint64_t one = 1;
+#endif
+
+	if (token == NULL || token->fd < 0)
+		return BT_ERR_BAD_PARAM;
+
+#ifndef WINDOWS
+	__atomic_store_n(&token->cancelled, 1, __ATOMIC_RELEASE);
+	// the counter can only overflow if it's never reset, and then it's still signalled
+	if (write(token->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		LOG("bt_cancel: error %d signalling eventfd %d\n", errno, token->fd);
+		return BT_ERR_UNKNOWN;
+	}
+#endif
+
+	return BT_SUCCESS;
+}
+
+/**
+ * Clear a cancel token so that it can be used again. Calls that are still
+ * waiting on it when it's reset may or may not be cancelled.
+ * @param token The token to reset.
+ */
+void bt_cancel_reset(bt_cancel_token_t *token) {
+#ifndef WINDOWS
+	uint64_t count;
+#endif
+
+	if (token == NULL || token->fd < 0)
+		return;
+
+#ifndef WINDOWS
+	__atomic_store_n(&token->cancelled, 0, __ATOMIC_RELEASE);
+	// the eventfd is non-blocking, so this fails harmlessly if it wasn't signalled
+	if (read(token->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		LOG("bt_cancel_reset: error %d clearing eventfd %d\n", errno, token->fd);
+	}
+#endif
+}
+
+/**
+ * Check whether a token has been cancelled, without waiting. This is cheap
+ * enough to call between the steps of a long operation.
+ * @param token The token to check, or NULL.
+ * @return `true` if the token has been cancelled, `false` if it hasn't or
+ *         was NULL.
+ */
+bool bt_cancel_requested(bt_cancel_token_t const *token) {
+#ifdef WINDOWS
+	// tokens can't be initialised, so they can't be cancelled either
+	return false;
+#else
+	return (token != NULL) && __atomic_load_n(&token->cancelled, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
 /******************************************************************************\
  * PLATFORM-SPECIFIC CONVERSIONS                                              *
 \******************************************************************************/
@@ -29,11 +29,44 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "picobt/bt.h"
 #include "picobt/devicelist.h"
+#ifdef WINDOWS
+// nothing further to include
+#else // LINUX
+#include <pthread.h>
+#endif
 #include "picobt/log.h"
 
+/**
+ * A message being sent to a list of devices by {@link bt_send_to_list_ex},
+ * shared between the threads doing the sending.
+ */
+typedef struct {
+	/// The service to send to.
+	const bt_uuid_t *service;
+	/// The message to send.
+	const void *message;
+	/// The length of the message.
+	size_t length;
+	/// The pool to take connections from, or NULL.
+	bt_pool_t *pool;
+	/// When to stop trying.
+	bt_deadline_t deadline;
+	/// One result for each device, with the addresses filled in.
+	bt_send_result_t *results;
+	/// The number of devices.
+	size_t count;
+	/// The next device not yet taken by a thread.
+	size_t next;
+#ifndef WINDOWS
+	/// Protects next.
+	pthread_mutex_t lock;
+#endif
+} bt_send_job_t;
+
 /**
  * Create a new empty device list. Free using {@link bt_list_delete}.
  * 
@@ -247,6 +280,8 @@ bt_err_t bt_get_next_device(bt_iterator_t *iterator, bt_addr_t *address) {
 
 /**
  * Helper function for Pico, to send a message to all devices in the given list.
+ * A new connection is made to each device and closed afterwards; use
+ * {@link bt_send_to_list_pooled} to keep connections open between messages.
  * 
  * @param list Pointer to the list of devices to send to.
  * @param service Pointer to the service UUID to send to.
@@ -255,10 +290,30 @@ bt_err_t bt_get_next_device(bt_iterator_t *iterator, bt_addr_t *address) {
  */
 void bt_send_to_list(const bt_device_list_t *list, const bt_uuid_t *service,
 						const void *message, size_t length) {
+	bt_send_to_list_pooled(NULL, list, service, message, length);
+}
+
+/**
+ * Send a message to all devices in the given list, taking the connections
+ * from a pool. Connections are returned to the pool afterwards so the next
+ * message to the same device can reuse them, and any that fail are dropped.
+ * If writing to a reused connection fails, the message is sent once more on
+ * another connection from the pool.
+ * 
+ * @param pool Pointer to the pool to take connections from, or NULL to
+ *             connect to each device afresh.
+ * @param list Pointer to the list of devices to send to.
+ * @param service Pointer to the service UUID to send to.
+ * @param message Pointer to the message to send.
+ * @param length Length of the message to send.
+ */
+void bt_send_to_list_pooled(bt_pool_t *pool, const bt_device_list_t *list,
+						const bt_uuid_t *service, const void *message, size_t length) {
 	bt_iterator_t iterator;
 	bt_addr_t address;
 	bt_socket_t socket;
 	char addressStr[BT_ADDRESS_LENGTH];
+	bool reused;
 	bt_err_t e;
 	
 	// validate parameters
@@ -270,8 +325,25 @@ void bt_send_to_list(const bt_device_list_t *list, const bt_uuid_t *service,
 	while (BT_SUCCESS == bt_get_next_device(&iterator, &address)) {
 		bt_addr_to_str(&address, addressStr);
 		LOG("Trying bluetooth device %s\n", addressStr);
-		// connect to the Pico
-		if (BT_SUCCESS == (e = bt_connect_to_service(&address, service, &socket))) {
+		if (pool != NULL) {
+			// reuse a connection if there is one
+			if (BT_SUCCESS == (e = bt_pool_checkout(pool, &address, service, &socket, BT_CONNECT_NO_TIMEOUT, &reused))) {
+				e = bt_write(&socket, message, length);
+				bt_pool_put(pool, &socket, e);
+				if (e != BT_SUCCESS && reused) {
+					// the device closed it since it was last used, so try once more
+					LOG("Pooled connection failed with error %d, retrying\n", e);
+					if (BT_SUCCESS == (e = bt_pool_get(pool, &address, service, &socket))) {
+						e = bt_write(&socket, message, length);
+						bt_pool_put(pool, &socket, e);
+					}
+				}
+			}
+			if (e != BT_SUCCESS) {
+				LOG("error %d\n", e);
+			}
+		} else if (BT_SUCCESS == (e = bt_connect_to_service(&address, service, &socket))) {
+			// connect to the Pico
 			bt_write(&socket, message, length);
 			// close the connection
 			bt_disconnect(&socket);
@@ -285,4 +357,183 @@ void bt_send_to_list(const bt_device_list_t *list, const bt_uuid_t *service,
 	
 }
 
+/**
+ * Connect to one device and send it the message, recording the outcome.
+ *
+ * @param job The message being sent
+ * @param result The device to send to, filled in with the outcome
+ */
+static void bt_send_to_device(bt_send_job_t *job, bt_send_result_t *result) {
+	bt_socket_t socket;
+	int64_t start;
+	int timeout_ms;
+	size_t n;
+	bt_err_t e;
+
+	start = bt_time_now_us();
+	result->bytes_sent = 0;
+	timeout_ms = bt_deadline_remaining_ms(job->deadline);
+	if (timeout_ms == 0) {
+		e = BT_ERR_TIMEOUT;
+	} else if (job->pool != NULL) {
+		e = bt_pool_get_ex(job->pool, &result->address, job->service, &socket, timeout_ms);
+	} else {
+		e = bt_connect_to_service_ex(&result->address, job->service, &socket, timeout_ms);
+	}
 
+	if (e == BT_SUCCESS) {
+		n = job->length;
+		e = bt_send_deadline(&socket, job->message, &n, job->deadline);
+		result->bytes_sent = n;
+		if (job->pool != NULL) {
+			bt_pool_put(job->pool, &socket, e);
+		} else {
+			bt_disconnect(&socket);
+		}
+	}
+
+	result->result = e;
+	result->latency_us = bt_time_now_us() - start;
+}
+
+/**
+ * Send the message to devices from the job until there are none left.
+ *
+ * @param arg The job, as a `bt_send_job_t *`
+ *
+ * @return NULL
+ */
+static void *bt_send_worker(void *arg) {
+	bt_send_job_t *job = arg;
+	size_t index;
+
+	for (;;) {
+#ifndef WINDOWS
+		pthread_mutex_lock(&job->lock);
+#endif
+		index = job->next;
+		if (index < job->count)
+			job->next++;
+#ifndef WINDOWS
+		pthread_mutex_unlock(&job->lock);
+#endif
+		if (index >= job->count)
+			break;
+
+		bt_send_to_device(job, &job->results[index]);
+	}
+
+	return NULL;
+}
+
+/**
+ * Send a message to all devices in the given list, contacting several at
+ * once so that a device that's out of range doesn't hold up the others.
+ * Each device gets its own connection, taken from a pool if one is given.
+ * Devices not reached before the deadline are given the result
+ * `BT_ERR_TIMEOUT`.
+ *
+ * On Windows the devices are contacted one at a time, though the deadline
+ * still applies.
+ *
+ * @param list Pointer to the list of devices to send to.
+ * @param service Pointer to the service UUID to send to.
+ * @param message Pointer to the message to send.
+ * @param length Length of the message to send.
+ * @param config How to send, or NULL to use the defaults.
+ * @param results Array to store one result for each device in, in the order
+ *                of the list.
+ * @param max_results The number of elements in the results array.
+ * @param count Set to the number of results stored.
+ *
+ * @return `BT_SUCCESS` if the message was sent to every device, or one of the
+ *         following error values:
+ *    `BT_ERR_CONNECTION_FAILURE` - the message wasn't sent to at least one
+ *                                  device; the results say which
+ *    `BT_ERR_BUFFER_FULL`        - there are more devices than results
+ *    `BT_ERR_BAD_PARAM`          - a parameter was NULL or out of range
+ */
+bt_err_t bt_send_to_list_ex(const bt_device_list_t *list, const bt_uuid_t *service,
+						const void *message, size_t length, bt_send_config_t const *config,
+						bt_send_result_t *results, size_t max_results, size_t *count) {
+	bt_send_job_t job;
+	bt_iterator_t iterator;
+	unsigned concurrency;
+	int timeout_ms;
+	size_t i;
+#ifndef WINDOWS
+	pthread_t *threads;
+	unsigned started;
+#endif
+
+	// validate parameters
+	if (list == NULL || service == NULL || message == NULL || length == 0 || count == NULL)
+		return BT_ERR_BAD_PARAM;
+	if (results == NULL && max_results > 0)
+		return BT_ERR_BAD_PARAM;
+
+	concurrency = BT_SEND_DEFAULT_CONCURRENCY;
+	timeout_ms = BT_SEND_DEFAULT_TIMEOUT;
+	memset(&job, 0, sizeof(job));
+	if (config != NULL) {
+		if (config->concurrency > 0)
+			concurrency = config->concurrency;
+		if (config->timeout_ms != 0)
+			timeout_ms = config->timeout_ms;
+		job.pool = config->pool;
+	}
+	if (timeout_ms < 0 && timeout_ms != BT_SEND_NO_TIMEOUT)
+		return BT_ERR_BAD_PARAM;
+
+	*count = 0;
+	job.count = bt_get_list_size(list);
+	if (job.count > max_results)
+		return BT_ERR_BUFFER_FULL;
+
+	job.service = service;
+	job.message = message;
+	job.length = length;
+	job.deadline = bt_deadline_from_ms(timeout_ms);
+	job.results = results;
+
+	bt_iterate_list(&iterator, list);
+	for (i = 0; i < job.count; i++) {
+		bt_get_next_device(&iterator, &results[i].address);
+		results[i].result = BT_ERR_TIMEOUT;
+		results[i].latency_us = 0;
+		results[i].bytes_sent = 0;
+	}
+
+#ifdef WINDOWS
+	bt_send_worker(&job);
+#else // LINUX
+	if (concurrency > job.count)
+		concurrency = job.count;
+	pthread_mutex_init(&job.lock, NULL);
+	threads = malloc(sizeof(pthread_t) * concurrency);
+	started = 0;
+	if (threads != NULL) {
+		while (started < concurrency && pthread_create(&threads[started], NULL, bt_send_worker, &job) == 0)
+			started++;
+	}
+	if (started < concurrency)
+		LOG("bt_send_to_list_ex: only started %u of %u threads\n", started, concurrency);
+	if (started == 0) {
+		// fall back to sending from this thread
+		bt_send_worker(&job);
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	pthread_mutex_destroy(&job.lock);
+#endif
+
+	*count = job.count;
+	for (i = 0; i < job.count; i++) {
+		if (results[i].result != BT_SUCCESS)
+			return BT_ERR_CONNECTION_FAILURE;
+	}
+
+	return BT_SUCCESS;
+}
@@ -1,10 +1,36 @@
+#define _GNU_SOURCE
 #include "mockbluez.h"
 #include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
 
 int hci_get_route_default (bdaddr_t *bdaddr) {
 	return 0;
 }
 
+/// The status flags of each mock socket, so that non-blocking ones read back as such.
+static int fcntl_flags[1024];
+
+int fcntl_default (int fd, int cmd, int arg) {
+	if (fd < 0 || fd >= (int) (sizeof(fcntl_flags) / sizeof(fcntl_flags[0])))
+		return 0;
+	if (cmd == F_SETFL)
+		fcntl_flags[fd] = arg;
+	else if (cmd == F_GETFL)
+		return fcntl_flags[fd];
+	return 0;
+}
+
+int setsockopt_default (int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+	return 0;
+}
+
+int sdp_record_unregister_default (sdp_session_t *session, sdp_record_t *rec) {
+	// like the real thing, this frees the record
+	sdp_record_free(rec);
+	return 0;
+}
+
 BluezFunctions bz_funcs = {
 	.hci_get_route = hci_get_route_default,
 	.hci_open_dev = NULL,
@@ -22,9 +48,24 @@ BluezFunctions bz_funcs = {
 	.accept = NULL,
 	.recv = NULL,
 	.send = NULL,
+	.recvmsg = NULL,
+	.sendmsg = NULL,
 	.getsockname = NULL,
 	.sdp_record_register = NULL,
 	.getsockopt = NULL,
+	.fcntl = fcntl_default,
+	.epoll_create1 = NULL,
+	.epoll_ctl = NULL,
+	.epoll_wait = NULL,
+	.poll = NULL,
+	.sendfile = NULL,
+	.splice = NULL,
+	.pipe2 = NULL,
+	.pread = NULL,
+	.accept4 = NULL,
+	.setsockopt = setsockopt_default,
+	.sdp_record_unregister = sdp_record_unregister_default,
+	.hci_send_cmd = NULL,
 };
 
 #define FUNCTION_BODY(name, ...)\
@@ -76,8 +117,33 @@ FUNCTION5(int, select, int, fd_set*, fd_set*, fd_set*, struct timeval*)
 FUNCTION3(int, accept, int, struct sockaddr*, socklen_t*)
 FUNCTION4(ssize_t, recv, int, void*, size_t, int)
 FUNCTION4(ssize_t, send, int, const void*, size_t, int)
+FUNCTION3(ssize_t, recvmsg, int, struct msghdr*, int)
+FUNCTION3(ssize_t, sendmsg, int, const struct msghdr*, int)
 FUNCTION1(int, close, int)
 FUNCTION3(int, getsockname, int, struct sockaddr*, socklen_t*)
 FUNCTION3(int, sdp_record_register, sdp_session_t*, sdp_record_t*, uint8_t);
 FUNCTION5(int, getsockopt, int, int, int, void*, socklen_t*);
+FUNCTION1(int, epoll_create1, int)
+FUNCTION4(int, epoll_ctl, int, int, int, struct epoll_event*)
+FUNCTION4(int, epoll_wait, int, struct epoll_event*, int, int)
+FUNCTION3(int, poll, struct pollfd*, nfds_t, int)
+FUNCTION4(ssize_t, sendfile, int, int, off_t*, size_t)
+FUNCTION6(ssize_t, splice, int, loff_t*, int, loff_t*, size_t, unsigned int)
+FUNCTION2(int, pipe2, int*, int)
+FUNCTION4(ssize_t, pread, int, void*, size_t, off_t)
+FUNCTION4(int, accept4, int, struct sockaddr*, socklen_t*, int)
+FUNCTION5(int, setsockopt, int, int, int, const void*, socklen_t)
+FUNCTION2(int, sdp_record_unregister, sdp_session_t*, sdp_record_t*)
+FUNCTION5(int, hci_send_cmd, int, uint16_t, uint16_t, uint8_t, void*)
 
+// fcntl is variadic, so can't be generated with the macros above
+int fcntl (int fd, int cmd, ...) {
+	va_list args;
+	int arg;
+
+	va_start(args, cmd);
+	arg = va_arg(args, int);
+	va_end(args);
+
+	FUNCTION_BODY(fcntl, fd, cmd, arg)
+}
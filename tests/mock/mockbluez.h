@@ -1,6 +1,8 @@
 #include <picobt/bt.h>
 #include <picobt/devicelist.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
 
 typedef struct {
 	int (*hci_get_route) (bdaddr_t *bdaddr);
@@ -21,9 +23,24 @@ typedef struct {
 	int (*accept) (int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 	ssize_t (*recv) (int sockfd, void *buf, size_t len, int flags);
 	ssize_t (*send) (int sockfd, const void *buf, size_t len, int flags);
+	ssize_t (*recvmsg) (int sockfd, struct msghdr *msg, int flags);
+	ssize_t (*sendmsg) (int sockfd, const struct msghdr *msg, int flags);
 	int (*close) (int sockfd);
 	int (*getsockname) (int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 	int (*getsockopt) (int sockfd, int level, int optname, void *optval, socklen_t *optlen);
+	int (*fcntl) (int fd, int cmd, int arg);
+	int (*epoll_create1) (int flags);
+	int (*epoll_ctl) (int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait) (int epfd, struct epoll_event *events, int maxevents, int timeout);
+	int (*poll) (struct pollfd *fds, nfds_t nfds, int timeout);
+	ssize_t (*sendfile) (int out_fd, int in_fd, off_t *offset, size_t count);
+	ssize_t (*splice) (int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags);
+	int (*pipe2) (int *pipefd, int flags);
+	ssize_t (*pread) (int fd, void *buf, size_t count, off_t offset);
+	int (*accept4) (int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+	int (*setsockopt) (int sockfd, int level, int optname, const void *optval, socklen_t optlen);
+	int (*sdp_record_unregister) (sdp_session_t *session, sdp_record_t *rec);
+	int (*hci_send_cmd) (int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param);
 
 } BluezFunctions;
 
@@ -0,0 +1,306 @@
+/**
+ * @file test_btasync.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Test the functions in btasync.c
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btasync.h"
+#include "mock/mockbluez.h"
+
+/// The descriptor returned by the mocked epoll_create1.
+#define MOCK_EPOLL_FD 77
+/// The descriptor returned by the mocked socket.
+#define MOCK_SOCKET_FD 9
+
+/// The data registered for each descriptor by the mocked epoll_ctl.
+static epoll_data_t epoll_registered[32];
+/// The events registered for each descriptor by the mocked epoll_ctl.
+static uint32_t epoll_interest[32];
+
+/**
+ * Mocked epoll_create1.
+ */
+static int mock_epoll_create1(int flags) {
+	memset(epoll_registered, 0, sizeof(epoll_registered));
+	memset(epoll_interest, 0, sizeof(epoll_interest));
+	return MOCK_EPOLL_FD;
+}
+
+/**
+ * Mocked epoll_ctl that records the registrations.
+ */
+static int mock_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+	ck_assert_int_eq(epfd, MOCK_EPOLL_FD);
+	ck_assert(fd >= 0 && fd < 32);
+	if (op == EPOLL_CTL_DEL) {
+		epoll_interest[fd] = 0;
+		epoll_registered[fd].ptr = NULL;
+	}
+	else {
+		epoll_registered[fd] = event->data;
+		epoll_interest[fd] = event->events;
+	}
+	return 0;
+}
+
+/**
+ * Mocked epoll_wait that reports whichever registered interests are
+ * satisfied, treating the mocked socket as always ready.
+ */
+static int mock_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+	int count;
+	int fd;
+
+	ck_assert_int_eq(epfd, MOCK_EPOLL_FD);
+	count = 0;
+	for (fd = 0; fd < 32 && count < maxevents; fd++) {
+		if (epoll_interest[fd] & (EPOLLIN | EPOLLOUT)) {
+			events[count].events = epoll_interest[fd] & (EPOLLIN | EPOLLOUT);
+			events[count].data = epoll_registered[fd];
+			count++;
+		}
+	}
+	return count;
+}
+
+/// The socket's status flags, as set through the mocked fcntl.
+static int mock_fcntl_flags = O_RDWR;
+
+/**
+ * Mocked fcntl that remembers the switch to non-blocking mode.
+ */
+static int mock_fcntl(int fd, int cmd, int arg) {
+	if (cmd == F_GETFL)
+		return mock_fcntl_flags;
+	if (cmd == F_SETFL)
+		mock_fcntl_flags = arg;
+	return 0;
+}
+
+/**
+ * Mocked close for the event queue and socket.
+ */
+static int mock_close(int fd) {
+	ck_assert(fd == MOCK_EPOLL_FD || fd == MOCK_SOCKET_FD);
+	return 0;
+}
+
+/**
+ * Set up the mocked event queue.
+ */
+static void mock_epoll_start(void) {
+	bz_funcs.epoll_create1 = mock_epoll_create1;
+	bz_funcs.epoll_ctl = mock_epoll_ctl;
+	bz_funcs.epoll_wait = mock_epoll_wait;
+	bz_funcs.fcntl = mock_fcntl;
+	bz_funcs.close = mock_close;
+}
+
+START_TEST (test_async_connect_read_write)
+{
+	bt_async_t loop;
+	bt_socket_t sock;
+	bt_addr_t address;
+	char in[8];
+	int connects;
+	int reads;
+	int recvs;
+	int writes;
+	int completed;
+	bt_err_t e;
+
+	mock_epoll_start();
+	connects = 0;
+	reads = 0;
+	recvs = 0;
+	writes = 0;
+	memset(&address, 0, sizeof(address));
+
+	int socket_local(int domain, int type, int protocol) {
+		return MOCK_SOCKET_FD;
+	}
+	bz_funcs.socket = socket_local;
+
+	int connect_local(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+		ck_assert_int_eq(sockfd, MOCK_SOCKET_FD);
+		errno = EINPROGRESS;
+		return -1;
+	}
+	bz_funcs.connect = connect_local;
+
+	int getsockopt_local(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+		ck_assert_int_eq(optname, SO_ERROR);
+		*(int *)optval = 0;
+		return 0;
+	}
+	bz_funcs.getsockopt = getsockopt_local;
+
+	ssize_t recv_local(int sockfd, void *buf, size_t len, int flags) {
+		recvs++;
+		// the data arrives in two halves, with a gap in between
+		if (recvs == 2) {
+			errno = EAGAIN;
+			return -1;
+		}
+		ck_assert_int_eq(len, (recvs == 1) ? 8 : 4);
+		memcpy(buf, (recvs == 1) ? "Pico" : "Auth", 4);
+		return 4;
+	}
+	bz_funcs.recv = recv_local;
+
+	ssize_t send_local(int sockfd, const void *buf, size_t len, int flags) {
+		ck_assert(!memcmp(buf, "Reply", 5));
+		return len;
+	}
+	bz_funcs.send = send_local;
+
+	void on_write(bt_async_t *l, bt_socket_t *s, bt_err_t result, size_t numBytes, void *data) {
+		ck_assert(result == BT_SUCCESS);
+		ck_assert_int_eq(numBytes, 5);
+		writes++;
+	}
+
+	void on_read(bt_async_t *l, bt_socket_t *s, bt_err_t result, size_t numBytes, void *data) {
+		ck_assert(result == BT_SUCCESS);
+		ck_assert_int_eq(numBytes, 8);
+		ck_assert(!memcmp(in, "PicoAuth", 8));
+		reads++;
+		// start the reply from within the callback
+		ck_assert(bt_write_async(l, s, "Reply", 5, 1000, on_write, NULL) == BT_SUCCESS);
+	}
+
+	void on_connect(bt_async_t *l, bt_socket_t *s, bt_err_t result, size_t numBytes, void *data) {
+		ck_assert(l == &loop);
+		ck_assert(s == &sock);
+		ck_assert(data == &connects);
+		ck_assert(result == BT_SUCCESS);
+		connects++;
+		ck_assert(bt_read_async(l, s, in, sizeof(in), BT_ASYNC_NO_TIMEOUT, on_read, NULL) == BT_SUCCESS);
+		// only one read at a time
+		ck_assert(bt_read_async(l, s, in, sizeof(in), BT_ASYNC_NO_TIMEOUT, on_read, NULL) == BT_ERR_BAD_PARAM);
+	}
+
+	e = bt_async_init(&loop);
+	ck_assert(e == BT_SUCCESS);
+
+	e = bt_connect_async(&loop, &address, 5, &sock, 1000, on_connect, &connects);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sock.s, MOCK_SOCKET_FD);
+	ck_assert_int_eq(bt_async_pending(&loop), 1);
+	// reading has to wait for the connect
+	e = bt_read_async(&loop, &sock, in, sizeof(in), BT_ASYNC_NO_TIMEOUT, on_read, NULL);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	// the callback is never invoked by the call that starts the operation
+	ck_assert_int_eq(connects, 0);
+
+	e = bt_async_run_once(&loop, 0, &completed);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(completed, 1);
+	ck_assert_int_eq(connects, 1);
+	ck_assert_int_eq(epoll_interest[MOCK_SOCKET_FD] & (EPOLLIN | EPOLLOUT), EPOLLIN);
+
+	// half of the data arrives
+	e = bt_async_run_once(&loop, 0, &completed);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(completed, 0);
+
+	e = bt_async_run(&loop);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(reads, 1);
+	ck_assert_int_eq(writes, 1);
+	ck_assert_int_eq(bt_async_pending(&loop), 0);
+	// nothing outstanding means the socket is no longer watched
+	ck_assert(epoll_registered[MOCK_SOCKET_FD].ptr == NULL);
+
+	bt_async_free(&loop);
+}
+END_TEST
+
+START_TEST (test_async_timeout)
+{
+	bt_async_t loop;
+	bt_socket_t sock;
+	char in[4];
+	int calls;
+	int64_t start;
+	bt_err_t e;
+
+	mock_epoll_start();
+	calls = 0;
+	sock.s = 4;
+
+	int epoll_wait_local(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+		// the wait is cut short by the operation's deadline
+		ck_assert(timeout >= 0 && timeout <= 20);
+		usleep(timeout * 1000);
+		return 0;
+	}
+	bz_funcs.epoll_wait = epoll_wait_local;
+
+	void on_read(bt_async_t *l, bt_socket_t *s, bt_err_t result, size_t numBytes, void *data) {
+		ck_assert(result == BT_ERR_TIMEOUT);
+		ck_assert_int_eq(numBytes, 0);
+		calls++;
+	}
+
+	e = bt_async_init(&loop);
+	ck_assert(e == BT_SUCCESS);
+
+	start = bt_time_now_us();
+	e = bt_read_async(&loop, &sock, in, sizeof(in), 20, on_read, NULL);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_async_run(&loop);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(calls, 1);
+	ck_assert(bt_time_now_us() - start >= 20000);
+
+	// cancelled operations never call back
+	e = bt_read_async(&loop, &sock, in, sizeof(in), 20, on_read, NULL);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_async_cancel(&loop, &sock);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(bt_async_pending(&loop), 0);
+	ck_assert(epoll_registered[4].ptr == NULL);
+
+	bt_async_free(&loop);
+	ck_assert_int_eq(calls, 1);
+}
+END_TEST
+
+TCase *libpicobt_btasync_testcase(void) {
+	TCase *tcase = tcase_create("btasync");
+
+	tcase_add_test(tcase, test_async_connect_read_write);
+	tcase_add_test(tcase, test_async_timeout);
+
+	return tcase;
+}
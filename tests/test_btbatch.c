@@ -0,0 +1,175 @@
+/**
+ * @file test_btbatch.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Test the functions in btbatch.c
+ *
+ * These exercise the synchronous fallback, since the mocks can't stand in
+ * for io_uring.
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btbatch.h"
+#include "mock/mockbluez.h"
+
+START_TEST (test_batch_send_recv)
+{
+	bt_batch_t batch;
+	bt_batch_op_t results[4];
+	bt_batch_stats_t stats;
+	bt_socket_t socks[3];
+	char in[2][8];
+	unsigned count;
+	int tags[3];
+	bt_err_t e;
+
+	socks[0].s = 10;
+	socks[1].s = 11;
+	socks[2].s = 12;
+
+	ssize_t send_local(int sockfd, const void *buf, size_t len, int flags) {
+		ck_assert_int_eq(sockfd, 10);
+		ck_assert(!memcmp(buf, "Pico", 4));
+		return len;
+	}
+	bz_funcs.send = send_local;
+
+	ssize_t recv_local(int sockfd, void *buf, size_t len, int flags) {
+		if (sockfd == 12) {
+			// the other end has gone
+			errno = ECONNRESET;
+			return -1;
+		}
+		ck_assert_int_eq(sockfd, 11);
+		memcpy(buf, "Auth", 4);
+		return 4;
+	}
+	bz_funcs.recv = recv_local;
+
+	e = bt_batch_init(&batch, 3, BT_BATCH_SYNC);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(!bt_batch_uses_io_uring(&batch));
+
+	e = bt_batch_add_send(&batch, &socks[0], "Pico", 4, &tags[0]);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_batch_add_recv(&batch, &socks[1], in[0], sizeof(in[0]), &tags[1]);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_batch_add_recv(&batch, &socks[2], in[1], sizeof(in[1]), &tags[2]);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_batch_add_recv(&batch, &socks[2], in[1], sizeof(in[1]), NULL);
+	ck_assert(e == BT_ERR_BUFFER_FULL);
+
+	// nothing happens until the batch is submitted
+	e = bt_batch_reap(&batch, results, 4, 0, &count);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(count, 0);
+
+	e = bt_batch_submit(&batch);
+	ck_assert(e == BT_SUCCESS);
+
+	// collect the results in two goes, oldest first
+	e = bt_batch_reap(&batch, results, 2, 2, &count);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(count, 2);
+	ck_assert(results[0].type == BT_BATCH_SEND);
+	ck_assert(results[0].data == &tags[0]);
+	ck_assert(results[0].result == BT_SUCCESS);
+	ck_assert_int_eq(results[0].numBytes, 4);
+	ck_assert(results[1].type == BT_BATCH_RECV);
+	ck_assert(results[1].data == &tags[1]);
+	ck_assert(results[1].result == BT_SUCCESS);
+	ck_assert_int_eq(results[1].numBytes, 4);
+	ck_assert(!memcmp(in[0], "Auth", 4));
+
+	// the slots freed by reaping can be reused
+	e = bt_batch_add_send(&batch, &socks[0], "Pico", 4, NULL);
+	ck_assert(e == BT_SUCCESS);
+
+	e = bt_batch_reap(&batch, results, 4, 4, &count);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(count, 1);
+	ck_assert(results[0].data == &tags[2]);
+	ck_assert(results[0].result == BT_SOCKET_CLOSED);
+
+	bt_batch_get_stats(&batch, &stats);
+	ck_assert_int_eq(stats.ops, 3);
+	ck_assert_int_eq(stats.kernel_calls, 3);
+
+	bt_batch_free(&batch);
+}
+END_TEST
+
+START_TEST (test_batch_accept)
+{
+	bt_batch_t batch;
+	bt_batch_op_t result;
+	bt_socket_t listener;
+	bt_socket_t client;
+	unsigned count;
+	bt_err_t e;
+
+	listener.s = 20;
+	client.s = -1;
+
+	int poll_local (struct pollfd *fds, nfds_t nfds, int timeout) {
+		ck_assert_int_eq(fds[0].fd, 20);
+		return 1;
+	}
+	bz_funcs.poll = poll_local;
+
+	int accept_local(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+		ck_assert_int_eq(sockfd, 20);
+		return 21;
+	}
+	bz_funcs.accept = accept_local;
+
+	e = bt_batch_init(&batch, 0, BT_BATCH_SYNC);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(batch.entries, BT_BATCH_DEFAULT_ENTRIES);
+
+	e = bt_batch_add_accept(&batch, &listener, &client, NULL);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_batch_submit(&batch);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_batch_reap(&batch, &result, 1, 1, &count);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(count, 1);
+	ck_assert(result.type == BT_BATCH_ACCEPT);
+	ck_assert(result.result == BT_SUCCESS);
+	ck_assert_int_eq(client.s, 21);
+
+	bt_batch_free(&batch);
+}
+END_TEST
+
+TCase *libpicobt_btbatch_testcase(void) {
+	TCase *tcase = tcase_create("btbatch");
+
+	tcase_add_test(tcase, test_batch_send_recv);
+	tcase_add_test(tcase, test_batch_accept);
+
+	return tcase;
+}
@@ -0,0 +1,514 @@
+/**
+ * @file test_btbuffer.c
+ * 
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Test the functions in btbuffer.c
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btbuffer.h"
+#include "mock/mockbluez.h"
+
+/// Data the mocked socket will deliver.
+static const char *stream_data;
+/// Total length of the mocked stream.
+static size_t stream_length;
+/// How much of the mocked stream has been delivered.
+static size_t stream_offset;
+/// The most the mocked socket delivers per call.
+static size_t stream_chunk;
+
+/**
+ * Mocked recvmsg that delivers the stream in chunks of at most stream_chunk
+ * bytes, and reports the socket closed once the stream is exhausted.
+ */
+static ssize_t stream_recvmsg(int sockfd, struct msghdr *msg, int flags) {
+	size_t i, part, len, delivered;
+
+	ck_assert_int_eq(sockfd, 123);
+	len = stream_length - stream_offset;
+	if (len > stream_chunk)
+		len = stream_chunk;
+	delivered = 0;
+	for (i = 0; (i < msg->msg_iovlen) && (delivered < len); i++) {
+		part = msg->msg_iov[i].iov_len;
+		if (part > len - delivered)
+			part = len - delivered;
+		memcpy(msg->msg_iov[i].iov_base, stream_data + stream_offset, part);
+		stream_offset += part;
+		delivered += part;
+	}
+	return delivered;
+}
+
+/**
+ * Set up the mocked stream.
+ */
+static void stream_start(const char *data, size_t length, size_t chunk) {
+	stream_data = data;
+	stream_length = length;
+	stream_offset = 0;
+	stream_chunk = chunk;
+	bz_funcs.recvmsg = stream_recvmsg;
+}
+
+/// Data sent through the mocked socket.
+static char sent_data[256];
+/// Total number of bytes sent through the mocked socket.
+static size_t sent_length;
+/// Number of sendmsg calls made on the mocked socket.
+static int sent_calls;
+
+/**
+ * Mocked sendmsg that accepts everything and appends it to sent_data.
+ */
+static ssize_t sink_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+	size_t i, total;
+
+	ck_assert_int_eq(sockfd, 123);
+	total = 0;
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		ck_assert(sent_length + msg->msg_iov[i].iov_len <= sizeof(sent_data));
+		memcpy(sent_data + sent_length, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+		sent_length += msg->msg_iov[i].iov_len;
+		total += msg->msg_iov[i].iov_len;
+	}
+	sent_calls++;
+	return total;
+}
+
+/**
+ * Set up the mocked sink.
+ */
+static void sink_start(void) {
+	sent_length = 0;
+	sent_calls = 0;
+	bz_funcs.sendmsg = sink_sendmsg;
+}
+
+START_TEST (test_bufreader_length_prefixed)
+{
+	bt_socket_t sock;
+	bt_bufreader_t reader;
+	bt_bufreader_stats_t stats;
+	uint8_t header[4];
+	char body[8];
+	size_t len;
+	bt_err_t e;
+
+	sock.s = 123;
+	stream_start("\x00\x00\x00\x05hello\x00\x00\x00\x03" "abc", 16, 1024);
+
+	e = bt_bufreader_init(NULL, &sock, 0);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	e = bt_bufreader_init(&reader, &sock, 0);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(reader.capacity, BT_BUFREADER_DEFAULT_CAPACITY);
+
+	len = sizeof(header);
+	e = bt_bufreader_read_exact(&reader, header, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(header[3], 5);
+	// everything should have arrived in a single recv
+	ck_assert_int_eq(bt_bufreader_available(&reader), 12);
+
+	len = header[3];
+	e = bt_bufreader_read_exact(&reader, body, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(!memcmp(body, "hello", 5));
+
+	len = sizeof(header);
+	e = bt_bufreader_read_exact(&reader, header, &len);
+	ck_assert(e == BT_SUCCESS);
+	len = header[3];
+	e = bt_bufreader_read_exact(&reader, body, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(!memcmp(body, "abc", 3));
+
+	bt_bufreader_get_stats(&reader, &stats);
+	ck_assert_int_eq(stats.requests, 4);
+	ck_assert_int_eq(stats.recv_calls, 1);
+	ck_assert_int_eq(stats.buffer_hits, 3);
+	ck_assert_int_eq(stats.bytes_received, 16);
+	ck_assert_int_eq(stats.bytes_delivered, 16);
+	ck_assert_int_eq(bt_bufreader_syscalls_saved(&reader), 3);
+
+	// the stream is exhausted, so the socket now reads as closed
+	len = 1;
+	e = bt_bufreader_read_exact(&reader, body, &len);
+	ck_assert(e == BT_SOCKET_CLOSED);
+	ck_assert_int_eq(len, 0);
+
+	bt_bufreader_free(&reader);
+	bt_bufreader_free(NULL);
+}
+END_TEST
+
+START_TEST (test_bufreader_large_read)
+{
+	bt_socket_t sock;
+	bt_bufreader_t reader;
+	char data[64];
+	char out[40];
+	size_t len;
+	bt_err_t e;
+	int i;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (char) i;
+
+	sock.s = 123;
+	stream_start(data, sizeof(data), 24);
+
+	e = bt_bufreader_init(&reader, &sock, 16);
+	ck_assert(e == BT_SUCCESS);
+
+	// larger than the ring buffer, so received straight into the caller's buffer
+	len = sizeof(out);
+	e = bt_bufreader_read_exact(&reader, out, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, sizeof(out));
+	ck_assert(!memcmp(out, data, sizeof(out)));
+	// the surplus from the second recv lands in the ring buffer
+	ck_assert_int_eq(bt_bufreader_available(&reader), 8);
+
+	len = 24;
+	e = bt_bufreader_read_exact(&reader, out, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(!memcmp(out, data + 40, 24));
+	ck_assert_int_eq(reader.stats.bytes_delivered, 64);
+
+	bt_bufreader_free(&reader);
+}
+END_TEST
+
+START_TEST (test_bufreader_peek_wrap)
+{
+	bt_socket_t sock;
+	bt_bufreader_t reader;
+	const void *data;
+	char out[8];
+	size_t len;
+	bt_err_t e;
+
+	sock.s = 123;
+	stream_start("0123456789ABCDEF", 16, 6);
+
+	e = bt_bufreader_init(&reader, &sock, 8);
+	ck_assert(e == BT_SUCCESS);
+
+	e = bt_bufreader_peek(&reader, 9, &data);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+
+	e = bt_bufreader_peek(&reader, 4, &data);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(!memcmp(data, "0123", 4));
+	ck_assert_int_eq(bt_bufreader_available(&reader), 6);
+	e = bt_bufreader_consume(&reader, 5);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_bufreader_consume(&reader, 2);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+
+	// needs more data, which wraps around the end of the ring buffer
+	e = bt_bufreader_peek(&reader, 7, &data);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(!memcmp(data, "56789AB", 7));
+
+	len = 7;
+	e = bt_bufreader_read_exact(&reader, out, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(!memcmp(out, "56789AB", 7));
+
+	bt_bufreader_free(&reader);
+}
+END_TEST
+
+START_TEST (test_bufreader_read_until)
+{
+	bt_socket_t sock;
+	bt_bufreader_t reader;
+	char out[16];
+	size_t len;
+	bt_err_t e;
+
+	sock.s = 123;
+	stream_start("Pico\nAuthentication\nX", 21, 7);
+
+	e = bt_bufreader_init(&reader, &sock, 8);
+	ck_assert(e == BT_SUCCESS);
+
+	len = sizeof(out);
+	e = bt_bufreader_read_until(&reader, '\n', out, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, 5);
+	ck_assert(!memcmp(out, "Pico\n", 5));
+
+	// the delimiter is further away than the buffer is long
+	len = 8;
+	e = bt_bufreader_read_until(&reader, '\n', out, &len);
+	ck_assert(e == BT_ERR_BUFFER_FULL);
+	ck_assert_int_eq(len, 8);
+	ck_assert(!memcmp(out, "Authenti", 8));
+
+	len = sizeof(out);
+	e = bt_bufreader_read_until(&reader, '\n', out, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, 7);
+	ck_assert(!memcmp(out, "cation\n", 7));
+
+	// no delimiter before the socket closes
+	len = sizeof(out);
+	e = bt_bufreader_read_until(&reader, '\n', out, &len);
+	ck_assert(e == BT_SOCKET_CLOSED);
+	ck_assert_int_eq(len, 1);
+
+	bt_bufreader_free(&reader);
+}
+END_TEST
+
+START_TEST (test_bufwriter_threshold)
+{
+	bt_socket_t sock;
+	bt_bufwriter_t writer;
+	bt_err_t e;
+
+	sock.s = 123;
+	sink_start();
+
+	e = bt_bufwriter_init(&writer, &sock, 16, BT_BUFWRITER_NO_LATENCY_BUDGET);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_bufwriter_set_threshold(&writer, 17);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	e = bt_bufwriter_set_threshold(&writer, 8);
+	ck_assert(e == BT_SUCCESS);
+
+	// small writes are held back until they reach the threshold
+	e = bt_bufwriter_write(&writer, "\x00\x00\x00\x04", 4);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_bufwriter_write(&writer, "Pi", 2);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sent_calls, 0);
+	ck_assert_int_eq(bt_bufwriter_pending(&writer), 6);
+	ck_assert_int_eq(bt_bufwriter_time_remaining_us(&writer), -1);
+	e = bt_bufwriter_write(&writer, "co", 2);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sent_calls, 1);
+	ck_assert_int_eq(sent_length, 8);
+	ck_assert(!memcmp(sent_data, "\x00\x00\x00\x04Pico", 8));
+
+	// data that won't fit goes out with the buffer in one call
+	e = bt_bufwriter_write(&writer, "Auth", 4);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_bufwriter_write(&writer, "entication", 10);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sent_calls, 2);
+	ck_assert_int_eq(bt_bufwriter_pending(&writer), 0);
+	ck_assert(!memcmp(sent_data + 8, "Authentication", 14));
+
+	e = bt_bufwriter_write(&writer, "!", 1);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_bufwriter_flush(&writer);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sent_calls, 3);
+	ck_assert_int_eq(sent_length, 23);
+	// nothing to flush
+	e = bt_bufwriter_flush(&writer);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sent_calls, 3);
+
+	ck_assert_int_eq(writer.stats.writes, 6);
+	ck_assert_int_eq(writer.stats.flushes_threshold, 2);
+	ck_assert_int_eq(writer.stats.flushes_explicit, 1);
+	ck_assert_int_eq(writer.stats.flushes_latency, 0);
+	ck_assert_int_eq(writer.stats.bytes_sent, 23);
+
+	bt_bufwriter_free(&writer);
+}
+END_TEST
+
+START_TEST (test_bufwriter_latency)
+{
+	bt_socket_t sock;
+	bt_bufwriter_t writer;
+	int64_t remaining;
+	bt_err_t e;
+
+	sock.s = 123;
+	sink_start();
+
+	e = bt_bufwriter_init(&writer, &sock, 0, 2000);
+	ck_assert(e == BT_SUCCESS);
+
+	e = bt_bufwriter_write(&writer, "Pico", 4);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sent_calls, 0);
+	remaining = bt_bufwriter_time_remaining_us(&writer);
+	ck_assert(remaining >= 0 && remaining <= 2000);
+
+	usleep(5000);
+	ck_assert_int_eq(bt_bufwriter_time_remaining_us(&writer), 0);
+	e = bt_bufwriter_poll(&writer);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sent_calls, 1);
+	ck_assert_int_eq(writer.stats.flushes_latency, 1);
+
+	// an empty buffer never expires
+	e = bt_bufwriter_poll(&writer);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sent_calls, 1);
+	ck_assert_int_eq(bt_bufwriter_time_remaining_us(&writer), -1);
+
+	bt_bufwriter_free(&writer);
+}
+END_TEST
+
+/// The most bytes the congested socket takes before it would block.
+static size_t congested_room;
+
+/**
+ * Mocked sendmsg for a congested link, which takes up to congested_room
+ * bytes and then reports that it would block.
+ */
+static ssize_t congested_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+	size_t i, part, total;
+
+	if (congested_room == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	total = 0;
+	for (i = 0; i < msg->msg_iovlen && congested_room > 0; i++) {
+		part = msg->msg_iov[i].iov_len;
+		if (part > congested_room)
+			part = congested_room;
+		memcpy(sent_data + sent_length, msg->msg_iov[i].iov_base, part);
+		sent_length += part;
+		congested_room -= part;
+		total += part;
+	}
+	sent_calls++;
+	return total;
+}
+
+static int high_calls;
+static int low_calls;
+
+static void on_high(bt_sendq_t *queue, size_t queued, void *data) {
+	ck_assert(data == &high_calls);
+	high_calls++;
+}
+
+static void on_low(bt_sendq_t *queue, size_t queued, void *data) {
+	ck_assert_int_le(queued, 4);
+	low_calls++;
+}
+
+START_TEST (test_sendq_watermarks)
+{
+	bt_socket_t sock;
+	bt_sendq_t queue;
+	bt_sendq_stats_t stats;
+	bt_err_t e;
+
+	sock.s = 123;
+	sink_start();
+	bz_funcs.sendmsg = congested_sendmsg;
+	high_calls = 0;
+	low_calls = 0;
+
+	e = bt_sendq_init(&queue, &sock, 16);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_sendq_set_watermarks(&queue, 12, 4);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	e = bt_sendq_set_watermarks(&queue, 4, 12);
+	ck_assert(e == BT_SUCCESS);
+	bt_sendq_set_callbacks(&queue, on_high, on_low, &high_calls);
+
+	// what the socket won't take is queued
+	congested_room = 6;
+	e = bt_sendq_write(&queue, "0123456789", 10);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sent_length, 6);
+	ck_assert_int_eq(bt_sendq_pending(&queue), 4);
+
+	e = bt_sendq_write(&queue, "abcdefghij", 10);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(bt_sendq_pending(&queue), 14);
+	ck_assert_int_eq(high_calls, 1);
+	ck_assert(bt_sendq_congested(&queue));
+
+	// a message that doesn't fit is turned away whole
+	e = bt_sendq_write(&queue, "klmn", 4);
+	ck_assert(e == BT_ERR_BUFFER_FULL);
+	ck_assert_int_eq(sent_length, 6);
+
+	// part drained, but not down to the low watermark
+	congested_room = 8;
+	e = bt_sendq_drain(&queue);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(bt_sendq_pending(&queue), 6);
+	ck_assert_int_eq(low_calls, 0);
+
+	// this one wraps round the end of the ring
+	e = bt_sendq_write(&queue, "klmnop", 6);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(bt_sendq_pending(&queue), 12);
+	ck_assert_int_eq(high_calls, 1);
+
+	congested_room = 100;
+	e = bt_sendq_drain(&queue);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(bt_sendq_pending(&queue), 0);
+	ck_assert_int_eq(low_calls, 1);
+	ck_assert(!bt_sendq_congested(&queue));
+	ck_assert_int_eq(sent_length, 26);
+	ck_assert(!memcmp(sent_data, "0123456789abcdefghijklmnop", 26));
+
+	bt_sendq_get_stats(&queue, &stats);
+	ck_assert_int_eq(stats.writes, 3);
+	ck_assert_int_eq(stats.rejected, 1);
+	ck_assert_int_eq(stats.high_events, 1);
+	ck_assert_int_eq(stats.low_events, 1);
+	ck_assert_int_eq(stats.bytes_sent, 26);
+
+	bt_sendq_free(&queue);
+}
+END_TEST
+
+TCase *libpicobt_btbuffer_testcase(void) {
+	TCase *tcase = tcase_create("btbuffer");
+	
+	tcase_add_test(tcase, test_bufreader_length_prefixed);
+	tcase_add_test(tcase, test_bufreader_large_read);
+	tcase_add_test(tcase, test_bufreader_peek_wrap);
+	tcase_add_test(tcase, test_bufreader_read_until);
+	tcase_add_test(tcase, test_bufwriter_threshold);
+	tcase_add_test(tcase, test_bufwriter_latency);
+	tcase_add_test(tcase, test_sendq_watermarks);
+	
+	return tcase;
+}
@@ -0,0 +1,248 @@
+/**
+ * @file test_btframe.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Test the functions in btframe.c
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btframe.h"
+#include "mock/mockbluez.h"
+
+/// Data the mocked socket will deliver.
+static char stream_data[512];
+/// Total length of the mocked stream.
+static size_t stream_length;
+/// How much of the mocked stream has been delivered.
+static size_t stream_offset;
+/// The most the mocked socket delivers per call.
+static size_t stream_chunk;
+/// Number of recv calls made on the mocked socket.
+static int stream_calls;
+
+/**
+ * Mocked recv that delivers the stream in chunks of at most stream_chunk
+ * bytes, and reports that it would block once the stream is exhausted.
+ */
+static ssize_t stream_recv(int sockfd, void *buf, size_t len, int flags) {
+	ck_assert_int_eq(sockfd, 123);
+	stream_calls++;
+	if (stream_offset == stream_length) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (len > stream_length - stream_offset)
+		len = stream_length - stream_offset;
+	if (len > stream_chunk)
+		len = stream_chunk;
+	memcpy(buf, stream_data + stream_offset, len);
+	stream_offset += len;
+	return len;
+}
+
+/**
+ * Mocked sendmsg that accepts everything and appends it to the stream, so
+ * that it can be read back.
+ */
+static ssize_t stream_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+	size_t i, total;
+
+	ck_assert_int_eq(sockfd, 123);
+	total = 0;
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		ck_assert(stream_length + msg->msg_iov[i].iov_len <= sizeof(stream_data));
+		memcpy(stream_data + stream_length, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+		stream_length += msg->msg_iov[i].iov_len;
+		total += msg->msg_iov[i].iov_len;
+	}
+	return total;
+}
+
+/**
+ * Set up the mocked stream.
+ */
+static void stream_start(size_t chunk) {
+	stream_length = 0;
+	stream_offset = 0;
+	stream_chunk = chunk;
+	stream_calls = 0;
+	bz_funcs.recv = stream_recv;
+	bz_funcs.sendmsg = stream_sendmsg;
+}
+
+START_TEST (test_frame_send_recv)
+{
+	bt_frame_format_t varint = { BT_FRAME_LENGTH_VARINT, 1024 };
+	bt_frame_format_t small = { BT_FRAME_LENGTH_FIXED32, 4 };
+	bt_bufpool_t pool;
+	bt_socket_t sock;
+	char body[300];
+	char buffer[300];
+	void *pooled;
+	void *first;
+	size_t len;
+	bt_err_t e;
+
+	sock.s = 123;
+	memset(body, 'x', sizeof(body));
+	stream_start(3);
+
+	// the default is a four byte big-endian length
+	e = bt_frame_send(&sock, NULL, "hello", 5);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(stream_length, 9);
+	ck_assert(!memcmp(stream_data, "\x00\x00\x00\x05hello", 9));
+
+	// 300 needs two bytes as a varint
+	e = bt_frame_send(&sock, &varint, body, 300);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(stream_length, 9 + 2 + 300);
+	ck_assert(!memcmp(stream_data + 9, "\xac\x02", 2));
+
+	e = bt_frame_send(&sock, &small, body, 5);
+	ck_assert(e == BT_ERR_BAD_FRAME);
+	ck_assert_int_eq(stream_length, 9 + 2 + 300);
+
+	e = bt_frame_recv(&sock, NULL, buffer, sizeof(buffer), &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, 5);
+	ck_assert(!memcmp(buffer, "hello", 5));
+
+	e = bt_frame_recv(&sock, &varint, buffer, sizeof(buffer), &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, 300);
+	ck_assert(!memcmp(buffer, body, 300));
+
+	// pooled buffers are reused rather than allocated each time
+	e = bt_bufpool_init(&pool, bt_frame_buffer_size(NULL), 2);
+	ck_assert(e == BT_SUCCESS);
+	stream_start(64);
+	bt_frame_send(&sock, NULL, "one", 3);
+	bt_frame_send(&sock, NULL, "two", 3);
+
+	e = bt_frame_recv_pooled(&sock, NULL, &pool, &pooled, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, 3);
+	ck_assert(!memcmp(pooled, "one", 3));
+	first = pooled;
+	bt_bufpool_put(&pool, pooled);
+
+	e = bt_frame_recv_pooled(&sock, NULL, &pool, &pooled, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(pooled == first);
+	ck_assert(!memcmp(pooled, "two", 3));
+	bt_bufpool_put(&pool, pooled);
+
+	// frames larger than the format allows are rejected before the body is read
+	stream_start(64);
+	bt_frame_send(&sock, NULL, "hello", 5);
+	e = bt_frame_recv(&sock, &small, buffer, sizeof(buffer), &len);
+	ck_assert(e == BT_ERR_BAD_FRAME);
+	ck_assert_int_eq(stream_offset, 4);
+
+	bt_bufpool_free(&pool);
+}
+END_TEST
+
+START_TEST (test_frame_decoder)
+{
+	bt_frame_format_t varint = { BT_FRAME_LENGTH_VARINT, 16 };
+	bt_frame_decoder_t decoder;
+	bt_bufpool_t pool;
+	bt_socket_t sock;
+	const void *frame;
+	uint8_t buffer[32];
+	size_t len;
+	bt_err_t e;
+
+	sock.s = 123;
+	stream_start(4);
+	// the decoder is for non-blocking sockets, which run dry rather than time out
+	ck_assert(bt_set_nonblocking(&sock, true) == BT_SUCCESS);
+
+	e = bt_frame_decoder_init(&decoder, &varint, buffer, 8);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	e = bt_frame_decoder_init(&decoder, &varint, buffer, sizeof(buffer));
+	ck_assert(e == BT_SUCCESS);
+
+	bt_frame_send(&sock, &varint, "ab", 2);
+	bt_frame_send(&sock, &varint, "", 0);
+	bt_frame_send(&sock, &varint, "cdefghij", 8);
+	// only part of the last frame has arrived
+	stream_length -= 3;
+
+	// frames are returned in place as they complete
+	e = bt_frame_decoder_read(&decoder, &sock, &frame, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, 2);
+	ck_assert(!memcmp(frame, "ab", 2));
+	ck_assert((uint8_t const *) frame > buffer && (uint8_t const *) frame < buffer + sizeof(buffer));
+
+	e = bt_frame_decoder_read(&decoder, &sock, &frame, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, 0);
+
+	e = bt_frame_decoder_read(&decoder, &sock, &frame, &len);
+	ck_assert(e == BT_ERR_WOULD_BLOCK);
+
+	// the rest arrives
+	stream_length += 3;
+	e = bt_frame_decoder_read(&decoder, &sock, &frame, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, 8);
+	ck_assert(!memcmp(frame, "cdefghij", 8));
+
+	e = bt_frame_decoder_next(&decoder, &frame, &len);
+	ck_assert(e == BT_ERR_WOULD_BLOCK);
+	bt_frame_decoder_free(&decoder);
+
+	// a length over the maximum is reported rather than waited for
+	e = bt_bufpool_init(&pool, bt_frame_buffer_size(&varint), 1);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_frame_decoder_init_pooled(&decoder, &varint, &pool);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(pool.count, 0);
+
+	stream_start(32);
+	memcpy(stream_data, "\x11", 1);
+	stream_length = 1;
+	e = bt_frame_decoder_read(&decoder, &sock, &frame, &len);
+	ck_assert(e == BT_ERR_BAD_FRAME);
+
+	bt_frame_decoder_free(&decoder);
+	ck_assert_int_eq(pool.count, 1);
+	bt_bufpool_free(&pool);
+}
+END_TEST
+
+TCase *libpicobt_btframe_testcase(void) {
+	TCase *tcase = tcase_create("btframe");
+
+	tcase_add_test(tcase, test_frame_send_recv);
+	tcase_add_test(tcase, test_frame_decoder);
+
+	return tcase;
+}
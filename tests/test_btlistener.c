@@ -0,0 +1,197 @@
+/**
+ * @file test_btlistener.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Test the functions in btlistener.c
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btlistener.h"
+#include "mock/mockbluez.h"
+
+/// The descriptor returned by the mocked epoll_create1.
+#define MOCK_EPOLL_FD 77
+/// The first descriptor returned by the mocked socket.
+#define FIRST_SOCKET 10
+
+/// The data registered for each descriptor by the mocked epoll_ctl.
+static epoll_data_t epoll_registered[32];
+/// The channel each listening socket was given by the mocked listen.
+static uint8_t channels[32];
+/// The number of sockets created.
+static int sockets_made;
+/// The channels registered with the mocked SDP server.
+static int registered[4];
+/// The number of records registered.
+static int registrations;
+/// The connections waiting on each listening socket.
+static int waiting[32];
+
+static int mock_epoll_create1(int flags) {
+	return MOCK_EPOLL_FD;
+}
+
+static int mock_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+	ck_assert_int_eq(epfd, MOCK_EPOLL_FD);
+	if (op != EPOLL_CTL_DEL)
+		epoll_registered[fd] = event->data;
+	return 0;
+}
+
+static int mock_socket(int domain, int type, int protocol) {
+	ck_assert(domain == AF_BLUETOOTH);
+	ck_assert(protocol == BTPROTO_RFCOMM);
+	return FIRST_SOCKET + sockets_made++;
+}
+
+static int mock_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	// the operating system picks the channel, so there's only one bind
+	ck_assert_int_eq(((const struct sockaddr_rc *) addr)->rc_channel, 0);
+	return 0;
+}
+
+static int mock_listen(int sockfd, int backlog) {
+	channels[sockfd] = sockfd - FIRST_SOCKET + 3;
+	return 0;
+}
+
+static int mock_getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+	((struct sockaddr_rc *) addr)->rc_channel = channels[sockfd];
+	return 0;
+}
+
+static sdp_session_t *mock_sdp_connect(const bdaddr_t *src, const bdaddr_t *dst, uint32_t flags) {
+	return calloc(1, sizeof(sdp_session_t));
+}
+
+static int mock_sdp_record_register(sdp_session_t *session, sdp_record_t *rec, uint8_t flags) {
+	sdp_list_t *protos;
+
+	ck_assert_int_eq(sdp_get_access_protos(rec, &protos), 0);
+	registered[registrations++] = sdp_get_proto_port(protos, RFCOMM_UUID);
+	sdp_list_free(protos, 0);
+	return 0;
+}
+
+static int mock_sdp_close(sdp_session_t *session) {
+	free(session);
+	return 0;
+}
+
+static int mock_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+	if (waiting[sockfd] == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return 100 * sockfd + waiting[sockfd]--;
+}
+
+static int mock_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+	// only the second service has a connection waiting
+	events[0].events = EPOLLIN;
+	events[0].data = epoll_registered[FIRST_SOCKET + 1];
+	return 1;
+}
+
+static int mock_close(int fd) {
+	return 0;
+}
+
+START_TEST (test_listener_dispatch)
+{
+	bt_listener_service_t services[2];
+	bt_listener_t listener;
+	bt_reactor_t reactor;
+	int accepted[2];
+	int dispatched;
+	bt_err_t e;
+
+	sockets_made = 0;
+	registrations = 0;
+	memset(waiting, 0, sizeof(waiting));
+	waiting[FIRST_SOCKET + 1] = 1;
+	bz_funcs.epoll_create1 = mock_epoll_create1;
+	bz_funcs.epoll_ctl = mock_epoll_ctl;
+	bz_funcs.epoll_wait = mock_epoll_wait;
+	bz_funcs.socket = mock_socket;
+	bz_funcs.bind = mock_bind;
+	bz_funcs.listen = mock_listen;
+	bz_funcs.getsockname = mock_getsockname;
+	bz_funcs.sdp_connect = mock_sdp_connect;
+	bz_funcs.sdp_record_register = mock_sdp_record_register;
+	bz_funcs.sdp_close = mock_sdp_close;
+	bz_funcs.accept = mock_accept;
+	bz_funcs.close = mock_close;
+
+	accepted[0] = -1;
+	accepted[1] = -1;
+	void handler(bt_listener_t *l, bt_socket_t *client, void *data) {
+		ck_assert(l == &listener);
+		*(int *) data = client->s;
+	}
+
+	bt_str_to_uuid("ed995e5a-c7e7-4442-a6ee-7bb76df43b0d", &services[0].uuid);
+	services[0].name = "Pico";
+	services[0].handler = handler;
+	services[0].data = &accepted[0];
+	bt_str_to_uuid("0af56906-6623-11e7-907b-a6006ad3dba0", &services[1].uuid);
+	services[1].name = "Pico Beacon";
+	services[1].handler = handler;
+	services[1].data = &accepted[1];
+
+	e = bt_reactor_init(&reactor);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_listener_init(&listener, &reactor, services, 2, NULL);
+	ck_assert(e == BT_SUCCESS);
+
+	// each service has its own channel, and its record says so
+	ck_assert_int_eq(bt_listener_get_channel(&listener, 0), 3);
+	ck_assert_int_eq(bt_listener_get_channel(&listener, 1), 4);
+	ck_assert_int_eq(bt_listener_get_channel(&listener, 2), 0);
+	ck_assert_int_eq(registrations, 2);
+	ck_assert_int_eq(registered[0], 3);
+	ck_assert_int_eq(registered[1], 4);
+	ck_assert_int_eq(bt_reactor_count(&reactor), 2);
+
+	// a connection to the second service goes to its handler
+	e = bt_reactor_run_once(&reactor, 0, &dispatched);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(accepted[0], -1);
+	ck_assert_int_eq(accepted[1], 1101);
+
+	bt_listener_free(&listener);
+	ck_assert_int_eq(bt_reactor_count(&reactor), 0);
+	bt_reactor_free(&reactor);
+}
+END_TEST
+
+TCase *libpicobt_btlistener_testcase(void) {
+	TCase *tcase = tcase_create("btlistener");
+
+	tcase_add_test(tcase, test_listener_dispatch);
+
+	return tcase;
+}
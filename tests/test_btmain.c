@@ -24,9 +24,14 @@
  * @brief Test the functions in btutil.c
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <check.h>
+#include <bluetooth/l2cap.h>
 #include "picobt/bt.h"
 #include "picobt/bttypes.h"
 #include "mock/mockbluez.h"
@@ -236,12 +241,15 @@ START_TEST (test_bt_services)
 		ck_assert(session->priv == (void*) 0x53C937);
 
 		// Check parameters
-		// For bt_services_begin we are expecting a full search
-		ck_assert(reqtype = SDP_ATTR_REQ_RANGE);
-		ck_assert(sdp_list_len(attrid_list) == 1);
+		// For bt_services_begin we are expecting just the attributes it uses
+		ck_assert(reqtype == SDP_ATTR_REQ_INDIVIDUAL);
+		ck_assert(sdp_list_len(attrid_list) == 4);
 		ck_assert(sdp_list_len(search) == 1);
 
-		ck_assert(*(uint32_t*) attrid_list->data == 0xffff);
+		ck_assert_int_eq(*(uint16_t*) attrid_list->data, SDP_ATTR_SVCLASS_ID_LIST);
+		ck_assert_int_eq(*(uint16_t*) attrid_list->next->data, SDP_ATTR_PROTO_DESC_LIST);
+		ck_assert_int_eq(*(uint16_t*) attrid_list->next->next->data, SDP_ATTR_SVCNAME_PRIMARY);
+		ck_assert_int_eq(*(uint16_t*) attrid_list->next->next->next->data, SDP_ATTR_SVCDESC_PRIMARY);
 		bt_uuid_t localuuid;
 		bt_uuidt_to_uuid(search->data, &localuuid);
 		bt_uuid_to_str(&localuuid, uuid);
@@ -354,6 +362,70 @@ START_TEST (test_bt_services)
 }
 END_TEST
 
+START_TEST (test_bt_services_attributes)
+{
+	bt_addr_t address;
+	bt_inquiry_t inquiry;
+	bt_service_t service;
+	sdp_attrreq_type_t requested;
+	int requested_count;
+	uint16_t requested_ids[4];
+	uint32_t requested_range;
+	bt_err_t e;
+
+	bt_str_to_addr("64:bc:0c:f9:e8:6c", &address);
+
+	sdp_session_t * sdp_connect_local(const bdaddr_t *src, const bdaddr_t *dst, uint32_t flags) {
+		return calloc(1, sizeof(sdp_session_t));
+	}
+	bz_funcs.sdp_connect = sdp_connect_local;
+
+	int close_local(sdp_session_t *session) {
+		free(session);
+		return 0;
+	}
+	bz_funcs.sdp_close = close_local;
+
+	int search_attr_req(sdp_session_t *session, const sdp_list_t *search, sdp_attrreq_type_t reqtype, const sdp_list_t *attrid_list, sdp_list_t **rsp_list) {
+		requested = reqtype;
+		requested_count = 0;
+		for (; attrid_list != NULL; attrid_list = attrid_list->next) {
+			if (reqtype == SDP_ATTR_REQ_RANGE)
+				requested_range = *(uint32_t*) attrid_list->data;
+			else if (requested_count < 4)
+				requested_ids[requested_count] = *(uint16_t*) attrid_list->data;
+			requested_count++;
+		}
+		*rsp_list = NULL;
+		return 0;
+	}
+	bz_funcs.sdp_service_search_attr_req = search_attr_req;
+
+	// a selection is sent as individual attributes, in ascending order
+	e = bt_services_begin_ex(&inquiry, &address, NULL, 0, BT_SERVICE_ATTR_NAME | BT_SERVICE_ATTR_PROTOCOLS);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(requested == SDP_ATTR_REQ_INDIVIDUAL);
+	ck_assert_int_eq(requested_count, 2);
+	ck_assert_int_eq(requested_ids[0], SDP_ATTR_PROTO_DESC_LIST);
+	ck_assert_int_eq(requested_ids[1], SDP_ATTR_SVCNAME_PRIMARY);
+	e = bt_services_next(&inquiry, &service);
+	ck_assert(e == BT_ERR_END_OF_ENUM);
+	bt_services_end(&inquiry);
+
+	// everything is still available as a single range
+	e = bt_services_begin_ex(&inquiry, &address, NULL, 0, BT_SERVICE_ATTR_ALL);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(requested == SDP_ATTR_REQ_RANGE);
+	ck_assert_int_eq(requested_count, 1);
+	ck_assert_int_eq(requested_range, 0xffff);
+	bt_services_end(&inquiry);
+
+	// asking for nothing is a mistake
+	e = bt_services_begin_ex(&inquiry, &address, NULL, 0, 0);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+}
+END_TEST
+
 START_TEST (test_connect_to_service)
 {
 	char *addressStr = "64:bc:0c:f9:e8:6c";
@@ -395,11 +467,12 @@ START_TEST (test_connect_to_service)
 
 		// Check parameters
 		// For bt_connect_to_service we are expecting the uuid that was requested
-		ck_assert(reqtype = SDP_ATTR_REQ_RANGE);
+		// and only the protocol list, which holds the channel
+		ck_assert(reqtype == SDP_ATTR_REQ_INDIVIDUAL);
 		ck_assert(sdp_list_len(attrid_list) == 1);
 		ck_assert(sdp_list_len(search) == 1);
 
-		ck_assert(*(uint32_t*) attrid_list->data == 0xffff);
+		ck_assert_int_eq(*(uint16_t*) attrid_list->data, SDP_ATTR_PROTO_DESC_LIST);
 		bt_uuid_t localuuid;
 		bt_uuidt_to_uuid(search->data, &localuuid);
 		bt_uuid_to_str(&localuuid, uuid);
@@ -476,6 +549,97 @@ START_TEST (test_connect_to_service)
 }
 END_TEST
 
+START_TEST (test_connect_to_port_ex)
+{
+	bt_addr_t address;
+	bt_socket_t sock;
+	bt_err_t e;
+	int nonblocking;
+	int so_error;
+	int closed;
+
+	bt_str_to_addr("64:bc:0c:f9:e8:6c", &address);
+	nonblocking = 0;
+	closed = 0;
+
+	int socket_local (int domain, int type, int protocol) {
+		return 666;
+	}
+	bz_funcs.socket = socket_local;
+
+	int fcntl_local (int fd, int cmd, int arg) {
+		ck_assert_int_eq(fd, 666);
+		if (cmd == F_GETFL)
+			return nonblocking ? O_NONBLOCK : 0;
+		nonblocking = ((arg & O_NONBLOCK) != 0);
+		return 0;
+	}
+	bz_funcs.fcntl = fcntl_local;
+
+	int connect_local (int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+		const struct sockaddr_rc* addr_rc = (const struct sockaddr_rc *)addr;
+		ck_assert(sockfd == 666);
+		ck_assert(addr_rc->rc_channel == 7);
+		// the connect mustn't block
+		ck_assert(nonblocking);
+		errno = EINPROGRESS;
+		return -1;
+	}
+	bz_funcs.connect = connect_local;
+
+	int poll_timeout (struct pollfd *fds, nfds_t nfds, int timeout) {
+		ck_assert_int_eq(nfds, 1);
+		ck_assert_int_eq(fds[0].fd, 666);
+		ck_assert(fds[0].events & POLLOUT);
+		ck_assert(timeout > 0 && timeout <= 250);
+		return 0;
+	}
+	bz_funcs.poll = poll_timeout;
+
+	int close_local (int fd) {
+		ck_assert_int_eq(fd, 666);
+		closed++;
+		return 0;
+	}
+	bz_funcs.close = close_local;
+
+	// the device never answers
+	e = bt_connect_to_port_ex(&address, 7, &sock, 250);
+	ck_assert(e == BT_ERR_DEVICE_NOT_FOUND);
+	ck_assert_int_eq(sock.s, -1);
+	ck_assert_int_eq(closed, 1);
+
+	int poll_ready (struct pollfd *fds, nfds_t nfds, int timeout) {
+		fds[0].revents = POLLOUT;
+		return 1;
+	}
+	bz_funcs.poll = poll_ready;
+
+	int getsockopt_local (int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+		ck_assert_int_eq(level, SOL_SOCKET);
+		ck_assert_int_eq(optname, SO_ERROR);
+		ck_assert_int_eq(*optlen, sizeof(int));
+		*(int *) optval = so_error;
+		return 0;
+	}
+	bz_funcs.getsockopt = getsockopt_local;
+
+	// the device refuses the connection
+	so_error = ECONNREFUSED;
+	e = bt_connect_to_port_ex(&address, 7, &sock, 250);
+	ck_assert(e == BT_ERR_CONNECTION_FAILURE);
+	ck_assert_int_eq(closed, 2);
+
+	// the connection is made and the socket is returned in blocking mode
+	so_error = 0;
+	e = bt_connect_to_port_ex(&address, 7, &sock, 250);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sock.s, 666);
+	ck_assert(!nonblocking);
+	ck_assert_int_eq(closed, 2);
+}
+END_TEST
+
 START_TEST (test_connect_to_service_and_sdp_connect_fails)
 {
 	bt_addr_t address;
@@ -533,11 +697,12 @@ START_TEST (test_connect_to_service_and_service_doesnt_exist)
 
 		// Check parameters
 		// For bt_connect_to_service we are expecting the uuid that was requested
-		ck_assert(reqtype = SDP_ATTR_REQ_RANGE);
+		// and only the protocol list, which holds the channel
+		ck_assert(reqtype == SDP_ATTR_REQ_INDIVIDUAL);
 		ck_assert(sdp_list_len(attrid_list) == 1);
 		ck_assert(sdp_list_len(search) == 1);
 
-		ck_assert(*(uint32_t*) attrid_list->data == 0xffff);
+		ck_assert_int_eq(*(uint16_t*) attrid_list->data, SDP_ATTR_PROTO_DESC_LIST);
 		bt_uuid_t localuuid;
 		bt_uuidt_to_uuid(search->data, &localuuid);
 		bt_uuid_to_str(&localuuid, uuid);
@@ -642,6 +807,143 @@ START_TEST (test_bt_listen)
 }
 END_TEST
 
+START_TEST (test_bt_socket_options)
+{
+	bt_socket_options_t options;
+	bt_socket_t listener;
+	bt_socket_t sock;
+	bt_addr_t address;
+	int socket_type;
+	int setsockopt_calls;
+	int security_level;
+	int mtu_calls;
+	int connect_calls;
+	bt_err_t e;
+
+	bt_str_to_addr("64:bc:0c:f9:e8:6c", &address);
+	setsockopt_calls = 0;
+	security_level = -1;
+	mtu_calls = 0;
+	connect_calls = 0;
+
+	int socket_local (int domain, int type, int protocol) {
+		ck_assert(domain == AF_BLUETOOTH);
+		ck_assert(protocol == BTPROTO_RFCOMM);
+		socket_type = type;
+		return 666;
+	}
+	bz_funcs.socket = socket_local;
+
+	int setsockopt_local (int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+		setsockopt_calls++;
+		if (level == SOL_BLUETOOTH && optname == BT_SECURITY) {
+			security_level = ((const struct bt_security *) optval)->level;
+		}
+		if (level == SOL_L2CAP) {
+			mtu_calls++;
+		}
+		if (level == SOL_SOCKET && optname == SO_SNDBUF) {
+			ck_assert_int_eq(*(const int *) optval, options.send_buffer);
+		}
+		return 0;
+	}
+	bz_funcs.setsockopt = setsockopt_local;
+
+	int bind_local (int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+		ck_assert_int_eq(sockfd, 666);
+		return 0;
+	}
+	bz_funcs.bind = bind_local;
+
+	// the throughput profile sets both buffers and the timeouts
+	e = bt_socket_options_init(&options, BT_SOCKET_PROFILE_THROUGHPUT);
+	ck_assert(e == BT_SUCCESS);
+	options.security = BT_SOCKET_SECURITY_HIGH;
+	options.flags |= BT_SOCKET_NONBLOCKING;
+	e = bt_bind_to_channel_with_options(&listener, 5, &options);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(socket_type, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC);
+	ck_assert_int_eq(setsockopt_calls, 5);
+	ck_assert_int_eq(security_level, BT_SECURITY_HIGH);
+	// the MTU hints only apply to L2CAP
+	ck_assert_int_eq(mtu_calls, 0);
+
+	// the default profile only sets the timeouts, as bt_bind_to_channel always has
+	setsockopt_calls = 0;
+	e = bt_bind_to_channel(&listener, 5);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(socket_type, SOCK_STREAM);
+	ck_assert_int_eq(setsockopt_calls, 2);
+
+	int poll_local (struct pollfd *fds, nfds_t nfds, int timeout) {
+		fds[0].revents = POLLIN;
+		return 1;
+	}
+	bz_funcs.poll = poll_local;
+
+	int accept4_local(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+		ck_assert_int_eq(sockfd, 666);
+		ck_assert_int_eq(flags, SOCK_CLOEXEC);
+		return 667;
+	}
+	bz_funcs.accept4 = accept4_local;
+
+	// the latency profile only shrinks the send buffer
+	e = bt_socket_options_init(&options, BT_SOCKET_PROFILE_LATENCY);
+	ck_assert(e == BT_SUCCESS);
+	setsockopt_calls = 0;
+	e = bt_accept_with_options(&listener, &sock, BT_DEADLINE_NEVER, &options);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sock.s, 667);
+	ck_assert_int_eq(setsockopt_calls, 3);
+
+	int connect_local (int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+		// the security level has to be set before connecting
+		ck_assert_int_eq(security_level, BT_SECURITY_MEDIUM);
+		ck_assert_int_eq(setsockopt_calls, 1);
+		connect_calls++;
+		return 0;
+	}
+	bz_funcs.connect = connect_local;
+
+	// anything left alone costs nothing
+	memset(&options, 0, sizeof(options));
+	options.timeout_ms = BT_SOCKET_TIMEOUT_UNCHANGED;
+	options.security = BT_SOCKET_SECURITY_MEDIUM;
+	setsockopt_calls = 0;
+	e = bt_connect_to_port_with_options(&address, 7, &sock, BT_CONNECT_NO_TIMEOUT, &options);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(connect_calls, 1);
+
+	e = bt_socket_options_init(&options, (bt_socket_profile_t) 99);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+}
+END_TEST
+
+START_TEST (test_bt_listen_with_backlog)
+{
+	bt_err_t e;
+	bt_socket_t sock;
+	sock.s = 123;
+	int requested = 0;
+
+	int listen_local(int sockfd, int backlog) {
+		ck_assert_int_eq(sockfd, 123);
+		requested = backlog;
+		return 0;
+	}
+	bz_funcs.listen = listen_local;
+
+	e = bt_listen_with_backlog(&sock, 64);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(requested, 64);
+
+	e = bt_listen_with_backlog(&sock, BT_LISTEN_MAX_BACKLOG);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(requested, SOMAXCONN);
+}
+END_TEST
+
 START_TEST (test_bt_accept)
 {
 	bt_err_t e;
@@ -781,6 +1083,439 @@ START_TEST (test_bt_read_error)
 }
 END_TEST
 
+START_TEST (test_bt_recv_would_block)
+{
+	bt_err_t e;
+	bt_socket_t sock;
+	sock.s = 123;
+
+	ssize_t recv_local(int sockfd, void *buf, size_t len, int flags) {
+		ck_assert_int_eq(sockfd, 123);
+		errno = EAGAIN;
+		return -1;
+	}
+	bz_funcs.recv = recv_local;
+
+	char buf[20];
+	size_t len = 20;
+	// on a blocking socket the timeout set by bt_set_timeout has expired
+	e = bt_recv(&sock, buf, &len);
+	ck_assert(e == BT_ERR_TIMEOUT);
+	ck_assert_int_eq(len, 0);
+
+	ck_assert(bt_set_nonblocking(&sock, true) == BT_SUCCESS);
+	len = 20;
+	e = bt_recv(&sock, buf, &len);
+	ck_assert(e == BT_ERR_WOULD_BLOCK);
+	ck_assert_int_eq(len, 0);
+}
+END_TEST
+
+
+START_TEST (test_bt_read_deadline)
+{
+	bt_err_t e;
+	bt_socket_t sock;
+	int polls;
+	int recvs;
+	sock.s = 123;
+	polls = 0;
+	recvs = 0;
+
+	int poll_local (struct pollfd *fds, nfds_t nfds, int timeout) {
+		ck_assert_int_eq(fds[0].fd, 123);
+		ck_assert(fds[0].events & POLLIN);
+		// every wait shares the same budget
+		ck_assert(timeout > 0 && timeout <= 500);
+		polls++;
+		// the data stops arriving after the third chunk
+		return (polls <= 3) ? 1 : 0;
+	}
+	bz_funcs.poll = poll_local;
+
+	ssize_t recv_local(int sockfd, void *buf, size_t len, int flags) {
+		ck_assert_int_eq(sockfd, 123);
+		ck_assert(flags & MSG_DONTWAIT);
+		recvs++;
+		if (recvs == 2) {
+			// nothing there after all
+			errno = EAGAIN;
+			return -1;
+		}
+		memcpy(buf, "Pico", 4);
+		return 4;
+	}
+	bz_funcs.recv = recv_local;
+
+	char buf[20];
+	size_t len = 8;
+	e = bt_read_deadline(&sock, buf, &len, bt_deadline_from_ms(500));
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, 8);
+	ck_assert(!memcmp(buf, "PicoPico", 8));
+
+	len = 20;
+	e = bt_read_deadline(&sock, buf, &len, bt_deadline_from_ms(500));
+	ck_assert(e == BT_ERR_TIMEOUT);
+	ck_assert_int_eq(len, 0);
+}
+END_TEST
+
+START_TEST (test_bt_accept_deadline)
+{
+	bt_err_t e;
+	bt_socket_t listener;
+	bt_socket_t sock;
+	listener.s = 12;
+
+	int poll_timeout (struct pollfd *fds, nfds_t nfds, int timeout) {
+		ck_assert_int_eq(fds[0].fd, 12);
+		ck_assert(fds[0].events & POLLIN);
+		ck_assert_int_eq(timeout, -1);
+		return 0;
+	}
+	bz_funcs.poll = poll_timeout;
+
+	e = bt_accept_deadline(&listener, &sock, BT_DEADLINE_NEVER);
+	ck_assert(e == BT_ERR_TIMEOUT);
+}
+END_TEST
+
+START_TEST (test_bt_cancel)
+{
+	bt_err_t e;
+	bt_cancel_token_t token;
+	bt_socket_t sock;
+	int polls;
+	sock.s = 123;
+	polls = 0;
+
+	e = bt_cancel_init(&token);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(token.fd >= 0);
+	ck_assert(!bt_cancel_requested(&token));
+
+	int poll_local (struct pollfd *fds, nfds_t nfds, int timeout) {
+		// the token is waited on alongside the socket
+		ck_assert_int_eq(nfds, 2);
+		ck_assert_int_eq(fds[0].fd, 123);
+		ck_assert_int_eq(fds[1].fd, token.fd);
+		ck_assert(fds[1].events & POLLIN);
+		polls++;
+		if (polls == 1) {
+			fds[0].revents = POLLIN;
+		} else {
+			// another thread cancels while the read is waiting
+			fds[1].revents = POLLIN;
+		}
+		return 1;
+	}
+	bz_funcs.poll = poll_local;
+
+	ssize_t recv_local(int sockfd, void *buf, size_t len, int flags) {
+		ck_assert_int_eq(sockfd, 123);
+		memcpy(buf, "Pico", 4);
+		return 4;
+	}
+	bz_funcs.recv = recv_local;
+
+	char buf[8];
+	size_t len = 8;
+	e = bt_read_cancellable(&sock, buf, &len, BT_DEADLINE_NEVER, &token);
+	ck_assert(e == BT_ERR_CANCELLED);
+	ck_assert_int_eq(len, 4);
+	ck_assert_int_eq(polls, 2);
+
+	// once cancelled, calls give up without waiting at all
+	e = bt_cancel(&token);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(bt_cancel_requested(&token));
+	bt_socket_t client;
+	e = bt_accept_cancellable(&sock, &client, BT_DEADLINE_NEVER, NULL, &token);
+	ck_assert(e == BT_ERR_CANCELLED);
+	len = 4;
+	e = bt_send_cancellable(&sock, "Pico", &len, BT_DEADLINE_NEVER, &token);
+	ck_assert(e == BT_ERR_CANCELLED);
+	ck_assert_int_eq(len, 0);
+	size_t count = 1;
+	e = bt_accept_many_cancellable(&sock, &client, 1, BT_DEADLINE_NEVER, &count, &token);
+	ck_assert(e == BT_ERR_CANCELLED);
+	ck_assert_int_eq(count, 0);
+	len = sizeof(buf);
+	e = bt_recv_message_cancellable(&sock, buf, &len, BT_DEADLINE_NEVER, &token);
+	ck_assert(e == BT_ERR_CANCELLED);
+	ck_assert_int_eq(len, 0);
+	// a service that isn't remembered isn't looked up
+	bt_addr_t address;
+	bt_uuid_t service;
+	bt_str_to_addr("de:ad:be:ef:00:20", &address);
+	bt_str_to_uuid("ed995e5a-c7e7-4442-a6ee-7bb76df43b0d", &service);
+	e = bt_connect_to_service_cancellable(&address, &service, &client, BT_CONNECT_NO_TIMEOUT, &token);
+	ck_assert(e == BT_ERR_CANCELLED);
+	ck_assert_int_eq(polls, 2);
+
+	bt_cancel_reset(&token);
+	ck_assert(!bt_cancel_requested(&token));
+
+	int close_local(int sockfd) {
+		ck_assert_int_eq(sockfd, token.fd);
+		return 0;
+	}
+	bz_funcs.close = close_local;
+	bt_cancel_free(&token);
+	ck_assert_int_eq(token.fd, -1);
+}
+END_TEST
+
+static bt_cancel_token_t inquiry_token;
+static volatile int inquiry_cancels;
+static volatile bool inquiry_cancel_ok;
+
+static int inquiry_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	// the watcher thread really has to wait, so pass the call on
+	return ppoll(fds, nfds, NULL, NULL);
+}
+
+static int inquiry_send_cmd(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param) {
+	// called from the watcher thread, so checked once the inquiry returns
+	inquiry_cancel_ok = (dd == 555) && (ogf == OGF_LINK_CTL) && (ocf == OCF_INQUIRY_CANCEL) && (plen == 0);
+	inquiry_cancels++;
+	return 0;
+}
+
+static int inquiry_close(int fd) {
+	return 0;
+}
+
+START_TEST (test_bt_inquiry_cancel)
+{
+	bt_err_t e;
+	bt_inquiry_t inquiry;
+	int waited;
+
+	int open_dev(int dev_id) {
+		return 555;
+	}
+	bz_funcs.hci_open_dev = open_dev;
+
+	int inquiry_func(int dev_id, int len, int num_rsp, const uint8_t *lap, inquiry_info **ii, long flags) {
+		// cancel part way through, then wait for the controller to be told
+		ck_assert(bt_cancel(&inquiry_token) == BT_SUCCESS);
+		for (waited = 0; waited < 2000 && inquiry_cancels == 0; waited++) {
+			usleep(1000);
+		}
+		ck_assert_int_eq(inquiry_cancels, 1);
+		return 0;
+	}
+	bz_funcs.hci_inquiry = inquiry_func;
+	bz_funcs.hci_send_cmd = inquiry_send_cmd;
+	bz_funcs.poll = inquiry_poll;
+	bz_funcs.close = inquiry_close;
+
+	e = bt_cancel_init(&inquiry_token);
+	ck_assert(e == BT_SUCCESS);
+	inquiry_cancels = 0;
+
+	e = bt_inquiry_begin_cancellable(&inquiry, 0, &inquiry_token);
+	ck_assert(e == BT_ERR_CANCELLED);
+	ck_assert_int_eq(inquiry_cancels, 1);
+	ck_assert(inquiry_cancel_ok);
+
+	// a cancelled token stops the next inquiry before it starts
+	e = bt_inquiry_begin_cancellable(&inquiry, 0, &inquiry_token);
+	ck_assert(e == BT_ERR_CANCELLED);
+	ck_assert_int_eq(inquiry_cancels, 1);
+
+	bt_cancel_free(&inquiry_token);
+}
+END_TEST
+
+START_TEST (test_bt_accept_many)
+{
+	bt_err_t e;
+	bt_socket_t listener;
+	bt_socket_t socks[4];
+	size_t count;
+	int waiting;
+	int polls;
+	int listenerFlags;
+	listener.s = 20;
+
+	int fcntl_local(int fd, int cmd, int arg) {
+		ck_assert_int_eq(fd, 20);
+		ck_assert_int_eq(cmd, F_GETFL);
+		return listenerFlags;
+	}
+	bz_funcs.fcntl = fcntl_local;
+
+	int poll_local (struct pollfd *fds, nfds_t nfds, int timeout) {
+		ck_assert_int_eq(fds[0].fd, 20);
+		ck_assert(fds[0].events & POLLIN);
+		polls++;
+		return (waiting > 0) ? 1 : 0;
+	}
+	bz_funcs.poll = poll_local;
+
+	int accept4_local(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+		ck_assert_int_eq(sockfd, 20);
+		ck_assert_int_eq(flags, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (waiting == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (waiting == 2) {
+			// this one gave up while it was queued
+			waiting--;
+			errno = ECONNABORTED;
+			return -1;
+		}
+		return 30 + waiting--;
+	}
+	bz_funcs.accept4 = accept4_local;
+
+	// a non-blocking listener is drained after a single wait
+	listenerFlags = O_NONBLOCK;
+	waiting = 4;
+	polls = 0;
+	e = bt_accept_many(&listener, socks, 4, BT_DEADLINE_NEVER, &count);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(count, 3);
+	ck_assert_int_eq(socks[0].s, 34);
+	ck_assert_int_eq(socks[1].s, 33);
+	ck_assert_int_eq(socks[2].s, 31);
+	ck_assert_int_eq(polls, 1);
+
+	// no more than max are taken
+	waiting = 3;
+	e = bt_accept_many(&listener, socks, 1, BT_DEADLINE_NEVER, &count);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(count, 1);
+	ck_assert_int_eq(waiting, 2);
+
+	// a blocking listener is polled before each further accept
+	listenerFlags = 0;
+	waiting = 1;
+	polls = 0;
+	e = bt_accept_many(&listener, socks, 4, BT_DEADLINE_NEVER, &count);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(count, 1);
+	ck_assert_int_eq(polls, 2);
+
+	e = bt_accept_many(&listener, socks, 4, bt_deadline_from_ms(100), &count);
+	ck_assert(e == BT_ERR_TIMEOUT);
+	ck_assert_int_eq(count, 0);
+}
+END_TEST
+
+START_TEST (test_bt_sendfile)
+{
+	bt_err_t e;
+	bt_socket_t sock;
+	bt_sendfile_stats_t stats;
+	char sent[64];
+	size_t sentLength;
+	int closes;
+	sock.s = 123;
+	sentLength = 0;
+	closes = 0;
+
+	const char *file = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+	ssize_t sendfile_local(int out_fd, int in_fd, off_t *offset, size_t count) {
+		ck_assert_int_eq(out_fd, 123);
+		ck_assert_int_eq(in_fd, 7);
+		// send a little at a time
+		if (count > 10)
+			count = 10;
+		memcpy(sent + sentLength, file + *offset, count);
+		sentLength += count;
+		*offset += count;
+		return count;
+	}
+	bz_funcs.sendfile = sendfile_local;
+
+	e = bt_sendfile(&sock, 7, 4, 24, &stats);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sentLength, 24);
+	ck_assert(!memcmp(sent, file + 4, 24));
+	ck_assert(stats.method == BT_SENDFILE_METHOD_SENDFILE);
+	ck_assert_int_eq(stats.bytes, 24);
+	ck_assert_int_eq(stats.calls, 3);
+
+	// without sendfile or splice, the file is copied through a buffer
+	ssize_t sendfile_unsupported(int out_fd, int in_fd, off_t *offset, size_t count) {
+		errno = EINVAL;
+		return -1;
+	}
+	bz_funcs.sendfile = sendfile_unsupported;
+
+	int pipe2_local(int *pipefd, int flags) {
+		pipefd[0] = 30;
+		pipefd[1] = 31;
+		return 0;
+	}
+	bz_funcs.pipe2 = pipe2_local;
+
+	ssize_t splice_local(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+		if (fd_in == 7) {
+			// filling the pipe works, but the socket won't take it
+			ck_assert_int_eq(fd_out, 31);
+			return len;
+		}
+		ck_assert_int_eq(fd_in, 30);
+		ck_assert_int_eq(fd_out, 123);
+		errno = EINVAL;
+		return -1;
+	}
+	bz_funcs.splice = splice_local;
+
+	int close_local(int fd) {
+		ck_assert(fd == 30 || fd == 31);
+		closes++;
+		return 0;
+	}
+	bz_funcs.close = close_local;
+
+	ssize_t pread_local(int fd, void *buf, size_t count, off_t offset) {
+		ck_assert_int_eq(fd, 7);
+		if (offset >= 36)
+			return 0;
+		if (count > 36 - offset)
+			count = 36 - offset;
+		memcpy(buf, file + offset, count);
+		return count;
+	}
+	bz_funcs.pread = pread_local;
+
+	int poll_local (struct pollfd *fds, nfds_t nfds, int timeout) {
+		ck_assert(fds[0].events & POLLOUT);
+		return 1;
+	}
+	bz_funcs.poll = poll_local;
+
+	ssize_t send_local(int sockfd, const void *buf, size_t len, int flags) {
+		ck_assert_int_eq(sockfd, 123);
+		memcpy(sent + sentLength, buf, len);
+		sentLength += len;
+		return len;
+	}
+	bz_funcs.send = send_local;
+
+	sentLength = 0;
+	e = bt_sendfile(&sock, 7, 30, 6, &stats);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sentLength, 6);
+	ck_assert(!memcmp(sent, "uvwxyz", 6));
+	ck_assert(stats.method == BT_SENDFILE_METHOD_COPY);
+	ck_assert_int_eq(stats.bytes, 6);
+	ck_assert_int_eq(closes, 2);
+
+	// the file ending early is an error
+	e = bt_sendfile(&sock, 7, 30, 10, &stats);
+	ck_assert(e == BT_ERR_UNKNOWN);
+	ck_assert_int_eq(stats.bytes, 6);
+}
+END_TEST
 
 START_TEST (test_bt_write)
 {
@@ -869,6 +1604,335 @@ START_TEST (test_bt_disconnect)
 }
 END_TEST
 
+START_TEST (test_bt_writev)
+{
+	bt_err_t e;
+	bt_socket_t sock;
+	sock.s = 123;
+	int num_called = 0;
+	char sent[32] = {0};
+	size_t sent_len = 0;
+
+	ssize_t sendmsg_local(int sockfd, const struct msghdr *msg, int flags) {
+		size_t i, part, len, accepted;
+		ck_assert_int_eq(sockfd, 123);
+		ck_assert_int_eq(flags, 0);
+		if (num_called == 0) {
+			// All three pieces offered at once, but only part of the body taken
+			ck_assert_int_eq(msg->msg_iovlen, 3);
+			ck_assert_int_eq(msg->msg_iov[0].iov_len, 4);
+			accepted = 5;
+		} else if (num_called == 1) {
+			// The window must restart part way through the body
+			ck_assert_int_eq(msg->msg_iovlen, 2);
+			ck_assert(!memcmp(msg->msg_iov[0].iov_base, "Authentication", 14));
+			accepted = msg->msg_iov[0].iov_len + msg->msg_iov[1].iov_len;
+		} else {
+			ck_assert(false);
+			accepted = 0;
+		}
+		// Gather the data actually accepted
+		len = accepted;
+		for (i = 0; (i < msg->msg_iovlen) && (len > 0); i++) {
+			part = msg->msg_iov[i].iov_len < len ? msg->msg_iov[i].iov_len : len;
+			memcpy(sent + sent_len, msg->msg_iov[i].iov_base, part);
+			sent_len += part;
+			len -= part;
+		}
+		num_called++;
+		return accepted;
+	}
+	bz_funcs.sendmsg = sendmsg_local;
+
+	bt_iovec_t iov[3];
+	iov[0].iov_base = "Pico";
+	iov[0].iov_len = 4;
+	iov[1].iov_base = " Authentication";
+	iov[1].iov_len = 15;
+	iov[2].iov_base = "!MAC";
+	iov[2].iov_len = 4;
+
+	e = bt_writev(NULL, iov, 3);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	e = bt_writev(&sock, NULL, 3);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	e = bt_writev(&sock, iov, 3);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(num_called, 2);
+	ck_assert_int_eq(sent_len, 23);
+	ck_assert_str_eq(sent, "Pico Authentication!MAC");
+	// The caller's array must not have been modified
+	ck_assert_int_eq(iov[1].iov_len, 15);
+}
+END_TEST
+
+START_TEST (test_bt_writev_error)
+{
+	bt_err_t e;
+	bt_socket_t sock;
+	sock.s = 123;
+	int num_called = 0;
+
+	ssize_t sendmsg_local(int sockfd, const struct msghdr *msg, int flags) {
+		num_called++;
+		if (num_called == 1) {
+			return 2;
+		}
+		errno = ECONNRESET;
+		return -1;
+	}
+	bz_funcs.sendmsg = sendmsg_local;
+
+	bt_iovec_t iov[2];
+	iov[0].iov_base = "Pico";
+	iov[0].iov_len = 4;
+	iov[1].iov_base = "Bluetooth";
+	iov[1].iov_len = 9;
+
+	e = bt_writev(&sock, iov, 2);
+	ck_assert(e == BT_SOCKET_CLOSED);
+	ck_assert_int_eq(num_called, 2);
+}
+END_TEST
+
+START_TEST (test_bt_readv)
+{
+	bt_err_t e;
+	bt_socket_t sock;
+	sock.s = 123;
+	int num_called = 0;
+	const char *incoming = "\x00\x00\x00\x0bHello there";
+	size_t offset = 0;
+
+	ssize_t recvmsg_local(int sockfd, struct msghdr *msg, int flags) {
+		size_t i, part, len;
+		ck_assert_int_eq(sockfd, 123);
+		ck_assert_int_eq(flags, 0);
+		// Deliver the data three bytes at a time
+		len = 3;
+		for (i = 0; (i < msg->msg_iovlen) && (len > 0) && (offset < 15); i++) {
+			part = msg->msg_iov[i].iov_len < len ? msg->msg_iov[i].iov_len : len;
+			memcpy(msg->msg_iov[i].iov_base, incoming + offset, part);
+			offset += part;
+			len -= part;
+		}
+		num_called++;
+		return 3 - len;
+	}
+	bz_funcs.recvmsg = recvmsg_local;
+
+	uint8_t header[4];
+	char body[12] = {0};
+	bt_iovec_t iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = body;
+	iov[1].iov_len = 11;
+
+	size_t len = 0;
+	e = bt_readv(&sock, iov, 2, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(num_called, 5);
+	ck_assert_int_eq(len, 15);
+	ck_assert_int_eq(header[3], 11);
+	ck_assert_str_eq(body, "Hello there");
+}
+END_TEST
+
+START_TEST (test_bt_readv_close_socket)
+{
+	bt_err_t e;
+	bt_socket_t sock;
+	sock.s = 123;
+	int num_called = 0;
+
+	ssize_t recvmsg_local(int sockfd, struct msghdr *msg, int flags) {
+		num_called++;
+		if (num_called == 1) {
+			memcpy(msg->msg_iov[0].iov_base, "Pi", 2);
+			return 2;
+		}
+		return 0;
+	}
+	bz_funcs.recvmsg = recvmsg_local;
+
+	char a[4], b[4];
+	bt_iovec_t iov[2];
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = b;
+	iov[1].iov_len = sizeof(b);
+
+	size_t len = 0;
+	e = bt_readv(&sock, iov, 2, &len);
+	ck_assert(e == BT_SOCKET_CLOSED);
+	ck_assert_int_eq(num_called, 2);
+	ck_assert_int_eq(len, 2);
+}
+END_TEST
+
+START_TEST (test_bt_l2cap)
+{
+	bt_addr_t address;
+	bt_socket_t listener;
+	bt_socket_t sock;
+	uint16_t send_mtu;
+	uint16_t recv_mtu;
+	char buffer[8];
+	size_t len;
+	bool truncate;
+	bt_err_t e;
+
+	bt_str_to_addr("64:bc:0c:f9:e8:6c", &address);
+	truncate = false;
+
+	int socket_local (int domain, int type, int protocol) {
+		ck_assert(domain == AF_BLUETOOTH);
+		ck_assert(type == SOCK_SEQPACKET);
+		ck_assert(protocol == BTPROTO_L2CAP);
+		return 444;
+	}
+	bz_funcs.socket = socket_local;
+
+	int connect_local (int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+		const struct sockaddr_l2* addr_l2 = (const struct sockaddr_l2 *)addr;
+		ck_assert_int_eq(sockfd, 444);
+		ck_assert(addrlen == sizeof(struct sockaddr_l2));
+		ck_assert(addr_l2->l2_family == AF_BLUETOOTH);
+		ck_assert_int_eq(btohs(addr_l2->l2_psm), 0x1001);
+		return 0;
+	}
+	bz_funcs.connect = connect_local;
+
+	int bind_local (int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+		const struct sockaddr_l2* addr_l2 = (const struct sockaddr_l2 *)addr;
+		ck_assert(addrlen == sizeof(struct sockaddr_l2));
+		// a PSM is assigned when listening starts
+		ck_assert_int_eq(addr_l2->l2_psm, 0);
+		return 0;
+	}
+	bz_funcs.bind = bind_local;
+
+	int getsockname_local(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+		ck_assert(*addrlen == sizeof(struct sockaddr_l2));
+		((struct sockaddr_l2 *) addr)->l2_psm = htobs(0x1003);
+		return 0;
+	}
+	bz_funcs.getsockname = getsockname_local;
+
+	int getsockopt_local(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+		ck_assert_int_eq(level, SOL_L2CAP);
+		ck_assert_int_eq(optname, L2CAP_OPTIONS);
+		((struct l2cap_options *) optval)->omtu = 672;
+		((struct l2cap_options *) optval)->imtu = 1013;
+		return 0;
+	}
+	bz_funcs.getsockopt = getsockopt_local;
+
+	ssize_t send_local(int sockfd, const void *buf, size_t len, int flags) {
+		ck_assert_int_eq(sockfd, 444);
+		if (len > 672) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		return len;
+	}
+	bz_funcs.send = send_local;
+
+	ssize_t recvmsg_local(int sockfd, struct msghdr *msg, int flags) {
+		ck_assert_int_eq(msg->msg_iovlen, 1);
+		ck_assert_int_eq(msg->msg_iov[0].iov_len, 8);
+		memcpy(msg->msg_iov[0].iov_base, "Message!", 8);
+		msg->msg_flags = truncate ? MSG_TRUNC : 0;
+		return truncate ? 8 : 7;
+	}
+	bz_funcs.recvmsg = recvmsg_local;
+
+	// even PSMs aren't valid
+	e = bt_connect_l2cap(&address, 0x1002, &sock);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+
+	e = bt_connect_l2cap(&address, 0x1001, &sock);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sock.s, 444);
+
+	e = bt_bind_l2cap(&listener, BT_L2CAP_PSM_DYNAMIC);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(bt_get_socket_psm(listener), 0x1003);
+
+	e = bt_get_l2cap_mtu(&sock, &send_mtu, &recv_mtu);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(send_mtu, 672);
+	ck_assert_int_eq(recv_mtu, 1013);
+
+	e = bt_send_message(&sock, buffer, sizeof(buffer));
+	ck_assert(e == BT_SUCCESS);
+	e = bt_send_message(&sock, buffer, 673);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	// an empty message would look like the connection closing
+	e = bt_send_message(&sock, buffer, 0);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+
+	// message boundaries are kept
+	len = sizeof(buffer);
+	e = bt_recv_message(&sock, buffer, &len);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(len, 7);
+
+	truncate = true;
+	len = sizeof(buffer);
+	e = bt_recv_message(&sock, buffer, &len);
+	ck_assert(e == BT_ERR_BUFFER_FULL);
+	ck_assert_int_eq(len, 8);
+}
+END_TEST
+
+START_TEST (test_bt_register_l2cap_service)
+{
+	bt_uuid_t uuid;
+	bt_socket_t sock;
+	bt_service_registration_t registration;
+	bool called = false;
+	bt_err_t e;
+
+	bt_str_to_uuid("0af56906-6623-11e7-907b-a6006ad3dba0", &uuid);
+	sock.s = 333;
+
+	int getsockname_local(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+		ck_assert_int_eq(sockfd, 333);
+		((struct sockaddr_l2 *) addr)->l2_psm = htobs(0x1005);
+		return 0;
+	}
+	bz_funcs.getsockname = getsockname_local;
+
+	sdp_session_t * sdp_connect_local(const bdaddr_t *src, const bdaddr_t *dst, uint32_t flags) {
+		return calloc(1, sizeof(sdp_session_t));
+	}
+	bz_funcs.sdp_connect = sdp_connect_local;
+
+	int sdp_record_register_local (sdp_session_t *session, sdp_record_t *rec, uint8_t flags) {
+		sdp_list_t* protos;
+		int err;
+
+		// the PSM is advertised in place of an RFCOMM channel
+		err = sdp_get_access_protos(rec, &protos);
+		ck_assert_int_eq(err, 0);
+		ck_assert_int_eq(sdp_get_proto_port(protos, L2CAP_UUID), 0x1005);
+		ck_assert_int_eq(sdp_get_proto_port(protos, RFCOMM_UUID), 0);
+
+		sdp_list_free(protos, 0);
+		called = true;
+		return 0;
+	}
+	bz_funcs.sdp_record_register = sdp_record_register_local;
+
+	e = bt_register_l2cap_service(&uuid, "Service Name", &sock, &registration);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(called);
+	ck_assert(registration.session != NULL);
+}
+END_TEST
+
 START_TEST (test_bt_register_service)
 {
 	bt_uuid_t uuid;
@@ -967,19 +2031,36 @@ TCase *libpicobt_btmain_testcase(void) {
 	tcase_add_test(tcase, test_bt_get_device_name);
 	tcase_add_test(tcase, test_bt_inquiry);
 	tcase_add_test(tcase, test_bt_services);
+	tcase_add_test(tcase, test_bt_services_attributes);
 	tcase_add_test(tcase, test_connect_to_service);
+	tcase_add_test(tcase, test_connect_to_port_ex);
 	tcase_add_test(tcase, test_connect_to_service_and_sdp_connect_fails);
 	tcase_add_test(tcase, test_connect_to_service_and_service_doesnt_exist);
 	tcase_add_test(tcase, test_bt_bind);
 	tcase_add_test(tcase, test_bt_listen);
+	tcase_add_test(tcase, test_bt_listen_with_backlog);
+	tcase_add_test(tcase, test_bt_socket_options);
 	tcase_add_test(tcase, test_bt_accept);
 	tcase_add_test(tcase, test_bt_read);
 	tcase_add_test(tcase, test_bt_read_close_socket);
 	tcase_add_test(tcase, test_bt_read_error);
+	tcase_add_test(tcase, test_bt_recv_would_block);
+	tcase_add_test(tcase, test_bt_read_deadline);
+	tcase_add_test(tcase, test_bt_accept_deadline);
+	tcase_add_test(tcase, test_bt_cancel);
+	tcase_add_test(tcase, test_bt_inquiry_cancel);
+	tcase_add_test(tcase, test_bt_accept_many);
+	tcase_add_test(tcase, test_bt_sendfile);
 	tcase_add_test(tcase, test_bt_write);
 	tcase_add_test(tcase, test_bt_write_error);
+	tcase_add_test(tcase, test_bt_writev);
+	tcase_add_test(tcase, test_bt_writev_error);
+	tcase_add_test(tcase, test_bt_readv);
+	tcase_add_test(tcase, test_bt_readv_close_socket);
 	tcase_add_test(tcase, test_bt_disconnect);
 	tcase_add_test(tcase, test_bt_register_service);
+	tcase_add_test(tcase, test_bt_l2cap);
+	tcase_add_test(tcase, test_bt_register_l2cap_service);
 	
 	return tcase;
 }
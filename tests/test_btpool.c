@@ -0,0 +1,257 @@
+/**
+ * @file test_btpool.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Test the functions in btpool.c
+ *
+ * Connections are made through the mocked SDP and socket calls, with every
+ * device offering the service on the same channel.
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btpool.h"
+#include "mock/mockbluez.h"
+
+/// The channel every mocked device offers the service on.
+#define POOL_CHANNEL 15
+
+static int next_socket;
+static int sockets_made;
+static int sockets_closed;
+static bool remote_closed;
+
+static sdp_session_t *pool_sdp_connect(const bdaddr_t *src, const bdaddr_t *dst, uint32_t flags) {
+	sdp_session_t *session = calloc(1, sizeof(sdp_session_t));
+
+	session->sock = 342;
+	return session;
+}
+
+static int pool_sdp_search(sdp_session_t *session, const sdp_list_t *search, sdp_attrreq_type_t reqtype, const sdp_list_t *attrid_list, sdp_list_t **rsp_list) {
+	sdp_record_t *record;
+	sdp_list_t *proto[2];
+	sdp_list_t *apseq;
+	uuid_t *l2cap;
+	uuid_t *rfcomm;
+	uint8_t channel = POOL_CHANNEL;
+
+	l2cap = malloc(sizeof(uuid_t));
+	rfcomm = malloc(sizeof(uuid_t));
+	record = sdp_record_alloc();
+	sdp_uuid16_create(l2cap, L2CAP_UUID);
+	proto[0] = sdp_list_append(NULL, l2cap);
+	apseq = sdp_list_append(NULL, proto[0]);
+	sdp_uuid16_create(rfcomm, RFCOMM_UUID);
+	proto[1] = sdp_list_append(NULL, rfcomm);
+	proto[1] = sdp_list_append(proto[1], sdp_data_alloc(SDP_UINT8, &channel));
+	apseq = sdp_list_append(apseq, proto[1]);
+	sdp_set_access_protos(record, sdp_list_append(NULL, apseq));
+
+	*rsp_list = sdp_list_append(*rsp_list, record);
+	return 0;
+}
+
+static int pool_sdp_close(sdp_session_t *session) {
+	free(session);
+	return 0;
+}
+
+static int pool_socket(int domain, int type, int protocol) {
+	sockets_made++;
+	return next_socket++;
+}
+
+static int pool_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	ck_assert(((const struct sockaddr_rc *) addr)->rc_channel == POOL_CHANNEL);
+	return 0;
+}
+
+static int pool_close(int sockfd) {
+	sockets_closed++;
+	return 0;
+}
+
+static int pool_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	// the liveness check mustn't wait
+	ck_assert_int_eq(timeout, 0);
+	fds[0].revents = remote_closed ? POLLIN : 0;
+	return remote_closed ? 1 : 0;
+}
+
+static ssize_t pool_recv(int sockfd, void *buf, size_t len, int flags) {
+	ck_assert(flags & MSG_PEEK);
+	return 0;
+}
+
+static void mock_pool_start(void) {
+	next_socket = 100;
+	sockets_made = 0;
+	sockets_closed = 0;
+	remote_closed = false;
+	bz_funcs.sdp_connect = pool_sdp_connect;
+	bz_funcs.sdp_service_search_attr_req = pool_sdp_search;
+	bz_funcs.sdp_close = pool_sdp_close;
+	bz_funcs.socket = pool_socket;
+	bz_funcs.connect = pool_connect;
+	bz_funcs.close = pool_close;
+	bz_funcs.poll = pool_poll;
+	bz_funcs.recv = pool_recv;
+}
+
+START_TEST (test_pool_reuse)
+{
+	bt_pool_t pool;
+	bt_pool_stats_t stats;
+	bt_addr_t address;
+	bt_uuid_t service;
+	bt_socket_t sock;
+	bt_err_t e;
+	int first;
+
+	mock_pool_start();
+	bt_str_to_addr("64:bc:0c:f9:e8:6c", &address);
+	bt_str_to_uuid("ed995e5a-c7e7-4442-a6ee-7bb76df43b0d", &service);
+
+	e = bt_pool_init(&pool, NULL);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(pool.config.max_size, BT_POOL_DEFAULT_SIZE);
+	ck_assert_int_eq(pool.config.idle_timeout_ms, BT_POOL_DEFAULT_IDLE_TIMEOUT);
+
+	e = bt_pool_get(&pool, &address, &service, &sock);
+	ck_assert(e == BT_SUCCESS);
+	first = sock.s;
+	bt_pool_get_stats(&pool, &stats);
+	ck_assert_int_eq(stats.in_use, 1);
+	bt_pool_put(&pool, &sock, BT_SUCCESS);
+	ck_assert_int_eq(sock.s, -1);
+	ck_assert_int_eq(sockets_closed, 0);
+
+	// the same connection comes back
+	e = bt_pool_get(&pool, &address, &service, &sock);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sock.s, first);
+	ck_assert_int_eq(sockets_made, 1);
+
+	// a failure drops it
+	bt_pool_put(&pool, &sock, BT_ERR_CONNECTION_FAILURE);
+	ck_assert_int_eq(sockets_closed, 1);
+
+	e = bt_pool_get(&pool, &address, &service, &sock);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_ne(sock.s, first);
+	bt_pool_put(&pool, &sock, BT_SUCCESS);
+
+	// so does the other end closing it while it's idle
+	remote_closed = true;
+	e = bt_pool_get(&pool, &address, &service, &sock);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sockets_made, 3);
+	ck_assert_int_eq(sockets_closed, 2);
+	bt_pool_put(&pool, &sock, BT_SUCCESS);
+
+	bt_pool_get_stats(&pool, &stats);
+	ck_assert_int_eq(stats.hits, 1);
+	ck_assert_int_eq(stats.misses, 3);
+	ck_assert_int_eq(stats.evicted, 2);
+	ck_assert_int_eq(stats.size, 1);
+	ck_assert_int_eq(stats.in_use, 0);
+
+	bt_pool_free(&pool);
+	ck_assert_int_eq(sockets_closed, 3);
+}
+END_TEST
+
+START_TEST (test_pool_limits)
+{
+	bt_pool_config_t config;
+	bt_pool_t pool;
+	bt_pool_stats_t stats;
+	bt_addr_t addresses[3];
+	bt_uuid_t service;
+	bt_socket_t socks[3];
+	bt_err_t e;
+
+	mock_pool_start();
+	bt_str_to_addr("64:bc:0c:f9:e8:6c", &addresses[0]);
+	bt_str_to_addr("64:bc:0c:f9:e8:6d", &addresses[1]);
+	bt_str_to_addr("64:bc:0c:f9:e8:6e", &addresses[2]);
+	bt_str_to_uuid("ed995e5a-c7e7-4442-a6ee-7bb76df43b0d", &service);
+
+	config.max_size = 2;
+	config.idle_timeout_ms = BT_POOL_NO_IDLE_TIMEOUT;
+	e = bt_pool_init(&pool, &config);
+	ck_assert(e == BT_SUCCESS);
+
+	e = bt_pool_get(&pool, &addresses[0], &service, &socks[0]);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_pool_get(&pool, &addresses[1], &service, &socks[1]);
+	ck_assert(e == BT_SUCCESS);
+
+	// with both checked out there's no room, so the third isn't kept
+	e = bt_pool_get(&pool, &addresses[2], &service, &socks[2]);
+	ck_assert(e == BT_SUCCESS);
+	bt_pool_put(&pool, &socks[2], BT_SUCCESS);
+	ck_assert_int_eq(sockets_closed, 1);
+
+	// once they're back, the least recently used makes way
+	bt_pool_put(&pool, &socks[0], BT_SUCCESS);
+	bt_pool_put(&pool, &socks[1], BT_SUCCESS);
+	e = bt_pool_get(&pool, &addresses[2], &service, &socks[2]);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sockets_closed, 2);
+	bt_pool_put(&pool, &socks[2], BT_SUCCESS);
+
+	e = bt_pool_get(&pool, &addresses[1], &service, &socks[1]);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sockets_made, 4);
+	bt_pool_put(&pool, &socks[1], BT_SUCCESS);
+
+	// failed connections aren't kept; the channel is forgotten so the SDP lookup fails
+	bt_sdp_cache_clear();
+	sdp_session_t *sdp_connect_local(const bdaddr_t *src, const bdaddr_t *dst, uint32_t flags) {
+		return NULL;
+	}
+	bz_funcs.sdp_connect = sdp_connect_local;
+	e = bt_pool_get(&pool, &addresses[0], &service, &socks[0]);
+	ck_assert(e == BT_ERR_DEVICE_NOT_FOUND);
+
+	bt_pool_get_stats(&pool, &stats);
+	ck_assert_int_eq(stats.size, 2);
+	ck_assert_int_eq(stats.hits, 1);
+	ck_assert_int_eq(stats.expired, 1);
+
+	bt_pool_free(&pool);
+}
+END_TEST
+
+TCase *libpicobt_btpool_testcase(void) {
+	TCase *tcase = tcase_create("btpool");
+
+	tcase_add_test(tcase, test_pool_reuse);
+	tcase_add_test(tcase, test_pool_limits);
+
+	return tcase;
+}
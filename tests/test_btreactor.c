@@ -0,0 +1,237 @@
+/**
+ * @file test_btreactor.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Test the functions in btreactor.c
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btreactor.h"
+#include "mock/mockbluez.h"
+
+/// The descriptor returned by the mocked epoll_create1.
+#define MOCK_EPOLL_FD 77
+
+/// The data registered for each descriptor by the mocked epoll_ctl.
+static epoll_data_t epoll_registered[32];
+/// The events registered for each descriptor by the mocked epoll_ctl.
+static uint32_t epoll_interest[32];
+
+/**
+ * Mocked epoll_create1.
+ */
+static int mock_epoll_create1(int flags) {
+	memset(epoll_registered, 0, sizeof(epoll_registered));
+	memset(epoll_interest, 0, sizeof(epoll_interest));
+	return MOCK_EPOLL_FD;
+}
+
+/**
+ * Mocked epoll_ctl that records the registrations.
+ */
+static int mock_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+	ck_assert_int_eq(epfd, MOCK_EPOLL_FD);
+	ck_assert(fd >= 0 && fd < 32);
+	if (op == EPOLL_CTL_DEL) {
+		epoll_interest[fd] = 0;
+	}
+	else {
+		epoll_registered[fd] = event->data;
+		epoll_interest[fd] = event->events;
+	}
+	return 0;
+}
+
+/**
+ * Mocked close for the event queue.
+ */
+static int mock_close(int fd) {
+	ck_assert_int_eq(fd, MOCK_EPOLL_FD);
+	return 0;
+}
+
+/**
+ * Set up the mocked event queue.
+ */
+static void mock_epoll_start(void) {
+	bz_funcs.epoll_create1 = mock_epoll_create1;
+	bz_funcs.epoll_ctl = mock_epoll_ctl;
+	bz_funcs.close = mock_close;
+}
+
+START_TEST (test_reactor_dispatch)
+{
+	bt_reactor_t reactor;
+	bt_socket_t socks[2];
+	int nonblocking;
+	int calls;
+	int seen_events;
+	int dispatched;
+	bt_err_t e;
+
+	mock_epoll_start();
+	nonblocking = 0;
+	calls = 0;
+	seen_events = 0;
+
+	int fcntl_func(int fd, int cmd, int arg) {
+		if (cmd == F_GETFL)
+			return O_RDWR;
+		ck_assert_int_eq(cmd, F_SETFL);
+		ck_assert(arg & O_NONBLOCK);
+		nonblocking++;
+		return 0;
+	}
+	bz_funcs.fcntl = fcntl_func;
+
+	int epoll_wait_func(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+		ck_assert_int_eq(epfd, MOCK_EPOLL_FD);
+		ck_assert_int_eq(maxevents, BT_REACTOR_MAX_EVENTS);
+		// both sockets become ready at once
+		events[0].events = EPOLLIN | EPOLLRDHUP;
+		events[0].data = epoll_registered[5];
+		events[1].events = EPOLLOUT;
+		events[1].data = epoll_registered[6];
+		return 2;
+	}
+	bz_funcs.epoll_wait = epoll_wait_func;
+
+	void callback(bt_reactor_t *r, bt_socket_t *socket, int events, void *data) {
+		ck_assert(r == &reactor);
+		ck_assert(data == &calls);
+		ck_assert(socket == &socks[0]);
+		calls++;
+		seen_events = events;
+		// removing the other socket means its event must not be dispatched
+		bt_reactor_remove(r, &socks[1]);
+		bt_reactor_remove(r, socket);
+	}
+
+	e = bt_reactor_init(&reactor);
+	ck_assert(e == BT_SUCCESS);
+
+	socks[0].s = 5;
+	socks[1].s = 6;
+	e = bt_reactor_add(&reactor, &socks[0], BT_REACTOR_READABLE, callback, &calls);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_reactor_add(&reactor, &socks[0], BT_REACTOR_READABLE, callback, &calls);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	e = bt_reactor_add(&reactor, &socks[1], BT_REACTOR_READABLE, callback, &calls);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(nonblocking, 2);
+	ck_assert_int_eq(bt_reactor_count(&reactor), 2);
+	ck_assert(epoll_interest[5] & EPOLLIN);
+	ck_assert(!(epoll_interest[5] & EPOLLOUT));
+
+	e = bt_reactor_modify(&reactor, &socks[1], BT_REACTOR_READABLE | BT_REACTOR_WRITABLE);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(epoll_interest[6] & EPOLLOUT);
+
+	e = bt_reactor_run_once(&reactor, 0, &dispatched);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(dispatched, 1);
+	ck_assert_int_eq(calls, 1);
+	ck_assert_int_eq(seen_events, BT_REACTOR_READABLE | BT_REACTOR_CLOSED);
+	ck_assert_int_eq(bt_reactor_count(&reactor), 0);
+
+	e = bt_reactor_remove(&reactor, &socks[0]);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+
+	bt_reactor_free(&reactor);
+}
+END_TEST
+
+START_TEST (test_reactor_listener)
+{
+	bt_reactor_t reactor;
+	bt_socket_t listener;
+	int accepted[4];
+	int accepts;
+	int next_client;
+	bt_err_t e;
+
+	mock_epoll_start();
+	accepts = 0;
+	next_client = 20;
+
+	int fcntl_func(int fd, int cmd, int arg) {
+		return 0;
+	}
+	bz_funcs.fcntl = fcntl_func;
+
+	int epoll_wait_func(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+		events[0].events = EPOLLIN;
+		events[0].data = epoll_registered[9];
+		return 1;
+	}
+	bz_funcs.epoll_wait = epoll_wait_func;
+
+	int accept_func(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+		ck_assert_int_eq(sockfd, 9);
+		// two connections are waiting
+		if (next_client < 22) {
+			return next_client++;
+		}
+		errno = EAGAIN;
+		return -1;
+	}
+	bz_funcs.accept = accept_func;
+
+	void on_accept(bt_reactor_t *r, bt_socket_t *l, bt_socket_t *client, void *data) {
+		ck_assert(l == &listener);
+		accepted[accepts++] = client->s;
+		if (accepts == 2)
+			bt_reactor_stop(r);
+	}
+
+	e = bt_reactor_init(&reactor);
+	ck_assert(e == BT_SUCCESS);
+
+	listener.s = 9;
+	e = bt_reactor_add_listener(&reactor, &listener, on_accept, NULL);
+	ck_assert(e == BT_SUCCESS);
+
+	// returns once the callback stops the loop
+	e = bt_reactor_run(&reactor);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(accepts, 2);
+	ck_assert_int_eq(accepted[0], 20);
+	ck_assert_int_eq(accepted[1], 21);
+	ck_assert_int_eq(bt_reactor_count(&reactor), 1);
+
+	bt_reactor_free(&reactor);
+}
+END_TEST
+
+TCase *libpicobt_btreactor_testcase(void) {
+	TCase *tcase = tcase_create("btreactor");
+
+	tcase_add_test(tcase, test_reactor_dispatch);
+	tcase_add_test(tcase, test_reactor_listener);
+
+	return tcase;
+}
@@ -0,0 +1,141 @@
+/**
+ * @file test_btsched.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Test the functions in btsched.c
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btsched.h"
+
+/// The number of steps each chain of continuations runs for.
+#define CHAIN_LENGTH 10
+
+/// The number of tasks run so far.
+static unsigned long ran;
+
+/**
+ * A task that counts itself and, while steps remain, submits its own
+ * continuation.
+ */
+static void chain_task(bt_sched_t *sched, void *data) {
+	long steps = (long) data;
+
+	__atomic_add_fetch(&ran, 1, __ATOMIC_SEQ_CST);
+	if (steps > 1) {
+		ck_assert(bt_sched_submit(sched, chain_task, (void *) (steps - 1)) == BT_SUCCESS);
+	}
+}
+
+/**
+ * A task that counts itself.
+ */
+static void count_task(bt_sched_t *sched, void *data) {
+	__atomic_add_fetch(&ran, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * A task that queues work on its own worker and then holds that worker up,
+ * so the work can only be done by being stolen.
+ */
+static void busy_task(bt_sched_t *sched, void *data) {
+	long i;
+
+	for (i = 0; i < (long) data; i++) {
+		ck_assert(bt_sched_submit(sched, count_task, NULL) == BT_SUCCESS);
+	}
+	usleep(100000);
+}
+
+START_TEST (test_sched_continuations)
+{
+	bt_sched_stats_t stats;
+	bt_sched_t sched;
+	long i;
+	bt_err_t e;
+
+	e = bt_sched_init(&sched, 4);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sched.workers, 4);
+
+	ran = 0;
+	for (i = 0; i < 100; i++) {
+		e = bt_sched_submit(&sched, chain_task, (void *) CHAIN_LENGTH);
+		ck_assert(e == BT_SUCCESS);
+	}
+	e = bt_sched_submit(&sched, NULL, NULL);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+
+	bt_sched_wait_idle(&sched);
+	ck_assert_int_eq(ran, 100 * CHAIN_LENGTH);
+
+	bt_sched_get_stats(&sched, &stats);
+	ck_assert_int_eq(stats.submitted, 100 * CHAIN_LENGTH);
+	ck_assert_int_eq(stats.executed, 100 * CHAIN_LENGTH);
+
+	bt_sched_free(&sched);
+	ck_assert(sched.state == NULL);
+}
+END_TEST
+
+START_TEST (test_sched_steal)
+{
+	bt_sched_stats_t stats;
+	bt_sched_t sched;
+	bt_err_t e;
+
+	e = bt_sched_init(&sched, 2);
+	ck_assert(e == BT_SUCCESS);
+
+	// more than fit in a queue initially, so it has to grow too
+	ran = 0;
+	e = bt_sched_submit(&sched, busy_task, (void *) 200);
+	ck_assert(e == BT_SUCCESS);
+
+	bt_sched_wait_idle(&sched);
+	ck_assert_int_eq(ran, 200);
+
+	bt_sched_get_stats(&sched, &stats);
+	ck_assert_int_eq(stats.executed, 201);
+	ck_assert(stats.stolen > 0);
+
+	// tasks still queued when the scheduler is freed are run first
+	ran = 0;
+	e = bt_sched_submit(&sched, chain_task, (void *) CHAIN_LENGTH);
+	ck_assert(e == BT_SUCCESS);
+	bt_sched_free(&sched);
+	ck_assert_int_eq(ran, CHAIN_LENGTH);
+}
+END_TEST
+
+TCase *libpicobt_btsched_testcase(void) {
+	TCase *tcase = tcase_create("btsched");
+
+	tcase_add_test(tcase, test_sched_continuations);
+	tcase_add_test(tcase, test_sched_steal);
+
+	return tcase;
+}
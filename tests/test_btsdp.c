@@ -0,0 +1,329 @@
+/**
+ * @file test_btsdp.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Test the functions in btsdp.c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btsdp.h"
+
+// a serial port record, as a device might send it
+static uint8_t const serial_record[] = {
+	0x35, 0x31,
+		0x09, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x00, 0x05,
+		0x09, 0x00, 0x01, 0x35, 0x03, 0x19, 0x11, 0x01,
+		0x09, 0x00, 0x04, 0x35, 0x0c,
+			0x35, 0x03, 0x19, 0x01, 0x00,
+			0x35, 0x05, 0x19, 0x00, 0x03, 0x08, 0x05,
+		0x09, 0x01, 0x00, 0x25, 0x0b, 'S', 'e', 'r', 'i', 'a', 'l', ' ', 'P', 'o', 'r', 't'
+};
+
+START_TEST (test_sdp_parse_record)
+{
+	bt_sdp_element_t elements[16];
+	bt_sdp_record_t record;
+	bt_err_t e;
+
+	e = bt_sdp_parse_record(serial_record, sizeof(serial_record), elements, 16, &record);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(record.count, 15);
+	ck_assert(record.elements == elements);
+	ck_assert(record.data == serial_record);
+
+	// the attribute list
+	ck_assert_int_eq(elements[0].type, BT_SDP_DATA_ELEMENT_SEQ);
+	ck_assert_int_eq(elements[0].recordSize, sizeof(serial_record));
+	ck_assert_int_eq(elements[0].count, 8);
+	ck_assert_int_eq(elements[0].descendants, 14);
+
+	// record handle
+	ck_assert_int_eq(elements[1].type, BT_SDP_DATA_ELEMENT_UINT);
+	ck_assert_int_eq(elements[1].value.u16, 0x0000);
+	ck_assert_int_eq(elements[2].size, 4);
+	ck_assert_int_eq(elements[2].value.u32, 0x00010005);
+
+	// service class list
+	ck_assert_int_eq(elements[3].value.u16, 0x0001);
+	ck_assert_int_eq(elements[4].count, 1);
+	ck_assert_int_eq(elements[5].type, BT_SDP_DATA_ELEMENT_UUID);
+	ck_assert_int_eq(elements[5].value.uuid16, 0x1101);
+
+	// protocol descriptor list, with the channel nested two deep
+	ck_assert_int_eq(elements[6].value.u16, 0x0004);
+	ck_assert_int_eq(elements[7].count, 2);
+	ck_assert_int_eq(elements[7].descendants, 5);
+	ck_assert_int_eq(elements[8].count, 1);
+	ck_assert_int_eq(elements[9].value.uuid16, 0x0100);
+	ck_assert_int_eq(elements[10].count, 2);
+	ck_assert_int_eq(elements[11].value.uuid16, 0x0003);
+	ck_assert_int_eq(elements[12].value.u8, 5);
+
+	// the name points into the data
+	ck_assert_int_eq(elements[13].value.u16, 0x0100);
+	ck_assert_int_eq(elements[14].type, BT_SDP_DATA_ELEMENT_TEXT);
+	ck_assert_int_eq(elements[14].size, 11);
+	ck_assert(elements[14].value.text == (char const *) serial_record + sizeof(serial_record) - 11);
+	ck_assert(!memcmp(elements[14].value.text, "Serial Port", 11));
+
+	// skipping a sequence lands on the next attribute ID
+	ck_assert_int_eq(elements[7 + elements[7].descendants + 1].value.u16, 0x0100);
+
+	// just counting
+	e = bt_sdp_parse_record(serial_record, sizeof(serial_record), NULL, 0, &record);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(record.count, 15);
+	ck_assert(record.elements == NULL);
+
+	// too small an array
+	e = bt_sdp_parse_record(serial_record, sizeof(serial_record), elements, 14, &record);
+	ck_assert(e == BT_ERR_BUFFER_FULL);
+
+	e = bt_sdp_parse_record(NULL, 0, elements, 16, &record);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	e = bt_sdp_parse_record(serial_record, sizeof(serial_record), elements, 16, NULL);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+}
+END_TEST
+
+START_TEST (test_sdp_parse_types)
+{
+	uint8_t const data[] = {
+		0x36, 0x00, 0x22,
+			0x1c, 0xed, 0x99, 0x5e, 0x5a, 0xc7, 0xe7, 0x44, 0x42,
+				0xa6, 0xee, 0x7b, 0xb7, 0x6d, 0xf4, 0x3b, 0x0d,
+			0x11, 0xff, 0xfe,
+			0x28, 0x01,
+			0x00,
+			0x45, 0x00,
+			0x0b, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08
+	};
+	bt_sdp_element_t elements[8];
+	bt_sdp_record_t record;
+	char uuid[BT_UUID_LENGTH];
+	bt_err_t e;
+
+	e = bt_sdp_parse_record(data, sizeof(data), elements, 8, &record);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(record.count, 7);
+	ck_assert_int_eq(elements[0].sizeDesc, 6);
+	ck_assert_int_eq(elements[0].size, 0x22);
+	ck_assert_int_eq(elements[0].count, 6);
+
+	bt_uuid_to_str(&elements[1].value.uuid, uuid);
+	ck_assert_str_eq(uuid, "ed995e5a-c7e7-4442-a6ee-7bb76df43b0d");
+	ck_assert_int_eq(elements[2].type, BT_SDP_DATA_ELEMENT_INT);
+	ck_assert_int_eq(elements[2].value.i16, -2);
+	ck_assert_int_eq(elements[3].type, BT_SDP_DATA_ELEMENT_BOOL);
+	ck_assert_int_eq(elements[3].value.boolean, 1);
+	ck_assert_int_eq(elements[4].type, BT_SDP_DATA_ELEMENT_NIL);
+	ck_assert_int_eq(elements[4].recordSize, 1);
+	ck_assert_int_eq(elements[5].type, BT_SDP_DATA_ELEMENT_URL);
+	ck_assert_int_eq(elements[5].size, 0);
+	ck_assert(elements[6].value.u64 == 0x0102030405060708ULL);
+}
+END_TEST
+
+START_TEST (test_sdp_parse_malformed)
+{
+	// lengths that run past the data, or past the sequence holding them
+	uint8_t const overrun[] = { 0x35, 0x05, 0x19, 0x11, 0x01 };
+	uint8_t const child_overrun[] = { 0x35, 0x02, 0x19, 0x11, 0x01 };
+	uint8_t const short_header[] = { 0x36, 0x00 };
+	uint8_t const short_text[] = { 0x25, 0x10, 'P', 'i', 'c', 'o' };
+	// sizes that aren't allowed for the type
+	uint8_t const bad_uuid[] = { 0x18, 0x01 };
+	uint8_t const bad_text[] = { 0x20, 'P' };
+	uint8_t const bad_sequence[] = { 0x30, 0x00 };
+	uint8_t const bad_nil[] = { 0x01, 0x00, 0x00 };
+	// a reserved type
+	uint8_t const reserved[] = { 0x48, 0x00 };
+	// more than one element
+	uint8_t const trailing[] = { 0x08, 0x01, 0x00 };
+	uint8_t nested[2 * (BT_SDP_MAX_DEPTH + 1)];
+	bt_sdp_element_t elements[BT_SDP_MAX_DEPTH + 1];
+	bt_sdp_record_t record;
+	bt_err_t e;
+	int i;
+
+	ck_assert(bt_sdp_parse_record(overrun, 0, elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+	ck_assert(bt_sdp_parse_record(overrun, sizeof(overrun), elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+	ck_assert(bt_sdp_parse_record(child_overrun, sizeof(child_overrun), elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+	ck_assert(bt_sdp_parse_record(short_header, sizeof(short_header), elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+	ck_assert(bt_sdp_parse_record(short_text, sizeof(short_text), elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+	ck_assert(bt_sdp_parse_record(bad_uuid, sizeof(bad_uuid), elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+	ck_assert(bt_sdp_parse_record(bad_text, sizeof(bad_text), elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+	ck_assert(bt_sdp_parse_record(bad_sequence, sizeof(bad_sequence), elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+	ck_assert(bt_sdp_parse_record(bad_nil, sizeof(bad_nil), elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+	ck_assert(bt_sdp_parse_record(reserved, sizeof(reserved), elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+	ck_assert(bt_sdp_parse_record(trailing, sizeof(trailing), elements, 4, &record) == BT_ERR_SDP_BAD_RECORD);
+
+	// sequences nested as deeply as allowed
+	for (i = 0; i < BT_SDP_MAX_DEPTH; i++) {
+		nested[2 * i] = 0x35;
+		nested[2 * i + 1] = 2 * (BT_SDP_MAX_DEPTH - i - 1);
+	}
+	e = bt_sdp_parse_record(nested, 2 * BT_SDP_MAX_DEPTH, elements, BT_SDP_MAX_DEPTH + 1, &record);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(record.count, BT_SDP_MAX_DEPTH);
+	ck_assert_int_eq(elements[0].descendants, BT_SDP_MAX_DEPTH - 1);
+	ck_assert_int_eq(elements[BT_SDP_MAX_DEPTH - 1].count, 0);
+
+	// and one deeper
+	for (i = 0; i <= BT_SDP_MAX_DEPTH; i++) {
+		nested[2 * i] = 0x35;
+		nested[2 * i + 1] = 2 * (BT_SDP_MAX_DEPTH - i);
+	}
+	e = bt_sdp_parse_record(nested, sizeof(nested), elements, BT_SDP_MAX_DEPTH + 1, &record);
+	ck_assert(e == BT_ERR_SDP_BAD_RECORD);
+}
+END_TEST
+
+START_TEST (test_sdp_cursor)
+{
+	bt_sdp_cursor_t cursor;
+	bt_sdp_cursor_t attributes;
+	bt_sdp_cursor_t protocols;
+	bt_sdp_cursor_t protocol;
+	bt_sdp_element_t e;
+	int pairs;
+	bt_err_t result;
+
+	result = bt_sdp_cursor_init(&cursor, serial_record, sizeof(serial_record));
+	ck_assert(result == BT_SUCCESS);
+
+	// the whole record is one sequence, stepped over in one go
+	result = bt_sdp_cursor_next(&cursor, &e);
+	ck_assert(result == BT_SUCCESS);
+	ck_assert_int_eq(e.type, BT_SDP_DATA_ELEMENT_SEQ);
+	ck_assert_int_eq(e.recordSize, sizeof(serial_record));
+	result = bt_sdp_cursor_enter_seq(&cursor, &attributes);
+	ck_assert(result == BT_SUCCESS);
+	result = bt_sdp_cursor_next(&cursor, &e);
+	ck_assert(result == BT_ERR_END_OF_ENUM);
+
+	// there's nothing to enter after a plain value
+	bt_sdp_cursor_next(&attributes, &e);
+	ck_assert_int_eq(e.value.u16, 0x0000);
+	result = bt_sdp_cursor_enter_seq(&attributes, &protocols);
+	ck_assert(result == BT_ERR_BAD_PARAM);
+
+	// walk the ID/value pairs, going into the protocol list on the way
+	pairs = 1;
+	bt_sdp_cursor_next(&attributes, &e);
+	while (bt_sdp_cursor_next(&attributes, &e) == BT_SUCCESS) {
+		pairs++;
+		ck_assert_int_eq(e.type, BT_SDP_DATA_ELEMENT_UINT);
+		if (e.value.u16 == 0x0004) {
+			bt_sdp_cursor_next(&attributes, &e);
+			ck_assert(bt_sdp_cursor_enter_seq(&attributes, &protocols) == BT_SUCCESS);
+			bt_sdp_cursor_next(&protocols, &e);
+			bt_sdp_cursor_next(&protocols, &e);
+			ck_assert(bt_sdp_cursor_enter_seq(&protocols, &protocol) == BT_SUCCESS);
+			bt_sdp_cursor_next(&protocol, &e);
+			ck_assert_int_eq(e.value.uuid16, 0x0003);
+			bt_sdp_cursor_next(&protocol, &e);
+			ck_assert_int_eq(e.value.u8, 5);
+			ck_assert(bt_sdp_cursor_next(&protocol, &e) == BT_ERR_END_OF_ENUM);
+			ck_assert(bt_sdp_cursor_next(&protocols, &e) == BT_ERR_END_OF_ENUM);
+		} else {
+			bt_sdp_cursor_next(&attributes, &e);
+		}
+	}
+	ck_assert_int_eq(pairs, 4);
+	ck_assert_int_eq(e.type, BT_SDP_DATA_ELEMENT_TEXT);
+	ck_assert(!memcmp(e.value.text, "Serial Port", 11));
+
+	ck_assert(bt_sdp_cursor_init(NULL, serial_record, 1) == BT_ERR_BAD_PARAM);
+	ck_assert(bt_sdp_cursor_next(&cursor, NULL) == BT_ERR_BAD_PARAM);
+}
+END_TEST
+
+START_TEST (test_sdp_find_attr)
+{
+	// everything after the service class list is garbage
+	uint8_t const truncated[] = {
+		0x35, 0x0c,
+			0x09, 0x00, 0x01, 0x35, 0x03, 0x19, 0x11, 0x01,
+			0x09, 0x00, 0x04, 0x4f
+	};
+	bt_sdp_cursor_t cursor;
+	bt_sdp_cursor_t inner;
+	bt_sdp_element_t value;
+	bt_sdp_element_t e;
+	bt_err_t result;
+
+	bt_sdp_cursor_init(&cursor, serial_record, sizeof(serial_record));
+	result = bt_sdp_find_attr(&cursor, 0x0004, &value);
+	ck_assert(result == BT_SUCCESS);
+	ck_assert_int_eq(value.type, BT_SDP_DATA_ELEMENT_SEQ);
+	ck_assert_int_eq(value.size, 12);
+	ck_assert(bt_sdp_cursor_enter_seq(&cursor, &inner) == BT_SUCCESS);
+	bt_sdp_cursor_next(&inner, &e);
+	ck_assert(bt_sdp_cursor_enter_seq(&inner, &inner) == BT_SUCCESS);
+	bt_sdp_cursor_next(&inner, &e);
+	ck_assert_int_eq(e.value.uuid16, 0x0100);
+
+	// carrying on from there, missing out an ID that isn't present
+	result = bt_sdp_find_attr(&cursor, 0x0009, &value);
+	ck_assert(result == BT_ERR_SDP_ATTR_NOT_FOUND);
+	result = bt_sdp_find_attr(&cursor, 0x0100, &value);
+	ck_assert(result == BT_SUCCESS);
+	ck_assert_int_eq(value.type, BT_SDP_DATA_ELEMENT_TEXT);
+	ck_assert_int_eq(value.size, 11);
+	result = bt_sdp_find_attr(&cursor, 0x0101, &value);
+	ck_assert(result == BT_ERR_SDP_ATTR_NOT_FOUND);
+
+	// the search stops before reaching anything malformed
+	bt_sdp_cursor_init(&cursor, truncated, sizeof(truncated));
+	result = bt_sdp_find_attr(&cursor, 0x0001, &value);
+	ck_assert(result == BT_SUCCESS);
+	ck_assert_int_eq(value.count, 0);
+	ck_assert_int_eq(value.recordSize, 5);
+	result = bt_sdp_find_attr(&cursor, 0x0004, &value);
+	ck_assert(result == BT_ERR_SDP_BAD_RECORD);
+
+	// a record that isn't an attribute list
+	bt_sdp_cursor_init(&cursor, serial_record + 2, 3);
+	result = bt_sdp_find_attr(&cursor, 0x0000, &value);
+	ck_assert(result == BT_ERR_SDP_BAD_RECORD);
+
+	ck_assert(bt_sdp_find_attr(&cursor, 0x0000, NULL) == BT_ERR_BAD_PARAM);
+}
+END_TEST
+
+TCase *libpicobt_btsdp_testcase(void) {
+	TCase *tcase = tcase_create("btsdp");
+
+	tcase_add_test(tcase, test_sdp_parse_record);
+	tcase_add_test(tcase, test_sdp_parse_types);
+	tcase_add_test(tcase, test_sdp_parse_malformed);
+	tcase_add_test(tcase, test_sdp_cursor);
+	tcase_add_test(tcase, test_sdp_find_attr);
+
+	return tcase;
+}
@@ -0,0 +1,307 @@
+/**
+ * @file test_btsdpcache.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Test the functions in btsdpcache.c
+ *
+ * The connect test looks services up through the mocked SDP calls, which
+ * report a channel that can be changed to simulate a service moving. The
+ * file test uses a real temporary file, and starts each "process" afresh by
+ * reconfiguring the cache, which empties its in-process part.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btsdpcache.h"
+#include "mock/mockbluez.h"
+
+static uint8_t service_channel;
+static int sdp_searches;
+
+static sdp_session_t *cache_sdp_connect(const bdaddr_t *src, const bdaddr_t *dst, uint32_t flags) {
+	sdp_session_t *session = calloc(1, sizeof(sdp_session_t));
+
+	session->sock = 342;
+	return session;
+}
+
+static int cache_sdp_search(sdp_session_t *session, const sdp_list_t *search, sdp_attrreq_type_t reqtype, const sdp_list_t *attrid_list, sdp_list_t **rsp_list) {
+	sdp_record_t *record;
+	sdp_list_t *proto[2];
+	sdp_list_t *apseq;
+	uuid_t *l2cap;
+	uuid_t *rfcomm;
+
+	sdp_searches++;
+	l2cap = malloc(sizeof(uuid_t));
+	rfcomm = malloc(sizeof(uuid_t));
+	record = sdp_record_alloc();
+	sdp_uuid16_create(l2cap, L2CAP_UUID);
+	proto[0] = sdp_list_append(NULL, l2cap);
+	apseq = sdp_list_append(NULL, proto[0]);
+	sdp_uuid16_create(rfcomm, RFCOMM_UUID);
+	proto[1] = sdp_list_append(NULL, rfcomm);
+	proto[1] = sdp_list_append(proto[1], sdp_data_alloc(SDP_UINT8, &service_channel));
+	apseq = sdp_list_append(apseq, proto[1]);
+	sdp_set_access_protos(record, sdp_list_append(NULL, apseq));
+
+	*rsp_list = sdp_list_append(*rsp_list, record);
+	return 0;
+}
+
+static int cache_sdp_close(sdp_session_t *session) {
+	free(session);
+	return 0;
+}
+
+static int cache_socket(int domain, int type, int protocol) {
+	return 600;
+}
+
+static int cache_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	// only the channel the service is currently on accepts connections
+	if (((const struct sockaddr_rc *) addr)->rc_channel != service_channel) {
+		errno = ECONNREFUSED;
+		return -1;
+	}
+	return 0;
+}
+
+static int cache_close(int fd) {
+	return 0;
+}
+
+static sdp_session_t *cache_sdp_unexpected(const bdaddr_t *src, const bdaddr_t *dst, uint32_t flags) {
+	ck_abort_msg("the device shouldn't be queried");
+	return NULL;
+}
+
+START_TEST (test_sdp_cache_entries)
+{
+	bt_sdp_cache_stats_t stats;
+	bt_addr_t addresses[3];
+	bt_uuid_t service;
+	uint8_t channel;
+	bt_err_t e;
+
+	bt_str_to_addr("00:11:22:33:44:01", &addresses[0]);
+	bt_str_to_addr("00:11:22:33:44:02", &addresses[1]);
+	bt_str_to_addr("00:11:22:33:44:03", &addresses[2]);
+	bt_str_to_uuid("ed995e5a-c7e7-4442-a6ee-7bb76df43b0d", &service);
+
+	e = bt_sdp_cache_configure(-2, 0);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+	e = bt_sdp_cache_configure(50, 2);
+	ck_assert(e == BT_SUCCESS);
+
+	ck_assert(!bt_sdp_cache_lookup(&addresses[0], &service, &channel));
+	bt_sdp_cache_store(&addresses[0], &service, 5);
+	bt_sdp_cache_store(&addresses[1], &service, 6);
+	// channels outside the RFCOMM range aren't kept
+	bt_sdp_cache_store(&addresses[2], &service, 0);
+	ck_assert(bt_sdp_cache_lookup(&addresses[0], &service, &channel));
+	ck_assert_int_eq(channel, 5);
+
+	// the cache is full, so the channel used least recently goes
+	bt_sdp_cache_store(&addresses[2], &service, 7);
+	ck_assert(!bt_sdp_cache_lookup(&addresses[1], &service, &channel));
+	ck_assert(bt_sdp_cache_lookup(&addresses[2], &service, &channel));
+	ck_assert_int_eq(channel, 7);
+
+	bt_sdp_cache_invalidate(&addresses[2], &service);
+	ck_assert(!bt_sdp_cache_lookup(&addresses[2], &service, &channel));
+
+	// channels are forgotten once the TTL has passed
+	usleep(60000);
+	ck_assert(!bt_sdp_cache_lookup(&addresses[0], &service, &channel));
+
+	bt_sdp_cache_get_stats(&stats);
+	ck_assert_int_eq(stats.hits, 2);
+	ck_assert_int_eq(stats.misses, 4);
+	ck_assert_int_eq(stats.evicted, 1);
+	ck_assert_int_eq(stats.invalidated, 1);
+	ck_assert_int_eq(stats.expired, 1);
+	ck_assert_int_eq(stats.size, 0);
+
+	// with the cache off nothing is remembered
+	e = bt_sdp_cache_configure(BT_SDP_CACHE_DISABLED, 0);
+	ck_assert(e == BT_SUCCESS);
+	bt_sdp_cache_store(&addresses[0], &service, 5);
+	ck_assert(!bt_sdp_cache_lookup(&addresses[0], &service, &channel));
+}
+END_TEST
+
+START_TEST (test_sdp_cache_connect)
+{
+	bt_sdp_cache_stats_t stats;
+	bt_addr_t address;
+	bt_uuid_t service;
+	bt_socket_t sock;
+	bt_err_t e;
+
+	bz_funcs.sdp_connect = cache_sdp_connect;
+	bz_funcs.sdp_service_search_attr_req = cache_sdp_search;
+	bz_funcs.sdp_close = cache_sdp_close;
+	bz_funcs.socket = cache_socket;
+	bz_funcs.connect = cache_connect;
+	bz_funcs.close = cache_close;
+	service_channel = 15;
+	sdp_searches = 0;
+
+	bt_str_to_addr("64:bc:0c:f9:e8:6c", &address);
+	bt_str_to_uuid("ed995e5a-c7e7-4442-a6ee-7bb76df43b0d", &service);
+
+	e = bt_connect_to_service(&address, &service, &sock);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sdp_searches, 1);
+
+	// the second connect goes straight to the remembered channel
+	e = bt_connect_to_service(&address, &service, &sock);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sdp_searches, 1);
+
+	// the service moves, so the remembered channel is refused and looked up again
+	service_channel = 16;
+	e = bt_connect_to_service(&address, &service, &sock);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sdp_searches, 2);
+
+	e = bt_connect_to_service(&address, &service, &sock);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(sdp_searches, 2);
+
+	bt_sdp_cache_get_stats(&stats);
+	ck_assert_int_eq(stats.hits, 3);
+	ck_assert_int_eq(stats.misses, 2);
+	ck_assert_int_eq(stats.invalidated, 1);
+	ck_assert_int_eq(stats.size, 1);
+}
+END_TEST
+
+START_TEST (test_sdp_cache_file)
+{
+	char path[] = "/tmp/picobt-sdpcache-XXXXXX";
+	bt_sdp_cache_stats_t stats;
+	bt_addr_t addresses[5];
+	bt_uuid_t service;
+	bt_inquiry_t inquiry;
+	bt_service_t found;
+	bt_socket_t sock;
+	char name[BT_SDP_CACHE_NAME_LENGTH];
+	char str[BT_UUID_LENGTH];
+	uint8_t channel;
+	bt_err_t e;
+	int i;
+
+	bz_funcs.sdp_connect = cache_sdp_unexpected;
+	bz_funcs.socket = cache_socket;
+	bz_funcs.connect = cache_connect;
+	bz_funcs.close = cache_close;
+	service_channel = 12;
+
+	for (i = 0; i < 5; i++) {
+		bt_str_to_addr("00:11:22:33:44:00", &addresses[i]);
+		addresses[i].b[0] = i;
+	}
+	bt_str_to_uuid("ed995e5a-c7e7-4442-a6ee-7bb76df43b0d", &service);
+
+	// an empty file is set up as a cache
+	ck_assert(mkstemp(path) >= 0);
+	e = bt_sdp_cache_open_file(path, 4);
+	ck_assert(e == BT_SUCCESS);
+	bt_sdp_cache_store_ex(&addresses[0], &service, 12, "Pico");
+
+	// a new process, with nothing remembered itself
+	bt_sdp_cache_close_file();
+	ck_assert(bt_sdp_cache_configure(BT_SDP_CACHE_DEFAULT_TTL, 0) == BT_SUCCESS);
+	e = bt_sdp_cache_open_file(path, 0);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert(bt_sdp_cache_lookup_ex(&addresses[0], &service, &channel, name, sizeof(name)));
+	ck_assert_int_eq(channel, 12);
+	ck_assert_str_eq(name, "Pico");
+
+	// the service can be listed and connected to without asking the device
+	ck_assert(bt_sdp_cache_configure(BT_SDP_CACHE_DEFAULT_TTL, 0) == BT_SUCCESS);
+	e = bt_services_begin(&inquiry, &addresses[0], &service, 1);
+	ck_assert(e == BT_SUCCESS);
+	e = bt_services_next(&inquiry, &found);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_str_eq(found.name, "Pico");
+	ck_assert_int_eq(found.port, 12);
+	bt_uuid_to_str(&found.uuid, str);
+	ck_assert_str_eq(str, "ed995e5a-c7e7-4442-a6ee-7bb76df43b0d");
+	e = bt_services_next(&inquiry, &found);
+	ck_assert(e == BT_ERR_END_OF_ENUM);
+	bt_services_end(&inquiry);
+
+	e = bt_connect_to_service(&addresses[0], &service, &sock);
+	ck_assert(e == BT_SUCCESS);
+
+	// the connect found the channel kept in this process by the listing
+	bt_sdp_cache_get_stats(&stats);
+	ck_assert_int_eq(stats.hits, 3);
+	ck_assert_int_eq(stats.file_hits, 2);
+	ck_assert_int_eq(stats.misses, 0);
+
+	// the file was made with four slots, so the oldest entry makes way
+	for (i = 1; i < 5; i++) {
+		usleep(1000);
+		bt_sdp_cache_store(&addresses[i], &service, 13);
+	}
+	ck_assert(bt_sdp_cache_configure(BT_SDP_CACHE_DEFAULT_TTL, 0) == BT_SUCCESS);
+	ck_assert(!bt_sdp_cache_lookup(&addresses[0], &service, &channel));
+	ck_assert(bt_sdp_cache_lookup(&addresses[4], &service, &channel));
+	ck_assert_int_eq(channel, 13);
+
+	// forgetting a channel takes it out of the file too
+	bt_sdp_cache_invalidate(&addresses[4], &service);
+	ck_assert(bt_sdp_cache_configure(BT_SDP_CACHE_DEFAULT_TTL, 0) == BT_SUCCESS);
+	ck_assert(!bt_sdp_cache_lookup(&addresses[4], &service, &channel));
+	ck_assert(bt_sdp_cache_lookup(&addresses[3], &service, &channel));
+
+	// a channel read from the file keeps its age, rather than starting afresh
+	ck_assert(bt_sdp_cache_configure(100, 0) == BT_SUCCESS);
+	bt_sdp_cache_store(&addresses[1], &service, 14);
+	usleep(60000);
+	ck_assert(bt_sdp_cache_configure(100, 0) == BT_SUCCESS);
+	ck_assert(bt_sdp_cache_lookup(&addresses[1], &service, &channel));
+	ck_assert_int_eq(channel, 14);
+	usleep(60000);
+	ck_assert(!bt_sdp_cache_lookup(&addresses[1], &service, &channel));
+
+	bt_sdp_cache_close_file();
+	unlink(path);
+}
+END_TEST
+
+TCase *libpicobt_btsdpcache_testcase(void) {
+	TCase *tcase = tcase_create("btsdpcache");
+
+	tcase_add_test(tcase, test_sdp_cache_entries);
+	tcase_add_test(tcase, test_sdp_cache_connect);
+	tcase_add_test(tcase, test_sdp_cache_file);
+
+	return tcase;
+}
@@ -0,0 +1,201 @@
+/**
+ * @file test_btserver.c
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of libtt.
+ *
+ * Libpicobt is free software: you can redistribute it and\/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * Libpicobt is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with libpicobt. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Test the functions in btserver.c
+ *
+ * The mocks here are called from the server's threads, so they're ordinary
+ * functions sharing state through a lock rather than nested functions.
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <check.h>
+#include "picobt/bt.h"
+#include "picobt/btserver.h"
+#include "mock/mockbluez.h"
+
+/// The descriptor of the mocked listening socket.
+#define LISTENER_FD 50
+/// The descriptor given to the first mocked connection.
+#define CLIENT_FD 100
+/// The number of connections the test makes.
+#define CLIENTS 6
+
+/// Protects the state shared with the mocks.
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+/// The number of connections waiting to be accepted.
+static int pending;
+/// The number of connections accepted so far.
+static int accepted;
+/// Flags for each connection: 1 if handled, 2 if closed.
+static int clients[CLIENTS];
+/// True once the listening socket has been closed.
+static bool listener_closed;
+
+static int socket_mock(int domain, int type, int protocol) {
+	return LISTENER_FD;
+}
+
+static int bind_mock(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	ck_assert_int_eq(((struct sockaddr_rc *)addr)->rc_channel, 3);
+	return 0;
+}
+
+static int listen_mock(int sockfd, int backlog) {
+	ck_assert_int_eq(sockfd, LISTENER_FD);
+	ck_assert_int_eq(backlog, SOMAXCONN);
+	return 0;
+}
+
+static int getsockname_mock(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+	((struct sockaddr_rc *)addr)->rc_channel = 3;
+	return 0;
+}
+
+static int poll_mock(struct pollfd *fds, nfds_t nfds, int timeout) {
+	int ready;
+
+	pthread_mutex_lock(&mock_lock);
+	ready = (pending > 0);
+	pthread_mutex_unlock(&mock_lock);
+	if (!ready) {
+		// stand in for the wait, but keep the test quick
+		usleep(5000);
+	}
+	return ready;
+}
+
+static int accept4_mock(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+	int fd;
+
+	ck_assert_int_eq(sockfd, LISTENER_FD);
+	pthread_mutex_lock(&mock_lock);
+	if (pending == 0) {
+		fd = -1;
+		errno = EAGAIN;
+	}
+	else {
+		pending--;
+		fd = CLIENT_FD + accepted++;
+	}
+	pthread_mutex_unlock(&mock_lock);
+
+	return fd;
+}
+
+static int close_mock(int fd) {
+	pthread_mutex_lock(&mock_lock);
+	if (fd == LISTENER_FD) {
+		listener_closed = true;
+	}
+	else {
+		ck_assert(fd >= CLIENT_FD && fd < CLIENT_FD + CLIENTS);
+		clients[fd - CLIENT_FD] |= 2;
+	}
+	pthread_mutex_unlock(&mock_lock);
+
+	return 0;
+}
+
+static void handler(bt_server_t *server, bt_socket_t *client, void *data) {
+	ck_assert(data == &pending);
+	ck_assert(client->s >= CLIENT_FD && client->s < CLIENT_FD + CLIENTS);
+	pthread_mutex_lock(&mock_lock);
+	// still open while being served
+	ck_assert_int_eq(clients[client->s - CLIENT_FD], 0);
+	clients[client->s - CLIENT_FD] |= 1;
+	pthread_mutex_unlock(&mock_lock);
+}
+
+START_TEST (test_server)
+{
+	bt_server_config_t config;
+	bt_server_stats_t stats;
+	bt_server_t server;
+	int tries;
+	int i;
+	bt_err_t e;
+
+	bz_funcs.socket = socket_mock;
+	bz_funcs.bind = bind_mock;
+	bz_funcs.listen = listen_mock;
+	bz_funcs.getsockname = getsockname_mock;
+	bz_funcs.poll = poll_mock;
+	bz_funcs.accept4 = accept4_mock;
+	bz_funcs.close = close_mock;
+
+	memset(&config, 0, sizeof(config));
+	e = bt_server_init(&server, &config);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+
+	config.channel = 3;
+	config.workers = 2;
+	config.handler = handler;
+	config.data = &pending;
+	e = bt_server_init(&server, &config);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(server.config.queue_size, BT_SERVER_DEFAULT_QUEUE);
+	ck_assert_int_eq(bt_server_get_channel(&server), 0);
+
+	e = bt_server_start(&server);
+	ck_assert(e == BT_SUCCESS);
+	ck_assert_int_eq(bt_server_get_channel(&server), 3);
+	e = bt_server_start(&server);
+	ck_assert(e == BT_ERR_BAD_PARAM);
+
+	// a burst of clients all get served
+	pthread_mutex_lock(&mock_lock);
+	pending = CLIENTS;
+	pthread_mutex_unlock(&mock_lock);
+
+	for (tries = 0; tries < 200; tries++) {
+		bt_server_get_stats(&server, &stats);
+		if (stats.handled == CLIENTS)
+			break;
+		usleep(10000);
+	}
+	ck_assert_int_eq(stats.accepted, CLIENTS);
+	ck_assert_int_eq(stats.handled, CLIENTS);
+	ck_assert_int_eq(stats.rejected, 0);
+	ck_assert_int_eq(stats.queued, 0);
+
+	bt_server_stop(&server);
+	ck_assert(listener_closed);
+	for (i = 0; i < CLIENTS; i++) {
+		ck_assert_int_eq(clients[i], 3);
+	}
+
+	bt_server_free(&server);
+}
+END_TEST
+
+TCase *libpicobt_btserver_testcase(void) {
+	TCase *tcase = tcase_create("btserver");
+
+	tcase_add_test(tcase, test_server);
+
+	return tcase;
+}
@@ -26,6 +26,7 @@
 
 #include <stdlib.h>
 #include <ctype.h>
+#include <unistd.h>
 #include <check.h>
 #include "picobt/bt.h"
 
@@ -214,6 +215,50 @@ START_TEST (libpicobt__btutil__uuid_type_conversion)
 }
 END_TEST
 
+/**
+ * Test that {@link bt_time_now_us} never goes backwards and measures
+ * microseconds.
+ */
+START_TEST (libpicobt__btutil__time_now_us)
+{
+	int64_t before;
+	int64_t after;
+
+	before = bt_time_now_us();
+	usleep(2000);
+	after = bt_time_now_us();
+
+	ck_assert(after - before >= 2000);
+	ck_assert(after - before < 2000000);
+}
+END_TEST
+
+/**
+ * Test {@link bt_deadline_from_ms} and {@link bt_deadline_remaining_ms}.
+ */
+START_TEST (libpicobt__btutil__deadlines)
+{
+	bt_deadline_t deadline;
+	int remaining;
+
+	ck_assert(bt_deadline_from_ms(-1) == BT_DEADLINE_NEVER);
+	ck_assert_int_eq(bt_deadline_remaining_ms(BT_DEADLINE_NEVER), -1);
+
+	deadline = bt_deadline_from_ms(1000);
+	remaining = bt_deadline_remaining_ms(deadline);
+	ck_assert(remaining > 900 && remaining <= 1000);
+
+	// a part-millisecond still counts as a millisecond
+	deadline = bt_time_now_us() + 1500;
+	remaining = bt_deadline_remaining_ms(deadline);
+	ck_assert(remaining >= 1 && remaining <= 2);
+
+	deadline = bt_deadline_from_ms(0);
+	ck_assert_int_eq(bt_deadline_remaining_ms(deadline), 0);
+	ck_assert_int_eq(bt_deadline_remaining_ms(deadline - 1000), 0);
+}
+END_TEST
+
 
 /**
  * Create the test suite for this file, covering the `libpicobt_btutil_*` tests.
@@ -227,6 +272,8 @@ TCase *libpicobt_btutil_testcase(void) {
 	tcase_add_test(tcase, libpicobt__btutil__compact_string_conversion);
 	tcase_add_test(tcase, libpicobt__btutil__bt_str_to_uuid);
 	tcase_add_test(tcase, libpicobt__btutil__uuid_type_conversion);
+	tcase_add_test(tcase, libpicobt__btutil__time_now_us);
+	tcase_add_test(tcase, libpicobt__btutil__deadlines);
 	
 	return tcase;
 }
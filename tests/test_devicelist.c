@@ -26,14 +26,92 @@
 
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
 #include <check.h>
 #include "picobt/devicelist.h"
 #include "picobt/btmain.h"
 #include "picobt/btutil.h"
+#include "picobt/btpool.h"
+#include "mock/mockbluez.h"
 
 #define ADDR1 "11:22:33:44:55:66"
 #define ADDR2 "aa:bb:cc:dd:ee:ff"
+#define ADDR3 "64:bc:0c:f9:e8:6c"
 #define FILE_TO_SAVE "devicelist.txt"
+#define SEND_CHANNEL 15
+
+static int sends;
+static int send_failures;
+
+// Every device offers the service on SEND_CHANNEL
+static sdp_session_t *send_sdp_connect(const bdaddr_t *src, const bdaddr_t *dst, uint32_t flags) {
+	return calloc(1, sizeof(sdp_session_t));
+}
+
+static int send_sdp_search(sdp_session_t *session, const sdp_list_t *search, sdp_attrreq_type_t reqtype, const sdp_list_t *attrid_list, sdp_list_t **rsp_list) {
+	sdp_record_t *record;
+	sdp_list_t *proto[2];
+	sdp_list_t *apseq;
+	uuid_t *l2cap;
+	uuid_t *rfcomm;
+	uint8_t channel = SEND_CHANNEL;
+
+	l2cap = malloc(sizeof(uuid_t));
+	rfcomm = malloc(sizeof(uuid_t));
+	record = sdp_record_alloc();
+	sdp_uuid16_create(l2cap, L2CAP_UUID);
+	proto[0] = sdp_list_append(NULL, l2cap);
+	apseq = sdp_list_append(NULL, proto[0]);
+	sdp_uuid16_create(rfcomm, RFCOMM_UUID);
+	proto[1] = sdp_list_append(NULL, rfcomm);
+	proto[1] = sdp_list_append(proto[1], sdp_data_alloc(SDP_UINT8, &channel));
+	apseq = sdp_list_append(apseq, proto[1]);
+	sdp_set_access_protos(record, sdp_list_append(NULL, apseq));
+
+	*rsp_list = sdp_list_append(*rsp_list, record);
+	return 0;
+}
+
+static int send_sdp_close(sdp_session_t *session) {
+	free(session);
+	return 0;
+}
+
+static int send_socket(int domain, int type, int protocol) {
+	return 500;
+}
+
+static int send_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	const struct sockaddr_rc *addr_rc = (const struct sockaddr_rc *) addr;
+
+	ck_assert(addr_rc->rc_channel == SEND_CHANNEL);
+	// the device with the highest address refuses
+	if (addr_rc->rc_bdaddr.b[5] == 0xaa) {
+		errno = ECONNREFUSED;
+		return -1;
+	}
+	return 0;
+}
+
+static int send_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	fds[0].revents = fds[0].events & POLLOUT;
+	return 1;
+}
+
+static ssize_t send_send(int sockfd, const void *buf, size_t len, int flags) {
+	ck_assert(!memcmp(buf, "Pico", 4));
+	if (send_failures > 0) {
+		send_failures--;
+		errno = EPIPE;
+		return -1;
+	}
+	__sync_fetch_and_add(&sends, 1);
+	return len;
+}
+
+static int send_close(int sockfd) {
+	return 0;
+}
 
 START_TEST (base_device_list)
 {
@@ -138,11 +216,131 @@ START_TEST (device_list_save_load)
 }
 END_TEST
 
+START_TEST (device_list_send_ex)
+{
+	bt_device_list_t *list;
+	bt_send_config_t config;
+	bt_send_result_t results[3];
+	bt_addr_t addr1;
+	bt_addr_t addr2;
+	bt_addr_t addr3;
+	bt_uuid_t service;
+	size_t count;
+	bt_err_t e;
+
+	sends = 0;
+	bz_funcs.sdp_connect = send_sdp_connect;
+	bz_funcs.sdp_service_search_attr_req = send_sdp_search;
+	bz_funcs.sdp_close = send_sdp_close;
+	bz_funcs.socket = send_socket;
+	bz_funcs.connect = send_connect;
+	bz_funcs.poll = send_poll;
+	bz_funcs.send = send_send;
+	bz_funcs.close = send_close;
+
+	bt_str_to_addr(ADDR1, &addr1);
+	bt_str_to_addr(ADDR2, &addr2);
+	bt_str_to_addr(ADDR3, &addr3);
+	bt_str_to_uuid("ed995e5a-c7e7-4442-a6ee-7bb76df43b0d", &service);
+
+	list = bt_list_new();
+	bt_list_add_device(list, &addr1);
+	bt_list_add_device(list, &addr2);
+	bt_list_add_device(list, &addr3);
+
+	memset(&config, 0, sizeof(config));
+	config.concurrency = 2;
+
+	// not enough room for the results
+	e = bt_send_to_list_ex(list, &service, "Pico", 4, &config, results, 2, &count);
+	ck_assert(e == BT_ERR_BUFFER_FULL);
+	ck_assert_int_eq(sends, 0);
+
+	e = bt_send_to_list_ex(list, &service, "Pico", 4, &config, results, 3, &count);
+	ck_assert(e == BT_ERR_CONNECTION_FAILURE);
+	ck_assert_int_eq(count, 3);
+	ck_assert_int_eq(sends, 2);
+
+	// the results are in list order whichever thread got to them first
+	ck_assert(!memcmp(&results[0].address, &addr1, sizeof(bt_addr_t)));
+	ck_assert(results[0].result == BT_SUCCESS);
+	ck_assert_int_eq(results[0].bytes_sent, 4);
+	ck_assert(!memcmp(&results[1].address, &addr2, sizeof(bt_addr_t)));
+	ck_assert(results[1].result == BT_ERR_CONNECTION_FAILURE);
+	ck_assert_int_eq(results[1].bytes_sent, 0);
+	ck_assert(!memcmp(&results[2].address, &addr3, sizeof(bt_addr_t)));
+	ck_assert(results[2].result == BT_SUCCESS);
+	ck_assert(results[2].latency_us >= 0);
+
+	bt_list_delete(list);
+}
+END_TEST
+
+START_TEST (device_list_send_pooled_retry)
+{
+	bt_device_list_t *list;
+	bt_pool_t pool;
+	bt_pool_config_t config;
+	bt_pool_stats_t stats;
+	bt_addr_t addr1;
+	bt_uuid_t service;
+
+	sends = 0;
+	send_failures = 0;
+	bz_funcs.sdp_connect = send_sdp_connect;
+	bz_funcs.sdp_service_search_attr_req = send_sdp_search;
+	bz_funcs.sdp_close = send_sdp_close;
+	bz_funcs.socket = send_socket;
+	bz_funcs.connect = send_connect;
+	bz_funcs.poll = send_poll;
+	bz_funcs.send = send_send;
+	bz_funcs.close = send_close;
+
+	bt_str_to_addr(ADDR1, &addr1);
+	bt_str_to_uuid("ed995e5a-c7e7-4442-a6ee-7bb76df43b0d", &service);
+
+	list = bt_list_new();
+	bt_list_add_device(list, &addr1);
+
+	memset(&config, 0, sizeof(config));
+	config.idle_timeout_ms = BT_POOL_NO_IDLE_TIMEOUT;
+	ck_assert(bt_pool_init(&pool, &config) == BT_SUCCESS);
+
+	bt_send_to_list_pooled(&pool, list, &service, "Pico", 4);
+	ck_assert_int_eq(sends, 1);
+
+	// the held connection looks open, but the write to it fails
+	send_failures = 1;
+	bt_send_to_list_pooled(&pool, list, &service, "Pico", 4);
+	ck_assert_int_eq(sends, 2);
+	bt_pool_get_stats(&pool, &stats);
+	ck_assert_int_eq(stats.hits, 1);
+	ck_assert_int_eq(stats.misses, 2);
+	ck_assert_int_eq(stats.evicted, 1);
+	ck_assert_int_eq(stats.size, 1);
+
+	// only one more attempt is made
+	send_failures = 3;
+	bt_send_to_list_pooled(&pool, list, &service, "Pico", 4);
+	ck_assert_int_eq(send_failures, 1);
+	ck_assert_int_eq(sends, 2);
+	bt_pool_get_stats(&pool, &stats);
+	ck_assert_int_eq(stats.evicted, 3);
+	ck_assert_int_eq(stats.size, 0);
+
+	send_failures = 0;
+	bt_pool_free(&pool);
+	bt_list_delete(list);
+}
+END_TEST
+
 TCase *libpicobt_devicelist_testcase(void) {
     TCase *tcase = tcase_create("devicelist");
     
     tcase_add_test(tcase, base_device_list);
     tcase_add_test(tcase, device_list_save_load);
+    tcase_add_test(tcase, device_list_send_ex);
+    tcase_add_test(tcase, device_list_send_pooled_retry);
     
     return tcase;
 }
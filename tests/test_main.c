@@ -32,6 +32,17 @@
 TCase *libpicobt_btutil_testcase(void);
 TCase *libpicobt_devicelist_testcase(void);
 TCase *libpicobt_btmain_testcase(void);
+TCase *libpicobt_btbuffer_testcase(void);
+TCase *libpicobt_btreactor_testcase(void);
+TCase *libpicobt_btbatch_testcase(void);
+TCase *libpicobt_btframe_testcase(void);
+TCase *libpicobt_btserver_testcase(void);
+TCase *libpicobt_btsched_testcase(void);
+TCase *libpicobt_btasync_testcase(void);
+TCase *libpicobt_btpool_testcase(void);
+TCase *libpicobt_btlistener_testcase(void);
+TCase *libpicobt_btsdpcache_testcase(void);
+TCase *libpicobt_btsdp_testcase(void);
 
 /**
  * Run the tests.
@@ -47,6 +58,17 @@ int main(void) {
 	suite_add_tcase(suite, libpicobt_btutil_testcase());
 	suite_add_tcase(suite, libpicobt_devicelist_testcase());
 	suite_add_tcase(suite, libpicobt_btmain_testcase());
+	suite_add_tcase(suite, libpicobt_btbuffer_testcase());
+	suite_add_tcase(suite, libpicobt_btreactor_testcase());
+	suite_add_tcase(suite, libpicobt_btbatch_testcase());
+	suite_add_tcase(suite, libpicobt_btframe_testcase());
+	suite_add_tcase(suite, libpicobt_btserver_testcase());
+	suite_add_tcase(suite, libpicobt_btsched_testcase());
+	suite_add_tcase(suite, libpicobt_btasync_testcase());
+	suite_add_tcase(suite, libpicobt_btpool_testcase());
+	suite_add_tcase(suite, libpicobt_btlistener_testcase());
+	suite_add_tcase(suite, libpicobt_btsdpcache_testcase());
+	suite_add_tcase(suite, libpicobt_btsdp_testcase());
 
 	runner = srunner_create(suite);
 	